@@ -0,0 +1,793 @@
+// Copyright (c) 2010 - Decho Corporation
+
+#include "dns.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include <boost/bind.hpp>
+
+#include "assert.h"
+#include "config.h"
+#include "iomanager.h"
+#include "log.h"
+#include "parallel.h"
+#include "statistics.h"
+#include "streams/random.h"
+
+namespace Mordor {
+namespace DNS {
+
+static Logger::ptr g_log = Log::lookup("mordor:dns");
+
+static ConfigVar<unsigned int>::ptr g_negativeTTL =
+    Config::lookup<unsigned int>("dns.negativettl", 60u,
+    "Seconds to cache a name that doesn't exist (or has no addresses) when "
+    "the name server doesn't include its zone's SOA record");
+static ConfigVar<size_t>::ptr g_cacheSize =
+    Config::lookup<size_t>("dns.cache.size", 10000u,
+    "Number of names a Resolver caches before dropping expired ones");
+
+static CountStatistic<unsigned long long> &g_statHits =
+    Statistics::registerStatistic("dns.cache.hits",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statMisses =
+    Statistics::registerStatistic("dns.cache.misses",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statCoalesced =
+    Statistics::registerStatistic("dns.cache.coalesced",
+    CountStatistic<unsigned long long>());
+
+enum Type {
+    TYPE_A = 1,
+    TYPE_CNAME = 5,
+    TYPE_SOA = 6,
+    TYPE_AAAA = 28
+};
+
+enum Class {
+    CLASS_IN = 1
+};
+
+enum ResponseCode {
+    RCODE_NOERROR = 0,
+    RCODE_NXDOMAIN = 3
+};
+
+namespace {
+struct Record
+{
+    std::string name;
+    unsigned short type;
+    unsigned int ttl;
+    size_t data, dataLength;
+    bool authority;
+};
+}
+
+static std::string
+lowercase(std::string string)
+{
+    std::transform(string.begin(), string.end(), string.begin(), tolower);
+    return string;
+}
+
+static unsigned short
+read16(const unsigned char *data)
+{
+    return (unsigned short)((data[0] << 8) | data[1]);
+}
+
+static unsigned int
+read32(const unsigned char *data)
+{
+    return ((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) |
+        ((unsigned int)data[2] << 8) | data[3];
+}
+
+/// @return NULL if address isn't an IPv4 or IPv6 address
+static Address::ptr
+parseAddress(const std::string &address, unsigned short port = 0)
+{
+    sockaddr_in sin;
+    memset(&sin, 0, sizeof(sockaddr_in));
+    if (inet_pton(AF_INET, address.c_str(), &sin.sin_addr) == 1) {
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        return Address::create((sockaddr *)&sin, sizeof(sockaddr_in),
+            SOCK_DGRAM, IPPROTO_UDP);
+    }
+    sockaddr_in6 sin6;
+    memset(&sin6, 0, sizeof(sockaddr_in6));
+    if (inet_pton(AF_INET6, address.c_str(), &sin6.sin6_addr) == 1) {
+        sin6.sin6_family = AF_INET6;
+        sin6.sin6_port = htons(port);
+        return Address::create((sockaddr *)&sin6, sizeof(sockaddr_in6),
+            SOCK_DGRAM, IPPROTO_UDP);
+    }
+    return Address::ptr();
+}
+
+static unsigned short
+servicePort(const std::string &service, int type)
+{
+    char *end;
+    unsigned long port = strtoul(service.c_str(), &end, 10);
+    if (!service.empty() && *end == '\0' && port <= 0xffff)
+        return (unsigned short)port;
+    // Named services come from /etc/services; getaddrinfo won't go to the
+    // network for them
+    addrinfo hints, *results;
+    memset(&hints, 0, sizeof(addrinfo));
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = type == SOCK_DGRAM ? SOCK_DGRAM : SOCK_STREAM;
+    int error = getaddrinfo(NULL, service.c_str(), &hints, &results);
+    if (error) {
+        MORDOR_LOG_ERROR(g_log) << "getaddrinfo(NULL, " << service << "): ("
+            << error << ")";
+        MORDOR_THROW_EXCEPTION(NameLookupException()
+            << errinfo_gaierror(error)
+            << boost::errinfo_api_function("getaddrinfo"));
+    }
+    port = ntohs(((sockaddr_in *)results->ai_addr)->sin_port);
+    freeaddrinfo(results);
+    return (unsigned short)port;
+}
+
+static bool
+wanted(const Address::ptr &address, int family)
+{
+    return family == AF_UNSPEC || address->family() == family;
+}
+
+static std::string
+buildQuery(const std::string &name, unsigned short type)
+{
+    // ID (filled in for each send), recursion desired, and one question
+    std::string query("\0\0\1\0\0\1\0\0\0\0\0\0", 12);
+    if (name.empty())
+        MORDOR_THROW_EXCEPTION(HostNotFoundException());
+    size_t start = 0;
+    while (start < name.size()) {
+        size_t end = name.find('.', start);
+        if (end == std::string::npos)
+            end = name.size();
+        size_t size = end - start;
+        if (size == 0 || size > 63)
+            MORDOR_THROW_EXCEPTION(HostNotFoundException());
+        query.append(1, (char)size);
+        query.append(name, start, size);
+        start = end + 1;
+    }
+    query.append(1, '\0');
+    if (query.size() - 12 > 255)
+        MORDOR_THROW_EXCEPTION(HostNotFoundException());
+    query.append(1, (char)(type >> 8));
+    query.append(1, (char)(type & 0xff));
+    query.append("\0\1", 2);
+    return query;
+}
+
+/// Read a (possibly compressed) name at offset, and move offset past it
+static bool
+readName(const unsigned char *message, size_t length, size_t &offset,
+    std::string &name)
+{
+    name.clear();
+    size_t position = offset;
+    bool jumped = false;
+    // Bounds the loops that compression pointers could otherwise make
+    for (int labels = 0; labels < 128; ++labels) {
+        if (position >= length)
+            return false;
+        unsigned char size = message[position];
+        if ((size & 0xc0) == 0xc0) {
+            if (position + 1 >= length)
+                return false;
+            if (!jumped)
+                offset = position + 2;
+            jumped = true;
+            position = ((size & 0x3f) << 8) | message[position + 1];
+            continue;
+        }
+        if (size & 0xc0)
+            return false;
+        ++position;
+        if (size == 0) {
+            if (!jumped)
+                offset = position;
+            name = lowercase(name);
+            return true;
+        }
+        if (position + size > length || name.size() + size + 1 > 255)
+            return false;
+        if (!name.empty())
+            name.append(1, '.');
+        name.append((const char *)message + position, size);
+        position += size;
+    }
+    return false;
+}
+
+/// @param truncated Set if the name server set TC; the reply may be
+/// missing records that didn't fit
+/// @return The reply's RCODE, or -1 if it isn't a reply to this query
+static int
+parseReply(const unsigned char *reply, size_t length, unsigned short id,
+    const std::string &name, unsigned short type,
+    std::vector<Address::ptr> &addresses, unsigned int &ttl, bool &truncated)
+{
+    if (length < 12 || read16(reply) != id || !(reply[2] & 0x80) ||
+        read16(reply + 4) != 1)
+        return -1;
+    size_t offset = 12;
+    std::string question;
+    if (!readName(reply, length, offset, question) || offset + 4 > length ||
+        question != name || read16(reply + offset) != type ||
+        read16(reply + offset + 2) != CLASS_IN)
+        return -1;
+    offset += 4;
+    int rcode = reply[3] & 0x0f;
+    truncated = !!(reply[2] & 0x02);
+    size_t answers = read16(reply + 6);
+    size_t records = answers + read16(reply + 8);
+
+    std::vector<Record> parsed;
+    for (size_t i = 0; i < records; ++i) {
+        Record record;
+        if (!readName(reply, length, offset, record.name) ||
+            offset + 10 > length ||
+            offset + 10 + read16(reply + offset + 8) > length) {
+            // Keep whatever made it into a truncated reply
+            if (truncated)
+                break;
+            return -1;
+        }
+        record.type = read16(reply + offset);
+        unsigned short klass = read16(reply + offset + 2);
+        record.ttl = read32(reply + offset + 4);
+        record.dataLength = read16(reply + offset + 8);
+        record.data = offset + 10;
+        record.authority = i >= answers;
+        offset = record.data + record.dataLength;
+        if (klass == CLASS_IN)
+            parsed.push_back(record);
+    }
+
+    ttl = ~0u;
+    // Follow any CNAMEs to the name that actually has the addresses
+    std::string target = name;
+    for (int hops = 0; hops < 16; ++hops) {
+        std::vector<Record>::const_iterator it = parsed.begin();
+        for (; it != parsed.end(); ++it)
+            if (!it->authority && it->type == TYPE_CNAME &&
+                it->name == target)
+                break;
+        if (it == parsed.end())
+            break;
+        size_t data = it->data;
+        if (!readName(reply, length, data, target))
+            return -1;
+        ttl = std::min(ttl, it->ttl);
+    }
+    for (std::vector<Record>::const_iterator it = parsed.begin();
+        it != parsed.end();
+        ++it) {
+        if (it->authority || it->type != type || it->name != target)
+            continue;
+        if (type == TYPE_A && it->dataLength == 4) {
+            sockaddr_in sin;
+            memset(&sin, 0, sizeof(sockaddr_in));
+            sin.sin_family = AF_INET;
+            memcpy(&sin.sin_addr, reply + it->data, 4);
+            addresses.push_back(Address::create((sockaddr *)&sin,
+                sizeof(sockaddr_in)));
+        } else if (type == TYPE_AAAA && it->dataLength == 16) {
+            sockaddr_in6 sin6;
+            memset(&sin6, 0, sizeof(sockaddr_in6));
+            sin6.sin6_family = AF_INET6;
+            memcpy(&sin6.sin6_addr, reply + it->data, 16);
+            addresses.push_back(Address::create((sockaddr *)&sin6,
+                sizeof(sockaddr_in6)));
+        } else {
+            continue;
+        }
+        ttl = std::min(ttl, it->ttl);
+    }
+
+    if (addresses.empty()) {
+        // Negative answers live as long as the SOA's TTL, capped by its
+        // MINIMUM field (RFC 2308)
+        ttl = ~0u;
+        for (std::vector<Record>::const_iterator it = parsed.begin();
+            it != parsed.end();
+            ++it) {
+            if (!it->authority || it->type != TYPE_SOA)
+                continue;
+            size_t data = it->data;
+            std::string mname, rname;
+            if (!readName(reply, length, data, mname) ||
+                !readName(reply, length, data, rname) ||
+                data + 20 > it->data + it->dataLength)
+                continue;
+            ttl = std::min(it->ttl, read32(reply + data + 16));
+        }
+    }
+    return rcode;
+}
+
+/// Read exactly length bytes, by deadline
+static void
+receiveAll(Socket &socket, unsigned char *buffer, size_t length,
+    unsigned long long deadline)
+{
+    while (length > 0) {
+        unsigned long long now = TimerManager::now();
+        if (now >= deadline)
+            MORDOR_THROW_EXCEPTION(TimedOutException());
+        socket.receiveTimeout(deadline - now);
+        size_t received = socket.receive(buffer, length);
+        if (received == 0)
+            MORDOR_THROW_EXCEPTION(ConnectionResetException());
+        buffer += received;
+        length -= received;
+    }
+}
+
+/// Send query to server again over TCP, for a reply too big for UDP; each
+/// message is prefixed with its length (RFC 1035 4.2.2)
+/// @return The reply's RCODE, or -1 if there isn't one
+static int
+queryOverTcp(IOManager &ioManager, const Address::ptr &server,
+    const std::string &query, unsigned short id, const std::string &name,
+    unsigned short type, unsigned long long deadline,
+    std::vector<Address::ptr> &addresses, unsigned int &ttl, bool &truncated)
+{
+    std::vector<unsigned char> reply;
+    try {
+        unsigned long long now = TimerManager::now();
+        if (now >= deadline)
+            MORDOR_THROW_EXCEPTION(TimedOutException());
+        Socket::ptr socket(new Socket(ioManager, server->family(),
+            SOCK_STREAM, IPPROTO_TCP));
+        socket->sendTimeout(deadline - now);
+        socket->connect(server);
+        std::string message;
+        message.append(1, (char)(query.size() >> 8));
+        message.append(1, (char)(query.size() & 0xff));
+        message.append(query);
+        for (size_t sent = 0; sent < message.size();)
+            sent += socket->send(message.data() + sent,
+                message.size() - sent);
+        unsigned char prefix[2];
+        receiveAll(*socket, prefix, 2, deadline);
+        reply.resize(read16(prefix));
+        if (reply.empty())
+            return -1;
+        receiveAll(*socket, &reply[0], reply.size(), deadline);
+    } catch (SocketException &) {
+        MORDOR_LOG_WARNING(g_log) << name << " (" << type << ") from "
+            << *server << " over TCP: "
+            << boost::current_exception_diagnostic_information();
+        return -1;
+    }
+    // Keep the UDP reply's results if this isn't a reply at all
+    std::vector<Address::ptr> result;
+    unsigned int resultTtl;
+    bool resultTruncated;
+    int rcode = parseReply(&reply[0], reply.size(), id, name, type, result,
+        resultTtl, resultTruncated);
+    if (rcode != -1) {
+        addresses.swap(result);
+        ttl = resultTtl;
+        truncated = resultTruncated;
+    }
+    return rcode;
+}
+
+Resolver::Resolver(IOManager &ioManager, const std::string &resolvConf,
+    const std::string &hosts)
+    : m_ioManager(ioManager),
+      m_timeout(5000000ull),
+      m_attempts(2),
+      m_ndots(1)
+{
+    if (!resolvConf.empty())
+        readResolvConf(resolvConf);
+    if (!hosts.empty())
+        readHosts(hosts);
+}
+
+void
+Resolver::readResolvConf(const std::string &path)
+{
+    std::ifstream file(path.c_str());
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream is(line.substr(0, line.find_first_of("#;")));
+        std::string keyword;
+        if (!(is >> keyword))
+            continue;
+        if (keyword == "nameserver") {
+            std::string server;
+            is >> server;
+            Address::ptr address = parseAddress(server, 53);
+            if (address)
+                m_nameServers.push_back(address);
+        } else if (keyword == "domain" || keyword == "search") {
+            // Whichever comes last wins
+            m_search.clear();
+            std::string domain;
+            while (is >> domain)
+                m_search.push_back(lowercase(domain));
+        } else if (keyword == "options") {
+            std::string option;
+            while (is >> option) {
+                size_t colon = option.find(':');
+                if (colon == std::string::npos)
+                    continue;
+                unsigned long value = strtoul(option.c_str() + colon + 1,
+                    NULL, 10);
+                option.resize(colon);
+                if (option == "ndots")
+                    m_ndots = value;
+                else if (option == "timeout")
+                    m_timeout = std::max(value, 1ul) * 1000000ull;
+                else if (option == "attempts")
+                    m_attempts = std::max(value, 1ul);
+            }
+        }
+    }
+    // Same as the C library
+    if (m_nameServers.empty())
+        m_nameServers.push_back(parseAddress("127.0.0.1", 53));
+    MORDOR_LOG_VERBOSE(g_log) << this << " read " << path << ": "
+        << m_nameServers.size() << " name servers, " << m_search.size()
+        << " search domains";
+}
+
+void
+Resolver::readHosts(const std::string &path)
+{
+    std::ifstream file(path.c_str());
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream is(line.substr(0, line.find('#')));
+        std::string address, name;
+        if (!(is >> address))
+            continue;
+        Address::ptr parsed = parseAddress(address);
+        if (!parsed)
+            continue;
+        while (is >> name)
+            m_hosts[lowercase(name)].push_back(parsed);
+    }
+    MORDOR_LOG_VERBOSE(g_log) << this << " read " << path << ": "
+        << m_hosts.size() << " names";
+}
+
+void
+Resolver::nameServers(const std::vector<Address::ptr> &servers)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_nameServers = servers;
+}
+
+void
+Resolver::searchDomains(const std::vector<std::string> &domains)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_search.clear();
+    for (std::vector<std::string>::const_iterator it = domains.begin();
+        it != domains.end();
+        ++it)
+        m_search.push_back(lowercase(*it));
+}
+
+std::vector<Address::ptr>
+Resolver::lookup(const std::string &host, int family, int type,
+    int protocol)
+{
+    std::string node;
+    const char *service = NULL;
+    // Check for [ipv6addr] (with optional :service)
+    if (!host.empty() && host[0] == '[') {
+        const char *endipv6 = (const char *)memchr(host.c_str() + 1, ']',
+            host.size() - 1);
+        if (endipv6) {
+            if (*(endipv6 + 1) == ':')
+                service = endipv6 + 2;
+            node = host.substr(1, endipv6 - host.c_str() - 1);
+        }
+    }
+    // Check for node:service
+    if (node.empty()) {
+        service = (const char *)memchr(host.c_str(), ':', host.size());
+        if (service) {
+            // More than 1 : means it's not node:service
+            if (!memchr(service + 1, ':',
+                host.c_str() + host.size() - service - 1)) {
+                node = host.substr(0, service - host.c_str());
+                ++service;
+            } else {
+                service = NULL;
+            }
+        }
+    }
+    if (node.empty())
+        node = host;
+    unsigned short port = service ? servicePort(service, type) : 0;
+
+    std::vector<Address::ptr> addresses;
+    bool exists = false;
+    Address::ptr literal = parseAddress(node);
+    if (literal) {
+        addresses.push_back(literal);
+        exists = true;
+    } else {
+        std::string name = lowercase(node);
+        bool absolute = !name.empty() && name[name.size() - 1] == '.';
+        if (absolute)
+            name.resize(name.size() - 1);
+        // Like the C library, a hosts entry without an address of the
+        // right family falls through to DNS
+        std::map<std::string, std::vector<Address::ptr> >::const_iterator
+            hosts = m_hosts.find(name);
+        if (hosts != m_hosts.end()) {
+            for (std::vector<Address::ptr>::const_iterator it =
+                hosts->second.begin();
+                it != hosts->second.end();
+                ++it)
+                if (wanted(*it, family))
+                    addresses.push_back(*it);
+            exists = !addresses.empty();
+        }
+        if (addresses.empty()) {
+            std::vector<std::string> candidates;
+            if (absolute) {
+                candidates.push_back(name);
+            } else {
+                boost::mutex::scoped_lock lock(m_mutex);
+                size_t dots = std::count(name.begin(), name.end(), '.');
+                if (dots >= m_ndots)
+                    candidates.push_back(name);
+                for (std::vector<std::string>::const_iterator it =
+                    m_search.begin();
+                    it != m_search.end();
+                    ++it)
+                    candidates.push_back(name + "." + *it);
+                if (dots < m_ndots)
+                    candidates.push_back(name);
+            }
+            boost::exception_ptr exception;
+            for (std::vector<std::string>::const_iterator it =
+                candidates.begin();
+                it != candidates.end() && addresses.empty();
+                ++it) {
+                // IPv6 first
+                boost::shared_ptr<Answer> answers[2];
+                if (family == AF_UNSPEC) {
+                    std::vector<boost::function<void ()> > dgs;
+                    dgs.push_back(boost::bind(&Resolver::query, this,
+                        boost::cref(*it), TYPE_AAAA, boost::ref(answers[0])));
+                    dgs.push_back(boost::bind(&Resolver::query, this,
+                        boost::cref(*it), TYPE_A, boost::ref(answers[1])));
+                    parallel_do(dgs);
+                } else if (family == AF_INET6) {
+                    query(*it, TYPE_AAAA, answers[0]);
+                } else if (family == AF_INET) {
+                    query(*it, TYPE_A, answers[1]);
+                }
+                for (int i = 0; i < 2; ++i) {
+                    if (!answers[i])
+                        continue;
+                    if (answers[i]->exception) {
+                        if (!exception)
+                            exception = answers[i]->exception;
+                        continue;
+                    }
+                    exists = exists || answers[i]->exists;
+                    addresses.insert(addresses.end(),
+                        answers[i]->addresses.begin(),
+                        answers[i]->addresses.end());
+                }
+            }
+            if (addresses.empty() && exception)
+                Mordor::rethrow_exception(exception);
+        }
+    }
+
+    std::vector<Address::ptr> result;
+    for (std::vector<Address::ptr>::const_iterator it = addresses.begin();
+        it != addresses.end();
+        ++it) {
+        if (!wanted(*it, family))
+            continue;
+        // One for each socket type, like getaddrinfo
+        for (int i = 0; i < 2; ++i) {
+            int socketType = type, socketProtocol = protocol;
+            if (type == 0) {
+                socketType = i == 0 ? SOCK_STREAM : SOCK_DGRAM;
+                socketProtocol = i == 0 ? IPPROTO_TCP : IPPROTO_UDP;
+            } else if (i != 0) {
+                break;
+            }
+            Address::ptr address = Address::create((*it)->name(),
+                (*it)->nameLen(), socketType, socketProtocol);
+            boost::static_pointer_cast<IPAddress>(address)->port(port);
+            result.push_back(address);
+        }
+    }
+    if (result.empty()) {
+        MORDOR_LOG_ERROR(g_log) << this << " lookup(" << host << ", "
+            << family << "): " << (exists ? "no data" : "not found");
+        if (exists)
+            MORDOR_THROW_EXCEPTION(NoNameServerDataException());
+        MORDOR_THROW_EXCEPTION(HostNotFoundException());
+    }
+    return result;
+}
+
+void
+Resolver::clearCache()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_cache.clear();
+}
+
+void
+Resolver::query(const std::string &name, unsigned short type,
+    boost::shared_ptr<Answer> &answer)
+{
+    std::pair<std::string, unsigned short> key(name, type);
+    bool mine = false;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        unsigned long long now = TimerManager::now();
+        Cache::iterator it = m_cache.find(key);
+        if (it != m_cache.end() && (!it->second->done ||
+            it->second->expires > now)) {
+            answer = it->second;
+            if (answer->done)
+                g_statHits.increment();
+            else
+                g_statCoalesced.increment();
+        } else {
+            if (it == m_cache.end() && m_cache.size() >= g_cacheSize->val()) {
+                for (it = m_cache.begin(); it != m_cache.end();) {
+                    if (it->second->done && it->second->expires <= now)
+                        m_cache.erase(it++);
+                    else
+                        ++it;
+                }
+            }
+            g_statMisses.increment();
+            answer.reset(new Answer());
+            m_cache[key] = answer;
+            mine = true;
+        }
+    }
+    // Someone else is (or was) asking
+    if (!mine) {
+        answer->event.wait();
+        return;
+    }
+
+    try {
+        resolve(name, type, *answer);
+    } catch (...) {
+        answer->exception = boost::current_exception();
+    }
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        answer->done = true;
+        if (answer->exception) {
+            Cache::iterator it = m_cache.find(key);
+            if (it != m_cache.end() && it->second == answer)
+                m_cache.erase(it);
+        }
+    }
+    answer->event.set();
+}
+
+void
+Resolver::resolve(const std::string &name, unsigned short type,
+    Answer &answer)
+{
+    std::string query = buildQuery(name, type);
+    std::vector<Address::ptr> nameServers;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        nameServers = m_nameServers;
+    }
+    if (nameServers.empty())
+        MORDOR_THROW_EXCEPTION(PermanentNameServerFailureException());
+    RandomStream random;
+    // Without EDNS0, UDP replies are at most 512 bytes
+    unsigned char reply[512];
+    for (size_t attempt = 0; attempt < m_attempts; ++attempt) {
+        for (std::vector<Address::ptr>::const_iterator it =
+            nameServers.begin();
+            it != nameServers.end();
+            ++it) {
+            unsigned short id;
+            random.read(&id, sizeof(id));
+            query[0] = (char)(id >> 8);
+            query[1] = (char)(id & 0xff);
+            // Replies that get ignored don't buy the name server more time
+            unsigned long long deadline = TimerManager::now() + m_timeout;
+            try {
+                Socket::ptr socket(new Socket(m_ioManager, (*it)->family(),
+                    SOCK_DGRAM, IPPROTO_UDP));
+                socket->connect(*it);
+                socket->send(query.data(), query.size());
+                while (true) {
+                    unsigned long long now = TimerManager::now();
+                    if (now >= deadline)
+                        MORDOR_THROW_EXCEPTION(TimedOutException());
+                    socket->receiveTimeout(deadline - now);
+                    size_t length = socket->receive(reply, sizeof(reply));
+                    std::vector<Address::ptr> addresses;
+                    unsigned int ttl;
+                    bool truncated;
+                    int rcode = parseReply(reply, length, id, name, type,
+                        addresses, ttl, truncated);
+                    if (rcode == -1) {
+                        MORDOR_LOG_WARNING(g_log) << this << " ignoring "
+                            << length << " byte reply from " << **it;
+                        continue;
+                    }
+                    if (truncated) {
+                        MORDOR_LOG_DEBUG(g_log) << this << " " << name
+                            << " (" << type << ") from " << **it
+                            << ": truncated, retrying over TCP";
+                        int tcpRcode = queryOverTcp(m_ioManager, *it, query,
+                            id, name, type, deadline, addresses, ttl,
+                            truncated);
+                        if (tcpRcode != -1)
+                            rcode = tcpRcode;
+                    }
+                    if (rcode != RCODE_NOERROR && rcode != RCODE_NXDOMAIN) {
+                        MORDOR_LOG_WARNING(g_log) << this << " " << name
+                            << " (" << type << ") from " << **it
+                            << ": rcode " << rcode;
+                        break;
+                    }
+                    // Whatever was cut off may have been the addresses; it
+                    // isn't an answer, let alone a negative one to cache
+                    if (truncated && addresses.empty()) {
+                        MORDOR_LOG_WARNING(g_log) << this << " " << name
+                            << " (" << type << ") from " << **it
+                            << ": truncated, with no addresses";
+                        break;
+                    }
+                    if (ttl == ~0u && addresses.empty())
+                        ttl = g_negativeTTL->val();
+                    answer.addresses.swap(addresses);
+                    answer.exists = rcode != RCODE_NXDOMAIN;
+                    answer.expires = TimerManager::now() +
+                        ttl * 1000000ull;
+                    MORDOR_LOG_DEBUG(g_log) << this << " " << name << " ("
+                        << type << ") from " << **it << ": "
+                        << answer.addresses.size() << " addresses, ttl "
+                        << ttl;
+                    return;
+                }
+            } catch (SocketException &) {
+                MORDOR_LOG_WARNING(g_log) << this << " " << name << " ("
+                    << type << ") from " << **it << ": "
+                    << boost::current_exception_diagnostic_information();
+            }
+        }
+    }
+    MORDOR_LOG_ERROR(g_log) << this << " " << name << " (" << type
+        << "): no name server answered";
+    MORDOR_THROW_EXCEPTION(TemporaryNameServerFailureException());
+}
+
+}}
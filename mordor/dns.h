@@ -0,0 +1,111 @@
+#ifndef __MORDOR_DNS_H__
+#define __MORDOR_DNS_H__
+// Copyright (c) 2010 - Decho Corporation
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/exception_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "fibersynchronization.h"
+#include "socket.h"
+
+namespace Mordor {
+
+class IOManager;
+
+namespace DNS {
+
+/// Resolves host names with UDP queries sent through Mordor Sockets,
+/// instead of blocking a thread in getaddrinfo(); replies too big for UDP
+/// are asked for again over TCP
+
+/// Name servers, search domains and options (ndots, timeout and attempts)
+/// come from resolv.conf, and static names from a hosts file, which is
+/// consulted first.  Answers are cached for their TTL; names that don't
+/// exist, or have no addresses, are cached for the TTL of their zone's SOA
+/// record (RFC 2308), or dns.negativettl without one.  Concurrent lookups
+/// of the same name share a single query.
+class Resolver : boost::noncopyable
+{
+public:
+    typedef boost::shared_ptr<Resolver> ptr;
+
+private:
+    struct Answer
+    {
+        Answer()
+            : done(false),
+              exists(true),
+              expires(0),
+              event(false)
+        {}
+
+        std::vector<Address::ptr> addresses;
+        /// Why the name servers couldn't be asked; never cached
+        boost::exception_ptr exception;
+        bool done, exists;
+        unsigned long long expires;
+        /// Set once done
+        FiberEvent event;
+    };
+    typedef std::map<std::pair<std::string, unsigned short>,
+        boost::shared_ptr<Answer> > Cache;
+
+public:
+    /// @param resolvConf resolv.conf to read; if empty, there are no name
+    /// servers until nameServers() is called
+    /// @param hosts hosts file to read; may be empty
+    Resolver(IOManager &ioManager,
+        const std::string &resolvConf = "/etc/resolv.conf",
+        const std::string &hosts = "/etc/hosts");
+
+    /// Replace the name servers queries are sent to (in order)
+    void nameServers(const std::vector<Address::ptr> &servers);
+    /// Replace the domains tried for names with fewer than ndots dots
+    void searchDomains(const std::vector<std::string> &domains);
+    /// How long to wait for a reply from each name server, each time it's
+    /// asked (including any retry over TCP)
+    void timeout(unsigned long long us) { m_timeout = us; }
+    /// How many times to go through the name servers
+    void attempts(size_t attempts) { m_attempts = attempts; }
+
+    /// Resolve host, which is parsed the same as for Address::lookup
+    /// (host, host:service or [ipv6]:service)
+
+    /// IPv6 addresses are returned before IPv4 ones.  Throws the same
+    /// NameLookupExceptions as Address::lookup.
+    /// @pre Scheduler::getThis() != NULL
+    std::vector<Address::ptr> lookup(const std::string &host,
+        int family = AF_UNSPEC, int type = 0, int protocol = 0);
+
+    /// Forget every cached answer
+    void clearCache();
+
+private:
+    void readResolvConf(const std::string &path);
+    void readHosts(const std::string &path);
+
+    void query(const std::string &name, unsigned short type,
+        boost::shared_ptr<Answer> &answer);
+    void resolve(const std::string &name, unsigned short type,
+        Answer &answer);
+
+private:
+    IOManager &m_ioManager;
+    unsigned long long m_timeout;
+    size_t m_attempts, m_ndots;
+    std::vector<Address::ptr> m_nameServers;
+    std::vector<std::string> m_search;
+    std::map<std::string, std::vector<Address::ptr> > m_hosts;
+    Cache m_cache;
+    boost::mutex m_mutex;
+};
+
+}}
+
+#endif
@@ -156,9 +156,17 @@ void
 EventLoop::messagePump()
 {
     MORDOR_LOG_DEBUG(g_log) << m_messageWindow << " starting message pump";
-    while (!hasWorkToDo() && !stopping()) {
+    while (true) {
+        // We're waiting for tickles outside of idle(), so the Scheduler
+        // needs to be told
+        sleeping(true);
+        if (hasWorkToDo() || stopping()) {
+            sleeping(false);
+            break;
+        }
         MSG msg;
         BOOL bRet = GetMessageW(&msg, NULL, 0, 0);
+        sleeping(false);
         if (bRet < 0)
             MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("GetMessageW");
         if (bRet == 0) {
@@ -0,0 +1,53 @@
+// Copyright (c) 2010 - Decho Corporation
+//
+// Mordor Fiber benchmark app.
+//
+// Measures the cost of switching between two Fibers on one thread.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+
+#include <boost/bind.hpp>
+
+#include "mordor/config.h"
+#include "mordor/fiber.h"
+#include "mordor/main.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+
+static ConfigVar<unsigned long long>::ptr g_iterations =
+    Config::lookup<unsigned long long>("fiberbench.iterations", 10000000ull,
+    "Number of round trips between two fibers");
+
+static void pingPong(unsigned long long iterations)
+{
+    for (unsigned long long i = 0; i < iterations; ++i)
+        Fiber::yield();
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        unsigned long long iterations = g_iterations->val();
+
+        Fiber::ptr fiber(new Fiber(boost::bind(&pingPong, iterations)));
+        unsigned long long start = TimerManager::now();
+        while (fiber->state() != Fiber::TERM)
+            fiber->call();
+        unsigned long long elapsed = TimerManager::now() - start;
+
+        // Every round trip is two switches
+        std::cout << iterations << " round trips in " << elapsed << "us ("
+            << (double)elapsed * 1000.0 / (iterations * 2)
+            << "ns per switch)" << std::endl;
+        return 0;
+    } catch (...) {
+        std::cerr << "caught: "
+                  << boost::current_exception_diagnostic_information() << "\n";
+        return 1;
+    }
+}
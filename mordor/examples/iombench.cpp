@@ -1,7 +1,9 @@
 //
 // Mordor IOManager benchmark app.
 //
-// Can act as both the client and the server.
+// Can act as both the client and the server.  Prints how many epoll
+// syscalls the IOManager made at the end; compare runs with
+// IOMANAGER_EPOLL_PERSISTENT=0 and 1.
 //
 
 #include "mordor/predef.h"
@@ -19,6 +21,7 @@
 #include "mordor/log.h"
 #include "mordor/main.h"
 #include "mordor/socket.h"
+#include "mordor/statistics.h"
 
 using namespace Mordor;
 
@@ -314,6 +317,16 @@ MORDOR_MAIN(int argc, char *argv[])
 
         bench.run(&server, &client);
         iom.stop();
+
+        const char *syscalls[] = {
+            "iomanager.epoll_ctl",
+            "iomanager.epoll_wait"
+        };
+        for (size_t i = 0; i < sizeof(syscalls) / sizeof(syscalls[0]); ++i) {
+            Statistic *stat = Statistics::lookup(syscalls[i]);
+            if (stat)
+                std::cout << syscalls[i] << ": " << *stat << std::endl;
+        }
         return 0;
     } catch (...) {
         std::cerr << "caught: "
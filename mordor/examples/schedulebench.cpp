@@ -0,0 +1,107 @@
+// Copyright (c) 2010 - Decho Corporation
+//
+// Mordor Scheduler benchmark app.
+//
+// Measures the cost of scheduling (and running) small and large functors on
+// a hijacking Scheduler, and how many heap allocations each one takes.
+//
+
+#include "mordor/predef.h"
+
+#include <stdlib.h>
+
+#include <iostream>
+#include <new>
+
+#include <boost/bind.hpp>
+
+#include "mordor/atomic.h"
+#include "mordor/config.h"
+#include "mordor/main.h"
+#include "mordor/timer.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+
+static ConfigVar<unsigned long long>::ptr g_iterations =
+    Config::lookup<unsigned long long>("schedulebench.iterations", 1000000ull,
+    "Number of functors to schedule for each test");
+static ConfigVar<size_t>::ptr g_batch =
+    Config::lookup<size_t>("schedulebench.batch", 1000u,
+    "Number of functors to schedule before dispatching them");
+
+static volatile size_t g_allocations;
+
+void *operator new(size_t size) throw (std::bad_alloc)
+{
+    atomicIncrement(g_allocations);
+    void *result = malloc(size ? size : 1);
+    if (!result)
+        throw std::bad_alloc();
+    return result;
+}
+
+void operator delete(void *p) throw()
+{
+    free(p);
+}
+
+static void small(unsigned long long &counter, int)
+{
+    ++counter;
+}
+
+static void large(unsigned long long &counter, void *, void *, void *,
+    void *, void *, void *, void *)
+{
+    ++counter;
+}
+
+template <class F>
+static void run(const char *name, WorkerPool &pool, const F &f,
+    unsigned long long &counter)
+{
+    unsigned long long iterations = g_iterations->val();
+    size_t batch = g_batch->val();
+    // Warm up, so the queues have grown to their working size
+    for (size_t i = 0; i < batch; ++i)
+        pool.schedule(f);
+    pool.dispatch();
+
+    counter = 0;
+    size_t allocations = g_allocations;
+    unsigned long long start = TimerManager::now();
+    for (unsigned long long done = 0; done < iterations; done += batch) {
+        for (size_t i = 0; i < batch; ++i)
+            pool.schedule(f);
+        pool.dispatch();
+    }
+    unsigned long long elapsed = TimerManager::now() - start;
+    allocations = g_allocations - allocations;
+
+    std::cout << name << " (" << sizeof(F) << " bytes): " << counter
+        << " functors in " << elapsed << "us ("
+        << (double)elapsed * 1000.0 / counter << "ns and "
+        << (double)allocations / counter << " allocations per functor)"
+        << std::endl;
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        WorkerPool pool;
+        unsigned long long counter;
+
+        run("small", pool, boost::bind(&small, boost::ref(counter), 0),
+            counter);
+        run("large", pool, boost::bind(&large, boost::ref(counter),
+            (void *)NULL, (void *)NULL, (void *)NULL, (void *)NULL,
+            (void *)NULL, (void *)NULL, (void *)NULL), counter);
+        return 0;
+    } catch (...) {
+        std::cerr << "caught: "
+                  << boost::current_exception_diagnostic_information() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,94 @@
+// Copyright (c) 2010 - Decho Corporation
+//
+// Mordor TimerManager benchmark app.
+//
+// Measures the cost of registering and cancelling timers (the way a read or
+// write timeout is set up and torn down around each I/O) with many other
+// timers outstanding, using an ordered set and a timing wheel.
+//
+
+#include "mordor/predef.h"
+
+#include <stdlib.h>
+
+#include <iostream>
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "mordor/config.h"
+#include "mordor/main.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+
+static ConfigVar<size_t>::ptr g_timers =
+    Config::lookup<size_t>("timerbench.timers", 100000u,
+    "Number of timers outstanding (such as two per socket)");
+static ConfigVar<unsigned long long>::ptr g_iterations =
+    Config::lookup<unsigned long long>("timerbench.iterations", 1000000ull,
+    "Number of timers to register and cancel for each test");
+static ConfigVar<unsigned long long>::ptr g_timeout =
+    Config::lookup<unsigned long long>("timerbench.timeout", 30000000ull,
+    "Timeout (in microseconds) of each timer; timeouts are spread over "
+    "twice this");
+static ConfigVar<unsigned long long>::ptr g_tick =
+    Config::lookup<unsigned long long>("timerbench.tick", 1000ull,
+    "Tick (in microseconds) of the timing wheel");
+
+static void nothing()
+{}
+
+static void run(const char *name, unsigned long long tick)
+{
+    ConfigVarBase::ptr wheelTick = Config::lookup("timer.wheel.tick");
+    std::string previous = wheelTick->toString();
+    wheelTick->fromString(boost::lexical_cast<std::string>(tick));
+    TimerManager manager;
+    wheelTick->fromString(previous);
+
+    size_t count = g_timers->val();
+    unsigned long long iterations = g_iterations->val();
+    unsigned long long timeout = g_timeout->val();
+    std::vector<Timer::ptr> timers(count);
+    for (size_t i = 0; i < count; ++i)
+        timers[i] = manager.registerTimer(timeout + rand() % timeout,
+            &nothing);
+
+    // Replace a random outstanding timer with a new one each time
+    unsigned long long start = TimerManager::now();
+    for (unsigned long long i = 0; i < iterations; ++i) {
+        Timer::ptr &timer = timers[rand() % count];
+        timer->cancel();
+        timer = manager.registerTimer(timeout + rand() % timeout, &nothing);
+    }
+    unsigned long long elapsed = TimerManager::now() - start;
+    std::cout << name << " register/cancel: " << iterations << " in "
+        << elapsed << "us (" << (double)elapsed * 1000.0 / iterations
+        << "ns each)" << std::endl;
+
+    start = TimerManager::now();
+    for (unsigned long long i = 0; i < iterations; ++i)
+        timers[rand() % count]->refresh();
+    elapsed = TimerManager::now() - start;
+    std::cout << name << " refresh: " << iterations << " in "
+        << elapsed << "us (" << (double)elapsed * 1000.0 / iterations
+        << "ns each)" << std::endl;
+
+    for (size_t i = 0; i < count; ++i)
+        timers[i]->cancel();
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        run("set", 0);
+        run("wheel", g_tick->val());
+        return 0;
+    } catch (...) {
+        std::cerr << "caught: "
+                  << boost::current_exception_diagnostic_information() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,135 @@
+// Copyright (c) 2010 - Decho Corporation
+//
+// Mordor UDP segmentation offload benchmark app.
+//
+// Blasts datagrams over loopback from another thread, one per system call,
+// udpbench.segments per system call with UDP_SEGMENT (GSO), and with GSO to
+// a receiver that has UDP_GRO on, and measures how fast they go out and how
+// fast (and at what CPU cost) they're received.
+//
+
+#include "mordor/predef.h"
+
+#include <time.h>
+
+#include <iostream>
+
+#include <boost/bind.hpp>
+
+#include "mordor/config.h"
+#include "mordor/iomanager.h"
+#include "mordor/main.h"
+#include "mordor/socket.h"
+#include "mordor/streams/buffer.h"
+#include "mordor/streams/socket.h"
+#include "mordor/thread.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+
+static ConfigVar<unsigned long long>::ptr g_bytes =
+    Config::lookup<unsigned long long>("udpbench.bytes", 268435456ull,
+    "Number of bytes to send for each test");
+static ConfigVar<size_t>::ptr g_size =
+    Config::lookup<size_t>("udpbench.size", 1400u,
+    "Size of each datagram");
+static ConfigVar<size_t>::ptr g_segments =
+    Config::lookup<size_t>("udpbench.segments", 32u,
+    "Datagrams per send with GSO (at most 64, and 64KB in all)");
+
+/// CPU time (in microseconds) used by this thread
+static unsigned long long cpuTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void blast(Socket &sock, Address::ptr to, size_t segments,
+    unsigned long long &elapsed)
+{
+    std::vector<char> data(g_size->val() * segments, 'x');
+    unsigned long long bytes = g_bytes->val();
+    unsigned long long start = TimerManager::now();
+    for (unsigned long long sent = 0; sent < bytes;) {
+        size_t length = (size_t)std::min<unsigned long long>(data.size(),
+            bytes - sent);
+        sent += sock.sendTo(&data[0], length, 0, *to);
+    }
+    elapsed = TimerManager::now() - start;
+}
+
+static void run(IOManager &ioManager, const char *name, bool gso, bool gro)
+{
+    Socket::ptr sock(new Socket(ioManager, AF_INET, SOCK_DGRAM));
+    int bufferSize = 4 * 1024 * 1024;
+    sock->setOption(SOL_SOCKET, SO_RCVBUF, bufferSize);
+    sock->bind(Address::lookup("127.0.0.1:0", AF_INET, SOCK_DGRAM).front());
+    if (gro && !sock->udpGro()) {
+        std::cout << name << ": UDP_GRO not supported" << std::endl;
+        return;
+    }
+    // The sender's done once it goes quiet
+    sock->receiveTimeout(200000);
+
+    // Blocking, on a thread of its own, so it doesn't take turns with the
+    // receiver
+    Socket sendSock(AF_INET, SOCK_DGRAM);
+    if (gso && !sendSock.udpSegment((unsigned short)g_size->val())) {
+        std::cout << name << ": UDP_SEGMENT not supported" << std::endl;
+        return;
+    }
+    unsigned long long sendElapsed = 0;
+    Thread sender(boost::bind(&blast, boost::ref(sendSock),
+        sock->localAddress(), gso ? g_segments->val() : 1,
+        boost::ref(sendElapsed)), "udpbench sender");
+    std::vector<Buffer> datagrams;
+    std::vector<char> data(65536);
+    unsigned long long received = 0, bytes = 0, start = 0, last = 0,
+        cpuStart = 0, cpuLast = 0;
+    try {
+        while (true) {
+            if (gro) {
+                receiveSegments(*sock, datagrams);
+                received += datagrams.size();
+                for (size_t i = 0; i < datagrams.size(); ++i)
+                    bytes += datagrams[i].readAvailable();
+            } else {
+                bytes += sock->receive(&data[0], data.size());
+                ++received;
+            }
+            last = TimerManager::now();
+            cpuLast = cpuTime();
+            if (start == 0) {
+                start = last;
+                cpuStart = cpuLast;
+            }
+        }
+    } catch (TimedOutException &) {
+    }
+    sender.join();
+    unsigned long long elapsed = std::max(last - start, 1ull);
+    sendElapsed = std::max(sendElapsed, 1ull);
+    std::cout << name << ": sent " << g_bytes->val() << " bytes in "
+        << sendElapsed << "us (" << g_bytes->val() / sendElapsed
+        << "MB/s); received " << received << " datagrams, " << bytes
+        << " bytes in " << elapsed << "us (" << bytes / elapsed << "MB/s, "
+        << (cpuLast - cpuStart) * 1000.0 / std::max(received, 1ull)
+        << "ns CPU each)" << std::endl;
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        IOManager ioManager;
+        run(ioManager, "plain", false, false);
+        run(ioManager, "gso", true, false);
+        run(ioManager, "gso+gro", true, true);
+        return 0;
+    } catch (...) {
+        std::cerr << "caught: "
+                  << boost::current_exception_diagnostic_information() << "\n";
+        return 1;
+    }
+}
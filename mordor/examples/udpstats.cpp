@@ -1,41 +1,183 @@
 // Copyright (c) 2009 - Decho Corporation
+//
+// Collects statistics on the UDP packets sent to an address, receiving up
+// to udpstats.batch of them per system call.
+//
+// "udpstats bench" instead measures how fast packets blasted over loopback
+// (from another thread) can be received, one per system call and in
+// batches.
+//
 
 #include "mordor/predef.h"
 
+#include <time.h>
+
 #include <iostream>
 
+#include <boost/bind.hpp>
+
 #include "mordor/config.h"
 #include "mordor/iomanager.h"
 #include "mordor/socket.h"
 #include "mordor/statistics.h"
+#include "mordor/thread.h"
+#include "mordor/timer.h"
 
 using namespace Mordor;
 
 ConfigVar<size_t>::ptr g_perCount = Config::lookup<size_t>("dumpfrequency", 10u, "How often should statistics be dumped (packets)");
+static ConfigVar<size_t>::ptr g_batch =
+    Config::lookup<size_t>("udpstats.batch", 32u,
+    "Most packets to receive per system call");
+static ConfigVar<unsigned long long>::ptr g_benchPackets =
+    Config::lookup<unsigned long long>("udpstats.bench.packets", 1000000ull,
+    "Number of packets to send for each benchmark");
+static ConfigVar<size_t>::ptr g_benchSize =
+    Config::lookup<size_t>("udpstats.bench.size", 64u,
+    "Size of each benchmark packet");
+
+namespace {
+/// Buffers for receiving a batch of packets
+struct Batch
+{
+    Batch(Socket &sock, size_t count, size_t size)
+        : data(count * size),
+          iovs(count),
+          datagrams(count)
+    {
+        for (size_t i = 0; i < count; ++i) {
+            iovs[i].iov_base = &data[i * size];
+            iovs[i].iov_len = size;
+            addresses.push_back(sock.emptyAddress());
+            datagrams[i].buffers = &iovs[i];
+            datagrams[i].count = 1;
+            datagrams[i].address = addresses[i].get();
+        }
+    }
+
+    std::vector<char> data;
+    std::vector<iovec> iovs;
+    std::vector<Address::ptr> addresses;
+    std::vector<Socket::Datagram> datagrams;
+};
+}
+
+static void collect(Socket &sock)
+{
+    AverageMinMaxStatistic<size_t> &stats = Statistics::registerStatistic("broadcasts",
+        AverageMinMaxStatistic<size_t>("bytes", "packets"));
+    size_t batchSize = std::max<size_t>(g_batch->val(), 1u);
+    Batch batch(sock, batchSize, 65536);
+    while (true) {
+        size_t received = sock.receiveBatch(&batch.datagrams[0], batchSize);
+        for (size_t i = 0; i < received; ++i) {
+            stats.update(batch.datagrams[i].length);
+            if (stats.count.count % g_perCount->val() == 0)
+                Statistics::dump(std::cout);
+        }
+    }
+}
+
+static void blast(Address::ptr to, size_t batchSize, volatile bool &done)
+{
+    // Blocking, on a thread of its own, so it doesn't take turns with the
+    // receiver
+    Socket sock(to->family(), SOCK_DGRAM);
+    std::vector<char> data(g_benchSize->val(), 'x');
+    iovec iov;
+    iov.iov_base = &data[0];
+    iov.iov_len = data.size();
+    std::vector<Socket::Datagram> datagrams(batchSize);
+    for (size_t i = 0; i < batchSize; ++i) {
+        datagrams[i].buffers = &iov;
+        datagrams[i].count = 1;
+        datagrams[i].address = to.get();
+    }
+    unsigned long long packets = g_benchPackets->val();
+    for (unsigned long long sent = 0; sent < packets && !done;) {
+        size_t count = (size_t)std::min<unsigned long long>(batchSize,
+            packets - sent);
+        if (batchSize == 1) {
+            sock.sendTo(&iov, 1, 0, *to);
+            ++sent;
+        } else {
+            sent += sock.sendBatch(&datagrams[0], count);
+        }
+    }
+}
+
+/// CPU time (in microseconds) used by this thread
+static unsigned long long cpuTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void bench(IOManager &ioManager, const char *name, size_t batchSize)
+{
+    Socket::ptr sock(new Socket(ioManager, AF_INET, SOCK_DGRAM));
+    int bufferSize = 4 * 1024 * 1024;
+    sock->setOption(SOL_SOCKET, SO_RCVBUF, bufferSize);
+    sock->bind(Address::lookup("127.0.0.1:0", AF_INET, SOCK_DGRAM).front());
+    // The sender's done (or drops are all that's left) once it goes quiet
+    sock->receiveTimeout(200000);
+    Batch batch(*sock, batchSize, 65536);
+
+    volatile bool done = false;
+    Thread sender(boost::bind(&blast, sock->localAddress(), batchSize,
+        boost::ref(done)), "udpstats sender");
+    unsigned long long received = 0, start = 0, last = 0, cpuStart = 0,
+        cpuLast = 0;
+    try {
+        while (true) {
+            if (batchSize == 1) {
+                // What udpstats did before batching
+                sock->receiveFrom(&batch.iovs[0], 1, *batch.addresses[0]);
+                ++received;
+            } else {
+                received += sock->receiveBatch(&batch.datagrams[0],
+                    batchSize);
+            }
+            last = TimerManager::now();
+            cpuLast = cpuTime();
+            if (start == 0) {
+                start = last;
+                cpuStart = cpuLast;
+            }
+        }
+    } catch (TimedOutException &) {
+    }
+    done = true;
+    sender.join();
+    unsigned long long elapsed = std::max(last - start, 1ull);
+    // The sender may be what limits the rate; the receiver's CPU time isn't
+    std::cout << name << ": received " << received << "/"
+        << g_benchPackets->val() << " packets in " << elapsed << "us ("
+        << (unsigned long long)(received * 1000000.0 / elapsed)
+        << " packets/s, " << (cpuLast - cpuStart) * 1000.0 / received
+        << "ns CPU each)" << std::endl;
+}
 
 int main(int argc, char **argv)
 {
     Config::loadFromEnvironment();
     if (argc != 2) {
-        std::cerr << "Usage: <address>" << std::endl;
+        std::cerr << "Usage: <address> | bench" << std::endl;
         return 1;
     }
     try {
         IOManager ioManager;
-        AverageMinMaxStatistic<size_t> &stats = Statistics::registerStatistic("broadcasts",
-            AverageMinMaxStatistic<size_t>("bytes", "packets"));
+        if (strcmp(argv[1], "bench") == 0) {
+            bench(ioManager, "single", 1);
+            bench(ioManager, "batched", std::max<size_t>(g_batch->val(), 1u));
+            return 0;
+        }
 
         std::vector<Address::ptr> addresses = Address::lookup(argv[1], AF_UNSPEC, SOCK_DGRAM);
         Socket::ptr sock = addresses[0]->createSocket(ioManager);
         sock->bind(addresses[0]);
-        char buf[65536];
-        IPv4Address addr;
-        while (true) {
-            size_t read = sock->receiveFrom(buf, 65536, addr);
-            stats.update(read);
-            if (stats.count.count % g_perCount->val() == 0)
-                Statistics::dump(std::cout);
-        }
+        collect(*sock);
     } catch (...) {
         std::cerr << boost::current_exception_diagnostic_information() << std::endl;
         return 2;
@@ -2,6 +2,9 @@
 
 #include "fiber.h"
 
+#include <map>
+#include <sstream>
+
 #include <boost/thread/tss.hpp>
 
 #include "assert.h"
@@ -10,15 +13,26 @@
 #include "statistics.h"
 #include "version.h"
 
+#ifdef GCC
+#include <cxxabi.h>
+#include <stdlib.h>
+#endif
+
 #ifdef WINDOWS
 #include <windows.h>
 
 #include "runtime_linking.h"
 #else
+#include <string.h>
 #include <sys/mman.h>
 #include <pthread.h>
 #endif
 
+#ifdef LINUX
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 namespace Mordor {
 
 static AverageMinMaxStatistic<unsigned int> &g_statAlloc =
@@ -27,6 +41,14 @@ static AverageMinMaxStatistic<unsigned int> &g_statAlloc =
 static AverageMinMaxStatistic<unsigned int> &g_statFree=
     Statistics::registerStatistic("fiber.freestack",
     AverageMinMaxStatistic<unsigned int>("us"));
+#ifdef POSIX
+static CountStatistic<unsigned long long> &g_statCacheHits =
+    Statistics::registerStatistic("fiber.stackcache.hits",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statCacheMisses =
+    Statistics::registerStatistic("fiber.stackcache.misses",
+    CountStatistic<unsigned long long>());
+#endif
 
 static void fiber_switchContext(void **oldsp, void *newsp);
 
@@ -66,6 +88,27 @@ static ConfigVar<size_t>::ptr g_defaultStackSize = Config::lookup<size_t>(
     "Default stack size for new fibers.  This is the virtual size; physical "
     "memory isn't consumed until it is actually referenced.");
 
+static ConfigVar<bool>::ptr g_stackProfile = Config::lookup(
+    "fiber.stackprofile", false,
+    "Paint fiber stacks, and report how much of its stack each entry point "
+    "used (as fiber.stack.<entry point> statistics).  Expensive; meant for "
+    "choosing stack sizes.");
+
+#ifdef POSIX
+static ConfigVar<size_t>::ptr g_threadStackCacheSize =
+    Config::lookup<size_t>("fiber.stackcache.thread", 16u,
+    "Maximum number of unused stacks each thread keeps around for new "
+    "fibers.");
+static ConfigVar<size_t>::ptr g_globalStackCacheSize =
+    Config::lookup<size_t>("fiber.stackcache.global", 256u,
+    "Maximum number of unused stacks kept around (per NUMA node) for new "
+    "fibers once a thread's own cache is full.");
+static ConfigVar<std::string>::ptr g_stackCacheAdvice = Config::lookup(
+    "fiber.stackcache.advice", std::string(),
+    "madvise() stacks as they are cached, so the kernel can reclaim their "
+    "memory (dontneed, free, or empty for none)");
+#endif
+
 // t_fiber is the Fiber currently executing on this thread
 // t_threadFiber is the Fiber that represents the thread's original stack
 // t_threadFiber is a boost::tss, because it supports automatic cleanup when
@@ -92,6 +135,10 @@ Fiber::Fiber()
     m_state = EXEC;
     m_stack = NULL;
     m_stacksize = 0;
+    m_stackDirty = 0;
+    m_stackPainted = false;
+    m_profileType = NULL;
+    m_profileFunction = NULL;
     m_sp = NULL;
     setThis(this);
 #ifdef NATIVE_WINDOWS_FIBERS
@@ -114,6 +161,10 @@ Fiber::Fiber(boost::function<void ()> dg, size_t stacksize)
     m_stack = NULL;
     m_stacksize = stacksize;
     allocStack();
+    m_stackDirty = m_stacksize;
+    m_stackPainted = false;
+    m_profileType = NULL;
+    m_profileFunction = NULL;
 #ifdef UCONTEXT_FIBERS
     m_sp = &m_ctx;
 #elif defined(SETJMP_FIBERS)
@@ -146,6 +197,7 @@ Fiber::~Fiber()
     } else {
         // Regular fiber
         MORDOR_ASSERT(m_state == TERM || m_state == INIT || m_state == EXCEPT);
+        profileStack();
         freeStack();
     }
 }
@@ -157,6 +209,8 @@ Fiber::reset()
     MORDOR_ASSERT(m_stack);
     MORDOR_ASSERT(m_state == TERM || m_state == INIT || m_state == EXCEPT);
     MORDOR_ASSERT(m_dg);
+    profileStack();
+    m_profileType = NULL;
     initStack();
     m_state = INIT;
 }
@@ -167,11 +221,20 @@ Fiber::reset(boost::function<void ()> dg)
     m_exception = boost::exception_ptr();
     MORDOR_ASSERT(m_stack);
     MORDOR_ASSERT(m_state == TERM || m_state == INIT || m_state == EXCEPT);
+    profileStack();
+    m_profileType = NULL;
     m_dg = dg;
     initStack();
     m_state = INIT;
 }
 
+void
+Fiber::profileAs(const std::type_info &type, void (*function)())
+{
+    m_profileType = &type;
+    m_profileFunction = function;
+}
+
 Fiber::ptr
 Fiber::getThis()
 {
@@ -368,6 +431,149 @@ Fiber::exitPoint(Fiber::ptr &cur, State targetState)
     }
 }
 
+#ifdef POSIX
+// Stacks are mapped with an inaccessible guard page just below them, so an
+// overflow faults instead of silently corrupting whatever is mapped there.
+// They're recycled through a per-thread cache (no locking), backed by a
+// global one (per NUMA node, so a stack whose pages were first touched on
+// one node doesn't end up backing a fiber on another), both keyed by stack
+// size.
+static void *
+mapStack(size_t size)
+{
+    void *base = mmap(NULL, size + g_pagesize, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (base == MAP_FAILED)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+    if (mprotect(base, g_pagesize, PROT_NONE)) {
+        munmap(base, size + g_pagesize);
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mprotect");
+    }
+    return (char *)base + g_pagesize;
+}
+
+static void
+unmapStack(void *stack, size_t size)
+{
+    munmap((char *)stack - g_pagesize, size + g_pagesize);
+}
+
+namespace {
+
+struct StackCache
+{
+    StackCache() : count(0) {}
+
+    void *get(size_t size)
+    {
+        std::map<size_t, std::vector<void *> >::iterator it =
+            stacks.find(size);
+        if (it == stacks.end() || it->second.empty())
+            return NULL;
+        void *stack = it->second.back();
+        it->second.pop_back();
+        --count;
+        return stack;
+    }
+
+    bool put(void *stack, size_t size, size_t limit)
+    {
+        if (count >= limit)
+            return false;
+        stacks[size].push_back(stack);
+        ++count;
+        return true;
+    }
+
+    std::map<size_t, std::vector<void *> > stacks;
+    size_t count;
+};
+
+}
+
+// These have to be constructed before (and so destructed after) t_stackCache,
+// which flushes the main thread's cache into them when it's destroyed
+static boost::mutex g_stackCacheMutex;
+static std::map<int, StackCache> g_stackCache;
+
+static int
+currentNode()
+{
+#if defined(LINUX) && defined(SYS_getcpu)
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+        return (int)node;
+#endif
+    return 0;
+}
+
+namespace {
+
+struct ThreadStackCache : StackCache
+{
+    // Hand our stacks off to the global cache when the thread exits
+    ~ThreadStackCache()
+    {
+        size_t limit = g_globalStackCacheSize->val();
+        int node = currentNode();
+        boost::mutex::scoped_lock lock(g_stackCacheMutex);
+        StackCache &global = g_stackCache[node];
+        for (std::map<size_t, std::vector<void *> >::iterator it =
+            stacks.begin(); it != stacks.end(); ++it) {
+            for (std::vector<void *>::iterator it2 = it->second.begin();
+                it2 != it->second.end(); ++it2) {
+                if (!global.put(*it2, it->first, limit))
+                    unmapStack(*it2, it->first);
+            }
+        }
+    }
+};
+
+}
+
+static boost::thread_specific_ptr<ThreadStackCache> t_stackCache;
+
+static void *
+getCachedStack(size_t size)
+{
+    ThreadStackCache *cache = t_stackCache.get();
+    if (!cache) {
+        cache = new ThreadStackCache();
+        t_stackCache.reset(cache);
+    }
+    void *stack = cache->get(size);
+    if (!stack) {
+        int node = currentNode();
+        boost::mutex::scoped_lock lock(g_stackCacheMutex);
+        stack = g_stackCache[node].get(size);
+    }
+    if (stack)
+        g_statCacheHits.increment();
+    else
+        g_statCacheMisses.increment();
+    return stack;
+}
+
+static bool
+cacheStack(void *stack, size_t size)
+{
+    const std::string &advice = g_stackCacheAdvice->val();
+    if (advice == "dontneed") {
+        madvise(stack, size, MADV_DONTNEED);
+#ifdef MADV_FREE
+    } else if (advice == "free") {
+        madvise(stack, size, MADV_FREE);
+#endif
+    }
+    ThreadStackCache *cache = t_stackCache.get();
+    if (cache && cache->put(stack, size, g_threadStackCacheSize->val()))
+        return true;
+    int node = currentNode();
+    boost::mutex::scoped_lock lock(g_stackCacheMutex);
+    return g_stackCache[node].put(stack, size, g_globalStackCacheSize->val());
+}
+#endif
+
 #ifdef NATIVE_WINDOWS_FIBERS
 static VOID CALLBACK native_fiber_entryPoint(PVOID lpParameter)
 {
@@ -397,9 +603,9 @@ Fiber::allocStack()
     VirtualAlloc((char*)m_stack + g_pagesize, m_stacksize, MEM_COMMIT, PAGE_READWRITE);
     m_sp = (char*)m_stack + m_stacksize + g_pagesize;
 #elif defined(POSIX)
-    m_stack = mmap(NULL, m_stacksize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-    if (m_stack == MAP_FAILED)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+    m_stack = getCachedStack(m_stacksize);
+    if (!m_stack)
+        m_stack = mapStack(m_stacksize);
 #if defined(VALGRIND) && (defined(LINUX) || defined(OSX))
     m_valgrindStackId = VALGRIND_STACK_REGISTER(m_stack, (char *)m_stack + m_stacksize);
 #endif
@@ -420,7 +626,8 @@ Fiber::freeStack()
 #if defined(VALGRIND) && (defined(LINUX) || defined(OSX))
     VALGRIND_STACK_DEREGISTER(m_valgrindStackId);
 #endif
-    munmap(m_stack, m_stacksize);
+    if (!cacheStack(m_stack, m_stacksize))
+        unmapStack(m_stack, m_stacksize);
 #endif
 }
 
@@ -444,12 +651,177 @@ fiber_switchContext(void **oldsp, void *newsp)
     if (!setjmp(**(jmp_buf**)oldsp))
          longjmp(*(jmp_buf*)newsp, 1);
 }
+#elif defined(ASM_FIBERS)
+// To the compiler this is just an ordinary function call, so only the
+// callee-saved registers need to be saved on the old stack and restored from
+// the new one.  Unlike swapcontext, there's no signal mask to switch (and so
+// no syscall).
+extern "C" void mordor_fiber_switchContext(void **oldsp, void *newsp);
+#ifdef X86_64
+asm(".text\n"
+    ".globl mordor_fiber_switchContext\n"
+    ".hidden mordor_fiber_switchContext\n"
+    ".type mordor_fiber_switchContext,@function\n"
+    ".align 16\n"
+"mordor_fiber_switchContext:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size mordor_fiber_switchContext,.-mordor_fiber_switchContext\n");
+#elif defined(ARM64)
+asm(".text\n"
+    ".globl mordor_fiber_switchContext\n"
+    ".hidden mordor_fiber_switchContext\n"
+    ".type mordor_fiber_switchContext,%function\n"
+    ".align 4\n"
+"mordor_fiber_switchContext:\n"
+    "    sub sp, sp, #0xa0\n"
+    "    stp x19, x20, [sp, #0x00]\n"
+    "    stp x21, x22, [sp, #0x10]\n"
+    "    stp x23, x24, [sp, #0x20]\n"
+    "    stp x25, x26, [sp, #0x30]\n"
+    "    stp x27, x28, [sp, #0x40]\n"
+    "    stp x29, x30, [sp, #0x50]\n"
+    "    stp d8, d9, [sp, #0x60]\n"
+    "    stp d10, d11, [sp, #0x70]\n"
+    "    stp d12, d13, [sp, #0x80]\n"
+    "    stp d14, d15, [sp, #0x90]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0x00]\n"
+    "    ldp x21, x22, [sp, #0x10]\n"
+    "    ldp x23, x24, [sp, #0x20]\n"
+    "    ldp x25, x26, [sp, #0x30]\n"
+    "    ldp x27, x28, [sp, #0x40]\n"
+    "    ldp x29, x30, [sp, #0x50]\n"
+    "    ldp d8, d9, [sp, #0x60]\n"
+    "    ldp d10, d11, [sp, #0x70]\n"
+    "    ldp d12, d13, [sp, #0x80]\n"
+    "    ldp d14, d15, [sp, #0x90]\n"
+    "    add sp, sp, #0xa0\n"
+    "    ret\n"
+    ".size mordor_fiber_switchContext,.-mordor_fiber_switchContext\n");
+#else
+#error Architecture not supported
 #endif
 
+static void
+fiber_switchContext(void **oldsp, void *newsp)
+{
+    mordor_fiber_switchContext(oldsp, newsp);
+}
+#endif
+
+
+// Stack profiling
+
+static const unsigned char STACK_PAINT = 0xcd;
+
+static boost::mutex g_stackProfileMutex;
+static std::map<std::string, AverageMinMaxStatistic<size_t> *>
+    g_stackProfiles;
+
+static std::string
+entryPointName(const std::type_info &type, void (*function)())
+{
+    std::string name = type.name();
+#ifdef GCC
+    int status;
+    char *demangled = abi::__cxa_demangle(name.c_str(), NULL, NULL, &status);
+    if (demangled) {
+        name = demangled;
+        free(demangled);
+    }
+#endif
+    // All plain functions have the same type; tell them apart by address
+    if (function) {
+        std::ostringstream os;
+        os << name << " " << (const void *)function;
+        name = os.str();
+    }
+    return name;
+}
+
+void
+Fiber::paintStack()
+{
+#ifndef NATIVE_WINDOWS_FIBERS
+    if (!g_stackProfile->val()) {
+        m_stackDirty = m_stacksize;
+        m_stackPainted = false;
+        return;
+    }
+    // Hasn't run since it was last painted
+    if (m_stackPainted)
+        return;
+    // Only what was used last time needs to be painted again
+    memset((char *)m_stack + m_stacksize - m_stackDirty, STACK_PAINT,
+        m_stackDirty);
+    m_stackDirty = 0;
+    m_stackPainted = true;
+#endif
+}
+
+void
+Fiber::profileStack()
+{
+    if (!m_stackPainted || m_state == INIT || !m_dg)
+        return;
+    const unsigned char *bottom = (const unsigned char *)m_stack;
+    const unsigned char *top = bottom + m_stacksize;
+    const unsigned char *highWater = bottom;
+    while (highWater < top && *highWater == STACK_PAINT)
+        ++highWater;
+    m_stackDirty = top - highWater;
+    m_stackPainted = false;
+
+    std::string name;
+    if (m_profileType) {
+        name = entryPointName(*m_profileType, m_profileFunction);
+    } else {
+        void (* const *function)() = m_dg.target<void (*)()>();
+        name = entryPointName(m_dg.target_type(),
+            function ? *function : NULL);
+    }
+    AverageMinMaxStatistic<size_t> *stat;
+    {
+        boost::mutex::scoped_lock lock(g_stackProfileMutex);
+        std::map<std::string, AverageMinMaxStatistic<size_t> *>::iterator it =
+            g_stackProfiles.find(name);
+        if (it == g_stackProfiles.end()) {
+            stat = &Statistics::registerStatistic("fiber.stack." + name,
+                AverageMinMaxStatistic<size_t>("bytes"));
+            g_stackProfiles[name] = stat;
+        } else {
+            stat = it->second;
+        }
+    }
+    stat->update(m_stackDirty);
+}
 
 void
 Fiber::initStack()
 {
+    paintStack();
 #ifdef NATIVE_WINDOWS_FIBERS
     if (m_stack)
         return;
@@ -471,6 +843,23 @@ Fiber::initStack()
     m_ctx.uc_mcontext = (mcontext_t)m_mctx;
 #endif
     makecontext(&m_ctx, &Fiber::entryPoint, 0);
+#elif defined(ASM_FIBERS)
+    // Lay out the stack as if the fiber had switched away just as it was
+    // about to call entryPoint, so the first switch to it "returns" there
+    void **sp = (void **)((char *)m_stack + m_stacksize);
+#ifdef X86_64
+    *--sp = NULL;                       // entryPoint's return address
+    *--sp = (void *)&Fiber::entryPoint;
+    for (int i = 0; i < 6; ++i)
+        *--sp = NULL;                   // rbp, rbx, r12-r15
+    // Default x87 control word and MXCSR
+    *--sp = (void *)((0x037fll << 32) | 0x1f80ll);
+#elif defined(ARM64)
+    sp -= 0xa0 / sizeof(void *);
+    memset(sp, 0, 0xa0);
+    sp[0x58 / sizeof(void *)] = (void *)&Fiber::entryPoint;    // x30
+#endif
+    m_sp = sp;
 #elif defined(SETJMP_FIBERS)
     if (setjmp(m_env)) {
         Fiber::entryPoint();
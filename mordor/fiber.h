@@ -3,6 +3,7 @@
 // Copyright (c) 2009 - Decho Corporation
 
 #include <list>
+#include <typeinfo>
 
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/function.hpp>
@@ -14,14 +15,19 @@
 #include "version.h"
 
 // Fiber impl selection
+// (build with -DUCONTEXT_FIBERS to use ucontext instead of ASM_FIBERS)
 
 #ifdef X86_64
 #   ifdef WINDOWS
 #       define NATIVE_WINDOWS_FIBERS
 #   elif defined(OSX)
 #       define SETJMP_FIBERS
+#   elif defined(LINUX) && !defined(UCONTEXT_FIBERS)
+#       define ASM_FIBERS
 #   elif defined(POSIX)
-#       define UCONTEXT_FIBERS
+#       ifndef UCONTEXT_FIBERS
+#           define UCONTEXT_FIBERS
+#       endif
 #   endif
 #elif defined(X86)
 #   ifdef WINDOWS
@@ -29,12 +35,26 @@
 #   elif defined(OSX)
 #       define SETJMP_FIBERS
 #   elif defined(POSIX)
-#       define UCONTEXT_FIBERS
+#       ifndef UCONTEXT_FIBERS
+#           define UCONTEXT_FIBERS
+#       endif
 #   endif
 #elif defined(PPC)
-#   define UCONTEXT_FIBERS
+#   ifndef UCONTEXT_FIBERS
+#       define UCONTEXT_FIBERS
+#   endif
 #elif defined(ARM)
-#   define UCONTEXT_FIBERS
+#   ifndef UCONTEXT_FIBERS
+#       define UCONTEXT_FIBERS
+#   endif
+#elif defined(ARM64)
+#   if defined(LINUX) && !defined(UCONTEXT_FIBERS)
+#       define ASM_FIBERS
+#   else
+#       ifndef UCONTEXT_FIBERS
+#           define UCONTEXT_FIBERS
+#       endif
+#   endif
 #else
 #   error Platform not supported
 #endif
@@ -101,6 +121,12 @@ public:
     /// @post state() == INIT
     void reset(boost::function<void ()> dg);
 
+    /// Name this Fiber's stack profile (fiber.stackprofile) after a functor
+    /// of type type (or, for a plain function, function), instead of after
+    /// the initial function; for an initial function that just runs
+    /// something else, like the Scheduler's.  Until the next reset().
+    void profileAs(const std::type_info &type, void (*function)() = NULL);
+
     /// @return The currently executing Fiber
     static ptr getThis();
 
@@ -167,11 +193,20 @@ private:
     void allocStack();
     void freeStack();
     void initStack();
+    void paintStack();
+    void profileStack();
 
 private:
     boost::function<void ()> m_dg;
     void *m_stack, *m_sp;
     size_t m_stacksize;
+    // Stack profiling (fiber.stackprofile); m_stackDirty is how much of the
+    // top of the stack may have been written to since it was last painted
+    size_t m_stackDirty;
+    bool m_stackPainted;
+    // From profileAs(); NULL to use m_dg
+    const std::type_info *m_profileType;
+    void (*m_profileFunction)();
 #ifdef UCONTEXT_FIBERS
     ucontext_t m_ctx;
 #ifdef OSX
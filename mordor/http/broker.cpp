@@ -5,6 +5,9 @@
 #include "auth.h"
 #include "client.h"
 #include "mordor/atomic.h"
+#ifndef WINDOWS
+#include "mordor/dns.h"
+#endif
 #include "mordor/fiber.h"
 #include "mordor/future.h"
 #include "mordor/iomanager.h"
@@ -31,6 +34,9 @@ createRequestBroker(const RequestBrokerOptions &options)
     SocketStreamBroker::ptr socketBroker(new SocketStreamBroker(options.ioManager,
         options.scheduler));
     socketBroker->connectTimeout(options.connectTimeout);
+#ifndef WINDOWS
+    socketBroker->resolver(options.resolver);
+#endif
 
     StreamBroker::ptr streamBroker = socketBroker;
     if (options.customStreamBrokerFilter) {
@@ -107,6 +113,11 @@ SocketStreamBroker::getStream(const URI &uri)
     else if (uri.schemeDefined())
         os << ":" << uri.scheme();
     std::vector<Address::ptr> addresses;
+#ifndef WINDOWS
+    if (m_resolver) {
+        addresses = m_resolver->lookup(os.str(), AF_UNSPEC, SOCK_STREAM);
+    } else
+#endif
     {
         SchedulerSwitcher switcher(m_scheduler);
         addresses = Address::lookup(os.str(), AF_UNSPEC, SOCK_STREAM);
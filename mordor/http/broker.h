@@ -15,6 +15,10 @@ class Socket;
 class Stream;
 class TimerManager;
 
+namespace DNS {
+class Resolver;
+}
+
 namespace HTTP {
 
 class ClientConnection;
@@ -75,6 +79,12 @@ public:
     {}
 
     void connectTimeout(unsigned long long timeout) { m_connectTimeout = timeout; }
+#ifndef WINDOWS
+    /// Look up hosts with resolver (which caches them), instead of
+    /// getaddrinfo on the Scheduler
+    void resolver(boost::shared_ptr<DNS::Resolver> resolver)
+    { m_resolver = resolver; }
+#endif
 
     boost::shared_ptr<Stream> getStream(const URI &uri);
     void cancelPending();
@@ -86,6 +96,9 @@ private:
     IOManager *m_ioManager;
     Scheduler *m_scheduler;
     unsigned long long m_connectTimeout;
+#ifndef WINDOWS
+    boost::shared_ptr<DNS::Resolver> m_resolver;
+#endif
 };
 
 class ConnectionBroker
@@ -371,6 +384,11 @@ struct RequestBrokerOptions
 
     IOManager *ioManager;
     Scheduler *scheduler;
+#ifndef WINDOWS
+    /// Resolves hosts without blocking, and caches them; see
+    /// SocketStreamBroker::resolver
+    boost::shared_ptr<DNS::Resolver> resolver;
+#endif
     boost::function<bool (size_t)> delayDg;
     bool handleRedirects;
     TimerManager *timerManager;
@@ -4,6 +4,7 @@
 
 #include <boost/bind.hpp>
 
+#include "mordor/config.h"
 #include "mordor/fiber.h"
 #include "mordor/scheduler.h"
 #include "mordor/socket.h"
@@ -17,6 +18,11 @@ namespace HTTP {
 
 static Logger::ptr g_log = Log::lookup("mordor:http:server");
 
+static ConfigVar<size_t>::ptr g_stackSize = Config::lookup<size_t>(
+    "http.server.stacksize", 0u,
+    "Stack size for the fibers processing each request (0 to run them on the "
+    "Scheduler's fibers, which use fiber.defaultstacksize)");
+
 ServerConnection::ServerConnection(Stream::ptr stream, boost::function<void (ServerRequest::ptr)> dg)
 : Connection(stream),
   m_dg(dg),
@@ -64,8 +70,14 @@ ServerConnection::scheduleNextRequest(ServerRequest *request)
         m_pendingRequests.push_back(nextRequest.get());
         MORDOR_LOG_TRACE(g_log) << this << "-" << nextRequest->m_requestNumber
             << " scheduling request";
-        Scheduler::getThis()->schedule(boost::bind(&ServerRequest::doRequest,
-            nextRequest));
+        boost::function<void ()> dg = boost::bind(&ServerRequest::doRequest,
+            nextRequest);
+        size_t stackSize = g_stackSize->val();
+        if (stackSize)
+            Scheduler::getThis()->schedule(Fiber::ptr(
+                new Fiber(dg, stackSize)));
+        else
+            Scheduler::getThis()->schedule(dg);
     }
 }
 
@@ -177,7 +177,10 @@ void respondError(ServerRequest::ptr request, Status status,
 ///
 /// This function will process Range, If-Range, and TE headers to stream
 /// response in the most efficient way, applying transfer encodings if
-/// necessary or possible
+/// necessary or possible.  A FileStream (or a LimitedStream on one) sent
+/// without a transfer encoding over a plain SocketStream is handed to the
+/// kernel with sendfile() (see transferStream() for how disk reads are kept
+/// off of the calling thread)
 void respondStream(ServerRequest::ptr request,
     boost::shared_ptr<Stream> response);
 
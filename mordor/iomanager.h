@@ -7,7 +7,11 @@
 #ifdef WINDOWS
 #include "iomanager_iocp.h"
 #elif defined(LINUX)
+#ifdef IOURING
+#include "iomanager_iouring.h"
+#else
 #include "iomanager_epoll.h"
+#endif
 #elif defined(BSD)
 #include "iomanager_kqueue.h"
 #endif
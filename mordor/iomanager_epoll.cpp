@@ -2,17 +2,61 @@
 
 #include "pch.h"
 
-#ifdef LINUX
+#if defined(LINUX) && !defined(IOURING)
 
 #include "iomanager_epoll.h"
 
+#include <sys/eventfd.h>
+
 #include "assert.h"
+#include "atomic.h"
+#include "config.h"
 #include "fiber.h"
+#include "statistics.h"
 
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:iomanager");
 
+static ConfigVar<bool>::ptr g_persistent = Config::lookup(
+    "iomanager.epoll.persistent", false,
+    "Add Sockets to the epoll set once, when they're created, instead of "
+    "every time they would block");
+static ConfigVar<bool>::ptr g_perThread = Config::lookup(
+    "iomanager.epoll.perthread", false,
+    "Give each thread an epoll set of its own, and resume Fibers waiting on "
+    "an fd on the thread that registered it");
+
+static ConfigVar<unsigned long long>::ptr g_busyPollWindow = Config::lookup(
+    "iomanager.busypoll.window", 0ull,
+    "How long (in microseconds) busy-polling threads poll epoll_wait "
+    "before blocking; 0 to not busy-poll");
+static ConfigVar<size_t>::ptr g_busyPollThreads = Config::lookup<size_t>(
+    "iomanager.busypoll.threads", 1u,
+    "How many of each IOManager's threads busy-poll");
+static ConfigVar<int>::ptr g_busyPollSocket = Config::lookup(
+    "iomanager.busypoll.socket", 0,
+    "SO_BUSY_POLL (in microseconds) to set on Sockets; 0 to leave it alone");
+
+static ConfigVar<size_t>::ptr g_maxEvents = Config::lookup<size_t>(
+    "iomanager.epoll.maxevents", 1024u,
+    "Most events to take from each epoll_wait; starting from 64, threads "
+    "double it while epoll_wait fills it, and halve it while it's mostly "
+    "empty");
+
+static CountStatistic<unsigned long long> &g_statCtl =
+    Statistics::registerStatistic("iomanager.epoll_ctl",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statWait =
+    Statistics::registerStatistic("iomanager.epoll_wait",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statSpinHits =
+    Statistics::registerStatistic("iomanager.spin.hits",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statSpinSleeps =
+    Statistics::registerStatistic("iomanager.spin.sleeps",
+    CountStatistic<unsigned long long>());
+
 enum epoll_ctl_op_t
 {
     epoll_ctl_op_t_dummy = 0x7ffffff
@@ -85,42 +129,61 @@ static std::ostream &operator <<(std::ostream &os, EPOLL_EVENTS events)
     return os;
 }
 
-IOManager::IOManager(size_t threads, bool useCaller)
-    : Scheduler(threads, useCaller)
+IOManager::AsyncEvent::AsyncEvent()
+    : m_epfd(-1),
+      m_persistent(false),
+      m_waiting(0),
+      m_ready(0)
 {
+    memset(&event, 0, sizeof(epoll_event));
+}
+
+IOManager::IOManager(size_t threads, bool useCaller, bool workStealing)
+    : Scheduler(threads, useCaller, 1, workStealing),
+      m_persistent(g_persistent->val()),
+      m_perThread(g_perThread->val()),
+      m_epollSets(NULL),
+      m_epollSetCount(0),
+      m_nextEpollSet(0),
+      m_setsReleased(false),
+      m_busyPollWindow(g_busyPollWindow->val()),
+      m_busyPollThreads((int)g_busyPollThreads->val()),
+      m_busyPollers(0),
+      m_busyPollSocket(g_busyPollSocket->val()),
+      m_pendingEventCount(0)
+{
+    memset((void *)m_pendingEvents, 0, sizeof(m_pendingEvents));
     m_epfd = epoll_create(5000);
     MORDOR_LOG_LEVEL(g_log, m_epfd <= 0 ? Log::ERROR : Log::TRACE) << this
         << " epoll_create(5000): " << m_epfd;
     if (m_epfd <= 0)
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_create");
-    int rc = pipe(m_tickleFds);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this << " pipe(): "
-        << rc << " (" << errno << ")";
-    if (rc) {
+    // Non-blocking, because more than one thread can be woken up by the same
+    // tickle, and only one of them will get to read it
+    m_tickleFd = eventfd(0, EFD_NONBLOCK);
+    MORDOR_LOG_LEVEL(g_log, m_tickleFd < 0 ? Log::ERROR : Log::VERBOSE) << this
+        << " eventfd(): " << m_tickleFd << " (" << errno << ")";
+    if (m_tickleFd < 0) {
         close(m_epfd);
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("pipe");
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("eventfd");
     }
-    MORDOR_ASSERT(m_tickleFds[0] > 0);
-    MORDOR_ASSERT(m_tickleFds[1] > 0);
     epoll_event event;
     memset(&event, 0, sizeof(epoll_event));
     event.events = EPOLLIN | EPOLLET;
-    event.data.fd = m_tickleFds[0];
-    rc = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
+    event.data.fd = m_tickleFd;
+    int rc = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFd, &event);
     MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", EPOLL_CTL_ADD, " << m_tickleFds[0]
+        << " epoll_ctl(" << m_epfd << ", EPOLL_CTL_ADD, " << m_tickleFd
         << ", EPOLLIN | EPOLLET): " << rc << " (" << errno << ")";
     if (rc) {
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
+        close(m_tickleFd);
         close(m_epfd);
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
     }
     try {
         start();
     } catch (...) {
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
+        close(m_tickleFd);
         close(m_epfd);
         throw;
     }
@@ -131,9 +194,199 @@ IOManager::~IOManager()
     stop();
     close(m_epfd);
     MORDOR_LOG_TRACE(g_log) << this << " close(" << m_epfd << ")";
-    close(m_tickleFds[0]);
-    MORDOR_LOG_VERBOSE(g_log) << this << " close(" << m_tickleFds[0] << ")";
-    close(m_tickleFds[1]);
+    close(m_tickleFd);
+    MORDOR_LOG_VERBOSE(g_log) << this << " close(" << m_tickleFd << ")";
+    while (m_epollSets) {
+        EpollSet *set = m_epollSets;
+        m_epollSets = set->next;
+        close(set->epfd);
+        close(set->tickleFd);
+        delete set;
+    }
+    for (size_t i = 0; i < EVENT_CHUNKS; ++i)
+        delete [] m_pendingEvents[i];
+}
+
+IOManager::AsyncEvent *
+IOManager::lookup(int fd, bool create)
+{
+    MORDOR_ASSERT(fd >= 0);
+    size_t chunk = (size_t)fd / EVENT_CHUNK;
+    if (chunk >= EVENT_CHUNKS) {
+        if (!create)
+            return NULL;
+        // Too many to track; as if the process were out of fds
+        MORDOR_LOG_ERROR(g_log) << this << " fd " << fd
+            << " is past the most that can be registered";
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(EMFILE, "epoll_ctl");
+    }
+    AsyncEvent *events = m_pendingEvents[chunk];
+    if (!events) {
+        if (!create)
+            return NULL;
+        boost::mutex::scoped_lock lock(m_mutex);
+        events = m_pendingEvents[chunk];
+        if (!events) {
+            events = new AsyncEvent[EVENT_CHUNK];
+            // Publish it only once it's fully constructed
+            atomicSwap(m_pendingEvents[chunk], events);
+        }
+    }
+    return &events[fd % EVENT_CHUNK];
+}
+
+IOManager::EpollSet *
+IOManager::createSet(tid_t thread)
+{
+    int epfd = epoll_create(5000);
+    MORDOR_LOG_LEVEL(g_log, epfd <= 0 ? Log::ERROR : Log::TRACE) << this
+        << " epoll_create(5000): " << epfd;
+    if (epfd <= 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_create");
+    int tickleFd = eventfd(0, EFD_NONBLOCK);
+    MORDOR_LOG_LEVEL(g_log, tickleFd < 0 ? Log::ERROR : Log::VERBOSE) << this
+        << " eventfd(): " << tickleFd << " (" << errno << ")";
+    if (tickleFd < 0) {
+        close(epfd);
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("eventfd");
+    }
+    int fds[] = { tickleFd, m_tickleFd };
+    for (size_t i = 0; i < 2; ++i) {
+        epoll_event event;
+        memset(&event, 0, sizeof(epoll_event));
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = fds[i];
+        int rc = epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &event);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " epoll_ctl(" << epfd << ", EPOLL_CTL_ADD, " << fds[i]
+            << ", EPOLLIN | EPOLLET): " << rc << " (" << errno << ")";
+        if (rc) {
+            close(tickleFd);
+            close(epfd);
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+        }
+    }
+    EpollSet *set = new EpollSet();
+    set->epfd = epfd;
+    set->tickleFd = tickleFd;
+    set->thread = thread;
+    set->waiting = false;
+    set->released = false;
+    boost::mutex::scoped_lock lock(m_mutex);
+    set->next = m_epollSets;
+    // Count it first, so nobody sees a set and a count of 0
+    atomicIncrement(m_epollSetCount);
+    // Publish it only once it's fully constructed
+    atomicSwap(m_epollSets, set);
+    return set;
+}
+
+IOManager::EpollSet *
+IOManager::claimSet()
+{
+    tid_t thread = gettid();
+    EpollSet *set;
+    for (set = m_epollSets; set; set = set->next)
+        if (set->thread == thread)
+            return set;
+    for (set = m_epollSets; set; set = set->next)
+        if (set->thread == emptytid() &&
+            atomicCompareAndSwap(set->thread, thread, emptytid()) ==
+            emptytid()) {
+            set->released = false;
+            return set;
+        }
+    return createSet(thread);
+}
+
+void
+IOManager::releaseSet(EpollSet *set)
+{
+    set->released = true;
+    set->thread = emptytid();
+    m_setsReleased = true;
+    // Whoever's still here has to take over its fds
+    tickle();
+}
+
+void
+IOManager::adoptSets(EpollSet *set)
+{
+    boost::mutex::scoped_lock adoptLock(m_adoptMutex);
+    m_setsReleased = false;
+    for (EpollSet *released = m_epollSets; released;
+        released = released->next) {
+        if (released == set || !released->released)
+            continue;
+        for (size_t chunk = 0; chunk < EVENT_CHUNKS; ++chunk) {
+            AsyncEvent *events = m_pendingEvents[chunk];
+            if (!events)
+                continue;
+            for (size_t i = 0; i < EVENT_CHUNK; ++i) {
+                AsyncEvent &e = events[i];
+                if (e.m_epfd != released->epfd || !e.event.events)
+                    continue;
+                boost::mutex::scoped_lock lock(e.m_mutex);
+                if (e.m_epfd != released->epfd || !e.event.events)
+                    continue;
+                int fd = e.event.data.fd;
+                g_statCtl.increment();
+                int rc = epoll_ctl(released->epfd, EPOLL_CTL_DEL, fd,
+                    &e.event);
+                MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE)
+                    << this << " epoll_ctl(" << released->epfd
+                    << ", EPOLL_CTL_DEL, " << fd << "): " << rc << " ("
+                    << errno << ")";
+                // Readiness is checked as it's added, so no edge is lost
+                g_statCtl.increment();
+                rc = epoll_ctl(set->epfd, EPOLL_CTL_ADD, fd, &e.event);
+                MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE)
+                    << this << " epoll_ctl(" << set->epfd
+                    << ", EPOLL_CTL_ADD, " << fd << ", "
+                    << (EPOLL_EVENTS)e.event.events << "): " << rc << " ("
+                    << errno << ")";
+                if (rc == 0)
+                    e.m_epfd = set->epfd;
+            }
+        }
+    }
+}
+
+void
+IOManager::checkReleased(int epfd)
+{
+    for (EpollSet *set = m_epollSets; set; set = set->next) {
+        if (set->epfd != epfd)
+            continue;
+        // Added after adoptSets() looked; have it look again
+        if (set->released) {
+            m_setsReleased = true;
+            tickle();
+        }
+        return;
+    }
+}
+
+int
+IOManager::epfd()
+{
+    if (!m_perThread)
+        return m_epfd;
+    if (Scheduler::getThis() == this)
+        return claimSet()->epfd;
+    // Not one of our threads; spread the fds between them
+    EpollSet *set = m_epollSets;
+    if (!set)
+        return createSet(emptytid())->epfd;
+    size_t index = atomicIncrement(m_nextEpollSet) % m_epollSetCount;
+    while (index-- != 0 && set->next)
+        set = set->next;
+    // Rather one that somebody polls
+    for (EpollSet *other = set; other; other = other->next) {
+        if (!other->released)
+            return other->epfd;
+    }
+    return set->epfd;
 }
 
 bool
@@ -152,18 +405,21 @@ IOManager::registerEvent(int fd, Event events, boost::function<void ()> dg)
 
     int epollevents = ((int)events & (EPOLLIN | EPOLLOUT | EPOLLRDHUP)) | EPOLLET;
     MORDOR_ASSERT(epollevents != 0);
-    boost::mutex::scoped_lock lock(m_mutex);
-    int op;
-    std::map<int, AsyncEvent>::iterator it = m_pendingEvents.find(fd);
-    AsyncEvent *event;
-    if (it == m_pendingEvents.end()) {
+    AsyncEvent *event = lookup(fd, true);
+    boost::mutex::scoped_lock lock(event->m_mutex);
+    int op = 0;
+    if (event->m_persistent) {
+        MORDOR_ASSERT(!(event->m_waiting & epollevents));
+        if (!event->m_waiting)
+            atomicIncrement(m_pendingEventCount);
+        event->m_waiting |= epollevents & ~EPOLLET;
+    } else if (!event->event.events) {
         op = EPOLL_CTL_ADD;
-        event = &m_pendingEvents[fd];
+        event->m_epfd = epfd();
         event->event.data.fd = fd;
         event->event.events = epollevents;
     } else {
         op = EPOLL_CTL_MOD;
-        event = &it->second;
         // OR == XOR means that none of the same bits were set
         MORDOR_ASSERT((event->event.events | (epollevents & ~EPOLLET))
             == (event->event.events ^ (epollevents & ~EPOLLET)));
@@ -171,6 +427,7 @@ IOManager::registerEvent(int fd, Event events, boost::function<void ()> dg)
     }
     if (epollevents & EPOLLIN) {
         event->m_schedulerIn = Scheduler::getThis();
+        event->m_priorityIn = Scheduler::currentPriority();
         if (dg) {
             event->m_dgIn = dg;
             event->m_fiberIn.reset();
@@ -181,6 +438,7 @@ IOManager::registerEvent(int fd, Event events, boost::function<void ()> dg)
     }
     if (epollevents & EPOLLOUT) {
         event->m_schedulerOut = Scheduler::getThis();
+        event->m_priorityOut = Scheduler::currentPriority();
         if (dg) {
             event->m_dgOut = dg;
             event->m_fiberOut.reset();
@@ -191,6 +449,7 @@ IOManager::registerEvent(int fd, Event events, boost::function<void ()> dg)
     }
     if (epollevents & EPOLLRDHUP) {
         event->m_schedulerClose = Scheduler::getThis();
+        event->m_priorityClose = Scheduler::currentPriority();
         if (dg) {
             event->m_dgClose = dg;
             event->m_fiberClose.reset();
@@ -199,27 +458,64 @@ IOManager::registerEvent(int fd, Event events, boost::function<void ()> dg)
             event->m_fiberClose = Fiber::getThis();
         }
     }
-    int rc = epoll_ctl(m_epfd, op, event->event.data.fd, &event->event);
+    if (event->m_persistent) {
+        uint32_t ready = event->m_ready & epollevents;
+        event->m_ready &= ~ready;
+        triggerNoLock(*event, ready);
+        return;
+    }
+    g_statCtl.increment();
+    int rc = epoll_ctl(event->m_epfd, op, event->event.data.fd,
+        &event->event);
     MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+        << " epoll_ctl(" << event->m_epfd << ", " << (epoll_ctl_op_t)op << ", "
         << event->event.data.fd << ", " << (EPOLL_EVENTS)event->event.events << "): " << rc
         << " (" << errno << ")";
-    if (rc)
+    if (rc) {
+        if (op == EPOLL_CTL_ADD)
+            event->event.events = 0;
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    }
+    if (op == EPOLL_CTL_ADD) {
+        atomicIncrement(m_pendingEventCount);
+        if (m_perThread)
+            checkReleased(event->m_epfd);
+    }
 }
 
 bool
 IOManager::unregisterEvent(int fd, Event events)
 {
-    boost::mutex::scoped_lock lock(m_mutex);
-    std::map<int, AsyncEvent>::iterator it = m_pendingEvents.find(fd);
-    if (it == m_pendingEvents.end())
+    AsyncEvent *event = lookup(fd, false);
+    if (!event)
         return false;
+    AsyncEvent &e = *event;
+    boost::mutex::scoped_lock lock(e.m_mutex);
+    if (e.m_persistent) {
+        uint32_t waiting = e.m_waiting & events;
+        if (!waiting)
+            return false;
+        if (waiting & EPOLLIN) {
+            e.m_dgIn = NULL;
+            e.m_fiberIn.reset();
+        }
+        if (waiting & EPOLLOUT) {
+            e.m_dgOut = NULL;
+            e.m_fiberOut.reset();
+        }
+        if (waiting & EPOLLRDHUP) {
+            e.m_dgClose = NULL;
+            e.m_fiberClose.reset();
+        }
+        e.m_waiting &= ~waiting;
+        if (!e.m_waiting)
+            atomicDecrement(m_pendingEventCount);
+        return true;
+    }
     // Nothing matching
-    if (!(events & it->second.event.events))
+    if (!(events & e.event.events))
         return false;
     bool result = false;
-    AsyncEvent &e = it->second;
     if ((events & EPOLLIN) && (e.event.events & EPOLLIN)) {
         e.m_dgIn = NULL;
         e.m_fiberIn.reset();
@@ -237,13 +533,16 @@ IOManager::unregisterEvent(int fd, Event events)
     }
     e.event.events &= ~events;
     int op = e.event.events == (unsigned int)EPOLLET ?
-        EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    int rc = epoll_ctl(m_epfd, op, fd, &e.event);
+        EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    g_statCtl.increment();
+    int rc = epoll_ctl(e.m_epfd, op, fd, &e.event);
     MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", " << fd
+        << " epoll_ctl(" << e.m_epfd << ", " << (epoll_ctl_op_t)op << ", " << fd
         << ", " << (EPOLL_EVENTS)e.event.events << "): " << rc << " (" << errno << ")";
-    if (op == EPOLL_CTL_DEL)
-        m_pendingEvents.erase(it);
+    if (op == EPOLL_CTL_DEL) {
+        e.event.events = 0;
+        atomicDecrement(m_pendingEventCount);
+    }
     if (rc)
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
     return result;
@@ -252,154 +551,362 @@ IOManager::unregisterEvent(int fd, Event events)
 void
 IOManager::cancelEvent(int fd, Event events)
 {
-    boost::mutex::scoped_lock lock(m_mutex);
-    std::map<int, AsyncEvent>::iterator it = m_pendingEvents.find(fd);
-    if (it == m_pendingEvents.end())
+    AsyncEvent *event = lookup(fd, false);
+    if (!event)
+        return;
+    AsyncEvent &e = *event;
+    boost::mutex::scoped_lock lock(e.m_mutex);
+    if (e.m_persistent) {
+        triggerNoLock(e, events);
+        return;
+    }
+    if (!e.event.events)
         return;
-    AsyncEvent &e = it->second;
     if ((events & EPOLLIN) && (e.event.events & EPOLLIN)) {
         if (e.m_dgIn)
-            e.m_schedulerIn->schedule(e.m_dgIn);
+            e.m_schedulerIn->schedule(e.m_dgIn, emptytid(), e.m_priorityIn);
         else
-            e.m_schedulerIn->schedule(e.m_fiberIn);
+            e.m_schedulerIn->schedule(e.m_fiberIn, emptytid(), e.m_priorityIn);
         e.m_dgIn = NULL;
         e.m_fiberIn.reset();
     }
     if ((events & EPOLLOUT) && (e.event.events & EPOLLOUT)) {
         if (e.m_dgOut)
-            e.m_schedulerOut->schedule(e.m_dgOut);
+            e.m_schedulerOut->schedule(e.m_dgOut, emptytid(), e.m_priorityOut);
         else
-            e.m_schedulerOut->schedule(e.m_fiberOut);
+            e.m_schedulerOut->schedule(e.m_fiberOut, emptytid(),
+                e.m_priorityOut);
         e.m_dgOut = NULL;
         e.m_fiberOut.reset();
     }
     if ((events & EPOLLRDHUP) && (e.event.events & EPOLLRDHUP)) {
         if (e.m_dgClose)
-            e.m_schedulerClose->schedule(e.m_dgClose);
+            e.m_schedulerClose->schedule(e.m_dgClose, emptytid(),
+                e.m_priorityClose);
         else
-            e.m_schedulerClose->schedule(e.m_fiberClose);
+            e.m_schedulerClose->schedule(e.m_fiberClose, emptytid(),
+                e.m_priorityClose);
         e.m_dgClose = NULL;
         e.m_fiberClose.reset();
     }
     e.event.events &= ~events;
     int op = e.event.events == (unsigned int)EPOLLET ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
-    int rc = epoll_ctl(m_epfd, op, fd, &e.event);
+    g_statCtl.increment();
+    int rc = epoll_ctl(e.m_epfd, op, fd, &e.event);
     MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", " << fd
+        << " epoll_ctl(" << e.m_epfd << ", " << (epoll_ctl_op_t)op << ", " << fd
         << ", " << (EPOLL_EVENTS)e.event.events << "): " << rc << " ("
         << errno << ")";
-    if (op == EPOLL_CTL_DEL)
-        m_pendingEvents.erase(it);
+    if (op == EPOLL_CTL_DEL) {
+        e.event.events = 0;
+        atomicDecrement(m_pendingEventCount);
+    }
     if (rc)
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
 }
 
+void
+IOManager::registerFd(int fd)
+{
+    MORDOR_ASSERT(fd > 0);
+    AsyncEvent *event = lookup(fd, true);
+    boost::mutex::scoped_lock lock(event->m_mutex);
+    MORDOR_ASSERT(!event->event.events);
+    event->m_epfd = epfd();
+    event->event.data.fd = fd;
+    event->event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    g_statCtl.increment();
+    int rc = epoll_ctl(event->m_epfd, EPOLL_CTL_ADD, fd, &event->event);
+    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+        << " epoll_ctl(" << event->m_epfd << ", EPOLL_CTL_ADD, " << fd << ", "
+        << (EPOLL_EVENTS)event->event.events << "): " << rc << " (" << errno
+        << ")";
+    if (rc) {
+        event->event.events = 0;
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    }
+    event->m_persistent = true;
+    event->m_waiting = event->m_ready = 0;
+    if (m_perThread)
+        checkReleased(event->m_epfd);
+}
+
+void
+IOManager::unregisterFd(int fd)
+{
+    AsyncEvent *event = lookup(fd, false);
+    MORDOR_ASSERT(event);
+    boost::mutex::scoped_lock lock(event->m_mutex);
+    MORDOR_ASSERT(event->m_persistent);
+    MORDOR_ASSERT(!event->m_waiting);
+    g_statCtl.increment();
+    int rc = epoll_ctl(event->m_epfd, EPOLL_CTL_DEL, fd, &event->event);
+    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+        << " epoll_ctl(" << event->m_epfd << ", EPOLL_CTL_DEL, " << fd << "): " << rc
+        << " (" << errno << ")";
+    event->event.events = 0;
+    event->m_persistent = false;
+    if (rc)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+}
+
+void
+IOManager::triggerNoLock(AsyncEvent &e, uint32_t events, tid_t thread,
+    std::vector<FiberAndThread> *batch)
+{
+    events &= e.m_waiting;
+    if (!events)
+        return;
+    if (events & EPOLLIN)
+        fire(e.m_schedulerIn, e.m_fiberIn, e.m_dgIn, e.m_priorityIn, thread,
+            batch);
+    if (events & EPOLLOUT)
+        fire(e.m_schedulerOut, e.m_fiberOut, e.m_dgOut, e.m_priorityOut,
+            thread, batch);
+    if (events & EPOLLRDHUP)
+        fire(e.m_schedulerClose, e.m_fiberClose, e.m_dgClose,
+            e.m_priorityClose, thread, batch);
+    e.m_waiting &= ~events;
+    if (!e.m_waiting)
+        atomicDecrement(m_pendingEventCount);
+}
+
+void
+IOManager::fire(Scheduler *scheduler, Fiber::ptr &fiber,
+    boost::function<void ()> &dg, Scheduler::Priority priority, tid_t thread,
+    std::vector<FiberAndThread> *batch)
+{
+    if (scheduler != this)
+        thread = emptytid();
+    if (batch && scheduler == this) {
+        batch->push_back(FiberAndThread());
+        FiberAndThread &ft = batch->back();
+        if (dg)
+            ft.dg = dg;
+        else
+            ft.fiber.swap(fiber);
+        ft.thread = thread;
+        ft.priority = priority;
+    } else if (dg) {
+        scheduler->schedule(dg, thread, priority);
+    } else {
+        scheduler->schedule(fiber, thread, priority);
+    }
+    dg = NULL;
+    fiber.reset();
+}
+
+void
+IOManager::busyPoll(unsigned long long window, size_t threads)
+{
+    m_busyPollWindow = window;
+    m_busyPollThreads = (int)threads;
+}
+
 bool
-IOManager::stopping(unsigned long long &nextTimeout)
+IOManager::claimBusyPoll()
 {
-    nextTimeout = nextTimer();
-    if (nextTimeout == ~0ull && Scheduler::stopping()) {
-        boost::mutex::scoped_lock lock(m_mutex);
-        if (m_pendingEvents.empty()) {
+    while (true) {
+        int busyPollers = m_busyPollers;
+        if (busyPollers >= m_busyPollThreads)
+            return false;
+        if (atomicCompareAndSwap(m_busyPollers, busyPollers + 1,
+            busyPollers) == busyPollers)
             return true;
-        }
     }
-    return false;
+}
+
+bool
+IOManager::releaseBusyPoll()
+{
+    while (true) {
+        int busyPollers = m_busyPollers;
+        if (busyPollers <= m_busyPollThreads)
+            return false;
+        if (atomicCompareAndSwap(m_busyPollers, busyPollers - 1,
+            busyPollers) == busyPollers)
+            return true;
+    }
+}
+
+bool
+IOManager::stopping(unsigned long long &nextTimeout)
+{
+    nextTimeout = nextTimer();
+    return nextTimeout == ~0ull && Scheduler::stopping() &&
+        m_pendingEventCount == 0;
 }
 
 void
 IOManager::idle()
 {
-    epoll_event events[64];
+    size_t maxEvents = std::max<size_t>(g_maxEvents->val(), 1u);
+    std::vector<epoll_event> events(std::min<size_t>(64u, maxEvents));
+    // Everything made runnable by one pass, for one schedule()
+    std::vector<FiberAndThread> batch;
+    EpollSet *set = m_perThread ? claimSet() : NULL;
+    int epfd = set ? set->epfd : m_epfd;
+    // Fibers woken up by our own set resume on this thread
+    tid_t thread = set ? gettid() : emptytid();
+    bool busyPoll = false;
     while (true) {
         unsigned long long nextTimeout;
-        if (stopping(nextTimeout))
+        if (stopping(nextTimeout)) {
+            if (set)
+                releaseSet(set);
+            if (busyPoll)
+                atomicDecrement(m_busyPollers);
             return;
+        }
+        if (set && m_setsReleased)
+            adoptSets(set);
+        // busyPoll() may have changed how many threads get to poll since
+        // the last pass
+        if (busyPoll)
+            busyPoll = !releaseBusyPoll();
+        else
+            busyPoll = claimBusyPoll();
+        // Poll instead of blocking until the spin is over (or a timer is
+        // due); tickles arrive on m_tickleFd, so they end the spin too
+        unsigned long long spinUntil = spinTime();
+        if (busyPoll && m_busyPollWindow > spinUntil)
+            spinUntil = m_busyPollWindow;
+        spinUntil = std::min(spinUntil, nextTimeout);
+        if (spinUntil != 0)
+            spinUntil += TimerManager::now();
         int rc = -1;
         errno = EINTR;
         int timeout;
         while (rc < 0 && errno == EINTR) {
+            if (spinUntil != 0 && TimerManager::now() >= spinUntil) {
+                // Nothing turned up; block (for however long is left)
+                spinUntil = 0;
+                nextTimeout = nextTimer();
+                g_statSpinSleeps.increment();
+            }
             timeout = -1;
-            if (nextTimeout != ~0ull)
+            if (spinUntil != 0)
+                timeout = 0;
+            else if (nextTimeout != ~0ull)
                 timeout = (int)(nextTimeout / 1000) + 1;
-            rc = epoll_wait(m_epfd, events, 64, timeout);
-            if (rc < 0 && errno == EINTR)
+            g_statWait.increment();
+            if (set)
+                set->waiting = true;
+            rc = epoll_wait(epfd, &events[0], (int)events.size(), timeout);
+            if (set)
+                set->waiting = false;
+            if (rc < 0 && errno == EINTR) {
                 nextTimeout = nextTimer();
+            } else if (rc == 0 && timeout == 0) {
+                rc = -1;
+                errno = EINTR;
+            }
         }
         MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::VERBOSE) << this
-            << " epoll_wait(" << m_epfd << ", 64, " << timeout << "): " << rc
+            << " epoll_wait(" << epfd << ", " << events.size() << ", "
+            << timeout << "): " << rc
             << " (" << errno << ")";
         if (rc < 0)
             MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_wait");
+        if (spinUntil != 0)
+            g_statSpinHits.increment();
+        // Work we schedule for ourselves doesn't need a tickle
+        if (set)
+            sleeping(false);
         std::vector<boost::function<void ()> > expired = processTimers();
-        schedule(expired.begin(), expired.end());
+        for (size_t i = 0; i < expired.size(); ++i) {
+            batch.push_back(FiberAndThread());
+            batch.back().dg = expired[i];
+            batch.back().thread = emptytid();
+            batch.back().priority = NORMAL;
+        }
 
         for(int i = 0; i < rc; ++i) {
             epoll_event &event = events[i];
-            if (event.data.fd == m_tickleFds[0]) {
-                unsigned char dummy;
-                int rc2 = read(m_tickleFds[0], &dummy, 1);
-                MORDOR_VERIFY(rc2 == 1);
+            if (event.data.fd == m_tickleFd ||
+                (set && event.data.fd == set->tickleFd)) {
+                // Reset the count; another thread may have beaten us to it
+                uint64_t count;
+                int rc2 = read(event.data.fd, &count, sizeof(uint64_t));
+                MORDOR_VERIFY(rc2 == sizeof(uint64_t) ||
+                    (rc2 < 0 && errno == EAGAIN));
                 MORDOR_LOG_VERBOSE(g_log) << this << " received tickle";
                 continue;
             }
             bool err = event.events & (EPOLLERR | EPOLLHUP);
-            boost::mutex::scoped_lock lock(m_mutex);
-            std::map<int, AsyncEvent>::iterator it =
-m_pendingEvents.find(event.data.fd);
-            if (it == m_pendingEvents.end())
+            AsyncEvent *asyncEvent = lookup(event.data.fd, false);
+            if (!asyncEvent)
+                continue;
+            AsyncEvent &e = *asyncEvent;
+            boost::mutex::scoped_lock lock(e.m_mutex);
+            // Unregistered since epoll_wait returned
+            if (!e.event.events)
+                continue;
+            if (e.m_persistent) {
+                uint32_t ready = event.events &
+                    (EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+                if (err)
+                    ready |= EPOLLIN | EPOLLOUT;
+                e.m_ready |= ready & ~e.m_waiting;
+                triggerNoLock(e, ready, thread, &batch);
                 continue;
-            AsyncEvent &e = it->second;
+            }
             MORDOR_LOG_TRACE(g_log) << " epoll_event {"
                 << (EPOLL_EVENTS)event.events << ", " << event.data.fd
                 << "}, registered for " << (EPOLL_EVENTS)e.event.events;
 
-            if ((event.events & EPOLLRDHUP) && (e.event.events & EPOLLRDHUP)) {
-                if (e.m_dgClose)
-                    e.m_schedulerClose->schedule(e.m_dgClose);
-                else
-                    e.m_schedulerClose->schedule(e.m_fiberClose);
-                e.m_dgClose = NULL;
-                e.m_fiberClose.reset();
-            }
+            if ((event.events & EPOLLRDHUP) && (e.event.events & EPOLLRDHUP))
+                fire(e.m_schedulerClose, e.m_fiberClose, e.m_dgClose,
+                    e.m_priorityClose, thread, &batch);
 
             if (((event.events & EPOLLIN) ||
                 err) && (e.event.events & EPOLLIN)) {
-                if (e.m_dgIn)
-                    e.m_schedulerIn->schedule(e.m_dgIn);
-                else
-                    e.m_schedulerIn->schedule(e.m_fiberIn);
-                e.m_dgIn = NULL;
-                e.m_fiberIn.reset();
+                fire(e.m_schedulerIn, e.m_fiberIn, e.m_dgIn, e.m_priorityIn,
+                    thread, &batch);
                 event.events |= EPOLLIN;
             }
             if (((event.events & EPOLLOUT) ||
                 err) && (e.event.events & EPOLLOUT)) {
-                if (e.m_dgOut)
-                    e.m_schedulerOut->schedule(e.m_dgOut);
-                else
-                    e.m_schedulerOut->schedule(e.m_fiberOut);
-                e.m_dgOut = NULL;
-                e.m_fiberOut.reset();
+                fire(e.m_schedulerOut, e.m_fiberOut, e.m_dgOut,
+                    e.m_priorityOut, thread, &batch);
                 event.events |= EPOLLOUT;
             }
             e.event.events &= ~event.events;
 
             int op = e.event.events == (unsigned int)EPOLLET ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
-            int rc2 = epoll_ctl(m_epfd, op, event.data.fd,
+            g_statCtl.increment();
+            int rc2 = epoll_ctl(e.m_epfd, op, event.data.fd,
                 &e.event);
             MORDOR_LOG_LEVEL(g_log, rc2 ? Log::ERROR : Log::VERBOSE) << this
-                << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+                << " epoll_ctl(" << e.m_epfd << ", " << (epoll_ctl_op_t)op << ", "
                 << event.data.fd << ", " << (EPOLL_EVENTS)e.event.events << "): " << rc2
                 << " (" << errno << ")";
-            if (rc2)
+            if (op == EPOLL_CTL_DEL) {
+                e.event.events = 0;
+                atomicDecrement(m_pendingEventCount);
+            }
+            if (rc2) {
+                lock.unlock();
+                schedule(batch);
                 MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
-            if (op == EPOLL_CTL_DEL)
-                m_pendingEvents.erase(it);
+            }
         }
+        schedule(batch);
+        // Take more next time if there might have been more; take fewer
+        // once there are few, so one thread doesn't hog a shared set
+        if ((size_t)rc == events.size() && events.size() < maxEvents)
+            events.resize(std::min(events.size() * 2, maxEvents));
+        else if ((size_t)rc < events.size() / 4 && events.size() > 64)
+            events.resize(std::max<size_t>(events.size() / 2, 64u));
+        if (set)
+            sleeping(true);
         try {
             Fiber::yield();
         } catch (OperationAbortedException &) {
+            if (set)
+                releaseSet(set);
+            if (busyPoll)
+                atomicDecrement(m_busyPollers);
             return;
         }
     }
@@ -408,10 +915,46 @@ m_pendingEvents.find(event.data.fd);
 void
 IOManager::tickle()
 {
-    int rc = write(m_tickleFds[1], "T", 1);
-    MORDOR_LOG_VERBOSE(g_log) << this << " write(" << m_tickleFds[1] << ", 1): "
+    int fd = m_tickleFd;
+    size_t count = m_epollSetCount;
+    if (count != 0) {
+        // Take turns between the threads waiting in epoll_wait; if there
+        // aren't any, m_tickleFd reaches every set, so whoever waits next
+        // will get it
+        size_t start = atomicIncrement(m_nextEpollSet) % count, index = 0;
+        for (EpollSet *set = m_epollSets; set; set = set->next, ++index) {
+            if (!set->waiting)
+                continue;
+            fd = set->tickleFd;
+            if (index >= start)
+                break;
+        }
+    }
+    uint64_t one = 1;
+    int rc = write(fd, &one, sizeof(uint64_t));
+    MORDOR_LOG_VERBOSE(g_log) << this << " write(" << fd << ", 8): "
         << rc << " (" << errno << ")";
-    MORDOR_VERIFY(rc == 1);
+    MORDOR_VERIFY(rc == sizeof(uint64_t));
+}
+
+void
+IOManager::tickleThread(tid_t thread)
+{
+    if (m_perThread) {
+        // Only thread polls its set, so any other thread would just go back
+        // to sleep; its tickleFd gets through even if it isn't waiting yet
+        for (EpollSet *set = m_epollSets; set; set = set->next) {
+            if (set->thread != thread)
+                continue;
+            uint64_t one = 1;
+            int rc = write(set->tickleFd, &one, sizeof(uint64_t));
+            MORDOR_LOG_VERBOSE(g_log) << this << " write(" << set->tickleFd
+                << ", 8): " << rc << " (" << errno << ")";
+            MORDOR_VERIFY(rc == sizeof(uint64_t));
+            return;
+        }
+    }
+    tickle();
 }
 
 }
@@ -33,15 +33,51 @@ public:
 private:
     struct AsyncEvent
     {
+        AsyncEvent();
+
+        boost::mutex m_mutex;
+        /// events is 0 while the fd isn't in an epoll set
         epoll_event event;
+        /// The epoll set the fd was last added to
+        int m_epfd;
 
         Scheduler *m_schedulerIn, *m_schedulerOut, *m_schedulerClose;
         boost::shared_ptr<Fiber> m_fiberIn, m_fiberOut, m_fiberClose;
         boost::function<void ()> m_dgIn, m_dgOut, m_dgClose;
+        /// Scheduler::currentPriority() of whoever registered each event
+        Scheduler::Priority m_priorityIn, m_priorityOut, m_priorityClose;
+
+        /// Added by registerFd(); events stays put, and these track which
+        /// events are being waited for, and which have become ready with
+        /// nobody waiting
+        bool m_persistent;
+        uint32_t m_waiting, m_ready;
+    };
+
+    /// With iomanager.epoll.perthread, each thread waits on an epoll set of
+    /// its own.  Like Scheduler's Mailboxes, they're never freed while the
+    /// IOManager is alive; a thread leaving idle() releases its set (thread
+    /// is set back to emptytid()), and the next thread to need one claims it.
+    /// Meanwhile, a thread that's still running adopts its fds, so nobody
+    /// waits on a set that nobody polls.
+    struct EpollSet
+    {
+        int epfd;
+        /// Tickles meant for this set's thread alone; every set also watches
+        /// m_tickleFd, for tickles sent while no thread is waiting
+        int tickleFd;
+        volatile tid_t thread;
+        /// thread is (about to be) in epoll_wait
+        volatile bool waiting;
+        /// Released by a thread leaving idle(), and not claimed since; fds
+        /// found in it are adopted by another thread's set
+        volatile bool released;
+        EpollSet *next;
     };
 
 public:
-    IOManager(size_t threads = 1, bool useCaller = true);
+    IOManager(size_t threads = 1, bool useCaller = true,
+        bool workStealing = false);
     ~IOManager();
 
     bool stopping();
@@ -53,18 +89,116 @@ public:
     /// Will cause the event to fire
     void cancelEvent(int fd, Event events);
 
+    /// If Sockets should registerFd() themselves (iomanager.epoll.persistent)
+    bool persistent() const { return m_persistent; }
+    /// Add fd to the epoll set once, edge-triggered for READ | WRITE | CLOSE,
+    /// instead of adding and removing it for each registerEvent()
+
+    /// Edges that arrive with nobody waiting are remembered, and a later
+    /// registerEvent() for them fires straight away, without a syscall; so
+    /// a wait can be spurious, and the caller should just retry its I/O.
+    void registerFd(int fd);
+    /// Remove fd from the epoll set; call it before closing fd
+    void unregisterFd(int fd);
+
+    /// If each thread has an epoll set of its own (iomanager.epoll.perthread)
+
+    /// An fd is added to the set of the thread that registers it (or, for
+    /// registerFd(), the thread that creates or accepts the Socket), and the
+    /// Fiber waiting on it is rescheduled on that thread, so a connection
+    /// served by one thread stays on that thread.  Pair it with
+    /// listenOnEachThread() for a shared-nothing server.  fds registered
+    /// from outside the IOManager take turns between the sets.  When a
+    /// thread is retired by threadCount() or elastic(), one of the threads
+    /// still running takes over its fds, and wakes up whoever waits on them.
+    bool perThread() const { return m_perThread; }
+
+    /// Let up to threads of this IOManager's threads busy-poll
+
+    /// Once they run out of work, they poll epoll_wait without blocking for
+    /// up to window microseconds (or scheduler.spin, if that's longer)
+    /// before they block.  The first threads to go idle are the ones that
+    /// poll, and they keep polling until they exit, or until threads is
+    /// lowered (raising it lets more threads poll as they next go idle);
+    /// so with perThread(), the connections they serve are the low latency
+    /// ones.  Defaults come
+    /// from iomanager.busypoll.window and iomanager.busypoll.threads.  Spins
+    /// that find something to do, and spins that end up blocking anyway, are
+    /// counted in iomanager.spin.hits and iomanager.spin.sleeps.
+    void busyPoll(unsigned long long window, size_t threads = 1);
+    /// SO_BUSY_POLL (in microseconds) for Sockets to set on themselves
+    /// when they're created or accepted (iomanager.busypoll.socket); 0
+    /// leaves it alone
+    int busyPollSocket() const { return m_busyPollSocket; }
+    void busyPollSocket(int us) { m_busyPollSocket = us; }
+
 protected:
     bool stopping(unsigned long long &nextTimeout);
     void idle();
     void tickle();
+    void tickleThread(tid_t thread);
 
-    void onTimerInsertedAtFront() { tickle(); }
+    void onTimerInsertedAtFront() { wake(); }
 
 private:
+    /// The AsyncEvent for fd, or NULL if it's never been registered (and
+    /// create is false); throws EMFILE if fd is too big to register
+    AsyncEvent *lookup(int fd, bool create);
+    /// Schedule (and forget) whoever is waiting for events on a registerFd()
+    /// fd
+    void triggerNoLock(AsyncEvent &e, uint32_t events,
+        tid_t thread = emptytid(), std::vector<FiberAndThread> *batch = NULL);
+    /// Schedule (and forget) fiber, or dg if it's set, on scheduler (on
+    /// thread, if that's this IOManager); if it is this IOManager, and
+    /// there's a batch, add it to batch instead
+    void fire(Scheduler *scheduler, boost::shared_ptr<Fiber> &fiber,
+        boost::function<void ()> &dg, Scheduler::Priority priority,
+        tid_t thread, std::vector<FiberAndThread> *batch);
+    /// The epoll set to add an fd to from this thread
+    int epfd();
+    /// The calling thread's EpollSet, claiming or creating one if needed
+    EpollSet *claimSet();
+    EpollSet *createSet(tid_t thread);
+    /// Give up the calling thread's set as it leaves idle()
+    void releaseSet(EpollSet *set);
+    /// Move the fds in released sets into set
+    void adoptSets(EpollSet *set);
+    /// If epfd is a released set's, have adoptSets() look at it again
+    void checkReleased(int epfd);
+    /// @return If the calling thread got to be one of the busy-polling ones
+    bool claimBusyPoll();
+    /// @return If the calling thread, one of the busy-polling ones, has to
+    /// stop because busyPoll() lowered the number of threads
+    bool releaseBusyPoll();
+
+private:
+    /// AsyncEvents are indexed by fd, in chunks of EVENT_CHUNK that are
+    /// allocated as needed, and never move or go away; each is guarded by
+    /// its own m_mutex
+    enum {
+        EVENT_CHUNK = 4096,
+        EVENT_CHUNKS = 1024
+    };
+
     int m_epfd;
-    int m_tickleFds[2];
-    std::map<int, AsyncEvent> m_pendingEvents;
+    int m_tickleFd;
+    bool m_persistent;
+    bool m_perThread;
+    EpollSet * volatile m_epollSets;
+    volatile size_t m_epollSetCount, m_nextEpollSet;
+    /// A set has been released (or an fd added to one) since adoptSets()
+    /// last looked
+    volatile bool m_setsReleased;
+    volatile unsigned long long m_busyPollWindow;
+    volatile int m_busyPollThreads, m_busyPollers;
+    volatile int m_busyPollSocket;
+    AsyncEvent * volatile m_pendingEvents[EVENT_CHUNKS];
+    /// fds currently in the epoll set
+    volatile size_t m_pendingEventCount;
+    /// Only taken to allocate a chunk of m_pendingEvents, or an EpollSet
     boost::mutex m_mutex;
+    /// One adoptSets() at a time
+    boost::mutex m_adoptMutex;
 };
 
 }
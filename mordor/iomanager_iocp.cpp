@@ -211,8 +211,8 @@ IOManager::WaitBlock::removeEntry(int index)
     memmove(&m_recurring[index], &m_recurring[index + 1], (m_inUseCount - index) * sizeof(bool));
 }
 
-IOManager::IOManager(size_t threads, bool useCaller)
-    : Scheduler(threads, useCaller)
+IOManager::IOManager(size_t threads, bool useCaller, bool workStealing)
+    : Scheduler(threads, useCaller, 1, workStealing)
 {
     m_pendingEventCount = 0;
     m_hCompletionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
@@ -261,6 +261,7 @@ IOManager::registerEvent(AsyncEvent *e)
     e->m_scheduler = Scheduler::getThis();
     e->m_thread = gettid();
     e->m_fiber = Fiber::getThis();
+    e->m_priority = Scheduler::currentPriority();
     MORDOR_ASSERT(e->m_scheduler);
     MORDOR_ASSERT(e->m_fiber);
     MORDOR_LOG_DEBUG(g_log) << this << " registerEvent(" << &e->overlapped << ")";
@@ -457,7 +458,7 @@ IOManager::idle()
             fiber.swap(e->m_fiber);
             e->m_thread = emptytid();
             e->m_scheduler = NULL;
-            scheduler->schedule(fiber);
+            scheduler->schedule(fiber, emptytid(), e->m_priority);
         }
         if (count != tickles)
             atomicAdd(m_pendingEventCount, (size_t)(-(ptrdiff_t)(count - tickles)));
@@ -28,6 +28,8 @@ struct AsyncEvent
     Scheduler  *m_scheduler;
     tid_t m_thread;
     boost::shared_ptr<Fiber> m_fiber;
+    /// Scheduler::currentPriority() of the Fiber that registered the event
+    Scheduler::Priority m_priority;
 };
 
 class IOManager : public Scheduler, public TimerManager
@@ -63,7 +65,8 @@ private:
     };
 
 public:
-    IOManager(size_t threads = 1, bool useCaller = true);
+    IOManager(size_t threads = 1, bool useCaller = true,
+        bool workStealing = false);
     ~IOManager();
 
     bool stopping();
@@ -84,7 +87,7 @@ protected:
     void idle();
     void tickle();
 
-    void onTimerInsertedAtFront() { tickle(); }
+    void onTimerInsertedAtFront() { wake(); }
 
 private:
     HANDLE m_hCompletionPort;
@@ -0,0 +1,581 @@
+// Copyright (c) 2010 - Decho Corporation
+
+#include "pch.h"
+
+#if defined(LINUX) && defined(IOURING)
+
+#include "iomanager_iouring.h"
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <boost/bind.hpp>
+
+#include "assert.h"
+#include "atomic.h"
+#include "config.h"
+#include "fiber.h"
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:iomanager");
+
+static ConfigVar<unsigned int>::ptr g_entries =
+    Config::lookup("iomanager.iouring.entries", 1024u,
+    "Number of submission queue entries in each io_uring");
+
+// Completions that nobody is waiting for (tickles, cancels, poll removals)
+static const __u64 IGNORED = 0;
+// PollEvents are tagged in the low bit, to tell them apart from AsyncEvents
+static const __u64 POLL_EVENT = 1;
+
+static int io_uring_setup(unsigned int entries, io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned int toSubmit,
+    unsigned int minComplete, unsigned int flags, void *arg, size_t argSize)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+        arg, argSize);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, const void *arg,
+    unsigned int args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, args);
+}
+
+IOManager::AsyncEvent::AsyncEvent()
+    : result(0),
+      m_scheduler(NULL),
+      m_priority(Scheduler::NORMAL),
+      m_pending(false),
+      m_cancelled(false)
+{
+    memset(&sqe, 0, sizeof(io_uring_sqe));
+}
+
+io_uring_sqe &
+IOManager::AsyncEvent::prepare(unsigned char opcode, int fd)
+{
+    MORDOR_ASSERT(!m_pending);
+    memset(&sqe, 0, sizeof(io_uring_sqe));
+    sqe.opcode = opcode;
+    sqe.fd = fd;
+    result = 0;
+    m_cancelled = false;
+    return sqe;
+}
+
+IOManager::IOManager(size_t threads, bool useCaller, bool workStealing)
+    : Scheduler(threads, useCaller, 1, workStealing),
+      m_rings(MAP_FAILED),
+      m_sqes((io_uring_sqe *)MAP_FAILED),
+      m_unsubmitted(0),
+      m_pendingEventCount(0)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(io_uring_params));
+    m_ringfd = io_uring_setup(g_entries->val(), &params);
+    MORDOR_LOG_LEVEL(g_log, m_ringfd < 0 ? Log::ERROR : Log::TRACE) << this
+        << " io_uring_setup(" << g_entries->val() << "): " << m_ringfd << " ("
+        << errno << ")";
+    if (m_ringfd < 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("io_uring_setup");
+    const unsigned int required = IORING_FEAT_SINGLE_MMAP |
+        IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required) {
+        MORDOR_LOG_ERROR(g_log) << this << " io_uring features "
+            << params.features << " missing " << (required & ~params.features);
+        close(m_ringfd);
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(EOPNOTSUPP, "io_uring_setup");
+    }
+    m_entries = params.sq_entries;
+
+    // With IORING_FEAT_SINGLE_MMAP, the SQ and CQ rings share one mapping
+    m_ringsSize = std::max<size_t>(
+        params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    m_rings = mmap(NULL, m_ringsSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQ_RING);
+    if (m_rings != MAP_FAILED)
+        m_sqes = (io_uring_sqe *)mmap(NULL,
+            params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQES);
+    if (m_rings == MAP_FAILED || m_sqes == MAP_FAILED) {
+        MORDOR_LOG_ERROR(g_log) << this << " mmap(" << m_ringfd << "): ("
+            << errno << ")";
+        error_t error = errno;
+        closeRing();
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "mmap");
+    }
+    char *rings = (char *)m_rings;
+    m_sqHead = (volatile unsigned int *)(rings + params.sq_off.head);
+    m_sqTail = (volatile unsigned int *)(rings + params.sq_off.tail);
+    m_sqMask = *(unsigned int *)(rings + params.sq_off.ring_mask);
+    m_sqArray = (volatile unsigned int *)(rings + params.sq_off.array);
+    m_cqHead = (volatile unsigned int *)(rings + params.cq_off.head);
+    m_cqTail = (volatile unsigned int *)(rings + params.cq_off.tail);
+    m_cqMask = *(unsigned int *)(rings + params.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    try {
+        start();
+    } catch (...) {
+        closeRing();
+        throw;
+    }
+}
+
+IOManager::~IOManager()
+{
+    stop();
+    closeRing();
+    for (std::set<PollEvent *>::iterator it = m_removedEvents.begin();
+        it != m_removedEvents.end();
+        ++it)
+        delete *it;
+}
+
+void
+IOManager::closeRing()
+{
+    if (m_sqes != MAP_FAILED)
+        munmap(m_sqes, m_entries * sizeof(io_uring_sqe));
+    if (m_rings != MAP_FAILED)
+        munmap(m_rings, m_ringsSize);
+    close(m_ringfd);
+    MORDOR_LOG_TRACE(g_log) << this << " close(" << m_ringfd << ")";
+}
+
+bool
+IOManager::stopping()
+{
+    unsigned long long timeout;
+    return stopping(timeout);
+}
+
+void
+IOManager::registerEvent(int fd, Event events, boost::function<void ()> dg)
+{
+    MORDOR_ASSERT(fd > 0);
+    MORDOR_ASSERT(Scheduler::getThis());
+    MORDOR_ASSERT(Fiber::getThis());
+    MORDOR_ASSERT(events & (READ | WRITE | CLOSE));
+
+    static const Event all[] = { READ, WRITE, CLOSE };
+    boost::mutex::scoped_lock lock(m_mutex);
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); ++i) {
+        if (!(events & all[i]))
+            continue;
+        PollEvent *&e = m_pendingEvents[std::make_pair(fd, all[i])];
+        MORDOR_ASSERT(!e);
+        e = new PollEvent();
+        e->fd = fd;
+        e->event = all[i];
+        e->m_scheduler = Scheduler::getThis();
+        e->m_priority = Scheduler::currentPriority();
+        if (dg)
+            e->m_dg = dg;
+        else
+            e->m_fiber = Fiber::getThis();
+        atomicIncrement(m_pendingEventCount);
+
+        io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(io_uring_sqe));
+        sqe.opcode = IORING_OP_POLL_ADD;
+        sqe.fd = fd;
+        sqe.poll32_events = all[i];
+        sqe.user_data = (__u64)(uintptr_t)e | POLL_EVENT;
+        MORDOR_LOG_VERBOSE(g_log) << this << " IORING_OP_POLL_ADD(" << fd
+            << ", " << all[i] << "): " << e;
+        queue(sqe);
+    }
+}
+
+bool
+IOManager::unregisterEvent(int fd, Event events)
+{
+    static const Event all[] = { READ, WRITE, CLOSE };
+    bool result = false;
+    boost::mutex::scoped_lock lock(m_mutex);
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); ++i) {
+        if (!(events & all[i]))
+            continue;
+        std::map<std::pair<int, Event>, PollEvent *>::iterator it =
+            m_pendingEvents.find(std::make_pair(fd, all[i]));
+        if (it == m_pendingEvents.end())
+            continue;
+        PollEvent *e = it->second;
+        m_pendingEvents.erase(it);
+        removePollEventNoLock(e);
+        result = true;
+    }
+    return result;
+}
+
+void
+IOManager::cancelEvent(int fd, Event events)
+{
+    static const Event all[] = { READ, WRITE, CLOSE };
+    boost::mutex::scoped_lock lock(m_mutex);
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); ++i) {
+        if (!(events & all[i]))
+            continue;
+        std::map<std::pair<int, Event>, PollEvent *>::iterator it =
+            m_pendingEvents.find(std::make_pair(fd, all[i]));
+        if (it == m_pendingEvents.end())
+            continue;
+        PollEvent *e = it->second;
+        m_pendingEvents.erase(it);
+        if (e->m_dg)
+            e->m_scheduler->schedule(e->m_dg, emptytid(), e->m_priority);
+        else
+            e->m_scheduler->schedule(e->m_fiber, emptytid(), e->m_priority);
+        e->m_dg = NULL;
+        e->m_fiber.reset();
+        removePollEventNoLock(e);
+    }
+}
+
+void
+IOManager::removePollEventNoLock(PollEvent *e)
+{
+    // e is freed once its poll completes (with -ECANCELED, if the removal
+    // gets there first)
+    m_removedEvents.insert(e);
+    atomicDecrement(m_pendingEventCount);
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(io_uring_sqe));
+    sqe.opcode = IORING_OP_POLL_REMOVE;
+    sqe.fd = -1;
+    sqe.addr = (__u64)(uintptr_t)e | POLL_EVENT;
+    sqe.user_data = IGNORED;
+    MORDOR_LOG_VERBOSE(g_log) << this << " IORING_OP_POLL_REMOVE(" << e->fd
+        << ", " << e->event << "): " << e;
+    queue(sqe);
+}
+
+bool
+IOManager::submit(AsyncEvent &event)
+{
+    MORDOR_ASSERT(Scheduler::getThis());
+    MORDOR_ASSERT(Fiber::getThis());
+    boost::mutex::scoped_lock lock(m_mutex);
+    MORDOR_ASSERT(!event.m_pending);
+    if (event.m_cancelled) {
+        event.result = -ECANCELED;
+        return false;
+    }
+    event.m_scheduler = Scheduler::getThis();
+    event.m_fiber = Fiber::getThis();
+    event.m_priority = Scheduler::currentPriority();
+    event.m_pending = true;
+    event.sqe.user_data = (__u64)(uintptr_t)&event;
+    atomicIncrement(m_pendingEventCount);
+    MORDOR_LOG_VERBOSE(g_log) << this << " submit(" << (int)event.sqe.opcode
+        << ", " << event.sqe.fd << "): " << &event;
+    // Still holding m_mutex, so a cancel can't be queued ahead of it
+    queue(event.sqe);
+    return true;
+}
+
+int
+IOManager::perform(AsyncEvent &event)
+{
+    io_uring_sqe sqe = event.sqe;
+    while (true) {
+        if (submit(event))
+            Scheduler::yieldTo();
+        if (event.result != -EAGAIN)
+            return event.result;
+        // Wait for the fd to be ready, and try again; this doesn't go
+        // through prepare(), so a cancel in the meantime still counts
+        bool read = false;
+        switch (sqe.opcode) {
+            case IORING_OP_RECVMSG:
+            case IORING_OP_ACCEPT:
+            case IORING_OP_READV:
+            case IORING_OP_READ:
+            case IORING_OP_READ_FIXED:
+                read = true;
+                break;
+        }
+        memset(&event.sqe, 0, sizeof(io_uring_sqe));
+        event.sqe.opcode = IORING_OP_POLL_ADD;
+        event.sqe.fd = sqe.fd;
+        event.sqe.poll32_events = read ? POLLIN : POLLOUT;
+        if (submit(event))
+            Scheduler::yieldTo();
+        if (event.result < 0)
+            return event.result;
+        event.sqe = sqe;
+    }
+}
+
+void
+IOManager::cancelEvent(AsyncEvent &event)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    event.m_cancelled = true;
+    if (!event.m_pending)
+        return;
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(io_uring_sqe));
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = -1;
+    sqe.addr = (__u64)(uintptr_t)&event;
+    sqe.user_data = IGNORED;
+    MORDOR_LOG_VERBOSE(g_log) << this << " IORING_OP_ASYNC_CANCEL(" << &event
+        << ")";
+    queue(sqe);
+}
+
+void
+IOManager::registerBuffers(const std::vector<iovec> &buffers)
+{
+    MORDOR_ASSERT(buffers.size() <= 0xffff);
+    if (!m_buffers.empty()) {
+        int rc = io_uring_register(m_ringfd, IORING_UNREGISTER_BUFFERS, NULL,
+            0);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " io_uring_register(" << m_ringfd
+            << ", IORING_UNREGISTER_BUFFERS): " << rc << " (" << errno << ")";
+        if (rc)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("io_uring_register");
+        m_buffers.clear();
+    }
+    if (buffers.empty())
+        return;
+    int rc = io_uring_register(m_ringfd, IORING_REGISTER_BUFFERS, &buffers[0],
+        (unsigned int)buffers.size());
+    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+        << " io_uring_register(" << m_ringfd << ", IORING_REGISTER_BUFFERS, "
+        << buffers.size() << "): " << rc << " (" << errno << ")";
+    if (rc)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("io_uring_register");
+    m_buffers = buffers;
+}
+
+int
+IOManager::registeredBuffer(const void *buffer, size_t length) const
+{
+    const char *start = (const char *)buffer;
+    for (size_t i = 0; i < m_buffers.size(); ++i) {
+        const char *base = (const char *)m_buffers[i].iov_base;
+        if (start >= base && start + length <= base + m_buffers[i].iov_len)
+            return (int)i;
+    }
+    return -1;
+}
+
+bool
+IOManager::stopping(unsigned long long &nextTimeout)
+{
+    nextTimeout = nextTimer();
+    return nextTimeout == ~0ull && Scheduler::stopping() &&
+        m_pendingEventCount == 0;
+}
+
+bool
+IOManager::queueNoLock(const io_uring_sqe &sqe)
+{
+    unsigned int tail = *m_sqTail;
+    if (tail - *m_sqHead == m_entries)
+        return false;
+    unsigned int index = tail & m_sqMask;
+    m_sqes[index] = sqe;
+    m_sqArray[index] = index;
+    // The kernel mustn't see the new tail before the entry itself
+    __sync_synchronize();
+    *m_sqTail = tail + 1;
+    ++m_unsubmitted;
+    return true;
+}
+
+void
+IOManager::queue(const io_uring_sqe &sqe)
+{
+    bool first;
+    {
+        boost::mutex::scoped_lock lock(m_sqMutex);
+        while (!queueNoLock(sqe))
+            submitNoLock();
+        // Nothing will come along to submit it later
+        if (Scheduler::getThis() != this) {
+            submitNoLock();
+            return;
+        }
+        first = m_unsubmitted == 1;
+    }
+    // Submit everything queued by this scheduling pass in one go, once the
+    // current Fiber has yielded
+    if (first)
+        schedule(boost::bind(&IOManager::flush, this), gettid(),
+            Scheduler::CRITICAL);
+}
+
+void
+IOManager::submitNoLock()
+{
+    while (m_unsubmitted > 0) {
+        int rc = io_uring_enter(m_ringfd, m_unsubmitted, 0, 0, NULL, 0);
+        MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::VERBOSE) << this
+            << " io_uring_enter(" << m_ringfd << ", " << m_unsubmitted
+            << "): " << rc << " (" << errno << ")";
+        if (rc < 0) {
+            // Out of memory for the request, or the completion queue is
+            // overflowing; reaping completions is up to the idle Fibers
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("io_uring_enter");
+        }
+        m_unsubmitted -= rc;
+    }
+}
+
+void
+IOManager::flush()
+{
+    boost::mutex::scoped_lock lock(m_sqMutex);
+    submitNoLock();
+}
+
+void
+IOManager::reap()
+{
+    boost::mutex::scoped_lock lock(m_cqMutex);
+    unsigned int head = *m_cqHead;
+    unsigned int tail = *m_cqTail;
+    // Don't read the entries before the tail that published them
+    __sync_synchronize();
+    for (; head != tail; ++head) {
+        const io_uring_cqe &cqe = m_cqes[head & m_cqMask];
+        __u64 userData = cqe.user_data;
+        int res = cqe.res;
+        if (userData == IGNORED)
+            continue;
+        if (userData & POLL_EVENT) {
+            PollEvent *e = (PollEvent *)(uintptr_t)(userData & ~POLL_EVENT);
+            MORDOR_LOG_TRACE(g_log) << this << " poll(" << e->fd << ", "
+                << e->event << "): " << res << " (" << e << ")";
+            boost::mutex::scoped_lock lock2(m_mutex);
+            std::set<PollEvent *>::iterator it = m_removedEvents.find(e);
+            if (it != m_removedEvents.end()) {
+                m_removedEvents.erase(it);
+                delete e;
+                continue;
+            }
+            m_pendingEvents.erase(std::make_pair(e->fd, e->event));
+            if (e->m_dg)
+                e->m_scheduler->schedule(e->m_dg, emptytid(), e->m_priority);
+            else
+                e->m_scheduler->schedule(e->m_fiber, emptytid(),
+                    e->m_priority);
+            delete e;
+            atomicDecrement(m_pendingEventCount);
+            continue;
+        }
+        AsyncEvent &event = *(AsyncEvent *)(uintptr_t)userData;
+        MORDOR_LOG_TRACE(g_log) << this << " completed("
+            << (int)event.sqe.opcode << ", " << event.sqe.fd << "): " << res
+            << " (" << &event << ")";
+        Scheduler *scheduler;
+        Fiber::ptr fiber;
+        Scheduler::Priority priority;
+        {
+            boost::mutex::scoped_lock lock2(m_mutex);
+            MORDOR_ASSERT(event.m_pending);
+            event.result = res;
+            event.m_pending = false;
+            scheduler = event.m_scheduler;
+            priority = event.m_priority;
+            fiber.swap(event.m_fiber);
+        }
+        atomicDecrement(m_pendingEventCount);
+        scheduler->schedule(fiber, emptytid(), priority);
+    }
+    __sync_synchronize();
+    *m_cqHead = head;
+}
+
+void
+IOManager::idle()
+{
+    while (true) {
+        unsigned long long nextTimeout;
+        if (stopping(nextTimeout))
+            return;
+        // Poll instead of blocking until the spin is over (or a timer is
+        // due); a tickle completes a NOP, so it ends the spin too
+        unsigned long long spinUntil = spinTime();
+        if (spinUntil != 0) {
+            unsigned long long now = TimerManager::now();
+            spinUntil = std::min(spinUntil, nextTimeout) + now;
+            while (*m_cqHead == *m_cqTail && TimerManager::now() < spinUntil)
+                ;
+        }
+        unsigned int toSubmit;
+        {
+            boost::mutex::scoped_lock lock(m_sqMutex);
+            toSubmit = m_unsubmitted;
+            m_unsubmitted = 0;
+        }
+        __kernel_timespec ts;
+        io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(io_uring_getevents_arg));
+        arg.sigmask_sz = _NSIG / 8;
+        if (nextTimeout != ~0ull) {
+            ts.tv_sec = nextTimeout / 1000000;
+            ts.tv_nsec = (nextTimeout % 1000000) * 1000;
+            arg.ts = (__u64)(uintptr_t)&ts;
+        }
+        int rc = io_uring_enter(m_ringfd, toSubmit, 1,
+            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+            sizeof(io_uring_getevents_arg));
+        MORDOR_LOG_LEVEL(g_log, rc < 0 && errno != ETIME && errno != EINTR ?
+            Log::ERROR : Log::VERBOSE) << this << " io_uring_enter("
+            << m_ringfd << ", " << toSubmit << ", 1, " << nextTimeout
+            << "): " << rc << " (" << errno << ")";
+        if (rc < 0) {
+            if (errno != ETIME && errno != EINTR && errno != EAGAIN &&
+                errno != EBUSY)
+                MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("io_uring_enter");
+            rc = 0;
+        }
+        if ((unsigned int)rc < toSubmit) {
+            boost::mutex::scoped_lock lock(m_sqMutex);
+            m_unsubmitted += toSubmit - rc;
+        }
+        std::vector<boost::function<void ()> > expired = processTimers();
+        schedule(expired.begin(), expired.end());
+        reap();
+        try {
+            Fiber::yield();
+        } catch (OperationAbortedException &) {
+            return;
+        }
+    }
+}
+
+void
+IOManager::tickle()
+{
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(io_uring_sqe));
+    sqe.opcode = IORING_OP_NOP;
+    sqe.fd = -1;
+    sqe.user_data = IGNORED;
+    boost::mutex::scoped_lock lock(m_sqMutex);
+    while (!queueNoLock(sqe))
+        submitNoLock();
+    submitNoLock();
+    MORDOR_LOG_VERBOSE(g_log) << this << " tickle()";
+}
+
+}
+
+#endif
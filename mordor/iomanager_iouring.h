@@ -0,0 +1,157 @@
+#ifndef __MORDOR_IOMANAGER_IOURING_H__
+#define __MORDOR_IOMANAGER_IOURING_H__
+// Copyright (c) 2010 - Decho Corporation
+
+#include <poll.h>
+#include <sys/uio.h>
+
+#include <linux/io_uring.h>
+
+#include <set>
+
+#include "scheduler.h"
+#include "timer.h"
+#include "version.h"
+
+#ifndef LINUX
+#error IOManagerIOUring is Linux only
+#endif
+
+namespace Mordor {
+
+class Fiber;
+
+/// IOManager built on io_uring (build with -DIOURING to use it instead of
+/// IOManagerEPoll)
+
+/// Operations are handed to the kernel as SQEs, and the Fiber waiting for
+/// one is rescheduled from its completion.  SQEs queued while running
+/// scheduled work are submitted together, by a single io_uring_enter at the
+/// end of the scheduling pass (or by the idle Fiber, on its way to waiting
+/// for completions).  registerEvent() and friends are still supported, as
+/// one-shot poll SQEs.
+class IOManager : public Scheduler, public TimerManager
+{
+public:
+    enum Event {
+        READ = POLLIN,
+        WRITE = POLLOUT,
+        CLOSE = POLLRDHUP
+    };
+
+    /// An operation to submit; it must stay put until it completes
+    struct AsyncEvent
+    {
+        AsyncEvent();
+
+        /// Start preparing a new operation
+        io_uring_sqe &prepare(unsigned char opcode, int fd);
+
+        /// Filled in by prepare() and the caller; user_data is ours
+        io_uring_sqe sqe;
+        /// What the operation returned; -errno on failure
+        int result;
+
+        Scheduler *m_scheduler;
+        boost::shared_ptr<Fiber> m_fiber;
+        Scheduler::Priority m_priority;
+        bool m_pending, m_cancelled;
+    };
+
+private:
+    struct PollEvent
+    {
+        int fd;
+        Event event;
+        Scheduler *m_scheduler;
+        boost::shared_ptr<Fiber> m_fiber;
+        boost::function<void ()> m_dg;
+        Scheduler::Priority m_priority;
+    };
+
+public:
+    IOManager(size_t threads = 1, bool useCaller = true,
+        bool workStealing = false);
+    ~IOManager();
+
+    bool stopping();
+
+    void registerEvent(int fd, Event events, boost::function<void ()> dg = NULL);
+    /// Will not cause the event to fire
+    /// @return If the event was successfully unregistered before firing normally
+    bool unregisterEvent(int fd, Event events);
+    /// Will cause the event to fire
+    void cancelEvent(int fd, Event events);
+
+    /// Queue event.sqe for submission
+
+    /// The calling Fiber should then Scheduler::yieldTo(); it will be
+    /// rescheduled with event.result set once the operation completes.
+    /// @return false (with event.result set to -ECANCELED) if cancelEvent()
+    /// got there first, and there's nothing to wait for
+    bool submit(AsyncEvent &event);
+    /// submit(), wait for the result, and return it
+
+    /// Kernels that won't wait for a non-blocking fd to be ready on their
+    /// own fail the operation with -EAGAIN; it's retried once the fd is
+    /// ready.
+    int perform(AsyncEvent &event);
+    /// Make event's operation complete with -ECANCELED as soon as possible
+    /// (or immediately, if it hasn't been submitted yet).  It's a no-op if
+    /// the operation has already completed.
+    void cancelEvent(AsyncEvent &event);
+
+    /// Register memory with the kernel, replacing any registered before
+
+    /// Reads and writes (through FDStream) that fall entirely within one of
+    /// these buffers use IORING_OP_READ_FIXED/WRITE_FIXED, and skip mapping
+    /// the pages on every operation.  Must not be called while this
+    /// IOManager is doing I/O.
+    void registerBuffers(const std::vector<iovec> &buffers);
+    /// @return The index of the registered buffer containing
+    /// [buffer, buffer + length), or -1
+    int registeredBuffer(const void *buffer, size_t length) const;
+
+protected:
+    bool stopping(unsigned long long &nextTimeout);
+    void idle();
+    void tickle();
+
+    void onTimerInsertedAtFront() { wake(); }
+
+private:
+    void closeRing();
+    void queue(const io_uring_sqe &sqe);
+    bool queueNoLock(const io_uring_sqe &sqe);
+    void submitNoLock();
+    void flush();
+    void reap();
+    void removePollEventNoLock(PollEvent *e);
+
+private:
+    int m_ringfd;
+    unsigned int m_entries;
+    void *m_rings;
+    size_t m_ringsSize;
+    io_uring_sqe *m_sqes;
+    volatile unsigned int *m_sqHead, *m_sqTail, *m_sqArray;
+    unsigned int m_sqMask;
+    volatile unsigned int *m_cqHead, *m_cqTail;
+    unsigned int m_cqMask;
+    io_uring_cqe *m_cqes;
+    /// SQEs queued, but not yet submitted
+    unsigned int m_unsubmitted;
+    boost::mutex m_sqMutex, m_cqMutex;
+
+    std::map<std::pair<int, Event>, PollEvent *> m_pendingEvents;
+    /// Unregistered PollEvents, whose SQEs haven't completed yet
+    std::set<PollEvent *> m_removedEvents;
+    /// Registered PollEvents, and AsyncEvents in flight
+    volatile size_t m_pendingEventCount;
+    std::vector<iovec> m_buffers;
+    boost::mutex m_mutex;
+};
+
+}
+
+#endif
@@ -13,8 +13,8 @@ namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:iomanager");
 
-IOManager::IOManager(size_t threads, bool useCaller)
-    : Scheduler(threads, useCaller)
+IOManager::IOManager(size_t threads, bool useCaller, bool workStealing)
+    : Scheduler(threads, useCaller, 1, workStealing)
 {
     m_kqfd = kqueue();
     MORDOR_LOG_LEVEL(g_log, m_kqfd <= 0 ? Log::ERROR : Log::TRACE) << this
@@ -105,12 +105,14 @@ IOManager::registerEvent(int fd, Event events,
         if (!dg)
            e.m_fiber = Fiber::getThis();
         e.m_scheduler = Scheduler::getThis();
+        e.m_priority = Scheduler::currentPriority();
     } else {
         MORDOR_ASSERT(!e.m_dgClose && !e.m_fiberClose);
         e.m_dgClose = dg;
         if (!dg)
             e.m_fiberClose = Fiber::getThis();
         e.m_schedulerClose = Scheduler::getThis();
+        e.m_priorityClose = Scheduler::currentPriority();
     }
     int rc = kevent(m_kqfd, &e.event, 1, NULL, 0, NULL);
     MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this << " kevent("
@@ -134,32 +136,36 @@ IOManager::cancelEvent(int fd, Event events)
     AsyncEvent &e = it->second;
     MORDOR_ASSERT(e.event.ident == (unsigned)fd);
     Scheduler *scheduler;
+    Scheduler::Priority priority;
     Fiber::ptr fiber;
     boost::function<void ()> dg;
     if (events == READ) {
         scheduler = e.m_scheduler;
+        priority = e.m_priority;
         fiber.swap(e.m_fiber);
         dg.swap(e.m_dg);
         if (e.m_fiberClose || e.m_dgClose) {
             if (dg)
-                scheduler->schedule(dg);
+                scheduler->schedule(dg, emptytid(), priority);
             else
-                scheduler->schedule(fiber);
+                scheduler->schedule(fiber, emptytid(), priority);
             return;
         }
     } else if (events == CLOSE) {
         scheduler = e.m_schedulerClose;
+        priority = e.m_priorityClose;
         fiber.swap(e.m_fiberClose);
         dg.swap(e.m_dgClose);
         if (e.m_fiber || e.m_dg) {
             if (dg)
-                scheduler->schedule(dg);
+                scheduler->schedule(dg, emptytid(), priority);
             else
-                scheduler->schedule(fiber);
+                scheduler->schedule(fiber, emptytid(), priority);
             return;
         }
     } else if (events == WRITE) {
         scheduler = e.m_scheduler;
+        priority = e.m_priority;
         fiber.swap(e.m_fiber);
         dg.swap(e.m_dg);
     } else {
@@ -173,9 +179,9 @@ IOManager::cancelEvent(int fd, Event events)
     if (rc)
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("kevent");
     if (dg)
-        scheduler->schedule(dg);
+        scheduler->schedule(dg, emptytid(), priority);
     else
-        scheduler->schedule(fiber);
+        scheduler->schedule(fiber, emptytid(), priority);
     m_pendingEvents.erase(it);
 }
 
@@ -299,18 +305,20 @@ IOManager::idle()
                     MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("kevent");
             }
             if (e.m_dg) {
-                e.m_scheduler->schedule(e.m_dg);
+                e.m_scheduler->schedule(e.m_dg, emptytid(), e.m_priority);
                 e.m_dg = NULL;
             } else if (e.m_fiber) {
-                e.m_scheduler->schedule(e.m_fiber);
+                e.m_scheduler->schedule(e.m_fiber, emptytid(), e.m_priority);
                 e.m_fiber.reset();
             }
             if (eof && e.event.filter == EVFILT_READ) {
                 if (e.m_dgClose) {
-                    e.m_schedulerClose->schedule(e.m_dgClose);
+                    e.m_schedulerClose->schedule(e.m_dgClose, emptytid(),
+                        e.m_priorityClose);
                     e.m_dgClose = NULL;
                 } else if (e.m_fiberClose) {
-                    e.m_schedulerClose->schedule(e.m_fiberClose);
+                    e.m_schedulerClose->schedule(e.m_fiberClose, emptytid(),
+                        e.m_priorityClose);
                     e.m_fiberClose.reset();
                 }
             }
@@ -34,13 +34,16 @@ private:
         Scheduler *m_scheduler, *m_schedulerClose;
         boost::shared_ptr<Fiber> m_fiber, m_fiberClose;
         boost::function<void ()> m_dg, m_dgClose;
+        /// Scheduler::currentPriority() of whoever registered each event
+        Scheduler::Priority m_priority, m_priorityClose;
 
         bool operator<(const AsyncEvent &rhs) const
         { if (event.ident < rhs.event.ident) return true; return event.filter < rhs.event.filter; }
     };
 
 public:
-    IOManager(size_t threads = 1, bool useCaller = true);
+    IOManager(size_t threads = 1, bool useCaller = true,
+        bool workStealing = false);
     ~IOManager();
 
     bool stopping();
@@ -54,7 +57,7 @@ protected:
     void idle();
     void tickle();
 
-    void onTimerInsertedAtFront() { tickle(); }
+    void onTimerInsertedAtFront() { wake(); }
 
 private:
     int m_kqfd;
@@ -4,9 +4,21 @@
 
 #include "assert.h"
 #include "atomic.h"
+#include "config.h"
 
 namespace Mordor {
 
+static ConfigVar<size_t>::ptr g_stackSize = Config::lookup<size_t>(
+    "parallel.stacksize", 0u,
+    "Stack size for fibers created by parallel_do and parallel_foreach (0 "
+    "for fiber.defaultstacksize)");
+
+size_t
+parallelStackSize()
+{
+    return g_stackSize->val();
+}
+
 static
 void
 parallel_do_impl(boost::function<void ()> dg, size_t &completed,
@@ -47,7 +59,7 @@ parallel_do(const std::vector<boost::function<void ()> > &dgs)
     for(size_t i = 0; i < dgs.size(); ++i) {
         Fiber::ptr f(new Fiber(boost::bind(&parallel_do_impl, dgs[i],
             boost::ref(completed), dgs.size(), boost::ref(exceptions[i]),
-            scheduler, caller)));
+            scheduler, caller), g_stackSize->val()));
         fibers.push_back(f);
         scheduler->schedule(f);
     }
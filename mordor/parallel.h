@@ -38,6 +38,10 @@ void
 parallel_do(const std::vector<boost::function<void ()> > &dgs,
             std::vector<Fiber::ptr> &fibers);
 
+/// Stack size for the Fibers created by parallel_do and parallel_foreach
+/// (parallel.stacksize; 0 means fiber.defaultstacksize)
+size_t parallelStackSize();
+
 template<class Iterator, class Functor>
 static
 void
@@ -106,7 +110,8 @@ parallel_foreach(Iterator begin, Iterator end, Functor functor,
         fibers[i] = Fiber::ptr(new Fiber(boost::bind(
             &parallel_foreach_impl<Iterator, Functor>,
             boost::ref(functor), boost::ref(current[i]), boost::ref(result[i]),
-            boost::ref(exceptions[i]), scheduler, caller)));
+            boost::ref(exceptions[i]), scheduler, caller),
+            parallelStackSize()));
     }
 
     int curFiber = 0;
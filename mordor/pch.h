@@ -58,6 +58,7 @@
 #include <byteswap.h>
 #include <semaphore.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <syscall.h>
 #elif defined(OSX)
 #include <libkern/OSAtomic.h>
@@ -2,24 +2,76 @@
 
 #include "scheduler.h"
 
+#include <sstream>
+
 #include <boost/bind.hpp>
+#include <boost/exception/diagnostic_information.hpp>
+#include <boost/thread/thread.hpp>
 
 #include "assert.h"
+#include "atomic.h"
+#include "config.h"
 #include "fiber.h"
+#include "timer.h"
 
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:scheduler");
 
+static ConfigVar<size_t>::ptr g_starvationLimit =
+    Config::lookup<size_t>("scheduler.starvationlimit", 8u,
+    "How many scheduling passes in a row lower priority work may be passed "
+    "over in favor of more urgent work before it gets a turn.");
+static ConfigVar<unsigned long long>::ptr g_elasticInterval =
+    Config::lookup<unsigned long long>("scheduler.elastic.interval", 100000ull,
+    "How often (in microseconds) elastic Schedulers decide whether to add or "
+    "retire a thread.");
+static ConfigVar<unsigned long long>::ptr g_elasticLatency =
+    Config::lookup<unsigned long long>("scheduler.elastic.latency", 10000ull,
+    "How long (in microseconds) work may wait to start on an elastic "
+    "Scheduler before it adds a thread.");
+static ConfigVar<size_t>::ptr g_elasticLinger =
+    Config::lookup<size_t>("scheduler.elastic.linger", 50u,
+    "How many samples in a row an elastic Scheduler must have a thread to "
+    "spare before it retires one.");
+static ConfigVar<size_t>::ptr g_mailboxCapacity =
+    Config::lookup<size_t>("scheduler.mailbox.capacity", 256u,
+    "How much work targeted at a thread may wait in its mailbox (without "
+    "locking the shared queue); the rest waits in the shared queue.");
+static ConfigVar<unsigned long long>::ptr g_spin =
+    Config::lookup<unsigned long long>("scheduler.spin", 0ull,
+    "How long (in microseconds) idle threads poll for new work before "
+    "blocking.");
+
 ThreadLocalStorage<Scheduler *> Scheduler::t_scheduler;
 ThreadLocalStorage<Fiber *> Scheduler::t_fiber;
+ThreadLocalStorage<Scheduler::ThreadQueue *> Scheduler::t_queue;
+// Stored relative to NORMAL, so that it reads as NORMAL on threads that have
+// never run scheduled work
+ThreadLocalStorage<intptr_t> Scheduler::t_priority;
 
-Scheduler::Scheduler(size_t threads, bool useCaller, size_t batchSize)
-    : m_activeThreadCount(0),
+Scheduler::Scheduler(size_t threads, bool useCaller, size_t batchSize,
+    bool workStealing)
+    : m_critical(0),
+      m_activeThreadCount(0),
+      m_idleThreadCount(0),
+      m_tickled(0),
       m_stopping(true),
       m_autoStop(false),
-      m_batchSize(batchSize)
+      m_batchSize(batchSize),
+      m_workStealing(workStealing),
+      m_nextVictim(0),
+      m_mailboxes(NULL),
+      m_affinity(false),
+      m_settingsVersion(0),
+      m_controllerStopping(false),
+      m_minThreads(0),
+      m_maxThreads(0),
+      m_probeScheduled(0),
+      m_probeLatency(0)
 {
+    for (size_t i = 0; i < PRIORITIES; ++i)
+        m_passedOver[i] = 0;
     MORDOR_ASSERT(threads >= 1);
     if (useCaller) {
         --threads;
@@ -29,6 +81,13 @@ Scheduler::Scheduler(size_t threads, bool useCaller, size_t batchSize)
         t_scheduler = this;
         t_fiber = m_rootFiber.get();
         m_rootThread = gettid();
+        // The root thread's queue outlives each dispatch, so work scheduled
+        // from the hijacked thread before yielding to us isn't lost
+        if (m_workStealing)
+            registerQueue();
+        // Likewise, so that work can be targeted at the root thread before
+        // it starts dispatching
+        registerMailbox();
     } else {
         m_rootThread = emptytid();
     }
@@ -40,6 +99,13 @@ Scheduler::~Scheduler()
     MORDOR_ASSERT(m_stopping);
     if (getThis() == this) {
         t_scheduler = NULL;
+        if (m_workStealing)
+            t_queue = NULL;
+    }
+    while (m_mailboxes) {
+        Mailbox *mailbox = m_mailboxes;
+        m_mailboxes = mailbox->nextMailbox;
+        delete mailbox;
     }
 }
 
@@ -70,16 +136,238 @@ Scheduler::start()
     }
 }
 
+void
+Scheduler::affinity(const std::vector<int> &cpus)
+{
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_cpus = cpus;
+        m_affinity = true;
+        ++m_settingsVersion;
+    }
+    // Have every thread look for work, and notice the change
+    for (size_t i = 0; i < threadCount(); ++i)
+        tickle();
+}
+
+void
+Scheduler::name(const std::string &name)
+{
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_name = name;
+        ++m_settingsVersion;
+    }
+    for (size_t i = 0; i < threadCount(); ++i)
+        tickle();
+}
+
+void
+Scheduler::applyThreadSettings(size_t &version)
+{
+    std::vector<int> cpus;
+    bool affinity;
+    std::string name;
+    tid_t thread = gettid();
+    size_t index = 0;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        version = m_settingsVersion;
+        cpus = m_cpus;
+        affinity = m_affinity;
+        name = m_name;
+        if (thread != m_rootThread) {
+            index = m_rootThread == emptytid() ? 0 : 1;
+            for (std::vector<boost::shared_ptr<Thread> >::const_iterator it =
+                m_threads.begin(); it != m_threads.end(); ++it, ++index)
+                if ((*it)->tid() == thread)
+                    break;
+        }
+    }
+    // Until affinity() is called, leave alone whatever taskset or a cgroup
+    // set up
+    if (affinity) {
+        int cpu = cpus.empty() ? -1 : cpus[index % cpus.size()];
+        MORDOR_LOG_VERBOSE(g_log) << this << " pinning thread " << thread
+            << " to cpu " << cpu;
+        try {
+            setThreadAffinity(cpu);
+        } catch (...) {
+            MORDOR_LOG_ERROR(g_log) << this << " unable to pin thread "
+                << thread << " to cpu " << cpu << ": "
+                << boost::current_exception_diagnostic_information();
+        }
+    }
+    if (!name.empty() && thread != m_rootThread) {
+        std::ostringstream os;
+        os << name << "-" << index;
+        setThreadName(os.str().c_str());
+    }
+}
+
+std::vector<tid_t>
+Scheduler::threadIds()
+{
+    std::vector<tid_t> result;
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_rootThread != emptytid())
+        result.push_back(m_rootThread);
+    for (std::vector<boost::shared_ptr<Thread> >::const_iterator it =
+        m_threads.begin(); it != m_threads.end(); ++it)
+        result.push_back((*it)->tid());
+    return result;
+}
+
+void
+Scheduler::elastic(size_t minThreads, size_t maxThreads)
+{
+    MORDOR_ASSERT(minThreads >= 1);
+    MORDOR_ASSERT(minThreads <= maxThreads);
+    boost::mutex::scoped_lock lock(m_controllerMutex);
+    m_minThreads = minThreads;
+    m_maxThreads = maxThreads;
+    if (!m_controller) {
+        m_controllerStopping = false;
+        m_controller.reset(new Thread(
+            boost::bind(&Scheduler::controlThreadCount, this)));
+    }
+}
+
+void
+Scheduler::controlThreadCount()
+{
+    size_t spareSamples = 0;
+    while (true) {
+        unsigned long long now, latency;
+        size_t minThreads, maxThreads;
+        bool scheduleProbe = false;
+        {
+            boost::mutex::scoped_lock lock(m_controllerMutex);
+            if (!m_controllerStopping)
+                m_controllerCondition.timed_wait(lock,
+                    boost::posix_time::microseconds(
+                    g_elasticInterval->val()));
+            if (m_controllerStopping)
+                return;
+            minThreads = m_minThreads;
+            maxThreads = m_maxThreads;
+            now = TimerManager::now();
+            if (m_probeScheduled != 0) {
+                // Still waiting to run
+                latency = now - m_probeScheduled;
+            } else {
+                latency = m_probeLatency;
+                m_probeScheduled = now;
+                scheduleProbe = true;
+            }
+        }
+        size_t queued;
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            queued = queuedNoLock();
+        }
+        size_t threads = threadCount();
+        size_t active = m_activeThreadCount;
+        // After sampling, so the probe doesn't count itself as queued work
+        if (scheduleProbe)
+            schedule(boost::bind(&Scheduler::probe, this, now));
+        if (threads < maxThreads && ((queued != 0 && active >= threads) ||
+            latency >= g_elasticLatency->val())) {
+            MORDOR_LOG_VERBOSE(g_log) << this << " growing to "
+                << threads + 1 << " threads (" << queued << " queued, "
+                << active << " active, " << latency << "us latency)";
+            threadCount(threads + 1);
+            spareSamples = 0;
+        } else if (threads > minThreads && queued == 0 && active < threads) {
+            if (++spareSamples >= g_elasticLinger->val()) {
+                MORDOR_LOG_VERBOSE(g_log) << this << " shrinking to "
+                    << threads - 1 << " threads";
+                threadCount(threads - 1);
+                spareSamples = 0;
+            }
+        } else {
+            spareSamples = 0;
+        }
+    }
+}
+
+void
+Scheduler::probe(unsigned long long scheduled)
+{
+    unsigned long long now = TimerManager::now();
+    boost::mutex::scoped_lock lock(m_controllerMutex);
+    m_probeLatency = now - scheduled;
+    m_probeScheduled = 0;
+}
+
+void
+Scheduler::stopController()
+{
+    boost::shared_ptr<Thread> controller;
+    {
+        boost::mutex::scoped_lock lock(m_controllerMutex);
+        if (!m_controller)
+            return;
+        m_controllerStopping = true;
+        m_controllerCondition.notify_one();
+        controller.swap(m_controller);
+    }
+    controller->join();
+}
+
+size_t
+Scheduler::queuedNoLock()
+{
+    size_t queued = 0;
+    for (size_t i = 0; i < PRIORITIES; ++i)
+        queued += m_fibers[i].size();
+    for (std::vector<boost::shared_ptr<ThreadQueue> >::const_iterator it =
+        m_queues.begin(); it != m_queues.end(); ++it) {
+        boost::mutex::scoped_lock lock((*it)->mutex);
+        queued += (*it)->fibers.size();
+    }
+    return queued;
+}
+
+void
+Scheduler::wake()
+{
+    if (m_idleThreadCount != 0 &&
+        atomicCompareAndSwap(m_tickled, (size_t)1, (size_t)0) == 0)
+        tickle();
+}
+
+void
+Scheduler::sleeping(bool asleep)
+{
+    tid_t thread = gettid();
+    Mailbox *mailbox = m_mailboxes;
+    while (mailbox->thread != thread)
+        mailbox = mailbox->nextMailbox;
+    if (asleep)
+        idling(mailbox);
+    else
+        awake(mailbox);
+}
+
+unsigned long long
+Scheduler::spinTime()
+{
+    return g_spin->val();
+}
+
 bool
 Scheduler::hasWorkToDo()
 {
     boost::mutex::scoped_lock lock(m_mutex);
-    return !m_fibers.empty();
+    return !fibersEmptyNoLock() || !queuesEmptyNoLock() || !mailboxesEmpty();
 }
 
 void
 Scheduler::stop()
 {
+    // Nobody else gets to change the thread count while we're stopping
+    stopController();
     // Already stopped
     if (m_rootFiber &&
         m_threadCount == 0 &&
@@ -113,7 +401,13 @@ Scheduler::stop()
         MORDOR_ASSERT(Scheduler::getThis() != this);
     }
     m_stopping = true;
-    for (size_t i = 0; i < m_threadCount; ++i)
+    size_t running;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        // Including any told to retire that haven't noticed yet
+        running = std::max(m_threadCount, m_threads.size());
+    }
+    for (size_t i = 0; i < running; ++i)
         tickle();
     if (m_rootFiber && (m_threadCount != 0u || Scheduler::getThis() != this))
         tickle();
@@ -150,34 +444,114 @@ bool
 Scheduler::stopping()
 {
     boost::mutex::scoped_lock lock(m_mutex);
-    return m_stopping && m_fibers.empty() && m_activeThreadCount == 0;
+    // The per-thread queues and mailboxes must be checked before
+    // m_activeThreadCount; a thread accounts for itself before taking work
+    // out of either of them
+    return m_stopping && fibersEmptyNoLock() && queuesEmptyNoLock() &&
+        mailboxesEmpty() && m_activeThreadCount == 0;
 }
 
 void
-Scheduler::schedule(Fiber::ptr f, tid_t thread)
+Scheduler::schedule(Fiber::ptr f, tid_t thread, Priority priority)
 {
+    ThreadQueue *queue = localQueue(thread, priority);
+    if (queue) {
+        MORDOR_LOG_DEBUG(g_log) << this << " scheduling " << f
+            << " on local queue";
+        MORDOR_ASSERT(f);
+        FiberAndThread ft = {f, Task(), thread, priority };
+        scheduleLocal(queue, ft);
+        return;
+    }
+    if (thread != emptytid()) {
+        MORDOR_ASSERT(f);
+        FiberAndThread ft = {f, Task(), thread, priority };
+        if (post(ft)) {
+            MORDOR_LOG_DEBUG(g_log) << this << " posted " << f
+                << " to thread " << thread;
+            return;
+        }
+    }
     bool tickleMe;
     {
         boost::mutex::scoped_lock lock(m_mutex);
-        tickleMe = scheduleNoLock(f, thread);
+        tickleMe = scheduleNoLock(f, thread, priority);
     }
     if (tickleMe && Scheduler::getThis() != this)
-        tickle();
+        wake();
 }
 
 void
-Scheduler::schedule(boost::function<void ()> dg, tid_t thread)
+Scheduler::schedule(const Task &dg, tid_t thread, Priority priority)
 {
+    ThreadQueue *queue = localQueue(thread, priority);
+    if (queue) {
+        MORDOR_LOG_DEBUG(g_log) << this << " scheduling " << dg
+            << " on local queue";
+        MORDOR_ASSERT(dg);
+        FiberAndThread ft = {Fiber::ptr(), dg, thread, priority };
+        scheduleLocal(queue, ft);
+        return;
+    }
+    if (thread != emptytid()) {
+        MORDOR_ASSERT(dg);
+        FiberAndThread ft = {Fiber::ptr(), dg, thread, priority };
+        if (post(ft)) {
+            MORDOR_LOG_DEBUG(g_log) << this << " posted " << dg
+                << " to thread " << thread;
+            return;
+        }
+    }
     bool tickleMe;
     {
         boost::mutex::scoped_lock lock(m_mutex);
-        tickleMe = scheduleNoLock(dg, thread);
+        tickleMe = scheduleNoLock(dg, thread, priority);
     }
     if (tickleMe && Scheduler::getThis() != this)
-        tickle();
+        wake();
+}
+
+void
+Scheduler::schedule(std::vector<FiberAndThread> &batch)
+{
+    // Thread-local and thread-targeted work first, the way schedule() would;
+    // what's left over is moved to the front, for the shared queue
+    size_t shared = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        FiberAndThread &ft = batch[i];
+        MORDOR_ASSERT(ft.fiber || ft.dg);
+        ThreadQueue *queue = localQueue(ft.thread, ft.priority);
+        if (queue) {
+            scheduleLocal(queue, ft);
+            continue;
+        }
+        if (ft.thread != emptytid() && post(ft))
+            continue;
+        if (shared != i)
+            batch[shared] = ft;
+        ++shared;
+    }
+    bool tickleMe = false;
+    if (shared != 0) {
+        boost::mutex::scoped_lock lock(m_mutex);
+        for (size_t i = 0; i < shared; ++i) {
+            FiberAndThread &ft = batch[i];
+            // Picked (out of threadIds(), say) before it retired
+            if (ft.anyIfRetired && !ownsThreadNoLock(ft.thread)) {
+                MORDOR_LOG_DEBUG(g_log) << this << " thread " << ft.thread
+                    << " is gone";
+                ft.thread = emptytid();
+            }
+            tickleMe = (ft.fiber ?
+                scheduleNoLock(ft.fiber, ft.thread, ft.priority) :
+                scheduleNoLock(ft.dg, ft.thread, ft.priority)) || tickleMe;
+        }
+    }
+    batch.clear();
+    if (tickleMe && Scheduler::getThis() != this)
+        wake();
 }
 
-#ifdef DEBUG
 static bool contains(const std::vector<boost::shared_ptr<Thread> >
     &threads, tid_t thread)
 {
@@ -187,38 +561,520 @@ static bool contains(const std::vector<boost::shared_ptr<Thread> >
             return true;
     return false;
 }
-#endif
 
 bool
-Scheduler::scheduleNoLock(Fiber::ptr f, tid_t thread)
+Scheduler::ownsThreadNoLock(tid_t thread) const
+{
+    return thread == emptytid() || thread == m_rootThread ||
+        contains(m_threads, thread);
+}
+
+bool
+Scheduler::scheduleNoLock(Fiber::ptr f, tid_t thread, Priority priority)
 {
     MORDOR_LOG_DEBUG(g_log) << this << " scheduling " << f << " on thread "
         << thread;
     MORDOR_ASSERT(f);
     // Not thread-targeted, or this scheduler owns the targetted thread
-    MORDOR_ASSERT(thread == emptytid() || thread == m_rootThread ||
-        contains(m_threads, thread));
-    FiberAndThread ft = {f, NULL, thread };
-    bool tickleMe = m_fibers.empty();
-    m_fibers.push_back(ft);
-    return tickleMe;
+    MORDOR_ASSERT(ownsThreadNoLock(thread));
+    FiberAndThread ft = {f, Task(), thread, priority };
+    return pushNoLock(ft);
 }
 
 bool
-Scheduler::scheduleNoLock(boost::function<void ()> dg, tid_t thread)
+Scheduler::scheduleNoLock(const Task &dg, tid_t thread, Priority priority)
 {
     MORDOR_LOG_DEBUG(g_log) << this << " scheduling " << dg << " on thread "
         << thread;
     MORDOR_ASSERT(dg);
     // Not thread-targeted, or this scheduler owns the targetted thread
-    MORDOR_ASSERT(thread == emptytid() || thread == m_rootThread ||
-        contains(m_threads, thread));
-    FiberAndThread ft = {Fiber::ptr(), dg, thread };
-    bool tickleMe = m_fibers.empty();
-    m_fibers.push_back(ft);
+    MORDOR_ASSERT(ownsThreadNoLock(thread));
+    FiberAndThread ft = {Fiber::ptr(), dg, thread, priority };
+    return pushNoLock(ft);
+}
+
+void
+Scheduler::FiberQueue::push_back(const FiberAndThread &ft)
+{
+    if (m_size == m_items.size()) {
+        // Grow, unwrapping the contents to the start of the new buffer
+        std::vector<FiberAndThread> items(m_items.empty() ? 16 :
+            m_items.size() * 2);
+        for (size_t i = 0; i < m_size; ++i)
+            items[i] = (*this)[i];
+        m_items.swap(items);
+        m_head = 0;
+    }
+    m_items[(m_head + m_size) & (m_items.size() - 1)] = ft;
+    ++m_size;
+}
+
+void
+Scheduler::FiberQueue::pop_front()
+{
+    MORDOR_ASSERT(m_size > 0);
+    release(front());
+    m_head = (m_head + 1) & (m_items.size() - 1);
+    --m_size;
+}
+
+void
+Scheduler::FiberQueue::erase(size_t index)
+{
+    MORDOR_ASSERT(index < m_size);
+    // Close the gap from whichever end is closer
+    if (index < m_size / 2) {
+        for (size_t i = index; i > 0; --i)
+            (*this)[i] = (*this)[i - 1];
+        pop_front();
+    } else {
+        for (size_t i = index; i + 1 < m_size; ++i)
+            (*this)[i] = (*this)[i + 1];
+        release((*this)[--m_size]);
+    }
+}
+
+void
+Scheduler::FiberQueue::clear()
+{
+    while (m_size > 0)
+        pop_front();
+}
+
+void
+Scheduler::FiberQueue::release(FiberAndThread &ft)
+{
+    // Don't keep the Fiber (or anything bound into the functor) alive just
+    // because its slot hasn't been reused yet
+    ft.fiber.reset();
+    ft.dg.clear();
+}
+
+bool
+Scheduler::pushNoLock(const FiberAndThread &ft)
+{
+    FiberQueue &fibers = m_fibers[ft.priority];
+    bool tickleMe = fibers.empty();
+    fibers.push_back(ft);
+    if (ft.priority == CRITICAL)
+        atomicIncrement(m_critical);
     return tickleMe;
 }
 
+bool
+Scheduler::fibersEmptyNoLock() const
+{
+    for (size_t i = 0; i < PRIORITIES; ++i)
+        if (!m_fibers[i].empty())
+            return false;
+    return true;
+}
+
+void
+Scheduler::laneOrderNoLock(size_t order[PRIORITIES]) const
+{
+    // Starved priorities first, then the rest, most urgent first
+    size_t limit = g_starvationLimit->val();
+    size_t next = 0;
+    for (size_t i = 0; i < PRIORITIES; ++i)
+        if (m_passedOver[i] >= limit)
+            order[next++] = i;
+    for (size_t i = 0; i < PRIORITIES; ++i)
+        if (m_passedOver[i] < limit)
+            order[next++] = i;
+}
+
+void
+Scheduler::passOverNoLock(const size_t taken[PRIORITIES])
+{
+    bool any = false;
+    for (size_t i = 0; i < PRIORITIES; ++i)
+        any = any || taken[i] != 0;
+    if (!any)
+        return;
+    for (size_t i = 0; i < PRIORITIES; ++i) {
+        if (taken[i] == 0 && !m_fibers[i].empty())
+            ++m_passedOver[i];
+        else
+            m_passedOver[i] = 0;
+    }
+}
+
+Scheduler::ThreadQueue *
+Scheduler::localQueue(tid_t thread, Priority priority)
+{
+    // Thread-targeted work always goes through the shared queue, since
+    // anything in a local queue may be stolen by another thread; so does
+    // anything but NORMAL work, since local queues have no priorities
+    if (!m_workStealing || thread != emptytid() || priority != NORMAL ||
+        t_scheduler.get() != this)
+        return NULL;
+    return t_queue.get();
+}
+
+void
+Scheduler::scheduleLocal(ThreadQueue *queue, const FiberAndThread &ft)
+{
+    MORDOR_ASSERT(queue->thread == gettid());
+    boost::mutex::scoped_lock lock(queue->mutex);
+    queue->fibers.push_back(ft);
+}
+
+Scheduler::ThreadQueue *
+Scheduler::registerQueue()
+{
+    boost::shared_ptr<ThreadQueue> queue(new ThreadQueue());
+    queue->thread = gettid();
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_queues.push_back(queue);
+    t_queue = queue.get();
+    return queue.get();
+}
+
+void
+Scheduler::unregisterQueueNoLock(ThreadQueue *queue)
+{
+    {
+        boost::mutex::scoped_lock lock(queue->mutex);
+        // Hand anything left over to the other threads
+        for (size_t i = 0; i < queue->fibers.size(); ++i)
+            pushNoLock(queue->fibers[i]);
+        queue->fibers.clear();
+    }
+    for (std::vector<boost::shared_ptr<ThreadQueue> >::iterator it =
+        m_queues.begin(); it != m_queues.end(); ++it) {
+        if (it->get() == queue) {
+            m_queues.erase(it);
+            break;
+        }
+    }
+    t_queue = NULL;
+}
+
+bool
+Scheduler::popLocal(ThreadQueue *queue, std::vector<FiberAndThread> &batch,
+    bool &isActive)
+{
+    boost::mutex::scoped_lock lock(queue->mutex);
+    if (queue->fibers.empty())
+        return false;
+    // Accounting (before the work leaves the queue; see stopping())
+    if (!isActive) {
+        atomicIncrement(m_activeThreadCount);
+        isActive = true;
+    }
+    while (batch.size() < m_batchSize && !queue->fibers.empty()) {
+        batch.push_back(queue->fibers.front());
+        queue->fibers.pop_front();
+    }
+    return !queue->fibers.empty();
+}
+
+bool
+Scheduler::stealNoLock(ThreadQueue *queue, std::vector<FiberAndThread> &batch,
+    bool &isActive, bool &dontIdle)
+{
+    for (size_t i = 0; i < m_queues.size(); ++i) {
+        ThreadQueue *victim = m_queues[(m_nextVictim + i) % m_queues.size()]
+            .get();
+        if (victim == queue)
+            continue;
+        boost::mutex::scoped_lock lock(victim->mutex);
+        size_t index = victim->fibers.size();
+        while (index != 0 && batch.size() < m_batchSize) {
+            FiberAndThread &ft = victim->fibers[--index];
+            // Still executing on the victim thread; it pushed itself and
+            // hasn't finished yielding yet
+            if (ft.fiber && ft.fiber->state() == Fiber::EXEC) {
+                dontIdle = true;
+                continue;
+            }
+            if (!isActive) {
+                atomicIncrement(m_activeThreadCount);
+                isActive = true;
+            }
+            batch.push_back(ft);
+            victim->fibers.erase(index);
+        }
+        if (!batch.empty()) {
+            MORDOR_LOG_DEBUG(g_log) << this << " stole " << batch.size()
+                << " fiber/dgs from thread " << victim->thread;
+            m_nextVictim = (m_nextVictim + i + 1) % m_queues.size();
+            return !victim->fibers.empty();
+        }
+    }
+    return false;
+}
+
+bool
+Scheduler::queuesEmptyNoLock()
+{
+    for (std::vector<boost::shared_ptr<ThreadQueue> >::const_iterator it =
+        m_queues.begin(); it != m_queues.end(); ++it) {
+        boost::mutex::scoped_lock lock((*it)->mutex);
+        if (!(*it)->fibers.empty())
+            return false;
+    }
+    return true;
+}
+
+Scheduler::Mailbox::Mailbox(size_t capacity)
+    : thread(emptytid()),
+      producers(0),
+      pending(0),
+      idle(false),
+      head(0),
+      tail(0),
+      nextMailbox(NULL)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    slots.resize(size);
+    for (size_t i = 0; i < size; ++i)
+        slots[i].sequence = i;
+}
+
+bool
+Scheduler::Mailbox::push(const FiberAndThread &ft)
+{
+    size_t position = head;
+    while (true) {
+        Slot &slot = slots[position & (slots.size() - 1)];
+        size_t sequence = slot.sequence;
+        if (sequence == position) {
+            size_t claimed = atomicCompareAndSwap(head, position + 1,
+                position);
+            if (claimed == position) {
+                slot.ft = ft;
+                // Publish (with a barrier) only once it's filled in
+                atomicSwap(slot.sequence, position + 1);
+                return true;
+            }
+            position = claimed;
+        } else if ((ptrdiff_t)(sequence - position) < 0) {
+            // Still holds (or is still being filled with) what was posted a
+            // lap ago
+            return false;
+        } else {
+            // Someone else claimed it first
+            position = head;
+        }
+    }
+}
+
+bool
+Scheduler::Mailbox::pop(FiberAndThread &ft)
+{
+    Slot &slot = slots[tail & (slots.size() - 1)];
+    if (slot.sequence != tail + 1)
+        return false;
+    ft = slot.ft;
+    // Don't keep the Fiber (or anything bound into the functor) alive just
+    // because the slot hasn't been reused yet
+    slot.ft.fiber.reset();
+    slot.ft.dg.clear();
+    ++tail;
+    // Hand it back to producers for the next lap
+    atomicSwap(slot.sequence, tail + slots.size() - 1);
+    return true;
+}
+
+bool
+Scheduler::post(const FiberAndThread &ft)
+{
+    for (Mailbox *mailbox = m_mailboxes; mailbox;
+        mailbox = mailbox->nextMailbox) {
+        if (mailbox->thread != ft.thread)
+            continue;
+        bool posted = false;
+        atomicIncrement(mailbox->producers);
+        // Re-check now that the owner will wait for us if it's exiting
+        if (mailbox->thread == ft.thread) {
+            // Counted first, so it's never not pending (see stopping())
+            atomicIncrement(mailbox->pending);
+            posted = mailbox->push(ft);
+            if (!posted) {
+                atomicDecrement(mailbox->pending);
+                MORDOR_LOG_DEBUG(g_log) << this << " mailbox for thread "
+                    << ft.thread << " is full";
+            }
+        }
+        atomicDecrement(mailbox->producers);
+        if (!posted)
+            return false;
+        // The owner will notice the new work on its own unless it's idle
+        if (mailbox->idle)
+            tickleThread(ft.thread);
+        return true;
+    }
+    return false;
+}
+
+Scheduler::Mailbox *
+Scheduler::registerMailbox()
+{
+    tid_t thread = gettid();
+    for (Mailbox *mailbox = m_mailboxes; mailbox;
+        mailbox = mailbox->nextMailbox) {
+        // The root thread keeps its mailbox across dispatches
+        if (mailbox->thread == thread)
+            return mailbox;
+    }
+    for (Mailbox *mailbox = m_mailboxes; mailbox;
+        mailbox = mailbox->nextMailbox) {
+        if (mailbox->thread == emptytid() && atomicCompareAndSwap(
+            mailbox->thread, thread, emptytid()) == emptytid())
+            return mailbox;
+    }
+    Mailbox *mailbox = new Mailbox(g_mailboxCapacity->val());
+    mailbox->thread = thread;
+    boost::mutex::scoped_lock lock(m_mutex);
+    mailbox->nextMailbox = m_mailboxes;
+    // Publish (with a barrier) only once it's fully constructed; producers
+    // walk the list without a lock
+    atomicSwap(m_mailboxes, mailbox);
+    return mailbox;
+}
+
+void
+Scheduler::releaseMailbox(Mailbox *mailbox)
+{
+    tid_t thread = gettid();
+    MORDOR_ASSERT(mailbox->thread == thread);
+    atomicCompareAndSwap(mailbox->thread, emptytid(), thread);
+    // Wait for anyone who saw us as the owner to finish posting; that's
+    // never more than a push, but they may have been preempted
+    while (mailbox->producers != 0)
+        boost::this_thread::yield();
+}
+
+void
+Scheduler::unregisterMailboxNoLock(Mailbox *mailbox)
+{
+    MORDOR_ASSERT(mailbox->thread == emptytid());
+    MORDOR_ASSERT(mailbox->producers == 0);
+    // Move anything left over to the shared queue (still targeted at this
+    // thread; see handOffNoLock())
+    for (size_t i = 0; i < mailbox->deferred.size(); ++i)
+        pushNoLock(mailbox->deferred[i]);
+    mailbox->deferred.clear();
+    FiberAndThread ft;
+    while (mailbox->pop(ft))
+        pushNoLock(ft);
+    mailbox->pending = 0;
+    MORDOR_ASSERT(!mailbox->idle);
+}
+
+bool
+Scheduler::handOffNoLock(bool all)
+{
+    bool handedOff = false, kept = false;
+    for (size_t priority = 0; priority < PRIORITIES; ++priority) {
+        FiberQueue &fibers = m_fibers[priority];
+        for (size_t i = 0; i < fibers.size(); ++i) {
+            FiberAndThread &ft = fibers[i];
+            if (ft.thread != gettid())
+                continue;
+            if (all || ft.anyIfRetired) {
+                ft.thread = emptytid();
+                handedOff = true;
+            } else {
+                kept = true;
+            }
+        }
+    }
+    if (handedOff)
+        tickle();
+    return kept;
+}
+
+void
+Scheduler::drainMailbox(Mailbox *mailbox, std::vector<FiberAndThread> &batch,
+    bool &isActive, bool &dontIdle)
+{
+    if (mailbox->pending == 0)
+        return;
+    size_t index = 0;
+    while (batch.size() < m_batchSize) {
+        FiberAndThread ft;
+        if (index < mailbox->deferred.size()) {
+            FiberAndThread &deferred = mailbox->deferred[index];
+            if (deferred.fiber->state() == Fiber::EXEC) {
+                ++index;
+                dontIdle = true;
+                continue;
+            }
+            ft = deferred;
+            mailbox->deferred.erase(index);
+        } else {
+            if (!mailbox->pop(ft)) {
+                // Someone is in the middle of posting
+                if (mailbox->pending != mailbox->deferred.size())
+                    dontIdle = true;
+                break;
+            }
+            // This fiber is still executing; it needs to finish yielding on
+            // another thread before it can run here
+            if (ft.fiber && ft.fiber->state() == Fiber::EXEC) {
+                MORDOR_LOG_DEBUG(g_log) << this
+                    << " deferring executing fiber " << ft.fiber;
+                mailbox->deferred.push_back(ft);
+                ++index;
+                dontIdle = true;
+                continue;
+            }
+        }
+        MORDOR_ASSERT(ft.fiber || ft.dg);
+        // Accounting (before pending drops; see stopping())
+        if (!isActive) {
+            atomicIncrement(m_activeThreadCount);
+            isActive = true;
+        }
+        atomicDecrement(mailbox->pending);
+        batch.push_back(ft);
+    }
+}
+
+bool
+Scheduler::mailboxesEmpty()
+{
+    for (Mailbox *mailbox = m_mailboxes; mailbox;
+        mailbox = mailbox->nextMailbox)
+        if (mailbox->pending != 0)
+            return false;
+    return true;
+}
+
+void
+Scheduler::tickleOtherMailboxes(Mailbox *mailbox)
+{
+    for (Mailbox *other = m_mailboxes; other; other = other->nextMailbox)
+        if (other != mailbox && other->pending != 0 && other->idle)
+            tickleThread(other->thread);
+}
+
+void
+Scheduler::idling(Mailbox *mailbox)
+{
+    MORDOR_ASSERT(!mailbox->idle);
+    mailbox->idle = true;
+    // Also a full barrier; whoever schedules work next will see us, or
+    // we'll see their work when we check again
+    atomicIncrement(m_idleThreadCount);
+}
+
+void
+Scheduler::awake(Mailbox *mailbox)
+{
+    MORDOR_ASSERT(mailbox->idle);
+    mailbox->idle = false;
+    atomicDecrement(m_idleThreadCount);
+    // Whoever got the last tickle (if it wasn't us) is awake too, or still
+    // has it coming; either way the next wake() can send another
+    m_tickled = 0;
+}
+
 void
 Scheduler::switchTo(tid_t thread)
 {
@@ -228,7 +1084,7 @@ Scheduler::switchTo(tid_t thread)
             return;
     }
     MORDOR_LOG_DEBUG(g_log) << this << " switching to thread " << thread;
-    schedule(Fiber::getThis(), thread);
+    schedule(Fiber::getThis(), thread, currentPriority());
     Scheduler::yieldTo();
 }
 
@@ -252,10 +1108,17 @@ void
 Scheduler::yield()
 {
     MORDOR_ASSERT(Scheduler::getThis());
-    Scheduler::getThis()->schedule(Fiber::getThis());
+    Scheduler::getThis()->schedule(Fiber::getThis(), emptytid(),
+        currentPriority());
     yieldTo();
 }
 
+Scheduler::Priority
+Scheduler::currentPriority()
+{
+    return (Priority)(t_priority.get() + NORMAL);
+}
+
 void
 Scheduler::dispatch()
 {
@@ -273,16 +1136,24 @@ Scheduler::threadCount(size_t threads)
     MORDOR_ASSERT(threads >= 1);
     if (m_rootFiber)
         --threads;
-    boost::mutex::scoped_lock lock(m_mutex);
-    if (threads == m_threadCount) {
-        return;
-    } else if (threads > m_threadCount) {
-        m_threads.resize(threads);
-        for (size_t i = m_threadCount; i < threads; ++i)
-            m_threads[i] = boost::shared_ptr<Thread>(new Thread(
-            boost::bind(&Scheduler::run, this)));
+    size_t retired = 0;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (threads == m_threadCount) {
+            return;
+        } else if (threads > m_threadCount) {
+            // Threads that haven't finished retiring yet can just stay
+            for (size_t i = m_threads.size(); i < threads; ++i)
+                m_threads.push_back(boost::shared_ptr<Thread>(new Thread(
+                    boost::bind(&Scheduler::run, this))));
+        } else {
+            retired = m_threadCount - threads;
+        }
+        m_threadCount = threads;
     }
-    m_threadCount = threads;
+    // Idle threads need to wake up to notice they should exit
+    for (size_t i = 0; i < retired; ++i)
+        tickle();
 }
 
 void
@@ -310,94 +1181,166 @@ Scheduler::run()
         // Hijacked a thread
         MORDOR_ASSERT(t_fiber.get() == Fiber::getThis().get());
     }
+    ThreadQueue *queue = NULL;
+    if (m_workStealing) {
+        queue = t_queue.get();
+        if (!queue)
+            queue = registerQueue();
+    }
+    Mailbox *mailbox = registerMailbox();
+    size_t settingsVersion = 0;
     Fiber::ptr idleFiber(new Fiber(boost::bind(&Scheduler::idle, this)));
     MORDOR_LOG_VERBOSE(g_log) << this << " starting thread with idle fiber " << idleFiber;
     Fiber::ptr dgFiber;
+    // The functor for dgFiber to run next
+    Task *task = NULL;
     // use a vector for O(1) .size()
     std::vector<FiberAndThread> batch(m_batchSize);
     bool isActive = false;
     while (true) {
+        if (settingsVersion != m_settingsVersion)
+            applyThreadSettings(settingsVersion);
+        // Given up (see below) on retiring after all
+        if (!mailbox)
+            mailbox = registerMailbox();
         batch.clear();
         bool dontIdle = false;
         bool tickleMe = false;
-        {
+        // Work targeted at this thread first
+        drainMailbox(mailbox, batch, isActive, dontIdle);
+        // Then our own queue; only if both are empty (or there's CRITICAL
+        // work waiting) do we touch the shared queue (and then try to steal
+        // from the other threads)
+        if (queue && batch.size() < m_batchSize && m_critical == 0) {
+            // If there's more left over, see if someone idle can steal it
+            tickleMe = popLocal(queue, batch, isActive) &&
+                m_activeThreadCount < threadCount();
+        }
+        if (batch.empty()) {
             boost::mutex::scoped_lock lock(m_mutex);
             // Kill ourselves off if needed
             if (m_threads.size() > m_threadCount && gettid() != m_rootThread) {
-                // Accounting
-                if (isActive)
-                    --m_activeThreadCount;
-                // Kill off the idle fiber
-                try {
-                    throw boost::enable_current_exception(
-                        OperationAbortedException());
-                } catch(...) {
-                    idleFiber->inject(boost::current_exception());
-                }
-                // Detach our thread
-                for (std::vector<boost::shared_ptr<Thread> >
-                    ::iterator it = m_threads.begin();
-                    it != m_threads.end();
-                    ++it)
-                    if ((*it)->tid() == gettid()) {
-                        m_threads.erase(it);
-                        if (m_threads.size() > m_threadCount)
-                            tickle();
-                        return;
+                // Posting to us falls back to the shared queue from here on
+                // (and nobody needs the lock while we wait for whoever's
+                // already posting)
+                lock.unlock();
+                releaseMailbox(mailbox);
+                lock.lock();
+                unregisterMailboxNoLock(mailbox);
+                mailbox = NULL;
+                if (m_threads.size() <= m_threadCount) {
+                    // Told to stay in the meantime
+                    dontIdle = true;
+                } else if (handOffNoLock(false)) {
+                    // Whoever targeted us without a fallback is counting on
+                    // us to run it; stay until it's done
+                    MORDOR_LOG_DEBUG(g_log) << this
+                        << " not retiring yet; there's work for this thread";
+                    dontIdle = true;
+                } else {
+                    // Accounting
+                    if (isActive)
+                        atomicDecrement(m_activeThreadCount);
+                    if (queue)
+                        unregisterQueueNoLock(queue);
+                    // Kill off the idle fiber (unless it never got to run)
+                    if (idleFiber->state() != Fiber::INIT) {
+                        try {
+                            throw boost::enable_current_exception(
+                                OperationAbortedException());
+                        } catch(...) {
+                            idleFiber->inject(boost::current_exception());
+                        }
                     }
-                MORDOR_NOTREACHED();
+                    // Detach our thread
+                    for (std::vector<boost::shared_ptr<Thread> >
+                        ::iterator it = m_threads.begin();
+                        it != m_threads.end();
+                        ++it)
+                        if ((*it)->tid() == gettid()) {
+                            m_threads.erase(it);
+                            if (m_threads.size() > m_threadCount)
+                                tickle();
+                            return;
+                        }
+                    MORDOR_NOTREACHED();
+                }
             }
 
-            std::list<FiberAndThread>::iterator it(m_fibers.begin());
-            while (it != m_fibers.end()) {
-                // If we've met our batch size, and we're not checking to see
-                // if we need to tickle another thread, then break
-                if ( (tickleMe || m_activeThreadCount == threadCount()) &&
-                    batch.size() == m_batchSize)
-                    break;
+            size_t order[PRIORITIES];
+            laneOrderNoLock(order);
+            size_t taken[PRIORITIES] = { 0 };
+            for (size_t lane = 0; lane < PRIORITIES; ++lane) {
+                Priority priority = (Priority)order[lane];
+                FiberQueue &fibers = m_fibers[priority];
+                size_t index = 0;
+                while (index < fibers.size()) {
+                    FiberAndThread &ft = fibers[index];
+                    // If we've met our batch size, and we're not checking to
+                    // see if we need to tickle another thread, then break
+                    if ( (tickleMe || m_activeThreadCount == threadCount()) &&
+                        batch.size() == m_batchSize)
+                        break;
 
-                if (it->thread != emptytid() && it->thread != gettid()) {
-                    MORDOR_LOG_DEBUG(g_log) << this
-                        << " skipping item scheduled for thread "
-                        << it->thread;
+                    if (ft.thread != emptytid() && ft.thread != gettid()) {
+                        MORDOR_LOG_DEBUG(g_log) << this
+                            << " skipping item scheduled for thread "
+                            << ft.thread;
 
-                    // Wake up another thread to hopefully service this
-                    tickleMe = true;
-                    dontIdle = true;
-                    ++it;
-                    continue;
-                }
-                MORDOR_ASSERT(it->fiber || it->dg);
-                // This fiber is still executing; probably just some race
-                // race condition that it needs to yield on one thread
-                // before running on another thread
-                if (it->fiber && it->fiber->state() == Fiber::EXEC) {
-                    MORDOR_LOG_DEBUG(g_log) << this
-                        << " skipping executing fiber " << it->fiber;
-                    ++it;
-                    dontIdle = true;
-                    continue;
+                        // Wake up another thread to hopefully service this
+                        tickleMe = true;
+                        dontIdle = true;
+                        ++index;
+                        continue;
+                    }
+                    MORDOR_ASSERT(ft.fiber || ft.dg);
+                    // This fiber is still executing; probably just some race
+                    // race condition that it needs to yield on one thread
+                    // before running on another thread
+                    if (ft.fiber && ft.fiber->state() == Fiber::EXEC) {
+                        MORDOR_LOG_DEBUG(g_log) << this
+                            << " skipping executing fiber " << ft.fiber;
+                        ++index;
+                        dontIdle = true;
+                        continue;
+                    }
+                    // We were just checking if there is more work; there is,
+                    // so set the flag and don't actually take this piece of
+                    // work
+                    if (batch.size() == m_batchSize) {
+                        tickleMe = true;
+                        break;
+                    }
+                    batch.push_back(ft);
+                    fibers.erase(index);
+                    ++taken[priority];
+                    if (priority == CRITICAL)
+                        atomicDecrement(m_critical);
+                    if (!isActive) {
+                        atomicIncrement(m_activeThreadCount);
+                        isActive = true;
+                    }
                 }
-                // We were just checking if there is more work; there is, so
-                // set the flag and don't actually take this piece of work
-                if (batch.size() == m_batchSize) {
+            }
+            passOverNoLock(taken);
+            if (queue && batch.empty()) {
+                // If the victim still has more, wake up someone else to
+                // steal it too
+                if (stealNoLock(queue, batch, isActive, dontIdle) &&
+                    m_activeThreadCount < threadCount())
                     tickleMe = true;
-                    break;
-                }
-                batch.push_back(*it);
-                it = m_fibers.erase(it);
-                if (!isActive) {
-                    ++m_activeThreadCount;
-                    isActive = true;
-                }
             }
             if (batch.empty() && isActive) {
-                --m_activeThreadCount;
+                atomicDecrement(m_activeThreadCount);
                 isActive = false;
             }
+            // Count ourselves idle while still holding the lock, so anyone
+            // scheduling work after we looked for it knows to wake us up
+            if (batch.empty() && !dontIdle)
+                idling(mailbox);
         }
         if (tickleMe)
-            tickle();
+            wake();
         MORDOR_LOG_DEBUG(g_log) << this
             << " got " << batch.size() << " fiber/dgs to process (max: "
             << m_batchSize << ", active: " << isActive << ")";
@@ -406,22 +1349,32 @@ Scheduler::run()
             std::vector<FiberAndThread>::iterator it;
             for (it = batch.begin(); it != batch.end(); ++it) {
                 Fiber::ptr f = it->fiber;
-                boost::function<void ()> dg = it->dg;
+                if (it->priority != currentPriority())
+                    t_priority = (intptr_t)it->priority - NORMAL;
 
                 try {
                     if (f && f->state() != Fiber::TERM) {
                         MORDOR_LOG_DEBUG(g_log) << this << " running " << f;
                         f->yieldTo();
-                    } else if (dg) {
+                    } else if (it->dg) {
+                        // dgFiber always runs runTask, so reusing it doesn't
+                        // copy the functor into a boost::function
                         if (!dgFiber)
-                            dgFiber.reset(new Fiber(dg));
-                        dgFiber->reset(dg);
-                        MORDOR_LOG_DEBUG(g_log) << this << " running " << dg;
+                            dgFiber.reset(new Fiber(boost::bind(
+                                &Scheduler::runTask, &task)));
+                        task = &it->dg;
+                        // Profile the stack as the functor's, not runTask's
+                        void (* const *function)() =
+                            it->dg.target<void (*)()>();
+                        dgFiber->profileAs(it->dg.target_type(),
+                            function ? *function : NULL);
+                        MORDOR_LOG_DEBUG(g_log) << this << " running "
+                            << it->dg;
                         dgFiber->yieldTo();
                         if (dgFiber->state() != Fiber::TERM)
                             dgFiber.reset();
                         else
-                            dgFiber->reset(NULL);
+                            dgFiber->reset();
                     }
                 } catch (...) {
                     MORDOR_LOG_FATAL(Log::root())
@@ -429,6 +1382,10 @@ Scheduler::run()
                     throw;
                 }
             }
+            // Whatever runs outside of scheduled work (the idle fiber, or
+            // the caller of a hijacking Scheduler) is NORMAL
+            if (t_priority.get() != 0)
+                t_priority = 0;
             continue;
         }
         if (dontIdle)
@@ -436,18 +1393,53 @@ Scheduler::run()
 
         if (idleFiber->state() == Fiber::TERM) {
             MORDOR_LOG_DEBUG(g_log) << this << " idle fiber terminated";
-            if (gettid() == m_rootThread)
+            awake(mailbox);
+            if (gettid() == m_rootThread) {
                 m_callingFiber.reset();
-            // Unblock the next thread
-            if (threadCount() > 1)
-                tickle();
+            } else {
+                releaseMailbox(mailbox);
+                boost::mutex::scoped_lock lock(m_mutex);
+                if (queue)
+                    unregisterQueueNoLock(queue);
+                unregisterMailboxNoLock(mailbox);
+                // Everyone's on their way out; someone may still get to it
+                handOffNoLock(true);
+            }
+            // Unblock the next thread; count the ones still running by their
+            // Mailboxes, since threadCount() doesn't include any that were
+            // told to retire and haven't yet
+            for (Mailbox *other = m_mailboxes; other;
+                other = other->nextMailbox) {
+                if (other != mailbox && other->thread != emptytid()) {
+                    tickle();
+                    break;
+                }
+            }
             return;
         }
+        // Make sure nothing was posted to us before anyone posting could see
+        // that we're idle
+        if (mailbox->pending != 0) {
+            awake(mailbox);
+            continue;
+        }
+        // Work posted to another idle thread may have woken us instead
+        tickleOtherMailboxes(mailbox);
         MORDOR_LOG_DEBUG(g_log) << this << " idling";
         idleFiber->call();
+        awake(mailbox);
     }
 }
 
+void
+Scheduler::runTask(Task **task)
+{
+    // Take a copy onto this Fiber's stack; if it blocks, the batch it came
+    // from will be cleared before it finishes
+    Task dg(**task);
+    dg();
+}
+
 SchedulerSwitcher::SchedulerSwitcher(Scheduler *target)
 {
     m_caller = Scheduler::getThis();
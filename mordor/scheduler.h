@@ -3,12 +3,16 @@
 // Copyright (c) 2009 - Decho Corporation
 
 #include <list>
+#include <string>
+#include <vector>
 
 #include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
 
+#include "task.h"
 #include "thread.h"
 #include "thread_local_storage.h"
 
@@ -31,6 +35,21 @@ class Fiber;
 class Scheduler : public boost::noncopyable
 {
 public:
+    /// Priority classes for scheduled work
+
+    /// Shared work is taken from the most urgent class that has any, except
+    /// that a class passed over scheduler.starvationlimit times in a row
+    /// gets the next turn, so BACKGROUND work still makes progress under
+    /// sustained load.  Thread-targeted work is always taken first by its
+    /// thread, whatever its priority.
+    enum Priority {
+        /// Latency-critical work, such as health checks and small requests
+        CRITICAL,
+        NORMAL,
+        /// Bulk work, such as large transfers
+        BACKGROUND
+    };
+
     /// Default constructor
 
     /// By default, a single-threaded hijacking Scheduler is constructed.
@@ -42,8 +61,13 @@ public:
     /// executing thread
     /// @param batchSize Number of operations to pull off the scheduler queue
     /// on every iteration
+    /// @param workStealing Give each thread its own run queue.  Work scheduled
+    /// from within the Scheduler stays on the thread that scheduled it, and
+    /// threads that run out of work steal from other threads' queues instead
+    /// of all contending on the shared queue
     /// @pre if (useCaller == true) Scheduler::getThis() == NULL
-    Scheduler(size_t threads = 1, bool useCaller = true, size_t batchSize = 1);
+    Scheduler(size_t threads = 1, bool useCaller = true, size_t batchSize = 1,
+        bool workStealing = false);
     /// Destroys the scheduler, implicitly calling stop()
     virtual ~Scheduler();
 
@@ -76,32 +100,65 @@ public:
     /// @param f The Fiber to schedule
     /// @param thread Optionally provide a specific thread for the Fiber to run
     /// on
-    void schedule(boost::shared_ptr<Fiber> fiber, tid_t thread = emptytid());
+    /// @param priority How urgently the Fiber should run
+    void schedule(boost::shared_ptr<Fiber> fiber, tid_t thread = emptytid(),
+        Priority priority = NORMAL);
     /// Schedule a generic functor to be executed on the Scheduler
 
-    /// The functor will be executed on a new Fiber.
+    /// The functor will be executed on a new Fiber.  Functors of up to
+    /// Task::BUFFER_SIZE bytes (which covers most uses of boost::bind) are
+    /// scheduled without allocating any memory; work for a specific thread
+    /// is posted to a fixed-size ring (see scheduler.mailbox.capacity), and
+    /// only when that's full goes through the (growable) shared queue.
     /// @param dg The functor to schedule
     /// @param thread Optionally provide a specific thread for the functor to
     /// run on
-    void schedule(boost::function<void ()> dg, tid_t thread = emptytid());
+    /// @param priority How urgently the functor should run
+    void schedule(const Task &dg, tid_t thread = emptytid(),
+        Priority priority = NORMAL);
+
+    /// A Fiber (or, if fiber is NULL, a functor) to schedule, along with
+    /// the thread it should run on, and how urgently
+    struct FiberAndThread {
+        boost::shared_ptr<Fiber> fiber;
+        Task dg;
+        tid_t thread;
+        Priority priority;
+        /// If thread has retired (see threadCount()) by the time this is
+        /// scheduled, or before it runs, run it on any thread instead;
+        /// otherwise thread has to stay around until it's run it
+        bool anyIfRetired;
+    };
+
+    /// Schedule a batch of work, each item with its own thread and Priority
+
+    /// Like schedule(begin, end), the shared queue is locked only once,
+    /// and at most one idle thread is tickled for all of it.  batch is
+    /// cleared, so it can be refilled without reallocating.  Only here can
+    /// thread-targeted work ask to go elsewhere if its thread is gone (see
+    /// FiberAndThread::anyIfRetired).
+    void schedule(std::vector<FiberAndThread> &batch);
 
     /// Schedule multiple items to be executed at once
 
     /// @param begin The first item to schedule
     /// @param end One past the last item to schedule
+    /// @param priority How urgently the items should run
     template <class InputIterator>
-    void schedule(InputIterator begin, InputIterator end)
+    void schedule(InputIterator begin, InputIterator end,
+        Priority priority = NORMAL)
     {
         bool tickleMe = false;
         {
             boost::mutex::scoped_lock lock(m_mutex);
             while (begin != end) {
-                tickleMe = scheduleNoLock(*begin) || tickleMe;
+                tickleMe = scheduleNoLock(*begin, emptytid(), priority) ||
+                    tickleMe;
                 ++begin;
             }
         }
         if (tickleMe && Scheduler::getThis() != this)
-            tickle();
+            wake();
     }
 
     /// Change the currently executing Fiber to be running on this Scheduler
@@ -130,6 +187,11 @@ public:
     /// @pre Scheduler::getThis() != NULL
     static void yield();
 
+    /// @return The Priority the currently executing work was scheduled with
+    /// (NORMAL if it wasn't started by a Scheduler).  yield(), switchTo(),
+    /// and IOManager events registered by this work keep this Priority.
+    static Priority currentPriority();
+
     /// Force a hijacking Scheduler to process scheduled work
 
     /// Calls yieldTo(), and yields back to the currently executing Fiber
@@ -143,6 +205,39 @@ public:
     }
     /// Change the number of threads in this scheduler
     void threadCount(size_t threads);
+    /// The hijacked thread (if any) and the spawned threads, numbered as in
+    /// affinity()
+    std::vector<tid_t> threadIds();
+
+    /// Let this Scheduler choose its own threadCount()
+
+    /// A controller thread samples the Scheduler every
+    /// scheduler.elastic.interval microseconds.  If every thread is busy and
+    /// work is waiting, or a probe functor it schedules waits longer than
+    /// scheduler.elastic.latency microseconds to start, it adds a thread.
+    /// After scheduler.elastic.linger samples in a row with a thread to
+    /// spare, it retires one.  The controller runs until stop().
+    /// @param minThreads The fewest threads to run (including the hijacked
+    /// thread, if any)
+    /// @param maxThreads The most threads to run
+    /// @pre 1 <= minThreads <= maxThreads
+    /// @pre This Scheduler is not driven by dispatch()
+    void elastic(size_t minThreads, size_t maxThreads);
+
+    /// Pin this Scheduler's threads to CPUs
+
+    /// The hijacked thread (if any) is thread 0, and spawned threads are
+    /// numbered after it in the order they were started; thread i is pinned
+    /// to cpus[i % cpus.size()].  Running threads are woken up to apply the
+    /// change; threads started later apply it as they start.  Memory first
+    /// touched by a pinned thread (fiber stacks, Buffer segments) is then
+    /// allocated on its NUMA node by the kernel's default policy.
+    /// @param cpus The CPU for each thread, or empty to unpin them (back to
+    /// the CPUs the process was allowed when it started)
+    void affinity(const std::vector<int> &cpus);
+    /// Name this Scheduler's spawned threads "<name>-<i>", with i numbered as
+    /// in affinity(); the hijacked thread keeps its name
+    void name(const std::string &name);
 
 protected:
     /// Derived classes can query stopping() to see if the Scheduler is trying
@@ -163,36 +258,209 @@ protected:
     /// The Scheduler wants to force the idle fiber to Fiber::yield(), because
     /// new work has been scheduled.
     virtual void tickle() = 0;
+    /// tickle(), aimed at thread in particular, for work posted to its
+    /// Mailbox; by default any idle thread is tickled
+    virtual void tickleThread(tid_t thread) { tickle(); }
+
+    /// tickle(), but only if some thread is idle, and no other tickle() is
+    /// already on its way to one of them (the thread it wakes up will pass
+    /// it on if there's more work than it can take)
+    void wake();
+    /// Derived classes that wait for tickle() anywhere but the idle Fiber
+    /// (such as a message pump run as scheduled work) must call
+    /// sleeping(true) before checking hasWorkToDo() and waiting, and
+    /// sleeping(false) after, or wake() won't tickle them
+    void sleeping(bool asleep);
+    /// How long (in microseconds) idle() should poll for new work before
+    /// blocking (scheduler.spin); waking up a blocked thread takes much
+    /// longer than noticing work while spinning
+    static unsigned long long spinTime();
 
     bool hasWorkToDo();
 
+private:
+    /// Circular buffer of FiberAndThreads
+
+    /// It grows (by doubling) as needed, but never shrinks, so once it has
+    /// reached its working size pushing and popping don't allocate.
+    class FiberQueue
+    {
+    public:
+        FiberQueue() : m_head(0), m_size(0) {}
+
+        bool empty() const { return m_size == 0; }
+        size_t size() const { return m_size; }
+        FiberAndThread &operator[](size_t index)
+        { return m_items[(m_head + index) & (m_items.size() - 1)]; }
+        FiberAndThread &front() { return (*this)[0]; }
+
+        void push_back(const FiberAndThread &ft);
+        void pop_front();
+        /// Remove the item at index, keeping the rest in order
+        void erase(size_t index);
+        void clear();
+
+    private:
+        static void release(FiberAndThread &ft);
+
+    private:
+        std::vector<FiberAndThread> m_items;
+        size_t m_head, m_size;
+    };
+
+    static const size_t PRIORITIES = BACKGROUND + 1;
+
+    /// Run queue owned by a single thread when work stealing is enabled
+
+    /// The owning thread pushes to the back and pops from the front (so
+    /// yield() stays fair); other threads steal from the back.
+    struct ThreadQueue {
+        tid_t thread;
+        boost::mutex mutex;
+        FiberQueue fibers;
+    };
+
+    /// Inbox for work targeted at a single thread
+
+    /// Any thread may post to a Mailbox without taking a lock (it's a
+    /// bounded multiple-producer, single-consumer ring of
+    /// scheduler.mailbox.capacity slots); only the owning thread takes work
+    /// out of it.  Neither allocates; when it's full post() fails, and the
+    /// work goes to the shared queue (still targeted) instead.  Mailboxes are
+    /// never freed while the Scheduler is alive; when a thread exits its
+    /// Mailbox is released (thread is set back to emptytid()) and can be
+    /// claimed by a new thread.
+    struct Mailbox : boost::noncopyable {
+        /// A place in the ring
+        struct Slot {
+            /// The position a producer may fill this Slot for; one more
+            /// once it has been filled (and until the owner takes it)
+            volatile size_t sequence;
+            FiberAndThread ft;
+        };
+
+        /// @param capacity Rounded up to a power of two
+        Mailbox(size_t capacity);
+
+        /// @return false if the Mailbox is full
+        bool push(const FiberAndThread &ft);
+        /// @return false if the Mailbox is empty, or a producer is in the
+        /// middle of posting the next item
+        bool pop(FiberAndThread &ft);
+
+        volatile tid_t thread;
+        /// Number of threads currently trying to post to this Mailbox
+        volatile size_t producers;
+        /// Number of items posted and not yet taken by the owner (including
+        /// those in deferred)
+        volatile size_t pending;
+        /// The owner is (about to be) in its idle fiber, and counted in
+        /// m_idleThreadCount
+        volatile bool idle;
+        std::vector<Slot> slots;
+        /// The next position to post to
+        volatile size_t head;
+        /// The next position to take from; owner only
+        size_t tail;
+        /// Fibers that were still executing when popped; owner only
+        FiberQueue deferred;
+        Mailbox *nextMailbox;
+    };
+
 private:
     void yieldTo(bool yieldToCallerOnTerminate);
     void run();
+    static void runTask(Task **task);
 
     bool scheduleNoLock(boost::shared_ptr<Fiber> fiber,
-        tid_t thread = emptytid());
-    bool scheduleNoLock(boost::function<void ()> dg,
-        tid_t thread = emptytid());
+        tid_t thread = emptytid(), Priority priority = NORMAL);
+    bool scheduleNoLock(const Task &dg, tid_t thread = emptytid(),
+        Priority priority = NORMAL);
+    bool pushNoLock(const FiberAndThread &ft);
+    /// Not thread-targeted, or this Scheduler runs thread
+    bool ownsThreadNoLock(tid_t thread) const;
+    /// Hand work queued for this (exiting) thread to any thread, if it may
+    /// go (or all, if all); returns if there's any left that may not
+    bool handOffNoLock(bool all);
+    bool fibersEmptyNoLock() const;
+    void laneOrderNoLock(size_t order[PRIORITIES]) const;
+    void passOverNoLock(const size_t taken[PRIORITIES]);
+
+    ThreadQueue *localQueue(tid_t thread, Priority priority);
+    void scheduleLocal(ThreadQueue *queue, const FiberAndThread &ft);
+    ThreadQueue *registerQueue();
+    void unregisterQueueNoLock(ThreadQueue *queue);
+    bool popLocal(ThreadQueue *queue, std::vector<FiberAndThread> &batch,
+        bool &isActive);
+    bool stealNoLock(ThreadQueue *queue, std::vector<FiberAndThread> &batch,
+        bool &isActive, bool &dontIdle);
+    bool queuesEmptyNoLock();
+
+    bool post(const FiberAndThread &ft);
+    Mailbox *registerMailbox();
+    /// Stop anyone from posting to this thread's mailbox, and wait for
+    /// anyone in the middle of it (without the lock)
+    void releaseMailbox(Mailbox *mailbox);
+    /// Move whatever was left in a released mailbox to the shared queue
+    void unregisterMailboxNoLock(Mailbox *mailbox);
+    void drainMailbox(Mailbox *mailbox, std::vector<FiberAndThread> &batch,
+        bool &isActive, bool &dontIdle);
+    bool mailboxesEmpty();
+    void tickleOtherMailboxes(Mailbox *mailbox);
+    void idling(Mailbox *mailbox);
+    void awake(Mailbox *mailbox);
+
+    void applyThreadSettings(size_t &version);
+
+    void controlThreadCount();
+    void probe(unsigned long long scheduled);
+    void stopController();
+    size_t queuedNoLock();
 
 private:
-    struct FiberAndThread {
-        boost::shared_ptr<Fiber> fiber;
-        boost::function<void ()> dg;
-        tid_t thread;
-    };
     static ThreadLocalStorage<Scheduler *> t_scheduler;
     static ThreadLocalStorage<Fiber *> t_fiber;
+    static ThreadLocalStorage<ThreadQueue *> t_queue;
+    static ThreadLocalStorage<intptr_t> t_priority;
     boost::mutex m_mutex;
-    std::list<FiberAndThread> m_fibers;
+    /// Shared work, one list per Priority
+    FiberQueue m_fibers[PRIORITIES];
+    /// How many scheduling passes in a row each non-empty Priority has
+    /// been passed over
+    size_t m_passedOver[PRIORITIES];
+    /// Number of CRITICAL items in m_fibers; threads check the shared queue
+    /// before their own when this is non-zero
+    volatile size_t m_critical;
     tid_t m_rootThread;
     boost::shared_ptr<Fiber> m_rootFiber;
     boost::shared_ptr<Fiber> m_callingFiber;
     std::vector<boost::shared_ptr<Thread> > m_threads;
-    size_t m_threadCount, m_activeThreadCount;
+    size_t m_threadCount;
+    volatile size_t m_activeThreadCount;
+    /// Number of threads that need a tickle() to notice new work
+    volatile size_t m_idleThreadCount;
+    /// A tickle() has been sent since a thread last woke up
+    volatile size_t m_tickled;
     bool m_stopping;
     bool m_autoStop;
     size_t m_batchSize;
+    bool m_workStealing;
+    std::vector<boost::shared_ptr<ThreadQueue> > m_queues;
+    size_t m_nextVictim;
+    Mailbox * volatile m_mailboxes;
+    std::vector<int> m_cpus;
+    /// affinity() has been called
+    bool m_affinity;
+    std::string m_name;
+    volatile size_t m_settingsVersion;
+    boost::shared_ptr<Thread> m_controller;
+    boost::mutex m_controllerMutex;
+    boost::condition_variable m_controllerCondition;
+    bool m_controllerStopping;
+    size_t m_minThreads, m_maxThreads;
+    /// When the outstanding probe was scheduled (0 if there isn't one)
+    unsigned long long m_probeScheduled;
+    unsigned long long m_probeLatency;
 };
 
 /// Automatic Scheduler switcher
@@ -106,6 +106,56 @@ Semaphore::wait()
 #endif
 }
 
+bool
+Semaphore::tryWait()
+{
+#ifdef WINDOWS
+    DWORD dwRet = WaitForSingleObject(m_semaphore, 0);
+    if (dwRet == WAIT_TIMEOUT)
+        return false;
+    if (dwRet != WAIT_OBJECT_0) {
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("WaitForSingleObject");
+    }
+    return true;
+#elif defined(OSX)
+    mach_timespec_t timeout = { 0, 0 };
+    while (true) {
+        kern_return_t rc = semaphore_timedwait(m_semaphore, timeout);
+        if (!rc)
+            return true;
+        if (rc == KERN_OPERATION_TIMED_OUT)
+            return false;
+        if (rc != KERN_ABORTED) {
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("semaphore_timedwait");
+        }
+    }
+#elif defined(FREEBSD)
+    sembuf op;
+    op.sem_num = 0;
+    op.sem_op = -1;
+    op.sem_flg = IPC_NOWAIT;
+    while (true) {
+        if (!semop(m_semaphore, &op, 1))
+            return true;
+        if (errno == EAGAIN)
+            return false;
+        if (errno != EINTR) {
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("semop");
+        }
+    }
+#else
+    while (true) {
+        if (!sem_trywait(&m_semaphore))
+            return true;
+        if (errno == EAGAIN)
+            return false;
+        if (errno != EINTR) {
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("sem_trywait");
+        }
+    }
+#endif
+}
+
 void
 Semaphore::notify()
 {
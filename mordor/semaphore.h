@@ -24,6 +24,8 @@ public:
     ~Semaphore();
 
     void wait();
+    /// @return If the Semaphore could be decremented without blocking
+    bool tryWait();
 
     void notify();
 
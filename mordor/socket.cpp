@@ -5,8 +5,10 @@
 #include <boost/bind.hpp>
 
 #include "assert.h"
+#include "config.h"
 #include "fiber.h"
 #include "iomanager.h"
+#include "statistics.h"
 #include "string.h"
 #include "version.h"
 
@@ -26,6 +28,21 @@
 #define closesocket close
 #endif
 
+#ifdef LINUX
+#include <netinet/udp.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#endif
+
+#if defined(LINUX) && defined(SO_ZEROCOPY) && !defined(IOURING)
+#include <linux/errqueue.h>
+#define ZEROCOPY
+#endif
+
+#if defined(LINUX) && defined(SOCK_NONBLOCK)
+#define ACCEPT4
+#endif
+
 namespace Mordor {
 
 namespace {
@@ -150,6 +167,24 @@ static struct Initializer {
 #endif
 
 static Logger::ptr g_log = Log::lookup("mordor:socket");
+
+#ifdef ZEROCOPY
+static ConfigVar<unsigned long long>::ptr g_zeroCopyInterval =
+    Config::lookup<unsigned long long>("socket.zerocopy.interval", 1000ull,
+    "How often (in microseconds) to collect zero-copy send completions for "
+    "sockets that aren't otherwise being used");
+
+static CountStatistic<unsigned long long> &g_statZeroCopySends =
+    Statistics::registerStatistic("socket.zerocopy.sends",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statZeroCopyCopied =
+    Statistics::registerStatistic("socket.zerocopy.copied",
+    CountStatistic<unsigned long long>());
+#endif
+
+static ConfigVar<size_t>::ptr g_acceptBatch =
+    Config::lookup<size_t>("socket.accept.batch", 64u,
+    "Most connections acceptOnEachThread() accepts at once");
 static int g_iosPortIndex;
 
 namespace {
@@ -161,6 +196,34 @@ static struct IOSInitializer {
 } g_iosInit;
 }
 
+#if defined(LINUX) && !defined(IOURING) && defined(SO_BUSY_POLL)
+// Best effort; raising it past net.core.busy_read needs CAP_NET_ADMIN
+static void busyPoll(IOManager &ioManager, socket_t sock)
+{
+    int us = ioManager.busyPollSocket();
+    if (us == 0)
+        return;
+    int rc = setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(int));
+    MORDOR_LOG_LEVEL(g_log, rc ? Log::WARNING : Log::DEBUG) << "setsockopt("
+        << sock << ", SOL_SOCKET, SO_BUSY_POLL, " << us << "): " << rc
+        << " (" << lastError() << ")";
+}
+#endif
+
+#ifndef WINDOWS
+// accept4() makes the new socket non-blocking (and close-on-exec) in the
+// same system call; elsewhere the caller has to fcntl() it
+static int acceptWithFlags(int sock, bool nonBlocking)
+{
+#ifdef ACCEPT4
+    return accept4(sock, NULL, NULL,
+        SOCK_CLOEXEC | (nonBlocking ? SOCK_NONBLOCK : 0));
+#else
+    return ::accept(sock, NULL, NULL);
+#endif
+}
+#endif
+
 Socket::Socket(IOManager *ioManager, int family, int type, int protocol, int initialize)
 : m_sock(-1),
   m_family(family),
@@ -175,7 +238,10 @@ Socket::Socket(IOManager *ioManager, int family, int type, int protocol, int ini
   m_scheduler(NULL),
 #endif
   m_isConnected(false),
-  m_isRegisteredForRemoteClose(false)
+  m_isRegisteredForRemoteClose(false),
+  m_zeroCopyFirst(0),
+  m_zeroCopySent(0),
+  m_zeroCopyThreshold(~0)
 {
 #ifdef WINDOWS
     if (pAcceptEx && m_ioManager) {
@@ -196,7 +262,10 @@ Socket::Socket(int family, int type, int protocol)
   m_protocol(protocol),
   m_ioManager(NULL),
   m_isConnected(false),
-  m_isRegisteredForRemoteClose(false)
+  m_isRegisteredForRemoteClose(false),
+  m_zeroCopyFirst(0),
+  m_zeroCopySent(0),
+  m_zeroCopyThreshold(~0)
 {
     m_sock = socket(family, type, protocol);
     MORDOR_LOG_DEBUG(g_log) << this << " socket(" << (Family)family << ", "
@@ -227,7 +296,10 @@ Socket::Socket(IOManager &ioManager, int family, int type, int protocol)
   m_scheduler(NULL),
 #endif
   m_isConnected(false),
-  m_isRegisteredForRemoteClose(false)
+  m_isRegisteredForRemoteClose(false),
+  m_zeroCopyFirst(0),
+  m_zeroCopySent(0),
+  m_zeroCopyThreshold(~0)
 {
     m_sock = socket(family, type, protocol);
     MORDOR_LOG_DEBUG(g_log) << this << " socket(" << (Family)family << ", "
@@ -251,6 +323,19 @@ Socket::Socket(IOManager &ioManager, int family, int type, int protocol)
         ::closesocket(m_sock);
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fcntl");
     }
+#if defined(LINUX) && !defined(IOURING)
+#ifdef SO_BUSY_POLL
+    busyPoll(*m_ioManager, m_sock);
+#endif
+    if (m_ioManager->persistent()) {
+        try {
+            m_ioManager->registerFd(m_sock);
+        } catch (...) {
+            ::closesocket(m_sock);
+            throw;
+        }
+    }
+#endif
 #endif
 #ifdef OSX
     unsigned int opt = 1;
@@ -263,6 +348,21 @@ Socket::Socket(IOManager &ioManager, int family, int type, int protocol)
 
 Socket::~Socket()
 {
+#ifdef ZEROCOPY
+    if (m_zeroCopyTimer)
+        m_zeroCopyTimer->cancel();
+    if (m_zeroCopyFirst != m_zeroCopySent) {
+        reapZeroCopy();
+        if (m_zeroCopyFirst != m_zeroCopySent) {
+            MORDOR_LOG_WARNING(g_log) << this << " "
+                << m_zeroCopySent - m_zeroCopyFirst
+                << " zero-copy sends outstanding at close";
+            for (size_t i = 0; i < m_zeroCopySent - m_zeroCopyFirst; ++i)
+                if (m_zeroCopyPending[i].second)
+                    m_zeroCopyPending[i].second();
+        }
+    }
+#endif
 #ifdef WINDOWS
     if (m_ioManager && m_hEvent) {
         if (m_isRegisteredForRemoteClose) {
@@ -274,6 +374,10 @@ Socket::~Socket()
 #else
     if (m_isRegisteredForRemoteClose)
         m_ioManager->unregisterEvent(m_sock, IOManager::CLOSE);
+#if defined(LINUX) && !defined(IOURING)
+    if (m_ioManager && m_sock != -1 && m_ioManager->persistent())
+        m_ioManager->unregisterFd(m_sock);
+#endif
 #endif
     if (m_sock != -1) {
         int rc = ::closesocket(m_sock);
@@ -469,6 +573,39 @@ suckylsp:
                 MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("connect");
             }
         }
+#elif defined(IOURING)
+        io_uring_sqe *sqe = &m_sendEvent.prepare(IORING_OP_CONNECT, m_sock);
+        sqe->addr = (__u64)(uintptr_t)to.name();
+        sqe->off = to.nameLen();
+        Timer::ptr timeout;
+        if (m_sendTimeout != ~0ull)
+            timeout = m_ioManager->registerTimer(m_sendTimeout, boost::bind(
+                &Socket::cancelIo, this, IOManager::WRITE,
+                boost::ref(m_cancelledSend), ETIMEDOUT));
+        int rc = m_cancelledSend ? -m_cancelledSend :
+            m_ioManager->perform(m_sendEvent);
+        if (rc == -EINPROGRESS) {
+            sqe = &m_sendEvent.prepare(IORING_OP_POLL_ADD, m_sock);
+            sqe->poll32_events = POLLOUT;
+            rc = m_cancelledSend ? -m_cancelledSend :
+                m_ioManager->perform(m_sendEvent);
+            if (rc >= 0) {
+                int err;
+                size_t size = sizeof(int);
+                getOption(SOL_SOCKET, SO_ERROR, &err, &size);
+                rc = -err;
+            }
+        }
+        if (timeout)
+            timeout->cancel();
+        if (rc < 0) {
+            error_t error = m_cancelledSend ? m_cancelledSend : -rc;
+            MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
+                << "): (" << error << ")";
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "connect");
+        }
+        MORDOR_LOG_INFO(g_log) << this << " connect(" << m_sock << ", " << to
+            << ")";
 #else
         if (!::connect(m_sock, to.name(), to.nameLen())) {
             MORDOR_LOG_INFO(g_log) << this << " connect(" << m_sock << ", " << to
@@ -555,7 +692,11 @@ Socket::accept(Socket &target)
     MORDOR_ASSERT(target.m_family == m_family);
     MORDOR_ASSERT(target.m_protocol == m_protocol);
     if (!m_ioManager) {
+#ifdef WINDOWS
         socket_t newsock = ::accept(m_sock, NULL, NULL);
+#else
+        socket_t newsock = acceptWithFlags(m_sock, false);
+#endif
         MORDOR_LOG_LEVEL(g_log, newsock == -1 ? Log::ERROR : Log::INFO)
             << this << " accept(" << m_sock << "): " << newsock << " ("
             << lastError() << ")";
@@ -702,43 +843,29 @@ suckylsp:
                     FILE_SKIP_COMPLETION_PORT_ON_SUCCESS |
                     FILE_SKIP_SET_EVENT_ON_HANDLE);
         }
-#else
-        int newsock = ::accept(m_sock, NULL, NULL);
-        while (newsock == -1 && errno == EAGAIN) {
-            m_ioManager->registerEvent(m_sock, IOManager::READ);
-            if (m_cancelledReceive) {
-                MORDOR_LOG_ERROR(g_log) << this << " accept(" << m_sock << "): ("
-                    << m_cancelledReceive << ")";
-                m_ioManager->cancelEvent(m_sock, IOManager::READ);
-                Scheduler::yieldTo();
-                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledReceive, "accept");
-            }
-            Timer::ptr timeout;
-            if (m_receiveTimeout != ~0ull)
-                timeout = m_ioManager->registerTimer(m_receiveTimeout, boost::bind(
-                    &Socket::cancelIo, this, IOManager::READ,
-                    boost::ref(m_cancelledReceive), ETIMEDOUT));
-            Scheduler::yieldTo();
-            if (timeout)
-                timeout->cancel();
-            if (m_cancelledReceive) {
-                MORDOR_LOG_ERROR(g_log) << this << " accept(" << m_sock
-                    << "): (" << m_cancelledReceive << ")";
-                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledReceive, "accept");
-            }
-            newsock = ::accept(m_sock, NULL, NULL);
-        }
-        MORDOR_LOG_LEVEL(g_log, newsock == -1 ? Log::ERROR : Log::INFO)
-            << this << " accept(" << m_sock << "): " << newsock
-            << " (" << lastError() << ")";
-        if (newsock == -1) {
-            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("accept");
-        }
-        if (fcntl(newsock, F_SETFL, O_NONBLOCK) == -1) {
-            ::close(newsock);
-            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fcntl");
+#elif defined(IOURING)
+        io_uring_sqe &sqe = m_receiveEvent.prepare(IORING_OP_ACCEPT, m_sock);
+        sqe.accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        Timer::ptr timeout;
+        if (m_receiveTimeout != ~0ull)
+            timeout = m_ioManager->registerTimer(m_receiveTimeout, boost::bind(
+                &Socket::cancelIo, this, IOManager::READ,
+                boost::ref(m_cancelledReceive), ETIMEDOUT));
+        int newsock = m_cancelledReceive ? -m_cancelledReceive :
+            m_ioManager->perform(m_receiveEvent);
+        if (timeout)
+            timeout->cancel();
+        if (newsock < 0) {
+            error_t error = m_cancelledReceive ? m_cancelledReceive : -newsock;
+            MORDOR_LOG_ERROR(g_log) << this << " accept(" << m_sock << "): ("
+                << error << ")";
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "accept");
         }
+        MORDOR_LOG_INFO(g_log) << this << " accept(" << m_sock << "): "
+            << newsock;
         target.m_sock = newsock;
+#else
+        target.accepted(acceptNonBlocking(true));
 #endif
         target.m_isConnected = true;
         if (!target.m_onRemoteClose.empty())
@@ -746,6 +873,92 @@ suckylsp:
     }
 }
 
+size_t
+Socket::acceptBatch(Socket::ptr *sockets, size_t count)
+{
+    MORDOR_ASSERT(count > 0);
+#if !defined(WINDOWS) && !defined(IOURING)
+    if (m_ioManager) {
+        int sockType = type();
+        size_t accepted = 0;
+        while (accepted < count) {
+            socket_t newsock;
+            try {
+                newsock = acceptNonBlocking(accepted == 0);
+            } catch (NativeException &) {
+                // Whatever it was will happen again (if it's still a
+                // problem) on the next call; don't lose what's been accepted
+                if (accepted == 0)
+                    throw;
+                break;
+            }
+            if (newsock == -1)
+                break;
+            Socket::ptr sock(new Socket(m_ioManager, m_family, sockType,
+                m_protocol, 0));
+            sock->accepted(newsock);
+            sock->m_isConnected = true;
+            sockets[accepted++] = sock;
+        }
+        return accepted;
+    }
+#endif
+    sockets[0] = accept();
+    return 1;
+}
+
+#if !defined(WINDOWS) && !defined(IOURING)
+socket_t
+Socket::acceptNonBlocking(bool wait)
+{
+    int newsock = acceptWithFlags(m_sock, true);
+    while (newsock == -1 && errno == EAGAIN) {
+        if (!wait)
+            return -1;
+        if (m_cancelledReceive) {
+            MORDOR_LOG_ERROR(g_log) << this << " accept(" << m_sock << "): ("
+                << m_cancelledReceive << ")";
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledReceive, "accept");
+        }
+        waitForIo(false, "accept");
+        newsock = acceptWithFlags(m_sock, true);
+    }
+    MORDOR_LOG_LEVEL(g_log, newsock == -1 ? Log::ERROR : Log::INFO)
+        << this << " accept(" << m_sock << "): " << newsock
+        << " (" << lastError() << ")";
+    if (newsock == -1) {
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("accept");
+    }
+#ifndef ACCEPT4
+    if (fcntl(newsock, F_SETFL, O_NONBLOCK) == -1) {
+        ::close(newsock);
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fcntl");
+    }
+#endif
+    return newsock;
+}
+
+void
+Socket::accepted(socket_t sock)
+{
+#ifdef LINUX
+#ifdef SO_BUSY_POLL
+    if (m_ioManager)
+        busyPoll(*m_ioManager, sock);
+#endif
+    if (m_ioManager && m_ioManager->persistent()) {
+        try {
+            m_ioManager->registerFd(sock);
+        } catch (...) {
+            ::close(sock);
+            throw;
+        }
+    }
+#endif
+    m_sock = sock;
+}
+#endif
+
 void
 Socket::shutdown(int how)
 {
@@ -802,11 +1015,18 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
 #endif
     error_t &cancelled = isSend ? m_cancelledSend : m_cancelledReceive;
     unsigned long long &timeout = isSend ? m_sendTimeout : m_receiveTimeout;
+    // Armed while blocked, instead of registering (and cancelling) a Timer
+    // for every operation
+    boost::scoped_ptr<Deadline> &deadline = isSend ? m_sendDeadline :
+        m_receiveDeadline;
 
 #ifdef WINDOWS
     DWORD bufferCount = (DWORD)std::min<size_t>(length, 0xffffffff);
     AsyncEvent &event = isSend ? m_sendEvent : m_receiveEvent;
     OVERLAPPED *overlapped = m_ioManager ? &event.overlapped : NULL;
+    if (m_ioManager && timeout != ~0ull && !deadline)
+        deadline.reset(new Deadline(*m_ioManager, boost::bind(
+            &IOManager::cancelEvent, m_ioManager, (HANDLE)m_sock, &event)));
 
     if (m_ioManager) {
         if (cancelled) {
@@ -867,14 +1087,11 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
         if (m_skipCompletionPortOnSuccess && result == 0) {
             m_ioManager->unregisterEvent(&event);
         } else {
-            Timer::ptr timer;
-            if (timeout != ~0ull)
-                timer = m_ioManager->registerTimer(timeout, boost::bind(
-                    &IOManager::cancelEvent, m_ioManager, (HANDLE)m_sock,
-                    &event));
+            if (deadline && timeout != ~0ull)
+                deadline->arm(timeout);
             Scheduler::yieldTo();
-            if (timer)
-                timer->cancel();
+            if (deadline)
+                deadline->disarm();
         }
         DWORD error = pRtlNtStatusToDosError(
             (NTSTATUS)event.overlapped.Internal);
@@ -906,22 +1123,39 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
             MORDOR_SOCKET_LOG(-1, cancelled);
             MORDOR_THROW_EXCEPTION_FROM_ERROR_API(cancelled, api);
         }
+        if (timeout != ~0ull && !deadline)
+            deadline.reset(new Deadline(*m_ioManager, boost::bind(
+                &Socket::cancelIo, this, event, boost::ref(cancelled),
+                ETIMEDOUT)));
     }
+#ifdef IOURING
+    if (m_ioManager) {
+        IOManager::AsyncEvent &asyncEvent = isSend ? m_sendEvent :
+            m_receiveEvent;
+        io_uring_sqe &sqe = asyncEvent.prepare(
+            isSend ? IORING_OP_SENDMSG : IORING_OP_RECVMSG, m_sock);
+        sqe.addr = (__u64)(uintptr_t)&msg;
+        sqe.len = 1;
+        sqe.msg_flags = flags;
+        if (deadline && timeout != ~0ull)
+            deadline->arm(timeout);
+        int rc = cancelled ? -cancelled : m_ioManager->perform(asyncEvent);
+        if (deadline)
+            deadline->disarm();
+        if (rc < 0) {
+            error_t error = cancelled ? cancelled : -rc;
+            MORDOR_SOCKET_LOG(-1, error);
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, api);
+        }
+        MORDOR_SOCKET_LOG(rc, 0);
+        if (!isSend)
+            flags = msg.msg_flags;
+        return rc;
+    }
+#endif
     int rc = isSend ? sendmsg(m_sock, &msg, flags) : recvmsg(m_sock, &msg, flags);
     while (m_ioManager && rc == -1 && errno == EAGAIN) {
-        m_ioManager->registerEvent(m_sock, event);
-        Timer::ptr timer;
-        if (timeout != ~0ull)
-            timer = m_ioManager->registerTimer(timeout, boost::bind(
-                &Socket::cancelIo, this, event, boost::ref(cancelled),
-                ETIMEDOUT));
-        Scheduler::yieldTo();
-        if (timer)
-            timer->cancel();
-        if (cancelled) {
-            MORDOR_SOCKET_LOG(-1, cancelled);
-            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(cancelled, api);
-        }
+        waitForIo(isSend, api);
         rc = isSend ? sendmsg(m_sock, &msg, flags) : recvmsg(m_sock, &msg, flags);
     }
     MORDOR_SOCKET_LOG(rc, lastError());
@@ -933,6 +1167,39 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
 #endif
 }
 
+#ifndef WINDOWS
+void
+Socket::waitForIo(bool isSend, const char *api)
+{
+    IOManager::Event event = isSend ? IOManager::WRITE : IOManager::READ;
+    error_t &cancelled = isSend ? m_cancelledSend : m_cancelledReceive;
+    unsigned long long &timeout = isSend ? m_sendTimeout : m_receiveTimeout;
+    boost::scoped_ptr<Deadline> &deadline = isSend ? m_sendDeadline :
+        m_receiveDeadline;
+    if (timeout != ~0ull && !deadline)
+        deadline.reset(new Deadline(*m_ioManager, boost::bind(
+            &Socket::cancelIo, this, event, boost::ref(cancelled),
+            ETIMEDOUT)));
+    m_ioManager->registerEvent(m_sock, event);
+    if (deadline && timeout != ~0ull)
+        deadline->arm(timeout);
+    Scheduler::yieldTo();
+    if (deadline)
+        deadline->disarm();
+#ifdef ZEROCOPY
+    // Zero-copy completions on the error queue wake both directions;
+    // collect them, or they'd keep doing so
+    if (m_zeroCopyFirst != m_zeroCopySent)
+        reapZeroCopy();
+#endif
+    if (cancelled) {
+        MORDOR_LOG_ERROR(g_log) << this << " " << api << "(" << m_sock
+            << "): (" << cancelled << ")";
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(cancelled, api);
+    }
+}
+#endif
+
 size_t
 Socket::send(const void *buffer, size_t length, int flags)
 {
@@ -964,6 +1231,401 @@ Socket::sendTo(const iovec *buffers, size_t length, int flags,
     return doIO<true>((iovec *)buffers, length, flags, (Address *)&to);
 }
 
+bool
+Socket::zeroCopy(size_t threshold)
+{
+    MORDOR_ASSERT(m_ioManager);
+#ifdef ZEROCOPY
+    int opt = 1;
+    int rc = setsockopt(m_sock, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(int));
+    MORDOR_LOG_LEVEL(g_log, rc ? Log::WARNING : Log::DEBUG) << this
+        << " setsockopt(" << m_sock << ", SOL_SOCKET, SO_ZEROCOPY, 1): " << rc
+        << " (" << lastError() << ")";
+    if (rc)
+        return false;
+    m_zeroCopyThreshold = threshold;
+    return true;
+#else
+    return false;
+#endif
+}
+
+size_t
+Socket::sendZeroCopy(const iovec *buffers, size_t length,
+    boost::function<void ()> release, int flags)
+{
+#ifdef ZEROCOPY
+    size_t total = 0;
+    for (size_t i = 0; i < length && total < m_zeroCopyThreshold; ++i)
+        total += buffers[i].iov_len;
+    if (total >= m_zeroCopyThreshold) {
+        // Make room in the kernel's accounting before adding to it
+        if (m_zeroCopyFirst != m_zeroCopySent)
+            reapZeroCopy();
+        int zeroCopyFlags = flags | MSG_ZEROCOPY;
+        size_t result;
+        try {
+            result = doIO<true>((iovec *)buffers, length, zeroCopyFlags);
+        } catch (boost::exception &ex) {
+            // Out of optmem to track the pinned pages
+            const int *error = boost::get_error_info<errinfo_nativeerror>(ex);
+            if (!error || *error != ENOBUFS)
+                throw;
+            result = doIO<true>((iovec *)buffers, length, flags);
+            if (release)
+                release();
+            return result;
+        }
+        g_statZeroCopySends.increment();
+        boost::mutex::scoped_lock lock(m_zeroCopyMutex);
+        size_t index = m_zeroCopySent++ - m_zeroCopyFirst;
+        // A completion may already have been collected for it
+        if (index >= m_zeroCopyPending.size())
+            m_zeroCopyPending.resize(index + 1);
+        m_zeroCopyPending[index].second = release;
+        if (m_zeroCopyPending[index].first) {
+            lock.unlock();
+            reapZeroCopy();
+        } else if (!m_zeroCopyTimer) {
+            Socket::weak_ptr self;
+            try {
+                self = shared_from_this();
+            } catch (boost::bad_weak_ptr &) {
+                // Not owned by a shared_ptr; only collected by later I/O
+                return result;
+            }
+            m_zeroCopyTimer = m_ioManager->registerTimer(
+                g_zeroCopyInterval->val(),
+                boost::bind(&Socket::onZeroCopyTimer, self), true);
+        }
+        return result;
+    }
+#endif
+    size_t result = doIO<true>((iovec *)buffers, length, flags);
+    if (release)
+        release();
+    return result;
+}
+
+#ifdef LINUX
+namespace {
+/// sendfile() has no MSG_NOSIGNAL; hold SIGPIPE off for this thread, for
+/// just the one call, and discard one it raised
+struct SigPipeBlocker
+{
+    SigPipeBlocker()
+    {
+        sigemptyset(&sigPipe);
+        sigaddset(&sigPipe, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &sigPipe, &previous);
+        // Only a thread that already had it blocked can have one pending
+        wasPending = false;
+        if (sigismember(&previous, SIGPIPE) == 1) {
+            sigset_t pending;
+            sigpending(&pending);
+            wasPending = sigismember(&pending, SIGPIPE) == 1;
+        }
+    }
+
+    /// @param raised If the call failed with EPIPE (and so raised SIGPIPE)
+    void restore(bool raised)
+    {
+        if (raised && !wasPending) {
+            sigset_t pending;
+            sigpending(&pending);
+            if (sigismember(&pending, SIGPIPE) == 1) {
+                timespec zero = { 0, 0 };
+                sigtimedwait(&sigPipe, NULL, &zero);
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    }
+
+    sigset_t sigPipe, previous;
+    bool wasPending;
+};
+}
+
+static ssize_t sendFileNoSignal(int sock, int fd, off_t *offset, size_t length)
+{
+    SigPipeBlocker blocker;
+    ssize_t rc = sendfile(sock, fd, offset, length);
+    int error = errno;
+    blocker.restore(rc == -1 && error == EPIPE);
+    errno = error;
+    return rc;
+}
+
+size_t
+Socket::sendFile(int fd, long long offset, size_t length)
+{
+    if (m_ioManager && m_cancelledSend) {
+        MORDOR_LOG_ERROR(g_log) << this << " sendfile(" << m_sock << ", "
+            << fd << ", " << offset << ", " << length << "): ("
+            << m_cancelledSend << ")";
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledSend, "sendfile");
+    }
+    off_t position = (off_t)offset;
+    ssize_t rc = sendFileNoSignal(m_sock, fd, &position, length);
+    while (m_ioManager && rc == -1 && errno == EAGAIN) {
+        waitForIo(true, "sendfile");
+        rc = sendFileNoSignal(m_sock, fd, &position, length);
+    }
+    error_t error = lastError();
+    MORDOR_LOG_LEVEL(g_log, rc == -1 ? Log::ERROR : Log::DEBUG) << this
+        << " sendfile(" << m_sock << ", " << fd << ", " << offset << ", "
+        << length << "): " << rc << " (" << error << ")";
+    if (rc == -1)
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "sendfile");
+    return (size_t)rc;
+}
+#endif
+
+void
+Socket::reapZeroCopy()
+{
+#ifdef ZEROCOPY
+    std::vector<boost::function<void ()> > released;
+    {
+        boost::mutex::scoped_lock lock(m_zeroCopyMutex);
+        while (true) {
+            union {
+                char buffer[128];
+                cmsghdr align;
+            } control;
+            msghdr msg;
+            memset(&msg, 0, sizeof(msghdr));
+            msg.msg_control = control.buffer;
+            msg.msg_controllen = sizeof(control.buffer);
+            int rc = recvmsg(m_sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+            if (rc == -1) {
+                if (errno != EAGAIN)
+                    MORDOR_LOG_ERROR(g_log) << this << " recvmsg(" << m_sock
+                        << ", MSG_ERRQUEUE): (" << lastError() << ")";
+                break;
+            }
+            for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+                cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (!(cmsg->cmsg_level == SOL_IP &&
+                    cmsg->cmsg_type == IP_RECVERR) &&
+                    !(cmsg->cmsg_level == SOL_IPV6 &&
+                    cmsg->cmsg_type == IPV6_RECVERR))
+                    continue;
+                const sock_extended_err *error =
+                    (const sock_extended_err *)CMSG_DATA(cmsg);
+                if (error->ee_errno != 0 ||
+                    error->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                    continue;
+                if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                    g_statZeroCopyCopied.add(error->ee_data - error->ee_info
+                        + 1);
+                // An inclusive range of ids, which may wrap
+                for (unsigned int id = error->ee_info;; ++id) {
+                    size_t index = id - m_zeroCopyFirst;
+                    MORDOR_ASSERT(index <= m_zeroCopySent - m_zeroCopyFirst);
+                    if (index >= m_zeroCopyPending.size())
+                        m_zeroCopyPending.resize(index + 1);
+                    m_zeroCopyPending[index].first = true;
+                    if (id == error->ee_data)
+                        break;
+                }
+            }
+        }
+        while (m_zeroCopyFirst != m_zeroCopySent &&
+            m_zeroCopyPending.front().first) {
+            if (m_zeroCopyPending.front().second)
+                released.push_back(m_zeroCopyPending.front().second);
+            m_zeroCopyPending.pop_front();
+            ++m_zeroCopyFirst;
+        }
+        MORDOR_LOG_DEBUG(g_log) << this << " " << released.size()
+            << " zero-copy sends completed, "
+            << m_zeroCopySent - m_zeroCopyFirst << " outstanding";
+        if (m_zeroCopyFirst == m_zeroCopySent && m_zeroCopyTimer) {
+            m_zeroCopyTimer->cancel();
+            m_zeroCopyTimer.reset();
+        }
+    }
+    for (size_t i = 0; i < released.size(); ++i)
+        released[i]();
+#endif
+}
+
+void
+Socket::onZeroCopyTimer(weak_ptr self)
+{
+    Socket::ptr strongSelf = self.lock();
+    if (strongSelf)
+        strongSelf->reapZeroCopy();
+}
+
+bool
+Socket::udpSegment(unsigned short size)
+{
+#if defined(LINUX) && defined(UDP_SEGMENT)
+    int value = size;
+    int rc = setsockopt(m_sock, SOL_UDP, UDP_SEGMENT, &value, sizeof(int));
+    MORDOR_LOG_LEVEL(g_log, rc ? Log::WARNING : Log::DEBUG) << this
+        << " setsockopt(" << m_sock << ", SOL_UDP, UDP_SEGMENT, " << size
+        << "): " << rc << " (" << lastError() << ")";
+    return rc == 0;
+#else
+    return false;
+#endif
+}
+
+bool
+Socket::udpGro(bool enable)
+{
+#if defined(LINUX) && defined(UDP_GRO)
+    int value = enable ? 1 : 0;
+    int rc = setsockopt(m_sock, SOL_UDP, UDP_GRO, &value, sizeof(int));
+    MORDOR_LOG_LEVEL(g_log, rc ? Log::WARNING : Log::DEBUG) << this
+        << " setsockopt(" << m_sock << ", SOL_UDP, UDP_GRO, " << value
+        << "): " << rc << " (" << lastError() << ")";
+    return rc == 0;
+#else
+    return !enable;
+#endif
+}
+
+size_t
+Socket::receiveSegments(iovec *buffers, size_t length, size_t &segmentSize,
+    Address *from, int *flags)
+{
+    int flagStorage = 0;
+    if (!flags)
+        flags = &flagStorage;
+#if defined(LINUX) && defined(UDP_GRO)
+    const char *api = "recvmsg";
+    if (m_ioManager && m_cancelledReceive) {
+        MORDOR_LOG_ERROR(g_log) << this << " " << api << "(" << m_sock
+            << ", " << length << "): (" << m_cancelledReceive << ")";
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledReceive, api);
+    }
+    // Aligned for the cmsghdr in it, as in cmsg(3)
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        cmsghdr align;
+    } control;
+    msghdr msg;
+    memset(&msg, 0, sizeof(msghdr));
+    msg.msg_iov = buffers;
+    msg.msg_iovlen = length;
+    if (from) {
+        msg.msg_name = (sockaddr *)from->name();
+        msg.msg_namelen = from->nameLen();
+    }
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    int rc = recvmsg(m_sock, &msg, *flags);
+    while (m_ioManager && rc == -1 && errno == EAGAIN) {
+        waitForIo(false, api);
+        msg.msg_controllen = sizeof(control.buffer);
+        rc = recvmsg(m_sock, &msg, *flags);
+    }
+    error_t error = lastError();
+    MORDOR_LOG_LEVEL(g_log, rc == -1 ? Log::ERROR : Log::DEBUG) << this
+        << " " << api << "(" << m_sock << ", " << length << "): " << rc
+        << " (" << error << ")";
+    if (rc == -1)
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, api);
+    *flags = msg.msg_flags;
+    segmentSize = rc;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+        cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(int));
+            if (size > 0)
+                segmentSize = size;
+        }
+    }
+    return rc;
+#else
+    size_t result = from ? receiveFrom(buffers, length, *from, flags) :
+        receive(buffers, length, flags);
+    segmentSize = result;
+    return result;
+#endif
+}
+
+template <bool isSend>
+size_t
+Socket::doBatch(Datagram *datagrams, size_t count, int flags)
+{
+    MORDOR_ASSERT(count > 0);
+#ifdef LINUX
+    const char *api = isSend ? "sendmmsg" : "recvmmsg";
+    error_t &cancelled = isSend ? m_cancelledSend : m_cancelledReceive;
+    // Otherwise recvmmsg() on a blocking socket waits for all of them
+    flags |= isSend ? MSG_NOSIGNAL : MSG_WAITFORONE;
+    // The most the kernel takes at once
+    count = std::min<size_t>(count, 1024u);
+    // Batches are usually small enough for the stack
+    mmsghdr stackMessages[32];
+    std::vector<mmsghdr> heapMessages;
+    mmsghdr *messages = stackMessages;
+    if (count > sizeof(stackMessages) / sizeof(mmsghdr)) {
+        heapMessages.resize(count);
+        messages = &heapMessages[0];
+    }
+    memset(messages, 0, count * sizeof(mmsghdr));
+    for (size_t i = 0; i < count; ++i) {
+        msghdr &message = messages[i].msg_hdr;
+        message.msg_iov = datagrams[i].buffers;
+        message.msg_iovlen = datagrams[i].count;
+        if (datagrams[i].address) {
+            message.msg_name = (sockaddr *)datagrams[i].address->name();
+            message.msg_namelen = datagrams[i].address->nameLen();
+        }
+    }
+    if (m_ioManager && cancelled) {
+        MORDOR_LOG_ERROR(g_log) << this << " " << api << "(" << m_sock
+            << ", " << count << "): (" << cancelled << ")";
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(cancelled, api);
+    }
+    int rc = isSend ? sendmmsg(m_sock, messages, count, flags) :
+        recvmmsg(m_sock, messages, count, flags, NULL);
+    while (m_ioManager && rc == -1 && errno == EAGAIN) {
+        waitForIo(isSend, api);
+        rc = isSend ? sendmmsg(m_sock, messages, count, flags) :
+            recvmmsg(m_sock, messages, count, flags, NULL);
+    }
+    error_t error = lastError();
+    MORDOR_LOG_LEVEL(g_log, rc == -1 ? Log::ERROR : Log::DEBUG) << this
+        << " " << api << "(" << m_sock << ", " << count << "): " << rc
+        << " (" << error << ")";
+    if (rc == -1)
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, api);
+    for (int i = 0; i < rc; ++i) {
+        datagrams[i].length = messages[i].msg_len;
+        if (!isSend)
+            datagrams[i].flags = messages[i].msg_hdr.msg_flags;
+    }
+    return rc;
+#else
+    Datagram &datagram = datagrams[0];
+    datagram.length = doIO<isSend>(datagram.buffers, datagram.count, flags,
+        datagram.address);
+    if (!isSend)
+        datagram.flags = flags;
+    return 1;
+#endif
+}
+
+size_t
+Socket::sendBatch(Datagram *datagrams, size_t count, int flags)
+{
+    return doBatch<true>(datagrams, count, flags);
+}
+
+size_t
+Socket::receiveBatch(Datagram *datagrams, size_t count, int flags)
+{
+    return doBatch<false>(datagrams, count, flags);
+}
+
 size_t
 Socket::receive(void *buffer, size_t length, int *flags)
 {
@@ -1116,6 +1778,10 @@ Socket::cancelIo(int event, error_t &cancelled, error_t error)
     if (cancelled)
         return;
     cancelled = error;
+#ifdef IOURING
+    m_ioManager->cancelEvent(event == IOManager::READ ? m_receiveEvent :
+        m_sendEvent);
+#endif
     m_ioManager->cancelEvent(m_sock, (IOManager::Event)event);
 }
 #endif
@@ -1593,6 +2259,58 @@ UnknownAddress::UnknownAddress(int family, int type, int protocol)
     sa.sa_family = family;
 }
 
+#ifdef SO_REUSEPORT
+void
+listenOnEachThread(IOManager &ioManager, const Address &address,
+    boost::function<void (Socket::ptr)> acceptor, int backlog)
+{
+    MORDOR_ASSERT(Scheduler::getThis() == &ioManager);
+    tid_t caller = gettid();
+    std::vector<tid_t> threads = ioManager.threadIds();
+    for (std::vector<tid_t>::const_iterator it = threads.begin();
+        it != threads.end();
+        ++it) {
+        ioManager.switchTo(*it);
+        Socket::ptr sock(new Socket(ioManager, address.family(),
+            address.type(), address.protocol()));
+        int opt = 1;
+        sock->setOption(SOL_SOCKET, SO_REUSEADDR, opt);
+        sock->setOption(SOL_SOCKET, SO_REUSEPORT, opt);
+        sock->bind(address);
+        sock->listen(backlog);
+        ioManager.schedule(boost::bind(acceptor, sock), *it);
+    }
+    ioManager.switchTo(caller);
+}
+#endif
+
+void
+acceptOnEachThread(IOManager &ioManager, Socket &listen,
+    boost::function<void (Socket::ptr)> acceptor)
+{
+    std::vector<Socket::ptr> sockets;
+    std::vector<Scheduler::FiberAndThread> batch;
+    size_t next = 0;
+    while (true) {
+        sockets.resize(std::max<size_t>(g_acceptBatch->val(), 1u));
+        size_t accepted = listen.acceptBatch(&sockets[0], sockets.size());
+        // Threads come and go (see Scheduler::elastic())
+        std::vector<tid_t> threads = ioManager.threadIds();
+        MORDOR_ASSERT(!threads.empty());
+        for (size_t i = 0; i < accepted; ++i) {
+            batch.push_back(Scheduler::FiberAndThread());
+            Scheduler::FiberAndThread &ft = batch.back();
+            ft.dg = boost::bind(acceptor, sockets[i]);
+            ft.thread = threads[next++ % threads.size()];
+            ft.priority = Scheduler::NORMAL;
+            // Just taking turns; any thread will do if that one's gone
+            ft.anyIfRetired = true;
+            sockets[i].reset();
+        }
+        ioManager.schedule(batch);
+    }
+}
+
 std::ostream &operator <<(std::ostream &os, const Address &addr)
 {
     return addr.insert(os);
@@ -2,12 +2,16 @@
 #define __MORDOR_SOCKET_H__
 // Copyright (c) 2009 - Decho Corporation
 
+#include <deque>
 #include <vector>
 
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "endian.h"
 #include "exception.h"
@@ -26,11 +30,16 @@
 # include <netinet/ip.h>
 #endif
 #include <sys/un.h>
+#ifdef IOURING
+#include "iomanager.h"
+#endif
 #endif
 
 namespace Mordor {
 
+class Deadline;
 class IOManager;
+class Timer;
 
 #ifdef WINDOWS
 struct iovec
@@ -95,6 +104,11 @@ public:
 
     Socket::ptr accept();
     void accept(Socket &target);
+    /// Accept up to count connections, waiting (and timing out) only for
+    /// the first; the rest are whatever else is already pending (accept4()
+    /// on Linux; elsewhere, just one)
+    /// @return How many were accepted; at least one
+    size_t acceptBatch(Socket::ptr *sockets, size_t count);
     void shutdown(int how = SHUT_RDWR);
 
     void getOption(int level, int option, void *result, size_t *len);
@@ -127,11 +141,97 @@ public:
     size_t sendTo(const iovec *buffers, size_t length, int flags, const boost::shared_ptr<Address> to)
     { return sendTo(buffers, length, flags, *to.get()); }
 
+    /// Send with MSG_ZEROCOPY from now on, for sends of at least threshold
+    /// bytes through sendZeroCopy() (and SocketStream)
+
+    /// The kernel pins the pages being sent instead of copying them, and
+    /// reports when it's done with them on the socket's error queue.  Only
+    /// worth it for large sends; small ones cost more in page pinning and
+    /// completion handling than the copy they save.
+    /// @return If the platform and socket support it
+    /// @pre This Socket has an IOManager
+    bool zeroCopy(size_t threshold = 16384);
+    /// Smallest send that's done without copying (~0 if zeroCopy() hasn't
+    /// been enabled)
+    size_t zeroCopyThreshold() const { return m_zeroCopyThreshold; }
+    /// send(), without copying the data if it's at least
+    /// zeroCopyThreshold() bytes
+
+    /// release is called (possibly on another thread) once the kernel no
+    /// longer references buffers; until then they must not be modified or
+    /// freed.  It's called before returning if the data was copied instead.
+    /// Completions are collected by later sends, by sends and receives
+    /// that block, and by a timer (socket.zerocopy.interval).  Data that's
+    /// still queued when the Socket is destroyed is released regardless,
+    /// so flush (shutdown and wait for the peer) before then.
+    size_t sendZeroCopy(const iovec *buffers, size_t length,
+        boost::function<void ()> release, int flags = 0);
+#ifdef LINUX
+    /// Send up to length bytes of fd, starting at offset, with sendfile()
+
+    /// Blocks (and times out) like send().  fd's own position isn't used or
+    /// changed.
+    /// @return 0 if offset is at the end of fd
+    size_t sendFile(int fd, long long offset, size_t length);
+#endif
+
+    /// Have the kernel (or NIC) split each send on this datagram socket
+    /// into datagrams of size bytes (the last may be shorter), instead of
+    /// making a system call per datagram (UDP_SEGMENT)
+
+    /// A send can carry at most 64 datagrams, and 64KB in all.  0 turns
+    /// it off.
+    /// @return If the platform and socket support it
+    bool udpSegment(unsigned short size);
+    /// Allow the kernel to coalesce datagrams from the same sender into
+    /// one receive (UDP_GRO); see receiveSegments()
+    /// @return If the platform and socket support it
+    bool udpGro(bool enable = true);
+    /// Receive a datagram, or (with udpGro()) several coalesced ones
+    /// @param segmentSize Set to the size of each datagram, except the last,
+    /// which may be shorter
+    /// @return How much was received in all
+    size_t receiveSegments(iovec *buffers, size_t length, size_t &segmentSize,
+        Address *from = NULL, int *flags = NULL);
+
     size_t receive(void *buffer, size_t length, int *flags = NULL);
     size_t receive(iovec *buffers, size_t length, int *flags = NULL);
     size_t receiveFrom(void *buffer, size_t length, Address &from, int *flags = NULL);
     size_t receiveFrom(iovec *buffers, size_t length, Address &from, int *flags = NULL);
 
+    /// One datagram for sendBatch() or receiveBatch()
+    struct Datagram
+    {
+        Datagram()
+            : buffers(NULL),
+              count(0),
+              address(NULL),
+              length(0),
+              flags(0)
+        {}
+
+        /// Where the data is sent from, or received into
+        iovec *buffers;
+        size_t count;
+        /// Who to send to (NULL on a connected socket), or where to put who
+        /// it came from (from emptyAddress(); NULL if not wanted)
+        Address *address;
+        /// Set to how much was sent or received
+        size_t length;
+        /// Set to the flags the datagram was received with (MSG_TRUNC, etc.)
+        int flags;
+    };
+
+    /// Send as many of count datagrams as will go in one system call
+    /// (sendmmsg() on Linux; elsewhere, just the first)
+    /// @return How many were sent; at least one
+    size_t sendBatch(Datagram *datagrams, size_t count, int flags = 0);
+    /// Receive up to count datagrams in one system call (recvmmsg() on
+    /// Linux; elsewhere, just one), waiting (and timing out) only for the
+    /// first
+    /// @return How many were received; at least one
+    size_t receiveBatch(Datagram *datagrams, size_t count, int flags = 0);
+
     boost::shared_ptr<Address> emptyAddress();
     boost::shared_ptr<Address> remoteAddress();
     boost::shared_ptr<Address> localAddress();
@@ -152,8 +252,25 @@ public:
 private:
     template <bool isSend>
     size_t doIO(iovec *buffers, size_t length, int &flags, Address *address = NULL);
+    template <bool isSend>
+    size_t doBatch(Datagram *datagrams, size_t count, int flags);
+#ifndef WINDOWS
+    /// Wait for a send (or receive) that would have blocked to be worth
+    /// retrying; throws if it's cancelled or times out meanwhile
+    void waitForIo(bool isSend, const char *api);
+#endif
+#if !defined(WINDOWS) && !defined(IOURING)
+    /// Accept a connection, already non-blocking; if !wait, -1 when there
+    /// isn't one pending
+    socket_t acceptNonBlocking(bool wait);
+    /// Take over sock, just accepted, for m_ioManager
+    void accepted(socket_t sock);
+#endif
     static void callOnRemoteClose(weak_ptr self);
     void registerForRemoteClose();
+    /// Release the sends the error queue says have completed
+    void reapZeroCopy();
+    static void onZeroCopyTimer(weak_ptr self);
 
 #ifdef WINDOWS
     // For WSAEventSelect
@@ -167,6 +284,8 @@ private:
     int m_family, m_protocol;
     IOManager *m_ioManager;
     unsigned long long m_receiveTimeout, m_sendTimeout;
+    // Created by the first send/receive with a timeout
+    boost::scoped_ptr<Deadline> m_sendDeadline, m_receiveDeadline;
     error_t m_cancelledSend, m_cancelledReceive;
     boost::shared_ptr<Address> m_localAddress, m_remoteAddress;
 #ifdef WINDOWS
@@ -178,9 +297,18 @@ private:
     Scheduler *m_scheduler;
 
     AsyncEvent m_sendEvent, m_receiveEvent;
+#elif defined(IOURING)
+    IOManager::AsyncEvent m_sendEvent, m_receiveEvent;
 #endif
     bool m_isConnected, m_isRegisteredForRemoteClose;
     boost::signals2::signal<void ()> m_onRemoteClose;
+    // Outstanding MSG_ZEROCOPY sends, from id m_zeroCopyFirst (the kernel
+    // numbers them in order); completed, and what to call when they are
+    std::deque<std::pair<bool, boost::function<void ()> > > m_zeroCopyPending;
+    unsigned int m_zeroCopyFirst, m_zeroCopySent;
+    size_t m_zeroCopyThreshold;
+    boost::shared_ptr<Timer> m_zeroCopyTimer;
+    boost::mutex m_zeroCopyMutex;
 };
 
 #ifdef WINDOWS
@@ -312,6 +440,32 @@ private:
     sockaddr sa;
 };
 
+#ifdef SO_REUSEPORT
+/// Listen on address with a SO_REUSEPORT Socket per ioManager thread, and
+/// start acceptor (on that thread) for each of them
+
+/// The kernel spreads incoming connections across the Sockets, so each
+/// thread accepts (and, if acceptor schedules its connections with
+/// gettid(), serves) its own share; with IOManager::perThread() connections
+/// never leave the thread that accepted them.  Each Socket is created on the
+/// thread it belongs to.
+/// @pre Scheduler::getThis() == &ioManager
+void listenOnEachThread(IOManager &ioManager, const Address &address,
+    boost::function<void (Socket::ptr)> acceptor, int backlog = SOMAXCONN);
+#endif
+
+/// Accept connections on listen (already listening) until that throws
+/// (after cancelAccept(), for instance), and schedule acceptor for each of
+/// them, taking turns between ioManager's threads
+
+/// Everything pending is accepted each time listen is readable, up to
+/// socket.accept.batch connections, and scheduled together, so that one
+/// Fiber can accept as fast as all the threads can serve.  With
+/// IOManager::perThread(), a connection's I/O still wakes up the thread
+/// that accepted it; use listenOnEachThread() instead.
+void acceptOnEachThread(IOManager &ioManager, Socket &listen,
+    boost::function<void (Socket::ptr)> acceptor);
+
 std::ostream &operator <<(std::ostream &os, const Address &addr);
 
 bool operator<(const Address::ptr &lhs, const Address::ptr &rhs);
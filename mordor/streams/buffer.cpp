@@ -23,12 +23,14 @@ static size_t iovLength(size_t length)
 namespace Mordor {
 
 Buffer::SegmentData::SegmentData()
+    : m_adopted(false)
 {
     start(NULL);
     length(0);
 }
 
 Buffer::SegmentData::SegmentData(size_t length)
+    : m_adopted(false)
 {
     m_array.reset(new unsigned char[length]);
     start(m_array.get());
@@ -36,6 +38,7 @@ Buffer::SegmentData::SegmentData(size_t length)
 }
 
 Buffer::SegmentData::SegmentData(void *buffer, size_t length)
+    : m_adopted(true)
 {
     m_array.reset((unsigned char *)buffer, &nop<unsigned char *>);
     start(m_array.get());
@@ -51,6 +54,7 @@ Buffer::SegmentData::slice(size_t start, size_t length)
     MORDOR_ASSERT(length + start <= this->length());
     SegmentData result;
     result.m_array = m_array;
+    result.m_adopted = m_adopted;
     result.start((unsigned char*)this->start() + start);
     result.length(length);
     return result;
@@ -65,6 +69,7 @@ Buffer::SegmentData::slice(size_t start, size_t length) const
     MORDOR_ASSERT(length + start <= this->length());
     SegmentData result;
     result.m_array = m_array;
+    result.m_adopted = m_adopted;
     result.start((unsigned char*)this->start() + start);
     result.length(length);
     return result;
@@ -234,6 +239,21 @@ Buffer::segments() const
     return m_segments.size();
 }
 
+bool
+Buffer::adopted(size_t length) const
+{
+    if (length == (size_t)~0)
+        length = readAvailable();
+    MORDOR_ASSERT(length <= readAvailable());
+    std::list<Segment>::const_iterator it;
+    for (it = m_segments.begin(); it != m_segments.end() && length > 0; ++it) {
+        if (it->m_data.m_adopted)
+            return true;
+        length -= std::min(it->readAvailable(), length);
+    }
+    return false;
+}
+
 void
 Buffer::adopt(void *buffer, size_t length)
 {
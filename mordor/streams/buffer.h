@@ -38,6 +38,8 @@ private:
         size_t m_length;
     private:
         boost::shared_array<unsigned char> m_array;
+        /// m_array doesn't own the memory (see Buffer::adopt)
+        bool m_adopted;
     };
 
     struct Segment
@@ -77,6 +79,9 @@ public:
     size_t writeAvailable() const;
     // Primarily for unit tests
     size_t segments() const;
+    /// If any of the first length bytes are in adopt()ed memory, which
+    /// copies of this Buffer can't keep alive
+    bool adopted(size_t length = ~0) const;
 
     void adopt(void *buffer, size_t length);
     void reserve(size_t length);
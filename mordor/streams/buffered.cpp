@@ -136,6 +136,24 @@ BufferedStream::write(const void *buffer, size_t length)
     return result;
 }
 
+#ifndef WINDOWS
+size_t
+BufferedStream::sendFile(int fd, long long offset, size_t length)
+{
+    flush(false);
+    if (m_readBuffer.readAvailable() && supportsSeek()) {
+        parent()->seek(-(long long)m_readBuffer.readAvailable(), CURRENT);
+        m_readBuffer.clear();
+    }
+    MORDOR_LOG_TRACE(g_log) << this << " parent()->sendFile(" << fd << ", "
+        << offset << ", " << length << ")";
+    size_t result = parent()->sendFile(fd, offset, length);
+    MORDOR_LOG_DEBUG(g_log) << this << " parent()->sendFile(" << fd << ", "
+        << offset << ", " << length << "): " << result;
+    return result;
+}
+#endif
+
 size_t
 BufferedStream::flushWrite(size_t length)
 {
@@ -25,12 +25,19 @@ public:
 
     bool supportsFind() { return supportsRead(); }
     bool supportsUnread() { return supportsRead() && (!supportsWrite() || !supportsSeek()); }
+#ifndef WINDOWS
+    bool supportsSendFile() { return parent()->supportsSendFile(); }
+#endif
 
     void close(CloseType type = BOTH);
     size_t read(Buffer &buffer, size_t length);
     size_t read(void *buffer, size_t length);
     size_t write(const Buffer &buffer, size_t length);
     size_t write(const void *buffer, size_t length);
+#ifndef WINDOWS
+    /// Anything already written is flushed first
+    size_t sendFile(int fd, long long offset, size_t length);
+#endif
     long long seek(long long offset, Anchor anchor = BEGIN);
     long long size();
     void truncate(long long size);
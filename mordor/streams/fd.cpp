@@ -5,21 +5,66 @@
 #include "fd.h"
 
 #include <sys/fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
 
 #include "buffer.h"
 #include "mordor/assert.h"
+#include "mordor/config.h"
+#include "mordor/workerpool.h"
 
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:streams:fd");
 
+static ConfigVar<size_t>::ptr g_fileThreads = Config::lookup<size_t>(
+    "fdstream.file.threads", 4u,
+    "Number of threads that read and write regular files for FDStreams "
+    "with an IOManager (and no Scheduler of their own)");
+
+namespace {
+struct FilePool
+{
+    FilePool()
+        : pool(std::max<size_t>(g_fileThreads->val(), 1u), false)
+    {
+        pool.name("fileio");
+    }
+
+    WorkerPool pool;
+};
+}
+
+static Scheduler *filePool()
+{
+    // Constructed on first use, so it's stopped at exit before anything its
+    // threads might still touch is destroyed
+    static FilePool filePool;
+    return &filePool.pool;
+}
+
+#ifdef IOURING
+// Submit event, and wait for it to complete; returns (and sets errno) like
+// the equivalent syscall
+static int perform(IOManager *ioManager, IOManager::AsyncEvent &event)
+{
+    int rc = ioManager->perform(event);
+    if (rc < 0) {
+        errno = -rc;
+        return -1;
+    }
+    return rc;
+}
+#endif
+
 FDStream::FDStream()
 : m_ioManager(NULL),
   m_scheduler(NULL),
   m_fd(-1),
-  m_own(false)
+  m_own(false),
+  m_file(false),
+  m_pos(-1)
 {}
 
 void
@@ -30,8 +75,12 @@ FDStream::init(int fd, IOManager *ioManager, Scheduler *scheduler, bool own)
     m_scheduler = scheduler;
     m_fd = fd;
     m_own = own;
+    m_file = false;
+    m_pos = -1;
     if (m_ioManager) {
-        if (fcntl(m_fd, F_SETFL, O_NONBLOCK)) {
+        // Keep O_APPEND
+        int flags = fcntl(m_fd, F_GETFL);
+        if (flags == -1 || fcntl(m_fd, F_SETFL, flags | O_NONBLOCK)) {
             int error = errno;
             if (own) {
                 ::close(m_fd);
@@ -39,6 +88,12 @@ FDStream::init(int fd, IOManager *ioManager, Scheduler *scheduler, bool own)
             }
             MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "fcntl");
         }
+        struct stat statbuf;
+        if (fstat(m_fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
+            m_file = true;
+            if (!(flags & O_APPEND))
+                m_pos = lseek(m_fd, 0, SEEK_CUR);
+        }
     }
 }
 
@@ -71,111 +126,219 @@ FDStream::close(CloseType type)
 size_t
 FDStream::read(Buffer &buffer, size_t length)
 {
-    SchedulerSwitcher switcher(m_ioManager ? NULL : m_scheduler);
-    MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
     std::vector<iovec> iovs = buffer.writeBuffers(length);
-    int rc = readv(m_fd, &iovs[0], iovs.size());
-    while (rc < 0 && errno == EAGAIN && m_ioManager) {
-        MORDOR_LOG_TRACE(g_log) << this << " readv(" << m_fd << ", " << length
-            << "): " << rc << " (EAGAIN)";
-        m_ioManager->registerEvent(m_fd, IOManager::READ);
-        Scheduler::yieldTo();
-        rc = readv(m_fd, &iovs[0], iovs.size());
-    }
-    int error = errno;
-    MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::DEBUG) << this
-        << " readv(" << m_fd << ", " << length << "): " << rc << " (" << error
-        << ")";
-    if (rc < 0)
-        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "readv");
-    buffer.produce(rc);
-    return rc;
+    size_t result = doRead(&iovs[0], iovs.size(), length, -1);
+    buffer.produce(result);
+    return result;
 }
 
 size_t
 FDStream::read(void *buffer, size_t length)
 {
-    SchedulerSwitcher switcher(m_ioManager ? NULL : m_scheduler);
-    MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
-    int rc = ::read(m_fd, buffer, length);
-    while (rc < 0 && errno == EAGAIN && m_ioManager) {
-        MORDOR_LOG_TRACE(g_log) << this << " read(" << m_fd << ", " << length
-            << "): " << rc << " (EAGAIN)";
-        m_ioManager->registerEvent(m_fd, IOManager::READ);
-        Scheduler::yieldTo();
-        rc = ::read(m_fd, buffer, length);
-    }
-    int error = errno;
-    MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::DEBUG) << this
-        << " read(" << m_fd << ", " << length << "): " << rc << " (" << error
-        << ")";
-    if (rc < 0)
-        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "read");
-    return rc;
+    iovec iov = { buffer, length };
+    return doRead(&iov, 1, length, -1);
 }
 
 size_t
 FDStream::write(const Buffer &buffer, size_t length)
 {
-    SchedulerSwitcher switcher(m_ioManager ? NULL : m_scheduler);
-    MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
     const std::vector<iovec> iovs = buffer.readBuffers(length);
-    int rc = writev(m_fd, &iovs[0], iovs.size());
+    return doWrite(&iovs[0], iovs.size(), length, -1);
+}
+
+size_t
+FDStream::write(const void *buffer, size_t length)
+{
+    if (length > 0xfffffffe)
+        length = 0xfffffffe;
+    iovec iov = { (void *)buffer, length };
+    return doWrite(&iov, 1, length, -1);
+}
+
+size_t
+FDStream::pread(Buffer &buffer, size_t length, long long offset)
+{
+    MORDOR_ASSERT(offset >= 0);
+    if (length > 0xfffffffe)
+        length = 0xfffffffe;
+    std::vector<iovec> iovs = buffer.writeBuffers(length);
+    size_t result = doRead(&iovs[0], iovs.size(), length, offset);
+    buffer.produce(result);
+    return result;
+}
+
+size_t
+FDStream::pread(void *buffer, size_t length, long long offset)
+{
+    MORDOR_ASSERT(offset >= 0);
+    if (length > 0xfffffffe)
+        length = 0xfffffffe;
+    iovec iov = { buffer, length };
+    return doRead(&iov, 1, length, offset);
+}
+
+size_t
+FDStream::pwrite(const Buffer &buffer, size_t length, long long offset)
+{
+    MORDOR_ASSERT(offset >= 0);
+    if (length > 0xfffffffe)
+        length = 0xfffffffe;
+    const std::vector<iovec> iovs = buffer.readBuffers(length);
+    return doWrite(&iovs[0], iovs.size(), length, offset);
+}
+
+size_t
+FDStream::pwrite(const void *buffer, size_t length, long long offset)
+{
+    MORDOR_ASSERT(offset >= 0);
+    if (length > 0xfffffffe)
+        length = 0xfffffffe;
+    iovec iov = { (void *)buffer, length };
+    return doWrite(&iov, 1, length, offset);
+}
+
+size_t
+FDStream::doRead(iovec *iovs, size_t count, size_t length, long long offset)
+{
+    Scheduler *scheduler = m_ioManager ? NULL : m_scheduler;
+#ifndef IOURING
+    // Always "ready", so it would block the IOManager's thread
+    if (m_file)
+        scheduler = blockingScheduler();
+#endif
+    SchedulerSwitcher switcher(scheduler);
+    MORDOR_ASSERT(m_fd >= 0);
+    long long position = offset >= 0 ? offset : m_pos;
+    const char *api = position >= 0 ? "preadv" : "readv";
+    int rc;
+#ifdef IOURING
+    IOManager::AsyncEvent event;
+    if (m_ioManager && Scheduler::getThis()) {
+        int index = count == 1 ? m_ioManager->registeredBuffer(
+            iovs[0].iov_base, iovs[0].iov_len) : -1;
+        if (index >= 0) {
+            io_uring_sqe &sqe = event.prepare(IORING_OP_READ_FIXED, m_fd);
+            sqe.addr = (__u64)(uintptr_t)iovs[0].iov_base;
+            sqe.len = (__u32)iovs[0].iov_len;
+            sqe.buf_index = (__u16)index;
+        } else {
+            io_uring_sqe &sqe = event.prepare(IORING_OP_READV, m_fd);
+            sqe.addr = (__u64)(uintptr_t)iovs;
+            sqe.len = (__u32)count;
+        }
+        event.sqe.off = position >= 0 ? (__u64)position : (__u64)-1;
+        rc = perform(m_ioManager, event);
+    } else
+#endif
+    rc = position >= 0 ? preadv(m_fd, iovs, count, position) :
+        readv(m_fd, iovs, count);
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
-        MORDOR_LOG_TRACE(g_log) << this << " writev(" << m_fd << ", " << length
-            << "): " << rc << " (EAGAIN)";
-        m_ioManager->registerEvent(m_fd, IOManager::WRITE);
+        MORDOR_LOG_TRACE(g_log) << this << " " << api << "(" << m_fd << ", "
+            << length << "): " << rc << " (EAGAIN)";
+        m_ioManager->registerEvent(m_fd, IOManager::READ);
         Scheduler::yieldTo();
-        rc = writev(m_fd, &iovs[0], iovs.size());
+        rc = position >= 0 ? preadv(m_fd, iovs, count, position) :
+            readv(m_fd, iovs, count);
     }
     int error = errno;
     MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::DEBUG) << this
-        << " writev(" << m_fd << ", " << length << "): " << rc << " (" << error
-        << ")";
-    if (rc == 0)
-        MORDOR_THROW_EXCEPTION(std::runtime_error("Zero length write"));
+        << " " << api << "(" << m_fd << ", " << length << ", " << position
+        << "): " << rc << " (" << error << ")";
     if (rc < 0)
-        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "writev");
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, api);
+    if (offset < 0 && m_pos >= 0)
+        m_pos += rc;
     return rc;
 }
 
 size_t
-FDStream::write(const void *buffer, size_t length)
+FDStream::doWrite(const iovec *iovs, size_t count, size_t length,
+    long long offset)
 {
-    SchedulerSwitcher switcher(m_ioManager ? NULL : m_scheduler);
+    Scheduler *scheduler = m_ioManager ? NULL : m_scheduler;
+#ifndef IOURING
+    // Always "ready", so it would block the IOManager's thread
+    if (m_file)
+        scheduler = blockingScheduler();
+#endif
+    SchedulerSwitcher switcher(scheduler);
     MORDOR_ASSERT(m_fd >= 0);
-    if (length > 0xfffffffe)
-        length = 0xfffffffe;
-    int rc = ::write(m_fd, buffer, length);
+    long long position = offset >= 0 ? offset : m_pos;
+    const char *api = position >= 0 ? "pwritev" : "writev";
+    int rc;
+#ifdef IOURING
+    IOManager::AsyncEvent event;
+    if (m_ioManager && Scheduler::getThis()) {
+        int index = count == 1 ? m_ioManager->registeredBuffer(
+            iovs[0].iov_base, iovs[0].iov_len) : -1;
+        if (index >= 0) {
+            io_uring_sqe &sqe = event.prepare(IORING_OP_WRITE_FIXED, m_fd);
+            sqe.addr = (__u64)(uintptr_t)iovs[0].iov_base;
+            sqe.len = (__u32)iovs[0].iov_len;
+            sqe.buf_index = (__u16)index;
+        } else {
+            io_uring_sqe &sqe = event.prepare(IORING_OP_WRITEV, m_fd);
+            sqe.addr = (__u64)(uintptr_t)iovs;
+            sqe.len = (__u32)count;
+        }
+        event.sqe.off = position >= 0 ? (__u64)position : (__u64)-1;
+        rc = perform(m_ioManager, event);
+    } else
+#endif
+    rc = position >= 0 ? pwritev(m_fd, iovs, count, position) :
+        writev(m_fd, iovs, count);
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
-        MORDOR_LOG_TRACE(g_log) << this << " write(" << m_fd << ", " << length
-            << "): " << rc << " (EAGAIN)";
+        MORDOR_LOG_TRACE(g_log) << this << " " << api << "(" << m_fd << ", "
+            << length << "): " << rc << " (EAGAIN)";
         m_ioManager->registerEvent(m_fd, IOManager::WRITE);
         Scheduler::yieldTo();
-        rc = ::write(m_fd, buffer, length);
+        rc = position >= 0 ? pwritev(m_fd, iovs, count, position) :
+            writev(m_fd, iovs, count);
     }
     int error = errno;
     MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::DEBUG) << this
-        << " write(" << m_fd << ", " << length << "): " << rc << " (" << error
-        << ")";
+        << " " << api << "(" << m_fd << ", " << length << ", " << position
+        << "): " << rc << " (" << error << ")";
     if (rc == 0)
         MORDOR_THROW_EXCEPTION(std::runtime_error("Zero length write"));
     if (rc < 0)
-        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "write");
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, api);
+    if (offset < 0 && m_pos >= 0)
+        m_pos += rc;
     return rc;
 }
 
 long long
 FDStream::seek(long long offset, Anchor anchor)
 {
-    SchedulerSwitcher switcher(m_scheduler);
     MORDOR_ASSERT(m_fd >= 0);
+    if (m_pos >= 0) {
+        long long pos = offset;
+        switch (anchor) {
+            case BEGIN:
+                break;
+            case CURRENT:
+                pos += m_pos;
+                break;
+            case END:
+                pos += size();
+                break;
+            default:
+                MORDOR_NOTREACHED();
+        }
+        MORDOR_LOG_VERBOSE(g_log) << this << " seek(" << m_fd << ", "
+            << offset << ", " << anchor << "): " << pos;
+        if (pos < 0)
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(EINVAL, "lseek");
+        return m_pos = pos;
+    }
+    SchedulerSwitcher switcher(m_scheduler);
     long long pos = lseek(m_fd, offset, (int)anchor);
     int error = errno;
     MORDOR_LOG_LEVEL(g_log, pos < 0 ? Log::ERROR : Log::VERBOSE) << this
@@ -218,7 +381,7 @@ FDStream::truncate(long long size)
 void
 FDStream::flush(bool flushParent)
 {
-    SchedulerSwitcher switcher(m_scheduler);
+    SchedulerSwitcher switcher(m_file ? blockingScheduler() : m_scheduler);
     MORDOR_ASSERT(m_fd >= 0);
     int rc = fsync(m_fd);
     int error = errno;
@@ -228,4 +391,62 @@ FDStream::flush(bool flushParent)
         MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "fsync");
 }
 
+void
+FDStream::prefetch(long long offset, size_t length)
+{
+    MORDOR_ASSERT(offset >= 0);
+    // Only a file read on an IOManager's thread would block it
+    if (!m_file || length == 0 || !Scheduler::getThis())
+        return;
+    MORDOR_ASSERT(m_fd >= 0);
+    long long pageSize = sysconf(_SC_PAGESIZE);
+    long long start = offset - offset % pageSize;
+    size_t mapped = (size_t)(offset - start) + length;
+    // Mapping (even past EOF) and mincore() don't touch the disk
+    void *addr = mmap(NULL, mapped, PROT_READ, MAP_SHARED, m_fd, start);
+    if (addr == MAP_FAILED) {
+        MORDOR_LOG_VERBOSE(g_log) << this << " mmap(" << m_fd << ", "
+            << start << ", " << mapped << "): (" << errno << ")";
+        return;
+    }
+    std::vector<unsigned char> resident((mapped + pageSize - 1) / pageSize);
+    int rc = mincore(addr, mapped, &resident[0]);
+    int error = errno;
+    munmap(addr, mapped);
+    if (rc) {
+        MORDOR_LOG_VERBOSE(g_log) << this << " mincore(" << m_fd << ", "
+            << start << ", " << mapped << "): " << rc << " (" << error << ")";
+        return;
+    }
+    size_t page = 0;
+    while (page < resident.size() && (resident[page] & 1))
+        ++page;
+    if (page == resident.size())
+        return;
+    MORDOR_LOG_DEBUG(g_log) << this << " prefetching " << m_fd << " from "
+        << start + page * pageSize;
+    // Read the rest in (a page already cached costs no more than a copy),
+    // stopping at EOF
+    SchedulerSwitcher switcher(blockingScheduler());
+    std::vector<char> scratch(65536);
+    long long pos = std::max(start + (long long)page * pageSize, offset);
+    long long end = offset + (long long)length;
+    while (pos < end) {
+        ssize_t result = ::pread(m_fd, &scratch[0],
+            (size_t)std::min<long long>(scratch.size(), end - pos), pos);
+        if (result <= 0)
+            break;
+        pos += result;
+    }
+}
+
+Scheduler *
+FDStream::blockingScheduler()
+{
+    // Can't switch back to a Scheduler we're not on
+    if (m_scheduler || !m_file || !Scheduler::getThis())
+        return m_scheduler;
+    return filePool();
+}
+
 }
@@ -2,11 +2,21 @@
 #define __MORDOR_FD_STREAM_H__
 // Copyright (c) 2009 - Decho Corporation
 
+#include <sys/uio.h>
+
 #include "mordor/iomanager.h"
 #include "stream.h"
 
 namespace Mordor {
 
+/// Stream on a file descriptor
+
+/// With an IOManager, reads and writes that would block wait on the
+/// IOManager instead.  Regular files never report that they would block,
+/// so with an IOManager they're read and written at an offset the FDStream
+/// keeps itself (seek() just moves it), either through io_uring (when built
+/// with IOURING), or on a pool of fdstream.file.threads threads that block
+/// in its place (or on scheduler, if one is given).
 class FDStream : public Stream
 {
 public:
@@ -33,6 +43,13 @@ public:
     size_t read(void *buffer, size_t length);
     size_t write(const Buffer &buffer, size_t length);
     size_t write(const void *buffer, size_t length);
+    /// Read or write at offset, without using or moving the current
+    /// position; unlike seek() and read(), concurrent calls don't interfere
+    /// with each other
+    size_t pread(Buffer &buffer, size_t length, long long offset);
+    size_t pread(void *buffer, size_t length, long long offset);
+    size_t pwrite(const Buffer &buffer, size_t length, long long offset);
+    size_t pwrite(const void *buffer, size_t length, long long offset);
     long long seek(long long offset, Anchor anchor);
     long long size();
     void truncate(long long size);
@@ -40,11 +57,30 @@ public:
 
     int fd() { return m_fd; }
 
+    /// Make sure [offset, offset + length) of a regular file is in the page
+    /// cache, reading whatever isn't where blocking on the disk is allowed
+    /// (see above), so that handing it to sendfile() on this thread won't
+    /// block the IOManager.  A no-op for anything else.
+    void prefetch(long long offset, size_t length);
+
+private:
+    /// @param offset Where to read or write, or -1 for the current position
+    size_t doRead(iovec *iovs, size_t count, size_t length, long long offset);
+    size_t doWrite(const iovec *iovs, size_t count, size_t length,
+        long long offset);
+    /// Where to make a call that might block
+    Scheduler *blockingScheduler();
+
 private:
     IOManager *m_ioManager;
     Scheduler *m_scheduler;
     int m_fd;
     bool m_own;
+    /// A regular file with an IOManager
+    bool m_file;
+    /// The current position, if m_file (and not O_APPEND); otherwise -1,
+    /// and the fd's own position is used
+    long long m_pos;
 };
 
 typedef FDStream NativeStream;
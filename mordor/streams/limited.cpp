@@ -42,6 +42,19 @@ LimitedStream::write(const Buffer &b, size_t len)
     return result;
 }
 
+#ifndef WINDOWS
+size_t
+LimitedStream::sendFile(int fd, long long offset, size_t length)
+{
+    if (m_pos >= m_size)
+        MORDOR_THROW_EXCEPTION(WriteBeyondEofException());
+    length = (size_t)std::min<long long>(length, m_size - m_pos);
+    size_t result = parent()->sendFile(fd, offset, length);
+    m_pos += result;
+    return result;
+}
+#endif
+
 long long
 LimitedStream::seek(long long offset, Anchor anchor)
 {
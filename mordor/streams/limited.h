@@ -24,9 +24,21 @@ public:
     bool supportsTell() { return true; }
     bool supportsSize() { return true; }
     bool supportsTruncate() { return false; }
+#ifndef WINDOWS
+    bool supportsSendFile() { return parent()->supportsSendFile(); }
+#endif
+
+    /// How much more can be read or written
+    long long remaining() { return m_pos < m_size ? m_size - m_pos : 0; }
+    /// Account for length bytes read from the parent without going through
+    /// this stream (such as by transferStream())
+    void advance(long long length) { m_pos += length; }
 
     size_t read(Buffer &b, size_t len);
     size_t write(const Buffer &b, size_t len);
+#ifndef WINDOWS
+    size_t sendFile(int fd, long long offset, size_t length);
+#endif
     long long seek(long long offset, Anchor anchor = BEGIN);
     long long size();
     void truncate(long long size);
@@ -62,6 +62,20 @@ public:
         }
     }
 
+#ifndef WINDOWS
+    bool supportsSendFile() { return parent()->supportsSendFile(); }
+    size_t sendFile(int fd, long long offset, size_t length)
+    {
+        try {
+            return parent()->sendFile(fd, offset, length);
+        } catch(...) {
+            if (notifyOnException)
+                notifyOnException();
+            throw;
+        }
+    }
+#endif
+
     void flush(bool flushParent = true)
     {
         try {
@@ -57,6 +57,15 @@ SingleplexStream::write(const void *buffer, size_t length)
     return parent()->write(buffer, length);
 }
 
+#ifndef WINDOWS
+size_t
+SingleplexStream::sendFile(int fd, long long offset, size_t length)
+{
+    MORDOR_ASSERT(m_type == WRITE);
+    return parent()->sendFile(fd, offset, length);
+}
+#endif
+
 void
 SingleplexStream::truncate(long long size)
 {
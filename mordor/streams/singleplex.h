@@ -24,6 +24,10 @@ public:
     { return m_type == READ && parent()->supportsFind(); }
     bool supportsUnread()
     { return m_type == READ && parent()->supportsUnread(); }
+#ifndef WINDOWS
+    bool supportsSendFile()
+    { return m_type == WRITE && parent()->supportsSendFile(); }
+#endif
 
     void close(CloseType type = BOTH);
 
@@ -31,6 +35,9 @@ public:
     size_t read(void *buffer, size_t length);
     size_t write(const Buffer &buffer, size_t length);
     size_t write(const void *buffer, size_t length);
+#ifndef WINDOWS
+    size_t sendFile(int fd, long long offset, size_t length);
+#endif
     void truncate(long long size);
     void flush(bool flushParent = true);
     ptrdiff_t find(char delimiter, size_t sanitySize = ~0,
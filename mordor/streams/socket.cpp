@@ -2,9 +2,12 @@
 
 #include "socket.h"
 
+#include <boost/bind.hpp>
+
 #include "buffer.h"
 #include "mordor/assert.h"
 #include "mordor/socket.h"
+#include "mordor/util.h"
 
 namespace Mordor {
 
@@ -59,8 +62,20 @@ SocketStream::cancelRead()
 size_t
 SocketStream::write(const Buffer &buffer, size_t length)
 {
-    const std::vector<iovec> iovs = buffer.readBuffers(length);
-    size_t result = m_socket->send(&iovs[0], iovs.size());
+    size_t result;
+    // Memory the Buffer adopted can't be kept alive until the kernel's done
+    // with it
+    if (length >= m_socket->zeroCopyThreshold() && !buffer.adopted(length)) {
+        // Share the segments, so they outlive the caller consuming them
+        boost::shared_ptr<Buffer> pinned(new Buffer());
+        pinned->copyIn(buffer, length);
+        const std::vector<iovec> iovs = pinned->readBuffers(length);
+        result = m_socket->sendZeroCopy(&iovs[0], iovs.size(),
+            boost::bind(&nop<boost::shared_ptr<Buffer> >, pinned));
+    } else {
+        const std::vector<iovec> iovs = buffer.readBuffers(length);
+        result = m_socket->send(&iovs[0], iovs.size());
+    }
     MORDOR_ASSERT(result > 0);
     return result;
 }
@@ -71,6 +86,14 @@ SocketStream::write(const void *buffer, size_t length)
     return m_socket->send(buffer, length);
 }
 
+#ifdef LINUX
+size_t
+SocketStream::sendFile(int fd, long long offset, size_t length)
+{
+    return m_socket->sendFile(fd, offset, length);
+}
+#endif
+
 void
 SocketStream::cancelWrite()
 {
@@ -84,4 +107,27 @@ SocketStream::onRemoteClose(
     return m_socket->onRemoteClose(slot);
 }
 
+size_t
+receiveSegments(Socket &socket, std::vector<Buffer> &datagrams,
+    Address *from, size_t length)
+{
+    Buffer buffer;
+    std::vector<iovec> iovs = buffer.writeBuffers(length);
+    size_t segmentSize;
+    size_t result = socket.receiveSegments(&iovs[0], iovs.size(),
+        segmentSize, from);
+    buffer.produce(result);
+    datagrams.clear();
+    // An empty datagram is still a datagram
+    if (result == 0)
+        datagrams.push_back(Buffer());
+    while (buffer.readAvailable() > 0) {
+        size_t datagram = std::min(segmentSize, buffer.readAvailable());
+        datagrams.push_back(Buffer());
+        datagrams.back().copyIn(buffer, datagram);
+        buffer.consume(datagram);
+    }
+    return datagrams.size();
+}
+
 }
@@ -2,10 +2,13 @@
 #define __MORDOR_SOCKET_STREAM_H__
 // Copyright (c) 2009 - Decho Corporation
 
+#include <vector>
+
 #include "stream.h"
 
 namespace Mordor {
 
+class Address;
 class Socket;
 
 class SocketStream : public Stream
@@ -20,6 +23,9 @@ public:
     bool supportsRead() { return true; }
     bool supportsWrite() { return true; }
     bool supportsCancel() { return true; }
+#ifdef LINUX
+    bool supportsSendFile() { return true; }
+#endif
 
     void close(CloseType type = BOTH);
 
@@ -28,6 +34,9 @@ public:
     void cancelRead();
     size_t write(const Buffer &buffer, size_t length);
     size_t write(const void *buffer, size_t length);
+#ifdef LINUX
+    size_t sendFile(int fd, long long offset, size_t length);
+#endif
     void cancelWrite();
 
     boost::signals2::connection onRemoteClose(
@@ -40,6 +49,13 @@ private:
     bool m_own;
 };
 
+/// Receive a datagram, or (with Socket::udpGro()) several coalesced ones,
+/// from socket, into a Buffer each (all sharing one allocation)
+/// @param length The most to receive at once
+/// @return How many datagrams were received
+size_t receiveSegments(Socket &socket, std::vector<Buffer> &datagrams,
+    Address *from = NULL, size_t length = 65536);
+
 }
 
 #endif
@@ -95,6 +95,14 @@ Stream::write(const Buffer &buffer, size_t length, bool coalesce)
     return write(iov.iov_base, iov.iov_len);
 }
 
+#ifndef WINDOWS
+size_t
+Stream::sendFile(int fd, long long offset, size_t length)
+{
+    MORDOR_NOTREACHED();
+}
+#endif
+
 long long
 Stream::seek(long long offset, Anchor anchor)
 {
@@ -81,6 +81,10 @@ public:
     virtual bool supportsFind() { return false; }
     /// @return If it is valid to call unread()
     virtual bool supportsUnread() { return false; }
+#ifndef WINDOWS
+    /// @return If it is valid to call sendFile()
+    virtual bool supportsSendFile() { return false; }
+#endif
 
     /// @brief Gracefully close the Stream
     /// @details
@@ -148,6 +152,21 @@ public:
     /// effect.
     virtual void cancelWrite() {}
 
+#ifndef WINDOWS
+    /// @brief Write data straight from a file descriptor
+    /// @details
+    /// Like write(), except the data is read from fd by the kernel
+    /// (sendfile()), without being copied through user space.  Only
+    /// Streams that write to a socket, and FilterStreams that pass data
+    /// through unchanged, support it; transferStream() uses it when it can.
+    /// @param offset Where in fd to start reading; fd's own position is
+    /// neither used nor changed
+    /// @return The amount actually written; 0 @b only if offset is at the
+    /// end of fd
+    /// @pre supportsSendFile()
+    virtual size_t sendFile(int fd, long long offset, size_t length);
+#endif
+
     /// @brief Change the current stream pointer
     /// @param offset Where to seek to
     /// @param anchor Where to seek from
@@ -6,29 +6,30 @@
 #include "mordor/exception.h"
 #include "mordor/log.h"
 #include "mordor/socket.h"
-#include "mordor/timer.h"
 
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:streams:timeout");
 
-static void cancelReadLocal(Stream::ptr stream, bool &flag, bool &flag2)
+void
+TimeoutStream::readTimedOut()
 {
-    if (!flag) {
+    if (!m_readTimedOut) {
         MORDOR_LOG_INFO(g_log) << "read timeout";
-        stream->cancelRead();
-        flag = flag2 = true;
+        parent()->cancelRead();
+        m_readTimedOut = m_permaReadTimedOut = true;
     } else {
         MORDOR_LOG_DEBUG(g_log) << "read timeout no longer registered";
     }
 }
 
-static void cancelWriteLocal(Stream::ptr stream, bool &flag, bool &flag2)
+void
+TimeoutStream::writeTimedOut()
 {
-    if (!flag) {
+    if (!m_writeTimedOut) {
         MORDOR_LOG_INFO(g_log) << "write timeout";
-        stream->cancelWrite();
-        flag = flag2 = true;
+        parent()->cancelWrite();
+        m_writeTimedOut = m_permaWriteTimedOut = true;
     } else {
         MORDOR_LOG_DEBUG(g_log) << "write timeout no longer registered";
     }
@@ -39,18 +40,12 @@ TimeoutStream::readTimeout(unsigned long long readTimeout)
 {
     FiberMutex::ScopedLock lock(m_mutex);
     m_readTimeout = readTimeout;
-    if (m_readTimer) {
-        if (readTimeout == ~0ull) {
-            m_readTimer->cancel();
-            m_readTimer.reset();
-        } else {
-            m_readTimer->reset(readTimeout, true);
-        }
-    } else if (m_readTimeout != ~0ull && !m_readTimedOut) {
-        m_readTimer = m_timerManager.registerTimer(m_readTimeout,
-            boost::bind(&cancelReadLocal, parent(),
-            boost::ref(m_readTimedOut), boost::ref(m_permaReadTimedOut)));
-    }
+    if (m_readTimedOut)
+        return;
+    if (readTimeout == ~0ull)
+        m_readDeadline.disarm();
+    else
+        m_readDeadline.arm(readTimeout);
 }
 
 void
@@ -58,18 +53,12 @@ TimeoutStream::writeTimeout(unsigned long long writeTimeout)
 {
     FiberMutex::ScopedLock lock(m_mutex);
     m_writeTimeout = writeTimeout;
-    if (m_writeTimer) {
-        if (writeTimeout == ~0ull) {
-            m_writeTimer->cancel();
-            m_writeTimer.reset();
-        } else {
-            m_writeTimer->reset(writeTimeout, true);
-        }
-    } else if (m_writeTimeout != ~0ull && !m_writeTimedOut) {
-        m_writeTimer = m_timerManager.registerTimer(m_writeTimeout,
-            boost::bind(&cancelWriteLocal, parent(),
-            boost::ref(m_writeTimedOut), boost::ref(m_permaWriteTimedOut)));
-    }
+    if (m_writeTimedOut)
+        return;
+    if (writeTimeout == ~0ull)
+        m_writeDeadline.disarm();
+    else
+        m_writeDeadline.arm(writeTimeout);
 }
 
 size_t
@@ -79,39 +68,27 @@ TimeoutStream::read(Buffer &buffer, size_t length)
     if (m_permaReadTimedOut)
         MORDOR_THROW_EXCEPTION(TimedOutException());
     m_readTimedOut = false;
-    MORDOR_ASSERT(!m_readTimer);
     if (m_readTimeout != ~0ull)
-        m_readTimer = m_timerManager.registerTimer(m_readTimeout,
-            boost::bind(&cancelReadLocal, parent(),
-            boost::ref(m_readTimedOut), boost::ref(m_permaReadTimedOut)));
+        m_readDeadline.arm(m_readTimeout);
     lock.unlock();
     size_t result;
     try {
         result = parent()->read(buffer, length);
     } catch (OperationAbortedException &) {
         lock.lock();
-        if (m_readTimer) {
-            m_readTimer->cancel();
-            m_readTimer.reset();
-        }
+        m_readDeadline.disarm();
         if (m_readTimedOut)
             MORDOR_THROW_EXCEPTION(TimedOutException());
         m_readTimedOut = true;
         throw;
     } catch (...) {
         lock.lock();
-        if (m_readTimer) {
-            m_readTimer->cancel();
-            m_readTimer.reset();
-        }
+        m_readDeadline.disarm();
         m_readTimedOut = true;
         throw;
     }
     lock.lock();
-    if (m_readTimer) {
-        m_readTimer->cancel();
-        m_readTimer.reset();
-    }
+    m_readDeadline.disarm();
     m_readTimedOut = true;
     return result;
 }
@@ -123,39 +100,27 @@ TimeoutStream::write(const Buffer &buffer, size_t length)
     if (m_permaWriteTimedOut)
         MORDOR_THROW_EXCEPTION(TimedOutException());
     m_writeTimedOut = false;
-    MORDOR_ASSERT(!m_writeTimer);
     if (m_writeTimeout != ~0ull)
-        m_writeTimer = m_timerManager.registerTimer(m_writeTimeout,
-            boost::bind(&cancelWriteLocal, parent(),
-            boost::ref(m_writeTimedOut), boost::ref(m_permaWriteTimedOut)));
+        m_writeDeadline.arm(m_writeTimeout);
     lock.unlock();
     size_t result;
     try {
         result = parent()->write(buffer, length);
     } catch (OperationAbortedException &) {
         lock.lock();
-        if (m_writeTimer) {
-            m_writeTimer->cancel();
-            m_writeTimer.reset();
-        }
+        m_writeDeadline.disarm();
         if (m_writeTimedOut)
             MORDOR_THROW_EXCEPTION(TimedOutException());
         m_writeTimedOut = true;
         throw;
     } catch (...) {
         lock.lock();
-        if (m_writeTimer) {
-            m_writeTimer->cancel();
-            m_writeTimer.reset();
-        }
+        m_writeDeadline.disarm();
         m_writeTimedOut = true;
         throw;
     }
     lock.lock();
-    if (m_writeTimer) {
-        m_writeTimer->cancel();
-        m_writeTimer.reset();
-    }
+    m_writeDeadline.disarm();
     m_writeTimedOut = true;
     return result;
 }
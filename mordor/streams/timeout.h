@@ -2,14 +2,14 @@
 #define __MORDOR_TIMEOUT_STREAM__
 // Copyright (c) 2010 - Decho Corporation
 
+#include <boost/bind.hpp>
+
 #include "filter.h"
 #include "mordor/fibersynchronization.h"
+#include "mordor/timer.h"
 
 namespace Mordor {
 
-class TimerManager;
-class Timer;
-
 class TimeoutStream : public FilterStream
 {
 public:
@@ -24,7 +24,11 @@ public:
           m_readTimedOut(true),
           m_writeTimedOut(true),
           m_permaReadTimedOut(false),
-          m_permaWriteTimedOut(false)
+          m_permaWriteTimedOut(false),
+          m_readDeadline(timerManager,
+              boost::bind(&TimeoutStream::readTimedOut, this)),
+          m_writeDeadline(timerManager,
+              boost::bind(&TimeoutStream::writeTimedOut, this))
     {}
 
     unsigned long long readTimeout() const { return m_readTimeout; }
@@ -35,11 +39,15 @@ public:
     size_t read(Buffer &buffer, size_t length);
     size_t write(const Buffer &buffer, size_t length);
 
+private:
+    void readTimedOut();
+    void writeTimedOut();
+
 private:
     TimerManager &m_timerManager;
     unsigned long long m_readTimeout, m_writeTimeout;
     bool m_readTimedOut, m_writeTimedOut, m_permaReadTimedOut, m_permaWriteTimedOut;
-    boost::shared_ptr<Timer> m_readTimer, m_writeTimer;
+    Deadline m_readDeadline, m_writeDeadline;
     FiberMutex m_mutex;
 };
 
@@ -4,6 +4,10 @@
 
 #include <boost/bind.hpp>
 
+#ifndef WINDOWS
+#include <sys/stat.h>
+#endif
+
 #include "mordor/assert.h"
 #include "mordor/fiber.h"
 #include "mordor/parallel.h"
@@ -11,6 +15,11 @@
 #include "mordor/streams/null.h"
 #include "stream.h"
 
+#ifndef WINDOWS
+#include "fd.h"
+#include "limited.h"
+#endif
+
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:stream:transfer");
@@ -31,6 +40,68 @@ static void writeOne(Stream &dst, Buffer *&buffer)
     }
 }
 
+#ifndef WINDOWS
+/// The regular file src reads from (possibly through a LimitedStream), so
+/// dst can be handed the descriptor instead of the data
+static FDStream *sendFileSource(Stream &src, LimitedStream *&limited)
+{
+    FDStream *fdStream = dynamic_cast<FDStream *>(&src);
+    limited = NULL;
+    if (!fdStream) {
+        limited = dynamic_cast<LimitedStream *>(&src);
+        if (!limited)
+            return NULL;
+        fdStream = dynamic_cast<FDStream *>(limited->parent().get());
+        if (!fdStream)
+            return NULL;
+    }
+    struct stat st;
+    if (fstat(fdStream->fd(), &st) || !S_ISREG(st.st_mode))
+        return NULL;
+    return fdStream;
+}
+
+static unsigned long long sendFile(FDStream &src, LimitedStream *limited,
+    Stream &dst, unsigned long long toTransfer, ExactLength exactLength)
+{
+    MORDOR_LOG_DEBUG(g_log) << "sending " << toTransfer << " bytes from "
+        << &src << " (fd " << src.fd() << ") to " << &dst;
+    unsigned long long totalSent = 0;
+    long long offset = src.tell();
+    while (totalSent < toTransfer) {
+        unsigned long long todo = toTransfer - totalSent;
+        if (limited)
+            todo = std::min<unsigned long long>(todo, limited->remaining());
+        if (todo == 0)
+            break;
+        // A bit at a time, so a cold file is read in (off of this thread)
+        // just ahead of sending it, instead of sendfile() blocking on it
+        size_t chunk = (size_t)std::min<unsigned long long>(todo, 1024 * 1024);
+        src.prefetch(offset, chunk);
+        size_t result = dst.sendFile(src.fd(), offset, chunk);
+        MORDOR_LOG_TRACE(g_log) << "sent " << result << " bytes to " << &dst;
+        if (result == 0) {
+            if (limited && limited->strict())
+                MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+            break;
+        }
+        // Keep src where read() would have left it
+        offset = src.seek(result, Stream::CURRENT);
+        if (limited)
+            limited->advance(result);
+        totalSent += result;
+    }
+    if (totalSent < toTransfer && exactLength == EXACT) {
+        MORDOR_LOG_ERROR(g_log) << "only read " << totalSent << "/"
+            << toTransfer << " from " << &src;
+        MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+    }
+    MORDOR_LOG_VERBOSE(g_log) << "sent " << totalSent << "/" << toTransfer
+        << " from " << &src << " to " << &dst;
+    return totalSent;
+}
+#endif
+
 unsigned long long transferStream(Stream &src, Stream &dst,
                                   unsigned long long toTransfer,
                                   ExactLength exactLength)
@@ -51,6 +122,16 @@ unsigned long long transferStream(Stream &src, Stream &dst,
         exactLength = (toTransfer == ~0ull ? UNTILEOF : EXACT);
     MORDOR_ASSERT(exactLength == EXACT || exactLength == UNTILEOF);
 
+#ifndef WINDOWS
+    // Straight from a file to a socket, without a trip through user space
+    if (dst.supportsSendFile()) {
+        LimitedStream *limited;
+        FDStream *fdStream = sendFileSource(src, limited);
+        if (fdStream)
+            return sendFile(*fdStream, limited, dst, toTransfer, exactLength);
+    }
+#endif
+
     readBuffer = &buf1;
     todo = chunkSize;
     if (toTransfer - totalRead < (unsigned long long)todo)
@@ -16,6 +16,13 @@ enum ExactLength
     UNTILEOF
 };
 
+/// Copy toTransfer bytes from src to dst
+
+/// A regular file (an FDStream, or a LimitedStream on one) going to a Stream
+/// that supportsSendFile() is sent with sendfile(), a megabyte at a time;
+/// any of it not already in the page cache is read in first through
+/// FDStream::prefetch(), so the disk I/O doesn't block this thread (as long
+/// as the file isn't evicted or grown in between)
 unsigned long long transferStream(Stream &src, Stream &dst,
                                   unsigned long long toTransfer = ~0ull,
                                   ExactLength exactLength = INFER);
@@ -0,0 +1,188 @@
+#ifndef __MORDOR_TASK_H__
+#define __MORDOR_TASK_H__
+// Copyright (c) 2010 - Decho Corporation
+
+#include <stddef.h>
+
+#include <new>
+#include <typeinfo>
+
+#include <boost/function.hpp>
+#include <boost/type_traits/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+
+#include "atomic.h"
+
+namespace Mordor {
+
+/// A function object taking no arguments, like boost::function<void ()>
+
+/// Unlike boost::function, functors of up to BUFFER_SIZE bytes (such as a
+/// boost::bind of a member function and a few arguments) are stored inside
+/// the Task itself, so creating and copying them doesn't touch the heap.
+/// Larger functors are copied to the heap once, and shared (not copied) when
+/// the Task is copied.
+class Task
+{
+public:
+    enum { BUFFER_SIZE = 48 };
+
+private:
+    typedef boost::aligned_storage<BUFFER_SIZE> Buffer;
+    typedef void (Task::*unspecified_bool_type)();
+
+    struct Ops
+    {
+        void (*invoke)(Task &task);
+        void (*copy)(const Task &from, Task &to);
+        void (*destroy)(Task &task);
+        const std::type_info &(*type)();
+        const void *(*target)(const Task &task);
+    };
+
+    template <class F, bool Inline = sizeof(F) <= BUFFER_SIZE &&
+        boost::alignment_of<F>::value <= boost::alignment_of<Buffer>::value>
+    struct Impl
+    {
+        static F &get(const Task &task)
+        { return *(F *)task.m_buffer.address(); }
+        static void create(Task &task, const F &f)
+        { new (task.m_buffer.address()) F(f); }
+        static void invoke(Task &task) { get(task)(); }
+        static void copy(const Task &from, Task &to) { create(to, get(from)); }
+        static void destroy(Task &task) { get(task).~F(); }
+        static const std::type_info &type() { return typeid(F); }
+        static const void *target(const Task &task) { return &get(task); }
+        static const Ops ops;
+    };
+
+    template <class F>
+    struct Impl<F, false>
+    {
+        struct Shared
+        {
+            Shared(const F &f) : f(f), refs(1) {}
+            F f;
+            volatile size_t refs;
+        };
+
+        static Shared *&get(const Task &task)
+        { return *(Shared **)task.m_buffer.address(); }
+        static void create(Task &task, const F &f)
+        { get(task) = new Shared(f); }
+        static void invoke(Task &task) { get(task)->f(); }
+        static void copy(const Task &from, Task &to)
+        {
+            atomicIncrement(get(from)->refs);
+            get(to) = get(from);
+        }
+        static void destroy(Task &task)
+        {
+            if (atomicDecrement(get(task)->refs) == 0)
+                delete get(task);
+        }
+        static const std::type_info &type() { return typeid(F); }
+        static const void *target(const Task &task) { return &get(task)->f; }
+        static const Ops ops;
+    };
+
+public:
+    Task() : m_ops(NULL) {}
+    /// An empty boost::function gives an empty Task
+    Task(const boost::function<void ()> &dg)
+        : m_ops(NULL)
+    {
+        if (dg)
+            init(dg);
+    }
+    Task(void (*fn)())
+        : m_ops(NULL)
+    {
+        if (fn)
+            init(fn);
+    }
+    template <class F>
+    Task(const F &f)
+        : m_ops(NULL)
+    {
+        init(f);
+    }
+    Task(const Task &copy)
+        : m_ops(copy.m_ops)
+    {
+        if (m_ops)
+            m_ops->copy(copy, *this);
+    }
+    ~Task() { clear(); }
+
+    Task &operator =(const Task &rhs)
+    {
+        if (this != &rhs) {
+            clear();
+            if (rhs.m_ops)
+                rhs.m_ops->copy(rhs, *this);
+            m_ops = rhs.m_ops;
+        }
+        return *this;
+    }
+
+    void operator()() { m_ops->invoke(*this); }
+
+    /// Destroy the functor (releasing anything bound into it)
+    void clear()
+    {
+        if (m_ops) {
+            m_ops->destroy(*this);
+            m_ops = NULL;
+        }
+    }
+    bool empty() const { return m_ops == NULL; }
+    operator unspecified_bool_type() const
+    { return m_ops ? &Task::operator() : NULL; }
+
+    /// The type of the functor, as for boost::function
+    const std::type_info &target_type() const
+    { return m_ops ? m_ops->type() : typeid(void); }
+    /// The functor, if it's a T, as for boost::function
+    template <class T>
+    const T *target() const
+    {
+        if (!m_ops || m_ops->type() != typeid(T))
+            return NULL;
+        return (const T *)m_ops->target(*this);
+    }
+
+private:
+    template <class F>
+    void init(const F &f)
+    {
+        Impl<F>::create(*this, f);
+        m_ops = &Impl<F>::ops;
+    }
+
+private:
+    const Ops *m_ops;
+    Buffer m_buffer;
+};
+
+template <class F, bool Inline>
+const Task::Ops Task::Impl<F, Inline>::ops = {
+    &Task::Impl<F, Inline>::invoke,
+    &Task::Impl<F, Inline>::copy,
+    &Task::Impl<F, Inline>::destroy,
+    &Task::Impl<F, Inline>::type,
+    &Task::Impl<F, Inline>::target
+};
+
+template <class F>
+const Task::Ops Task::Impl<F, false>::ops = {
+    &Task::Impl<F, false>::invoke,
+    &Task::Impl<F, false>::copy,
+    &Task::Impl<F, false>::destroy,
+    &Task::Impl<F, false>::type,
+    &Task::Impl<F, false>::target
+};
+
+}
+
+#endif
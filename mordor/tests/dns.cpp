@@ -0,0 +1,398 @@
+// Copyright (c) 2010 - Decho Corporation
+
+#include <stdio.h>
+
+#include <boost/bind.hpp>
+
+#include "mordor/dns.h"
+#include "mordor/iomanager.h"
+#include "mordor/parallel.h"
+#include "mordor/sleep.h"
+#include "mordor/socket.h"
+#include "mordor/test/test.h"
+
+using namespace Mordor;
+using namespace Mordor::DNS;
+using namespace Mordor::Test;
+
+namespace {
+/// Stands in for a name server, answering for a few names under "test"
+struct Server
+{
+    Server(IOManager &ioManager)
+        : ioManager(ioManager),
+          queries(0),
+          tcpQueries(0)
+    {
+        socket.reset(new Socket(ioManager, AF_INET, SOCK_DGRAM, IPPROTO_UDP));
+        socket->bind(Address::lookup("127.0.0.1:0", AF_INET,
+            SOCK_DGRAM).front());
+        address = socket->localAddress();
+    }
+
+    /// Also answer over TCP, on the same port
+    void listenTcp()
+    {
+        listen.reset(new Socket(ioManager, AF_INET, SOCK_STREAM,
+            IPPROTO_TCP));
+        listen->bind(address);
+        listen->listen();
+    }
+
+    IOManager &ioManager;
+    Socket::ptr socket, listen;
+    Address::ptr address;
+    int queries, tcpQueries;
+};
+}
+
+static std::string
+encode(const std::string &name)
+{
+    std::string result;
+    size_t start = 0;
+    while (start < name.size()) {
+        size_t end = name.find('.', start);
+        if (end == std::string::npos)
+            end = name.size();
+        result.append(1, (char)(end - start));
+        result.append(name, start, end - start);
+        start = end + 1;
+    }
+    result.append(1, '\0');
+    return result;
+}
+
+static void
+appendRecord(std::string &reply, const std::string &owner,
+    unsigned short type, unsigned int ttl, const std::string &data)
+{
+    reply.append(owner);
+    reply.append(1, (char)(type >> 8));
+    reply.append(1, (char)type);
+    reply.append("\0\1", 2);
+    reply.append(1, (char)(ttl >> 24));
+    reply.append(1, (char)(ttl >> 16));
+    reply.append(1, (char)(ttl >> 8));
+    reply.append(1, (char)ttl);
+    reply.append(1, (char)(data.size() >> 8));
+    reply.append(1, (char)data.size());
+    reply.append(data);
+}
+
+/// The reply to query (from from, or over TCP if it's NULL), or an empty
+/// string for no reply
+static std::string
+respond(Server &server, const unsigned char *query, size_t length,
+    const Address *from)
+{
+    bool tcp = from == NULL;
+    // Compression pointer to the name in the question
+    const std::string question("\xc0\x0c", 2);
+    const std::string www("\xc0\x00\x02\x01", 4);
+    ++(tcp ? server.tcpQueries : server.queries);
+    std::string name;
+    size_t offset = 12;
+    while (offset < length && query[offset]) {
+        if (!name.empty())
+            name.append(1, '.');
+        name.append((const char *)query + offset + 1, query[offset]);
+        offset += query[offset] + 1;
+    }
+    offset += 1;
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(offset + 4, length);
+    unsigned short type = (query[offset] << 8) | query[offset + 1];
+    std::string reply((const char *)query, offset + 4);
+    // Response, recursion desired and available, NOERROR
+    reply[2] = (char)0x81;
+    reply[3] = (char)0x80;
+    unsigned short answers = 0, authorities = 0;
+    if (name == "slow.test") {
+        return std::string();
+    } else if (name == "delayed.test" && type == 1) {
+        sleep(server.ioManager, 50000);
+        appendRecord(reply, question, 1, 300, www);
+        ++answers;
+    } else if (name == "www.test" && type == 1) {
+        appendRecord(reply, question, 1, 300, www);
+        ++answers;
+    } else if (name == "zero.test" && type == 1) {
+        appendRecord(reply, question, 1, 0, www);
+        ++answers;
+    } else if (name == "alias.test" && type == 1) {
+        appendRecord(reply, question, 5, 300, encode("www.test"));
+        appendRecord(reply, encode("www.test"), 1, 300, www);
+        answers += 2;
+    } else if (name == "missing.test") {
+        reply[3] |= 3;
+        // MNAME, RNAME, SERIAL, REFRESH, RETRY, EXPIRE and MINIMUM
+        std::string soa = encode("ns.test") + encode("admin.test") +
+            std::string(16, '\0') + std::string("\0\0\0\x3c", 4);
+        appendRecord(reply, encode("test"), 6, 600, soa);
+        ++authorities;
+    } else if (name == "chatty.test" && !tcp) {
+        // Replies to some other query, every 30ms, for 300ms
+        std::string other(reply);
+        other[0] = ~other[0];
+        for (int i = 0; i < 10; ++i) {
+            sleep(server.ioManager, 30000);
+            server.socket->sendTo(other.data(), other.size(), 0, *from);
+        }
+        return std::string();
+    } else if ((name == "big.test" || name == "cutoff.test") && type == 1) {
+        // Too big for UDP; over TCP, big.test has an answer, and cutoff.test
+        // hangs up
+        if (!tcp) {
+            reply[2] |= 0x02;
+        } else if (name == "big.test") {
+            appendRecord(reply, question, 1, 300, www);
+            ++answers;
+        } else {
+            return std::string();
+        }
+    }
+    reply[7] = (char)answers;
+    reply[9] = (char)authorities;
+    return reply;
+}
+
+static void
+serve(Server &server)
+{
+    unsigned char query[512];
+    while (true) {
+        Address::ptr from = server.socket->emptyAddress();
+        size_t length;
+        try {
+            length = server.socket->receiveFrom(query, sizeof(query), *from);
+        } catch (OperationAbortedException &) {
+            return;
+        }
+        std::string reply = respond(server, query, length, from.get());
+        if (!reply.empty())
+            server.socket->sendTo(reply.data(), reply.size(), 0, *from);
+    }
+}
+
+static void
+serveTcp(Server &server)
+{
+    unsigned char query[512];
+    while (true) {
+        Socket::ptr sock;
+        try {
+            sock = server.listen->accept();
+        } catch (OperationAbortedException &) {
+            return;
+        }
+        unsigned char prefix[2];
+        MORDOR_TEST_ASSERT_EQUAL(sock->receive(prefix, 2), 2u);
+        size_t length = (prefix[0] << 8) | prefix[1];
+        MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(length, sizeof(query));
+        MORDOR_TEST_ASSERT_EQUAL(sock->receive(query, length), length);
+        std::string reply = respond(server, query, length, NULL);
+        if (reply.empty())
+            continue;
+        std::string message;
+        message.append(1, (char)(reply.size() >> 8));
+        message.append(1, (char)(reply.size() & 0xff));
+        message.append(reply);
+        MORDOR_TEST_ASSERT_EQUAL(sock->send(message.data(), message.size()),
+            message.size());
+    }
+}
+
+static void
+lookupOne(Resolver &resolver, const std::string &host)
+{
+    std::vector<Address::ptr> addresses = resolver.lookup(host, AF_INET,
+        SOCK_STREAM);
+    MORDOR_TEST_ASSERT_EQUAL(addresses.size(), 1u);
+}
+
+static std::string
+toString(const Address::ptr &address)
+{
+    std::ostringstream os;
+    os << *address;
+    return os.str();
+}
+
+MORDOR_UNITTEST(DNS, lookupAndCache)
+{
+    IOManager ioManager;
+    Server server(ioManager);
+    ioManager.schedule(boost::bind(&serve, boost::ref(server)));
+    Resolver resolver(ioManager, "", "");
+    resolver.nameServers(std::vector<Address::ptr>(1, server.address));
+
+    // Both an A and an AAAA query; there's no IPv6 address
+    std::vector<Address::ptr> addresses = resolver.lookup("www.test:80",
+        AF_UNSPEC, SOCK_STREAM);
+    MORDOR_TEST_ASSERT_EQUAL(addresses.size(), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(toString(addresses.front()), "192.0.2.1:80");
+    MORDOR_TEST_ASSERT_EQUAL(addresses.front()->type(), SOCK_STREAM);
+    MORDOR_TEST_ASSERT_EQUAL(server.queries, 2);
+
+    // Cached, case-insensitively; without a type, one for each
+    addresses = resolver.lookup("WWW.Test:53", AF_UNSPEC);
+    MORDOR_TEST_ASSERT_EQUAL(addresses.size(), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(addresses[0]->type(), SOCK_STREAM);
+    MORDOR_TEST_ASSERT_EQUAL(addresses[1]->type(), SOCK_DGRAM);
+    MORDOR_TEST_ASSERT_EQUAL(server.queries, 2);
+
+    // Through a CNAME
+    lookupOne(resolver, "alias.test");
+    MORDOR_TEST_ASSERT_EQUAL(server.queries, 3);
+
+    // A TTL of 0 isn't cached
+    lookupOne(resolver, "zero.test");
+    lookupOne(resolver, "zero.test");
+    MORDOR_TEST_ASSERT_EQUAL(server.queries, 5);
+
+    resolver.clearCache();
+    lookupOne(resolver, "www.test");
+    MORDOR_TEST_ASSERT_EQUAL(server.queries, 6);
+
+    server.socket->cancelReceive();
+}
+
+MORDOR_UNITTEST(DNS, negativeCache)
+{
+    IOManager ioManager;
+    Server server(ioManager);
+    ioManager.schedule(boost::bind(&serve, boost::ref(server)));
+    Resolver resolver(ioManager, "", "");
+    resolver.nameServers(std::vector<Address::ptr>(1, server.address));
+
+    MORDOR_TEST_ASSERT_EXCEPTION(resolver.lookup("missing.test", AF_INET),
+        HostNotFoundException);
+    MORDOR_TEST_ASSERT_EXCEPTION(resolver.lookup("missing.test", AF_INET),
+        HostNotFoundException);
+    MORDOR_TEST_ASSERT_EQUAL(server.queries, 1);
+
+    // The name exists, but has no IPv6 address
+    MORDOR_TEST_ASSERT_EXCEPTION(resolver.lookup("www.test", AF_INET6),
+        NoNameServerDataException);
+    MORDOR_TEST_ASSERT_EXCEPTION(resolver.lookup("www.test", AF_INET6),
+        NoNameServerDataException);
+    MORDOR_TEST_ASSERT_EQUAL(server.queries, 2);
+
+    server.socket->cancelReceive();
+}
+
+MORDOR_UNITTEST(DNS, coalesce)
+{
+    IOManager ioManager;
+    Server server(ioManager);
+    ioManager.schedule(boost::bind(&serve, boost::ref(server)));
+    Resolver resolver(ioManager, "", "");
+    resolver.nameServers(std::vector<Address::ptr>(1, server.address));
+
+    std::vector<boost::function<void ()> > dgs;
+    for (int i = 0; i < 4; ++i)
+        dgs.push_back(boost::bind(&lookupOne, boost::ref(resolver),
+            "delayed.test"));
+    parallel_do(dgs);
+    MORDOR_TEST_ASSERT_EQUAL(server.queries, 1);
+
+    server.socket->cancelReceive();
+}
+
+MORDOR_UNITTEST(DNS, timeout)
+{
+    IOManager ioManager;
+    Server server(ioManager);
+    ioManager.schedule(boost::bind(&serve, boost::ref(server)));
+    Resolver resolver(ioManager, "", "");
+    resolver.nameServers(std::vector<Address::ptr>(1, server.address));
+    resolver.timeout(100000);
+    resolver.attempts(2);
+
+    unsigned long long start = TimerManager::now();
+    MORDOR_TEST_ASSERT_EXCEPTION(resolver.lookup("slow.test", AF_INET),
+        TemporaryNameServerFailureException);
+    MORDOR_TEST_ASSERT_ABOUT_EQUAL(start + 200000, TimerManager::now(),
+        50000);
+    MORDOR_TEST_ASSERT_EQUAL(server.queries, 2);
+    // Failures to get an answer aren't cached
+    MORDOR_TEST_ASSERT_EXCEPTION(resolver.lookup("slow.test", AF_INET),
+        TemporaryNameServerFailureException);
+    MORDOR_TEST_ASSERT_EQUAL(server.queries, 4);
+
+    // Replies to some other query don't buy the name server more time
+    resolver.attempts(1);
+    start = TimerManager::now();
+    MORDOR_TEST_ASSERT_EXCEPTION(resolver.lookup("chatty.test", AF_INET),
+        TemporaryNameServerFailureException);
+    MORDOR_TEST_ASSERT_ABOUT_EQUAL(start + 100000, TimerManager::now(),
+        50000);
+    // Let it finish
+    sleep(ioManager, 250000);
+
+    server.socket->cancelReceive();
+}
+
+MORDOR_UNITTEST(DNS, truncated)
+{
+    IOManager ioManager;
+    Server server(ioManager);
+    server.listenTcp();
+    ioManager.schedule(boost::bind(&serve, boost::ref(server)));
+    ioManager.schedule(boost::bind(&serveTcp, boost::ref(server)));
+    Resolver resolver(ioManager, "", "");
+    resolver.nameServers(std::vector<Address::ptr>(1, server.address));
+    resolver.timeout(100000);
+    resolver.attempts(1);
+
+    // Asked again over TCP
+    lookupOne(resolver, "big.test");
+    MORDOR_TEST_ASSERT_EQUAL(server.queries, 1);
+    MORDOR_TEST_ASSERT_EQUAL(server.tcpQueries, 1);
+
+    // A truncated reply with nothing in it isn't taken (or cached) as a
+    // name with no addresses
+    MORDOR_TEST_ASSERT_EXCEPTION(resolver.lookup("cutoff.test", AF_INET),
+        TemporaryNameServerFailureException);
+    MORDOR_TEST_ASSERT_EXCEPTION(resolver.lookup("cutoff.test", AF_INET),
+        TemporaryNameServerFailureException);
+    MORDOR_TEST_ASSERT_EQUAL(server.queries, 3);
+    MORDOR_TEST_ASSERT_EQUAL(server.tcpQueries, 3);
+
+    server.socket->cancelReceive();
+    server.listen->cancelAccept();
+}
+
+MORDOR_UNITTEST(DNS, hosts)
+{
+    char path[] = "/tmp/mordorXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mkstemp");
+    const char hosts[] = "# comment\n10.1.2.3 myhost MyAlias # comment\n"
+        "::1 ip6host\n";
+    ssize_t written = write(fd, hosts, sizeof(hosts) - 1);
+    close(fd);
+    MORDOR_TEST_ASSERT_EQUAL(written, (ssize_t)sizeof(hosts) - 1);
+
+    IOManager ioManager;
+    try {
+        Resolver resolver(ioManager, "", path);
+        std::vector<Address::ptr> addresses = resolver.lookup("myalias:80",
+            AF_INET, SOCK_STREAM);
+        MORDOR_TEST_ASSERT_EQUAL(addresses.size(), 1u);
+        MORDOR_TEST_ASSERT_EQUAL(toString(addresses.front()), "10.1.2.3:80");
+        addresses = resolver.lookup("ip6host", AF_UNSPEC, SOCK_STREAM);
+        MORDOR_TEST_ASSERT_EQUAL(addresses.size(), 1u);
+        MORDOR_TEST_ASSERT_EQUAL(addresses.front()->family(), AF_INET6);
+        // Literals never need a name server
+        addresses = resolver.lookup("192.0.2.7:8080", AF_UNSPEC,
+            SOCK_STREAM);
+        MORDOR_TEST_ASSERT_EQUAL(toString(addresses.front()),
+            "192.0.2.7:8080");
+    } catch (...) {
+        unlink(path);
+        throw;
+    }
+    unlink(path);
+}
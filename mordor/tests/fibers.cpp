@@ -2,8 +2,11 @@
 
 #include <boost/bind.hpp>
 
+#include "mordor/config.h"
 #include "mordor/fiber.h"
+#include "mordor/statistics.h"
 #include "mordor/test/test.h"
+#include "mordor/workerpool.h"
 
 using namespace Mordor;
 using namespace Mordor::Test;
@@ -601,3 +604,116 @@ MORDOR_UNITTEST(Fibers, exceptionDestructsBeforeFiberDestructs)
     }
     MORDOR_TEST_ASSERT_EQUAL(++sequence, 7);
 }
+
+#ifndef WINDOWS
+static void incrementSequence(int &sequence)
+{
+    ++sequence;
+}
+
+MORDOR_UNITTEST(Fibers, stackCacheReuse)
+{
+    CountStatistic<unsigned long long> *hits =
+        dynamic_cast<CountStatistic<unsigned long long> *>(
+            Statistics::lookup("fiber.stackcache.hits"));
+    MORDOR_TEST_ASSERT(hits);
+    int sequence = 0;
+    {
+        Fiber::ptr fiber(new Fiber(boost::bind(&incrementSequence,
+            boost::ref(sequence))));
+        fiber->call();
+    }
+    unsigned long long before = hits->count;
+    {
+        // Same (default) size; should come right back out of the cache
+        Fiber::ptr fiber(new Fiber(boost::bind(&incrementSequence,
+            boost::ref(sequence))));
+        fiber->call();
+    }
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 2);
+    MORDOR_TEST_ASSERT_GREATER_THAN(hits->count, before);
+}
+#endif
+
+static void useStack(int depth)
+{
+    volatile char buffer[1024];
+    buffer[0] = 0;
+    if (depth > 1)
+        useStack(depth - 1);
+    buffer[0] = buffer[0] + 1;
+}
+
+namespace {
+struct StackUser
+{
+    void operator()() { useStack(64); }
+};
+
+struct ScheduledStackUser
+{
+    void operator()() { useStack(64); }
+};
+}
+
+/// The high-water mark profiled for entry points named like name
+static size_t stackProfileMax(const char *name)
+{
+    size_t maxUsed = 0;
+    for (Statistics::StatisticsCache::const_iterator it =
+        Statistics::statistics().begin();
+        it != Statistics::statistics().end();
+        ++it) {
+        if (it->first.find("fiber.stack.") != 0 ||
+            it->first.find(name) == std::string::npos)
+            continue;
+        const AverageMinMaxStatistic<size_t> *stat =
+            dynamic_cast<const AverageMinMaxStatistic<size_t> *>(
+                it->second.second.get());
+        MORDOR_TEST_ASSERT(stat);
+        maxUsed = stat->max.max;
+    }
+    return maxUsed;
+}
+
+MORDOR_UNITTEST(Fibers, stackProfile)
+{
+    ConfigVarBase::ptr profile = Config::lookup("fiber.stackprofile");
+    MORDOR_TEST_ASSERT(profile);
+    profile->fromString("1");
+    try {
+        Fiber::ptr fiber(new Fiber(StackUser()));
+        fiber->call();
+        MORDOR_TEST_ASSERT_EQUAL(fiber->state(), Fiber::TERM);
+        // Measured when the fiber is reset (or destroyed)
+        fiber->reset();
+    } catch (...) {
+        profile->fromString("0");
+        throw;
+    }
+    profile->fromString("0");
+    size_t maxUsed = stackProfileMax("::StackUser");
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(maxUsed, 64 * 1024u);
+    MORDOR_TEST_ASSERT_LESS_THAN(maxUsed, 1024 * 1024u);
+}
+
+MORDOR_UNITTEST(Fibers, stackProfileScheduled)
+{
+    ConfigVarBase::ptr profile = Config::lookup("fiber.stackprofile");
+    MORDOR_TEST_ASSERT(profile);
+    profile->fromString("1");
+    try {
+        WorkerPool pool(1, false);
+        // Scheduled functors share a Fiber; each is profiled as itself
+        pool.schedule(ScheduledStackUser());
+        pool.schedule(ScheduledStackUser());
+        pool.stop();
+    } catch (...) {
+        profile->fromString("0");
+        throw;
+    }
+    profile->fromString("0");
+    size_t maxUsed = stackProfileMax("ScheduledStackUser");
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(maxUsed, 64 * 1024u);
+    MORDOR_TEST_ASSERT_LESS_THAN(maxUsed, 1024 * 1024u);
+}
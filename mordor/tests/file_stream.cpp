@@ -2,6 +2,15 @@
 
 #include "mordor/pch.h"
 
+#include <boost/bind.hpp>
+
+#ifndef WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#include "mordor/iomanager.h"
+#include "mordor/parallel.h"
 #include "mordor/streams/file.h"
 #include "mordor/test/test.h"
 
@@ -133,4 +142,77 @@ MORDOR_UNITTEST(FileStream, openSymlinkToNothing)
     }
     unlink(sym.c_str());
 }
+
+static void
+readAt(FileStream &stream, long long offset, char expected)
+{
+    char buffer[16];
+    MORDOR_TEST_ASSERT_EQUAL(stream.pread(buffer, 16, offset), 16u);
+    for (size_t i = 0; i < 16; ++i)
+        MORDOR_TEST_ASSERT_EQUAL(buffer[i], expected);
+}
+
+MORDOR_UNITTEST(FileStream, ioManager)
+{
+    IOManager ioManager;
+    FileStream stream(tempfilename(), FileStream::READWRITE,
+        (FileStream::CreateFlags)(FileStream::CREATE |
+        FileStream::DELETE_ON_CLOSE), &ioManager);
+    char block[4096];
+    for (int i = 0; i < 4; ++i) {
+        memset(block, 'a' + i, sizeof(block));
+        MORDOR_TEST_ASSERT_EQUAL(stream.write(block, sizeof(block)),
+            sizeof(block));
+    }
+    MORDOR_TEST_ASSERT_EQUAL(stream.seek(0, Stream::CURRENT), 16384);
+    MORDOR_TEST_ASSERT_EQUAL(stream.size(), 16384);
+
+    std::vector<boost::function<void ()> > dgs;
+    for (int i = 0; i < 4; ++i)
+        dgs.push_back(boost::bind(&readAt, boost::ref(stream),
+            i * 4096 + 100, 'a' + i));
+    parallel_do(dgs);
+    // pread doesn't move the position
+    MORDOR_TEST_ASSERT_EQUAL(stream.seek(0, Stream::CURRENT), 16384);
+
+    MORDOR_TEST_ASSERT_EQUAL(stream.seek(4096, Stream::BEGIN), 4096);
+    char c;
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(&c, 1), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(c, 'b');
+    MORDOR_TEST_ASSERT_EQUAL(stream.seek(0, Stream::CURRENT), 4097);
+    MORDOR_TEST_ASSERT_EQUAL(stream.seek(-1, Stream::END), 16383);
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(&c, 1), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(c, 'd');
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(&c, 1), 0u);
+}
+
+MORDOR_UNITTEST(FileStream, prefetch)
+{
+    IOManager ioManager;
+    FileStream stream(tempfilename(), FileStream::READWRITE,
+        (FileStream::CreateFlags)(FileStream::CREATE |
+        FileStream::DELETE_ON_CLOSE), &ioManager);
+    std::string data(65536 + 100, 'x');
+    MORDOR_TEST_ASSERT_EQUAL(stream.write(data.c_str(), data.size()),
+        data.size());
+    // Push it out of the page cache, if the filesystem allows it
+    fdatasync(stream.fd());
+    posix_fadvise(stream.fd(), 0, 0, POSIX_FADV_DONTNEED);
+
+    // Past EOF, too
+    stream.prefetch(100, 1024 * 1024);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t pages = (data.size() + pageSize - 1) / pageSize;
+    void *addr = mmap(NULL, data.size(), PROT_READ, MAP_SHARED, stream.fd(),
+        0);
+    MORDOR_TEST_ASSERT(addr != MAP_FAILED);
+    std::vector<unsigned char> resident(pages);
+    MORDOR_TEST_ASSERT_EQUAL(mincore(addr, data.size(), &resident[0]), 0);
+    munmap(addr, data.size());
+    for (size_t i = 0; i < pages; ++i)
+        MORDOR_TEST_ASSERT(resident[i] & 1);
+    // Doesn't move the position
+    MORDOR_TEST_ASSERT_EQUAL(stream.seek(0, Stream::CURRENT),
+        (long long)data.size());
+}
 #endif
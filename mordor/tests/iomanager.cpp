@@ -2,8 +2,14 @@
 
 #include <boost/bind.hpp>
 
+#include "mordor/atomic.h"
+#include "mordor/config.h"
 #include "mordor/iomanager.h"
+#include "mordor/sleep.h"
+#include "mordor/statistics.h"
+#include "mordor/streams/fd.h"
 #include "mordor/test/test.h"
+#include "mordor/thread.h"
 
 using namespace Mordor;
 using namespace Mordor::Test;
@@ -36,3 +42,215 @@ MORDOR_UNITTEST(IOManager, laterTimer)
     ++sequence;
     MORDOR_TEST_ASSERT_EQUAL(sequence, 2);
 }
+
+#ifdef IOURING
+static void
+registeredBuffers(IOManager &manager)
+{
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    FDStream reader(fds[0], &manager), writer(fds[1], &manager);
+    char buffers[2][16];
+    std::vector<iovec> iovs(2);
+    iovs[0].iov_base = buffers[0];
+    iovs[0].iov_len = sizeof(buffers[0]);
+    iovs[1].iov_base = buffers[1];
+    iovs[1].iov_len = sizeof(buffers[1]);
+    manager.registerBuffers(iovs);
+    MORDOR_TEST_ASSERT_EQUAL(manager.registeredBuffer(buffers[1] + 4, 12), 1);
+    MORDOR_TEST_ASSERT_EQUAL(manager.registeredBuffer(buffers[1] + 4, 13), -1);
+
+    memcpy(buffers[0], "hello", 5);
+    MORDOR_TEST_ASSERT_EQUAL(writer.write(buffers[0], 5), 5u);
+    MORDOR_TEST_ASSERT_EQUAL(reader.read(buffers[1], 16), 5u);
+    MORDOR_TEST_ASSERT_EQUAL(memcmp(buffers[1], "hello", 5), 0);
+    manager.registerBuffers(std::vector<iovec>());
+}
+
+MORDOR_UNITTEST(IOManager, registeredBuffers)
+{
+    IOManager manager;
+    manager.schedule(boost::bind(&registeredBuffers, boost::ref(manager)));
+    manager.dispatch();
+}
+#endif
+
+#if defined(LINUX) && !defined(IOURING)
+static unsigned long long
+spinHits()
+{
+    CountStatistic<unsigned long long> *stat =
+        dynamic_cast<CountStatistic<unsigned long long> *>(
+            Statistics::lookup("iomanager.spin.hits"));
+    MORDOR_TEST_ASSERT(stat);
+    return stat->count;
+}
+
+static void
+writeLater(int fd)
+{
+    Mordor::sleep(20000);
+    MORDOR_TEST_ASSERT_EQUAL(write(fd, "x", 1), 1);
+}
+
+static void
+busyPoll(IOManager &manager, int fd)
+{
+    FDStream reader(fd, &manager);
+    unsigned long long hits = spinHits();
+    char c;
+    MORDOR_TEST_ASSERT_EQUAL(reader.read(&c, 1), 1u);
+    // The idle thread was still polling when the write landed
+    MORDOR_TEST_ASSERT_GREATER_THAN(spinHits(), hits);
+}
+
+MORDOR_UNITTEST(IOManager, busyPoll)
+{
+    IOManager manager;
+    manager.busyPoll(5000000ull);
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    manager.schedule(boost::bind(&busyPoll, boost::ref(manager), fds[0]));
+    Thread writer(boost::bind(&writeLater, fds[1]));
+    manager.dispatch();
+    writer.join();
+    close(fds[1]);
+}
+
+static void
+readPipe(IOManager &manager, int fd, volatile int &blocked, volatile int &read)
+{
+    FDStream reader(fd, &manager, NULL, false);
+    atomicIncrement(blocked);
+    char c;
+    MORDOR_TEST_ASSERT_EQUAL(reader.read(&c, 1), 1u);
+    atomicIncrement(read);
+}
+
+MORDOR_UNITTEST(IOManager, perThreadShrink)
+{
+    ConfigVarBase::ptr perThread =
+        Config::lookup("iomanager.epoll.perthread");
+    MORDOR_TEST_ASSERT(perThread);
+    std::string wasPerThread = perThread->toString();
+    perThread->fromString("1");
+    IOManager manager(3, false);
+    perThread->fromString(wasPerThread);
+    MORDOR_TEST_ASSERT(manager.perThread());
+
+    // A reader waiting in each thread's epoll set
+    std::vector<tid_t> threads = manager.threadIds();
+    MORDOR_TEST_ASSERT_EQUAL(threads.size(), 3u);
+    int fds[3][2];
+    volatile int blocked = 0, read = 0;
+    for (size_t i = 0; i < 3; ++i) {
+        MORDOR_TEST_ASSERT_EQUAL(pipe(fds[i]), 0);
+        manager.schedule(boost::bind(&readPipe, boost::ref(manager),
+            fds[i][0], boost::ref(blocked), boost::ref(read)), threads[i]);
+    }
+    while (blocked < 3)
+        Mordor::sleep(1000);
+    Mordor::sleep(10000);
+
+    // Two of them retire; whoever is left has to wake up all three readers
+    manager.threadCount(1);
+    while (manager.threadIds().size() > 1)
+        Mordor::sleep(1000);
+    for (size_t i = 0; i < 3; ++i)
+        MORDOR_TEST_ASSERT_EQUAL(write(fds[i][1], "x", 1), 1);
+    manager.stop();
+    MORDOR_TEST_ASSERT_EQUAL(read, 3);
+    for (size_t i = 0; i < 3; ++i) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+}
+
+// If thread is busy-polling when a write turns up for a reader on it
+static bool
+pollsOn(IOManager &manager, tid_t thread)
+{
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    volatile int blocked = 0, read = 0;
+    manager.schedule(boost::bind(&readPipe, boost::ref(manager), fds[0],
+        boost::ref(blocked), boost::ref(read)), thread);
+    while (blocked == 0)
+        Mordor::sleep(1000);
+    // Let the thread go idle again
+    Mordor::sleep(20000);
+    unsigned long long hits = spinHits();
+    MORDOR_TEST_ASSERT_EQUAL(write(fds[1], "x", 1), 1);
+    while (read == 0)
+        Mordor::sleep(1000);
+    close(fds[0]);
+    close(fds[1]);
+    return spinHits() > hits;
+}
+
+MORDOR_UNITTEST(IOManager, busyPollThreads)
+{
+    ConfigVarBase::ptr perThread =
+        Config::lookup("iomanager.epoll.perthread");
+    MORDOR_TEST_ASSERT(perThread);
+    std::string wasPerThread = perThread->toString();
+    perThread->fromString("1");
+    IOManager manager(2, false);
+    perThread->fromString(wasPerThread);
+    std::vector<tid_t> threads = manager.threadIds();
+    MORDOR_TEST_ASSERT_EQUAL(threads.size(), 2u);
+
+    // Both threads are already idle when they're let poll
+    Mordor::sleep(20000);
+    manager.busyPoll(5000000ull, 2);
+    MORDOR_TEST_ASSERT(pollsOn(manager, threads[0]));
+    MORDOR_TEST_ASSERT(pollsOn(manager, threads[1]));
+    // And they stop once they aren't
+    manager.busyPoll(5000000ull, 0);
+    MORDOR_TEST_ASSERT(!pollsOn(manager, threads[0]));
+    MORDOR_TEST_ASSERT(!pollsOn(manager, threads[1]));
+    manager.stop();
+}
+
+static void
+countRun(volatile int &ran)
+{
+    atomicIncrement(ran);
+}
+
+MORDOR_UNITTEST(IOManager, perThreadTickle)
+{
+    ConfigVarBase::ptr perThread =
+        Config::lookup("iomanager.epoll.perthread");
+    MORDOR_TEST_ASSERT(perThread);
+    std::string wasPerThread = perThread->toString();
+    perThread->fromString("1");
+    IOManager manager(3, false);
+    perThread->fromString(wasPerThread);
+
+    // Work posted to an idle thread wakes up that thread, not some other
+    // one that can't run it
+    std::vector<tid_t> threads = manager.threadIds();
+    volatile int ran = 0;
+    for (int i = 0; i < 30; ++i) {
+        Mordor::sleep(1000);
+        manager.schedule(boost::bind(&countRun, boost::ref(ran)),
+            threads[i % threads.size()]);
+    }
+    unsigned long long start = TimerManager::now();
+    while (ran < 30 && TimerManager::now() - start < 5000000ull)
+        Mordor::sleep(1000);
+    MORDOR_TEST_ASSERT_EQUAL(ran, 30);
+    manager.stop();
+}
+
+MORDOR_UNITTEST(IOManager, registerFdTooBig)
+{
+    IOManager manager;
+    // Past the most fds an IOManager can keep track of
+    int fd = 4096 * 1024;
+    MORDOR_TEST_ASSERT_EXCEPTION(manager.registerFd(fd), NativeException);
+    MORDOR_TEST_ASSERT_EXCEPTION(manager.registerEvent(fd, IOManager::READ),
+        NativeException);
+}
+#endif
@@ -1,15 +1,23 @@
 // Copyright (c) 2009 - Decho Corporation
 
+#include <algorithm>
+
 #include <boost/bind.hpp>
 
 #include "mordor/atomic.h"
+#include "mordor/config.h"
 #include "mordor/fiber.h"
 #include "mordor/iomanager.h"
 #include "mordor/parallel.h"
 #include "mordor/sleep.h"
 #include "mordor/test/test.h"
+#include "mordor/version.h"
 #include "mordor/workerpool.h"
 
+#ifdef LINUX
+#include <sched.h>
+#endif
+
 using namespace Mordor;
 using namespace Mordor::Test;
 
@@ -319,6 +327,79 @@ MORDOR_UNITTEST(Scheduler, scheduleForThreadNotOnScheduler)
 }
 #endif
 
+MORDOR_UNITTEST(Scheduler, scheduleForRetiredThread)
+{
+    WorkerPool pool(3, false);
+    std::vector<tid_t> threads = pool.threadIds();
+    MORDOR_TEST_ASSERT_EQUAL(threads.size(), 3u);
+    pool.threadCount(1);
+    while (pool.threadIds().size() > 1)
+        sleep(1000ull);
+    tid_t left = pool.threadIds().front();
+    tid_t retired = threads[0] == left ? threads[1] : threads[0];
+
+    // Picked before it retired; whoever's left runs it instead
+    int total = 0;
+    std::vector<Scheduler::FiberAndThread> batch(1);
+    batch[0].dg = boost::bind(&increment, boost::ref(total));
+    batch[0].thread = retired;
+    batch[0].priority = Scheduler::NORMAL;
+    batch[0].anyIfRetired = true;
+    pool.schedule(batch);
+    pool.stop();
+    MORDOR_TEST_ASSERT_EQUAL(total, 1);
+}
+
+static void runOnThread(tid_t expected, volatile bool *release, int &ran,
+    int &misplaced)
+{
+    while (!*release)
+        sleep(1000ull);
+    atomicIncrement(ran);
+    if (gettid() != expected)
+        atomicIncrement(misplaced);
+}
+
+MORDOR_UNITTEST(Scheduler, retireAfterTargetedWork)
+{
+    WorkerPool pool(3, false);
+    std::vector<tid_t> threads = pool.threadIds();
+    volatile bool release = false;
+    int ran = 0, misplaced = 0;
+    for (size_t i = 0; i < 30; ++i)
+        pool.schedule(boost::bind(&runOnThread, threads[i % 3], &release,
+            boost::ref(ran), boost::ref(misplaced)), threads[i % 3]);
+    // Two of them are told to retire while they've still got work of their
+    // own queued; they run it first
+    pool.threadCount(1);
+    release = true;
+    pool.stop();
+    MORDOR_TEST_ASSERT_EQUAL(ran, 30);
+    MORDOR_TEST_ASSERT_EQUAL(misplaced, 0);
+}
+
+MORDOR_UNITTEST(Scheduler, mailboxOverflow)
+{
+    ConfigVarBase::ptr capacity = Config::lookup("scheduler.mailbox.capacity");
+    MORDOR_TEST_ASSERT(capacity);
+    std::string wasCapacity = capacity->toString();
+    capacity->fromString("2");
+    WorkerPool pool(2, false);
+    capacity->fromString(wasCapacity);
+    std::vector<tid_t> threads = pool.threadIds();
+    volatile bool release = false;
+    int ran = 0, misplaced = 0;
+    // Most of these don't fit; they wait in the shared queue instead, still
+    // for the same thread
+    for (size_t i = 0; i < 50; ++i)
+        pool.schedule(boost::bind(&runOnThread, threads[1], &release,
+            boost::ref(ran), boost::ref(misplaced)), threads[1]);
+    release = true;
+    pool.stop();
+    MORDOR_TEST_ASSERT_EQUAL(ran, 50);
+    MORDOR_TEST_ASSERT_EQUAL(misplaced, 0);
+}
+
 static void sleepForABit(std::set<tid_t> &threads,
     boost::mutex &mutex, Fiber::ptr scheduleMe, int *count)
 {
@@ -352,6 +433,30 @@ MORDOR_UNITTEST(Scheduler, spreadTheLoad)
     MORDOR_TEST_ASSERT_EQUAL(threads.size(), 4u);
 }
 
+MORDOR_UNITTEST(Scheduler, switchToThreadStress)
+{
+    WorkerPool pool(2, true);
+    std::set<tid_t> threads;
+    boost::mutex mutex;
+    // Find out what the other thread is
+    while (threads.size() < 2u) {
+        int count = 2;
+        for (size_t i = 0; i < 2; ++i)
+            pool.schedule(boost::bind(&sleepForABit, boost::ref(threads),
+                boost::ref(mutex), Fiber::getThis(), &count));
+        Scheduler::yieldTo();
+    }
+    tid_t root = gettid();
+    threads.erase(root);
+    tid_t other = *threads.begin();
+    for (int i = 0; i < 1000; ++i) {
+        tid_t thread = (i % 2) ? root : other;
+        pool.switchTo(thread);
+        MORDOR_TEST_ASSERT_EQUAL(gettid(), thread);
+    }
+    pool.switchTo(root);
+}
+
 static void fail()
 {
     MORDOR_NOTREACHED();
@@ -403,3 +508,330 @@ MORDOR_UNITTEST(Scheduler, spreadTheLoadWhileStopping)
     // Make sure we hit every thread
     MORDOR_TEST_ASSERT_EQUAL(threads.size(), 4u);
 }
+
+MORDOR_UNITTEST(Scheduler, workStealingSpreadTheLoad)
+{
+    std::set<tid_t> threads;
+    {
+        boost::mutex mutex;
+        WorkerPool pool(4, true, 1, true);
+        // Wait for the other threads to get to idle first
+        Mordor::sleep(100000);
+
+        // All of the work will be scheduled onto one thread's local queue;
+        // the other threads have to steal it
+        pool.schedule(boost::bind(&startTheFibers, boost::ref(threads),
+            boost::ref(mutex)));
+        pool.stop();
+    }
+    // Make sure we hit every thread
+    MORDOR_TEST_ASSERT_EQUAL(threads.size(), 4u);
+}
+
+static void yieldAndCount(int &count)
+{
+    for (int i = 0; i < 10; ++i)
+        Scheduler::yield();
+    atomicIncrement(count);
+}
+
+static void scheduleYielders(int &count)
+{
+    for (int i = 0; i < 100; ++i)
+        Scheduler::getThis()->schedule(boost::bind(&yieldAndCount,
+            boost::ref(count)));
+}
+
+MORDOR_UNITTEST(Scheduler, workStealingHybrid)
+{
+    int count = 0;
+    {
+        WorkerPool pool(4, true, 4, true);
+        for (int i = 0; i < 4; ++i)
+            pool.schedule(boost::bind(&scheduleYielders, boost::ref(count)));
+        pool.stop();
+    }
+    MORDOR_TEST_ASSERT_EQUAL(count, 400);
+}
+
+static void recordPriority(std::vector<Scheduler::Priority> &order,
+    bool yield)
+{
+    if (yield)
+        Scheduler::yield();
+    order.push_back(Scheduler::currentPriority());
+}
+
+static void countSmall(int &count, boost::shared_ptr<int>)
+{
+    ++count;
+}
+
+static void countLarge(int &count, boost::shared_ptr<int>, void *, void *,
+    void *, void *, void *, void *)
+{
+    ++count;
+}
+
+MORDOR_UNITTEST(Scheduler, functorLifetime)
+{
+    WorkerPool pool;
+    int count = 0;
+    boost::shared_ptr<int> bound(new int());
+    // Stored inline
+    pool.schedule(boost::bind(&countSmall, boost::ref(count), bound));
+    // Too big to be stored inline
+    pool.schedule(boost::bind(&countLarge, boost::ref(count), bound,
+        (void *)NULL, (void *)NULL, (void *)NULL, (void *)NULL, (void *)NULL,
+        (void *)NULL));
+    MORDOR_TEST_ASSERT_EQUAL(bound.use_count(), 3);
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(count, 2);
+    // Nothing is holding on to the functors once they've run
+    MORDOR_TEST_ASSERT_EQUAL(bound.use_count(), 1);
+}
+
+MORDOR_UNITTEST(Scheduler, priorities)
+{
+    WorkerPool pool;
+    std::vector<Scheduler::Priority> order;
+    pool.schedule(boost::bind(&recordPriority, boost::ref(order), false),
+        emptytid(), Scheduler::BACKGROUND);
+    pool.schedule(boost::bind(&recordPriority, boost::ref(order), false));
+    // Yielding keeps the priority
+    pool.schedule(boost::bind(&recordPriority, boost::ref(order), true),
+        emptytid(), Scheduler::CRITICAL);
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(order.size(), 3u);
+    MORDOR_TEST_ASSERT_EQUAL(order[0], Scheduler::CRITICAL);
+    MORDOR_TEST_ASSERT_EQUAL(order[1], Scheduler::NORMAL);
+    MORDOR_TEST_ASSERT_EQUAL(order[2], Scheduler::BACKGROUND);
+    MORDOR_TEST_ASSERT_EQUAL(Scheduler::currentPriority(), Scheduler::NORMAL);
+}
+
+MORDOR_UNITTEST(Scheduler, batch)
+{
+    WorkerPool pool;
+    std::vector<Scheduler::Priority> order;
+    std::vector<Scheduler::FiberAndThread> batch(3);
+    batch[0].dg = boost::bind(&recordPriority, boost::ref(order), false);
+    batch[0].thread = emptytid();
+    batch[0].priority = Scheduler::BACKGROUND;
+    // Thread-targeted
+    batch[1].dg = boost::bind(&recordPriority, boost::ref(order), false);
+    batch[1].thread = gettid();
+    batch[1].priority = Scheduler::NORMAL;
+    batch[2].fiber.reset(new Fiber(boost::bind(&recordPriority,
+        boost::ref(order), true)));
+    batch[2].thread = emptytid();
+    batch[2].priority = Scheduler::CRITICAL;
+    pool.schedule(batch);
+    MORDOR_TEST_ASSERT(batch.empty());
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(order.size(), 3u);
+    // The thread-targeted item goes through the thread's mailbox, so only
+    // the shared items are ordered by priority
+    std::vector<Scheduler::Priority>::iterator critical =
+        std::find(order.begin(), order.end(), Scheduler::CRITICAL);
+    std::vector<Scheduler::Priority>::iterator background =
+        std::find(order.begin(), order.end(), Scheduler::BACKGROUND);
+    MORDOR_TEST_ASSERT(critical < background);
+    MORDOR_TEST_ASSERT(background != order.end());
+    MORDOR_TEST_ASSERT(std::find(order.begin(), order.end(),
+        Scheduler::NORMAL) != order.end());
+}
+
+MORDOR_UNITTEST(Scheduler, starvationGuard)
+{
+    ConfigVarBase::ptr limit = Config::lookup("scheduler.starvationlimit");
+    MORDOR_TEST_ASSERT(limit);
+    std::string oldLimit = limit->toString();
+    limit->fromString("2");
+    std::vector<Scheduler::Priority> order;
+    try {
+        WorkerPool pool;
+        pool.schedule(boost::bind(&recordPriority, boost::ref(order), false),
+            emptytid(), Scheduler::BACKGROUND);
+        for (int i = 0; i < 6; ++i)
+            pool.schedule(boost::bind(&recordPriority, boost::ref(order),
+                false), emptytid(), Scheduler::CRITICAL);
+        pool.dispatch();
+    } catch (...) {
+        limit->fromString(oldLimit);
+        throw;
+    }
+    limit->fromString(oldLimit);
+    MORDOR_TEST_ASSERT_EQUAL(order.size(), 7u);
+    // Passed over twice, then gets a turn
+    MORDOR_TEST_ASSERT_EQUAL(order[2], Scheduler::BACKGROUND);
+}
+
+static void blockThread(int &done)
+{
+    // Blocks the whole thread, not just this fiber
+    sleep(100000ull);
+    atomicIncrement(done);
+}
+
+MORDOR_UNITTEST(Scheduler, elastic)
+{
+    ConfigVarBase::ptr interval =
+        Config::lookup("scheduler.elastic.interval");
+    ConfigVarBase::ptr linger = Config::lookup("scheduler.elastic.linger");
+    MORDOR_TEST_ASSERT(interval);
+    MORDOR_TEST_ASSERT(linger);
+    std::string oldInterval = interval->toString();
+    std::string oldLinger = linger->toString();
+    interval->fromString("10000");
+    linger->fromString("5");
+    try {
+        WorkerPool pool(1, false);
+        pool.elastic(1, 4);
+        int done = 0;
+        for (int i = 0; i < 8; ++i)
+            pool.schedule(boost::bind(&blockThread, boost::ref(done)));
+        size_t mostThreads = 1;
+        while (done < 8) {
+            mostThreads = std::max(mostThreads, pool.threadCount());
+            sleep(5000ull);
+        }
+        // Grew while every thread was blocked...
+        MORDOR_TEST_ASSERT_GREATER_THAN(mostThreads, 1u);
+        MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(mostThreads, 4u);
+        // ... and shrinks back once they're idle
+        for (int i = 0; i < 500 && pool.threadCount() > 1; ++i)
+            sleep(10000ull);
+        MORDOR_TEST_ASSERT_EQUAL(pool.threadCount(), 1u);
+        pool.stop();
+    } catch (...) {
+        interval->fromString(oldInterval);
+        linger->fromString(oldLinger);
+        throw;
+    }
+    interval->fromString(oldInterval);
+    linger->fromString(oldLinger);
+}
+
+namespace {
+class TickleCountingPool : public WorkerPool
+{
+public:
+    TickleCountingPool()
+        : WorkerPool(1, false),
+          tickles(0)
+    {}
+
+    volatile size_t tickles;
+
+protected:
+    void tickle()
+    {
+        atomicIncrement(tickles);
+        WorkerPool::tickle();
+    }
+};
+}
+
+static void yieldUntil(volatile int &running, volatile int &done)
+{
+    running = 1;
+    while (!done)
+        Scheduler::yield();
+}
+
+MORDOR_UNITTEST(Scheduler, tickleOnlyIdleThreads)
+{
+    TickleCountingPool pool;
+    volatile int running = 0, done = 0;
+    int count = 0;
+    pool.schedule(boost::bind(&yieldUntil, boost::ref(running),
+        boost::ref(done)));
+    while (!running)
+        sleep(1000ull);
+    size_t tickles = pool.tickles;
+    // The pool's only thread never goes idle, so it never needs a tickle
+    for (int i = 0; i < 100; ++i)
+        pool.schedule(boost::bind(&increment, boost::ref(count)));
+    MORDOR_TEST_ASSERT_EQUAL(pool.tickles, tickles);
+    done = 1;
+    // Before ~TickleCountingPool, so tickle() is still ours
+    pool.stop();
+    MORDOR_TEST_ASSERT_EQUAL(count, 100);
+}
+
+#ifdef LINUX
+static void recordCpu(int &cpu)
+{
+    // Give the thread a chance to notice the new settings
+    Scheduler::yield();
+    cpu = sched_getcpu();
+}
+
+static void recordMask(cpu_set_t &mask)
+{
+    Scheduler::yield();
+    sched_getaffinity(0, sizeof(cpu_set_t), &mask);
+}
+
+MORDOR_UNITTEST(Scheduler, affinity)
+{
+    cpu_set_t allowed;
+    MORDOR_TEST_ASSERT_EQUAL(
+        sched_getaffinity(0, sizeof(cpu_set_t), &allowed), 0);
+    int target = 0;
+    while (!CPU_ISSET(target, &allowed))
+        ++target;
+
+    WorkerPool pool(2, false);
+    pool.name("pinned");
+    pool.affinity(std::vector<int>(1, target));
+    std::vector<int> cpus(8, -1);
+    for (size_t i = 0; i < cpus.size(); ++i)
+        pool.schedule(boost::bind(&recordCpu, boost::ref(cpus[i])));
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        while (cpus[i] == -1)
+            sleep(1000ull);
+        MORDOR_TEST_ASSERT_EQUAL(cpus[i], target);
+    }
+
+    // Unpinned, they go back to what the process started out with
+    pool.affinity(std::vector<int>());
+    std::vector<cpu_set_t> masks(4);
+    for (size_t i = 0; i < masks.size(); ++i)
+        pool.schedule(boost::bind(&recordMask, boost::ref(masks[i])));
+    pool.stop();
+    for (size_t i = 0; i < masks.size(); ++i)
+        MORDOR_TEST_ASSERT(CPU_EQUAL(&masks[i], &allowed));
+}
+
+MORDOR_UNITTEST(Scheduler, nameKeepsAffinity)
+{
+    cpu_set_t allowed;
+    MORDOR_TEST_ASSERT_EQUAL(
+        sched_getaffinity(0, sizeof(cpu_set_t), &allowed), 0);
+    int target = 0;
+    while (!CPU_ISSET(target, &allowed))
+        ++target;
+    // As if by taskset; new threads inherit it
+    cpu_set_t restricted;
+    CPU_ZERO(&restricted);
+    CPU_SET(target, &restricted);
+    MORDOR_TEST_ASSERT_EQUAL(
+        sched_setaffinity(0, sizeof(cpu_set_t), &restricted), 0);
+
+    std::vector<cpu_set_t> masks(4);
+    try {
+        WorkerPool pool(2, false);
+        pool.name("named");
+        for (size_t i = 0; i < masks.size(); ++i)
+            pool.schedule(boost::bind(&recordMask, boost::ref(masks[i])));
+        pool.stop();
+    } catch (...) {
+        sched_setaffinity(0, sizeof(cpu_set_t), &allowed);
+        throw;
+    }
+    sched_setaffinity(0, sizeof(cpu_set_t), &allowed);
+    for (size_t i = 0; i < masks.size(); ++i)
+        MORDOR_TEST_ASSERT(CPU_EQUAL(&masks[i], &restricted));
+}
+#endif
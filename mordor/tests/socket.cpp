@@ -1,14 +1,24 @@
 // Copyright (c) 2009 - Decho Corporation
 
+#include <signal.h>
+
 #include <iostream>
+#include <set>
 
+#include <boost/bind.hpp>
 #include <boost/scoped_array.hpp>
 #include <boost/shared_array.hpp>
 
+#include "mordor/atomic.h"
+#include "mordor/config.h"
 #include "mordor/exception.h"
 #include "mordor/fiber.h"
 #include "mordor/iomanager.h"
+#include "mordor/sleep.h"
 #include "mordor/socket.h"
+#include "mordor/statistics.h"
+#include "mordor/streams/buffer.h"
+#include "mordor/streams/socket.h"
 #include "mordor/test/test.h"
 
 using namespace Mordor;
@@ -196,6 +206,43 @@ MORDOR_UNITTEST(Socket, receiveAfterShutdownOtherEnd)
     testShutdownException<DummyException>(false, true, true);
 }
 
+#ifdef LINUX
+MORDOR_UNITTEST(Socket, sendFileAfterShutdown)
+{
+    IOManager ioManager;
+    Connection conns = establishConn(ioManager);
+    ioManager.schedule(boost::bind(&acceptOne, boost::ref(conns)));
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+    char path[] = "/tmp/mordorXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mkstemp");
+    unlink(path);
+    try {
+        MORDOR_TEST_ASSERT_EQUAL(write(fd, "abc", 3), 3);
+
+        // sendfile() raises SIGPIPE (and would kill us with it) every time
+        conns.connect->shutdown(SHUT_WR);
+        MORDOR_TEST_ASSERT_EXCEPTION(conns.connect->sendFile(fd, 0, 3),
+            BrokenPipeException);
+        MORDOR_TEST_ASSERT_EXCEPTION(conns.connect->sendFile(fd, 0, 3),
+            BrokenPipeException);
+
+        // Only held off for the call, and not left pending
+        sigset_t mask, pending;
+        pthread_sigmask(SIG_BLOCK, NULL, &mask);
+        MORDOR_TEST_ASSERT_EQUAL(sigismember(&mask, SIGPIPE), 0);
+        sigpending(&pending);
+        MORDOR_TEST_ASSERT_EQUAL(sigismember(&pending, SIGPIPE), 0);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+#endif
+
 static void testAddress(const char *addr, const char *expected = NULL)
 {
     if (!expected)
@@ -478,3 +525,436 @@ MORDOR_UNITTEST(Socket, eventOnRemoteReset)
     ioManager.dispatch();
     MORDOR_TEST_ASSERT(remoteClosed);
 }
+
+static void receiveAll(Socket::ptr sock, size_t length)
+{
+    std::vector<char> buffer(65536);
+    while (length > 0) {
+        size_t received = sock->receive(&buffer[0],
+            std::min(length, buffer.size()));
+        MORDOR_TEST_ASSERT_GREATER_THAN(received, 0u);
+        for (size_t i = 0; i < received; ++i)
+            MORDOR_TEST_ASSERT_EQUAL(buffer[i], 'z');
+        length -= received;
+    }
+}
+
+static void releaseOne(int &released)
+{
+    ++released;
+}
+
+MORDOR_UNITTEST(Socket, zeroCopySend)
+{
+    IOManager ioManager;
+    Connection conns = establishConn(ioManager);
+    ioManager.schedule(boost::bind(&acceptOne, boost::ref(conns)));
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+
+    // Without kernel support, everything's copied and released right away
+    bool zeroCopy = conns.connect->zeroCopy(4096);
+    CountStatistic<unsigned long long> *zeroCopySends =
+        dynamic_cast<CountStatistic<unsigned long long> *>(
+            Statistics::lookup("socket.zerocopy.sends"));
+    unsigned long long before = zeroCopySends ? zeroCopySends->count : 0;
+
+    std::vector<char> data(1024 * 1024, 'z');
+    int released = 0, sends = 0;
+    iovec iov;
+    iov.iov_base = &data[0];
+    // Too small to be worth it
+    iov.iov_len = 100;
+    conns.connect->sendZeroCopy(&iov, 1,
+        boost::bind(&releaseOne, boost::ref(released)));
+    ++sends;
+    MORDOR_TEST_ASSERT_EQUAL(released, 1);
+
+    ioManager.schedule(boost::bind(&receiveAll, conns.accept,
+        data.size() + 100));
+    size_t sent = 0;
+    while (sent < data.size()) {
+        iov.iov_base = &data[sent];
+        iov.iov_len = data.size() - sent;
+        sent += conns.connect->sendZeroCopy(&iov, 1,
+            boost::bind(&releaseOne, boost::ref(released)));
+        ++sends;
+    }
+    ioManager.dispatch();
+
+    // Collected by the timer, now that the data's been delivered
+    unsigned long long start = TimerManager::now();
+    while (released < sends && TimerManager::now() - start < 5000000ull)
+        sleep(ioManager, 1000);
+    MORDOR_TEST_ASSERT_EQUAL(released, sends);
+    if (zeroCopy) {
+        MORDOR_TEST_ASSERT(zeroCopySends);
+        MORDOR_TEST_ASSERT_GREATER_THAN(zeroCopySends->count, before);
+    }
+}
+
+MORDOR_UNITTEST(Socket, sendReceiveBatch)
+{
+    IOManager ioManager;
+    Address::ptr loopback = Address::lookup("127.0.0.1:0", AF_INET,
+        SOCK_DGRAM).front();
+    Socket::ptr receiver(new Socket(ioManager, AF_INET, SOCK_DGRAM));
+    receiver->bind(loopback);
+    Address::ptr to = receiver->localAddress();
+    Socket::ptr sender(new Socket(ioManager, AF_INET, SOCK_DGRAM));
+    sender->bind(loopback);
+
+    char data[5][32];
+    iovec out[5];
+    Socket::Datagram outgoing[5];
+    for (size_t i = 0; i < 5; ++i) {
+        memset(data[i], 'a' + (int)i, sizeof(data[i]));
+        out[i].iov_base = data[i];
+        // The last one's too big for the receiver
+        out[i].iov_len = i == 4 ? 32 : i + 1;
+        outgoing[i].buffers = &out[i];
+        outgoing[i].count = 1;
+        outgoing[i].address = to.get();
+    }
+    size_t sent = 0;
+    while (sent < 5)
+        sent += sender->sendBatch(outgoing + sent, 5 - sent);
+    for (size_t i = 0; i < 5; ++i)
+        MORDOR_TEST_ASSERT_EQUAL(outgoing[i].length, out[i].iov_len);
+
+    char in[8][16];
+    iovec inIovs[8];
+    Address::ptr from[8];
+    Socket::Datagram incoming[8];
+    for (size_t i = 0; i < 8; ++i) {
+        inIovs[i].iov_base = in[i];
+        inIovs[i].iov_len = sizeof(in[i]);
+        from[i] = receiver->emptyAddress();
+        incoming[i].buffers = &inIovs[i];
+        incoming[i].count = 1;
+        incoming[i].address = from[i].get();
+    }
+    size_t received = 0;
+    while (received < 5)
+        received += receiver->receiveBatch(incoming + received,
+            8 - received);
+    MORDOR_TEST_ASSERT_EQUAL(received, 5u);
+    for (size_t i = 0; i < 5; ++i) {
+        MORDOR_TEST_ASSERT_EQUAL(incoming[i].length, i == 4 ? 16u : i + 1);
+        MORDOR_TEST_ASSERT_EQUAL(in[i][0], 'a' + (int)i);
+        MORDOR_TEST_ASSERT(*from[i] == *sender->localAddress());
+        MORDOR_TEST_ASSERT_EQUAL(incoming[i].flags & MSG_TRUNC,
+            i == 4 ? MSG_TRUNC : 0);
+    }
+
+    // Waits (and times out) for the first one
+    receiver->receiveTimeout(100000);
+    MORDOR_TEST_ASSERT_EXCEPTION(receiver->receiveBatch(incoming, 8),
+        TimedOutException);
+}
+
+MORDOR_UNITTEST(Socket, sendReceiveBigBatch)
+{
+    IOManager ioManager;
+    Address::ptr loopback = Address::lookup("127.0.0.1:0", AF_INET,
+        SOCK_DGRAM).front();
+    Socket::ptr receiver(new Socket(ioManager, AF_INET, SOCK_DGRAM));
+    receiver->bind(loopback);
+    Address::ptr to = receiver->localAddress();
+    Socket::ptr sender(new Socket(ioManager, AF_INET, SOCK_DGRAM));
+
+    // More than a batch keeps on the stack
+    char data[100];
+    iovec iovs[100];
+    Socket::Datagram datagrams[100];
+    for (size_t i = 0; i < 100; ++i) {
+        data[i] = (char)i;
+        iovs[i].iov_base = &data[i];
+        iovs[i].iov_len = 1;
+        datagrams[i].buffers = &iovs[i];
+        datagrams[i].count = 1;
+        datagrams[i].address = to.get();
+    }
+    size_t sent = 0;
+    while (sent < 100)
+        sent += sender->sendBatch(datagrams + sent, 100 - sent);
+
+    memset(data, 0xff, sizeof(data));
+    for (size_t i = 0; i < 100; ++i)
+        datagrams[i].address = NULL;
+    size_t received = 0;
+    while (received < 100)
+        received += receiver->receiveBatch(datagrams + received,
+            100 - received);
+    for (size_t i = 0; i < 100; ++i) {
+        MORDOR_TEST_ASSERT_EQUAL(datagrams[i].length, 1u);
+        MORDOR_TEST_ASSERT_EQUAL(data[i], (char)i);
+    }
+}
+
+MORDOR_UNITTEST(Socket, udpSegmentation)
+{
+    IOManager ioManager;
+    Address::ptr loopback = Address::lookup("127.0.0.1:0", AF_INET,
+        SOCK_DGRAM).front();
+    Socket::ptr receiver(new Socket(ioManager, AF_INET, SOCK_DGRAM));
+    receiver->bind(loopback);
+    Socket::ptr sender(new Socket(ioManager, AF_INET, SOCK_DGRAM));
+    // Without kernel support, it all goes as one datagram
+    bool segmented = sender->udpSegment(100);
+    receiver->udpGro();
+
+    std::string data;
+    for (int i = 0; i < 950; ++i)
+        data.append(1, (char)('a' + i / 100));
+    sender->sendTo(data.c_str(), data.size(), 0, receiver->localAddress());
+
+    // However many receives it takes, they split back up the same
+    std::vector<Buffer> datagrams, all;
+    Address::ptr from = receiver->emptyAddress();
+    size_t received = 0;
+    while (received < data.size()) {
+        receiveSegments(*receiver, datagrams, from.get());
+        for (size_t i = 0; i < datagrams.size(); ++i) {
+            received += datagrams[i].readAvailable();
+            all.push_back(datagrams[i]);
+        }
+    }
+    MORDOR_TEST_ASSERT_EQUAL(received, data.size());
+    if (!segmented) {
+        MORDOR_TEST_ASSERT_EQUAL(all.size(), 1u);
+        return;
+    }
+    MORDOR_TEST_ASSERT_EQUAL(all.size(), 10u);
+    for (size_t i = 0; i < all.size(); ++i) {
+        MORDOR_TEST_ASSERT_EQUAL(all[i].readAvailable(), i == 9 ? 50u : 100u);
+        MORDOR_TEST_ASSERT(all[i] == data.substr(i * 100,
+            all[i].readAvailable()));
+    }
+}
+
+#if defined(LINUX) && !defined(IOURING)
+static void pingPong(Socket::ptr sock, bool first, int count)
+{
+    char c = 'a';
+    for (int i = 0; i < count; ++i) {
+        if (first)
+            MORDOR_TEST_ASSERT_EQUAL(sock->send(&c, 1), 1u);
+        MORDOR_TEST_ASSERT_EQUAL(sock->receive(&c, 1), 1u);
+        if (!first)
+            MORDOR_TEST_ASSERT_EQUAL(sock->send(&c, 1), 1u);
+    }
+}
+
+MORDOR_UNITTEST(Socket, persistentRegistration)
+{
+    ConfigVarBase::ptr persistent =
+        Config::lookup("iomanager.epoll.persistent");
+    MORDOR_TEST_ASSERT(persistent);
+    std::string wasPersistent = persistent->toString();
+    persistent->fromString("1");
+    IOManager ioManager;
+    persistent->fromString(wasPersistent);
+    MORDOR_TEST_ASSERT(ioManager.persistent());
+
+    Connection conns = establishConn(ioManager);
+    ioManager.schedule(boost::bind(&acceptOne, boost::ref(conns)));
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+
+    CountStatistic<unsigned long long> *epollCtl =
+        dynamic_cast<CountStatistic<unsigned long long> *>(
+            Statistics::lookup("iomanager.epoll_ctl"));
+    MORDOR_TEST_ASSERT(epollCtl);
+    unsigned long long before = epollCtl->count;
+    // Every receive blocks, but none of them touch the epoll set
+    ioManager.schedule(boost::bind(&pingPong, conns.connect, true, 100));
+    ioManager.schedule(boost::bind(&pingPong, conns.accept, false, 100));
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(epollCtl->count, before);
+
+    bool remoteClosed = false;
+    conns.accept->onRemoteClose(boost::bind(&closed, boost::ref(remoteClosed)));
+    conns.connect->shutdown();
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT(remoteClosed);
+}
+
+namespace {
+struct Listeners
+{
+    Listeners() : served(0), sameThread(true) {}
+
+    boost::mutex mutex;
+    std::vector<Socket::ptr> sockets;
+    volatile size_t served;
+    bool sameThread;
+};
+}
+
+static void echoOnEachThread(Listeners &listeners, Socket::ptr listen)
+{
+    {
+        boost::mutex::scoped_lock lock(listeners.mutex);
+        listeners.sockets.push_back(listen);
+    }
+    while (true) {
+        Socket::ptr sock;
+        try {
+            sock = listen->accept();
+        } catch (OperationAbortedException &) {
+            return;
+        }
+        tid_t thread = gettid();
+        char c;
+        sock->receive(&c, 1);
+        sock->send(&c, 1);
+        if (gettid() != thread)
+            listeners.sameThread = false;
+        atomicIncrement(listeners.served);
+    }
+}
+
+static void connectToEachThread(IOManager &ioManager, Listeners &listeners)
+{
+    std::vector<Address::ptr> addresses =
+        Address::lookup("localhost", AF_UNSPEC, SOCK_STREAM);
+    MORDOR_TEST_ASSERT(!addresses.empty());
+    // Hold on to a port (without taking any connections) for the listeners
+    // to join
+    Socket::ptr reserve = addresses.front()->createSocket(ioManager);
+    int opt = 1;
+    reserve->setOption(SOL_SOCKET, SO_REUSEADDR, opt);
+    reserve->setOption(SOL_SOCKET, SO_REUSEPORT, opt);
+    reserve->bind(addresses.front());
+    Address::ptr address = reserve->localAddress();
+    listenOnEachThread(ioManager, *address,
+        boost::bind(&echoOnEachThread, boost::ref(listeners), _1));
+    reserve.reset();
+
+    for (int i = 0; i < 12; ++i) {
+        Socket::ptr sock = address->createSocket(ioManager);
+        sock->connect(address);
+        char c = 'a';
+        sock->send(&c, 1);
+        sock->receive(&c, 1);
+    }
+    while (true) {
+        {
+            boost::mutex::scoped_lock lock(listeners.mutex);
+            if (listeners.sockets.size() == ioManager.threadCount())
+                break;
+        }
+        Scheduler::yield();
+    }
+    boost::mutex::scoped_lock lock(listeners.mutex);
+    for (size_t i = 0; i < listeners.sockets.size(); ++i)
+        listeners.sockets[i]->cancelAccept();
+}
+
+MORDOR_UNITTEST(Socket, listenOnEachThread)
+{
+    ConfigVarBase::ptr perThread =
+        Config::lookup("iomanager.epoll.perthread");
+    MORDOR_TEST_ASSERT(perThread);
+    std::string wasPerThread = perThread->toString();
+    perThread->fromString("1");
+    IOManager ioManager(3);
+    perThread->fromString(wasPerThread);
+    MORDOR_TEST_ASSERT(ioManager.perThread());
+
+    Listeners listeners;
+    ioManager.schedule(boost::bind(&connectToEachThread,
+        boost::ref(ioManager), boost::ref(listeners)));
+    ioManager.stop();
+    MORDOR_TEST_ASSERT_EQUAL(listeners.sockets.size(), 3u);
+    MORDOR_TEST_ASSERT_EQUAL(listeners.served, 12u);
+    MORDOR_TEST_ASSERT(listeners.sameThread);
+}
+#endif
+
+MORDOR_UNITTEST(Socket, acceptBatch)
+{
+    IOManager ioManager;
+    Connection conns = establishConn(ioManager);
+    std::vector<Socket::ptr> clients;
+    for (int i = 0; i < 4; ++i) {
+        clients.push_back(conns.address->createSocket(ioManager));
+        clients.back()->connect(conns.address);
+    }
+    // Let the handshakes land in the listen queue
+    sleep(ioManager, 50000);
+
+    Socket::ptr sockets[8];
+    size_t accepted = conns.listen->acceptBatch(sockets, 8);
+#if defined(LINUX) && !defined(IOURING)
+    MORDOR_TEST_ASSERT_EQUAL(accepted, 4u);
+#endif
+    while (accepted < 4u)
+        accepted += conns.listen->acceptBatch(sockets + accepted, 1);
+    for (size_t i = 0; i < accepted; ++i) {
+        char c = 'a' + (char)i;
+        clients[i]->send(&c, 1);
+    }
+    // Connections are accepted in order
+    for (size_t i = 0; i < accepted; ++i) {
+        char c;
+        MORDOR_TEST_ASSERT_EQUAL(sockets[i]->receive(&c, 1), 1u);
+        MORDOR_TEST_ASSERT_EQUAL(c, 'a' + (char)i);
+    }
+}
+
+namespace {
+struct Served
+{
+    Served() : count(0) {}
+
+    boost::mutex mutex;
+    std::set<tid_t> threads;
+    volatile size_t count;
+};
+}
+
+static void echoServed(Served &served, Socket::ptr sock)
+{
+    {
+        boost::mutex::scoped_lock lock(served.mutex);
+        served.threads.insert(gettid());
+    }
+    char c;
+    sock->receive(&c, 1);
+    sock->send(&c, 1);
+    atomicIncrement(served.count);
+}
+
+static void acceptUntilCancelled(IOManager &ioManager, Socket::ptr listen,
+    Served &served)
+{
+    try {
+        acceptOnEachThread(ioManager, *listen,
+            boost::bind(&echoServed, boost::ref(served), _1));
+    } catch (OperationAbortedException &) {
+    }
+}
+
+MORDOR_UNITTEST(Socket, acceptOnEachThread)
+{
+    IOManager ioManager(3);
+    Connection conns = establishConn(ioManager);
+    Served served;
+    ioManager.schedule(boost::bind(&acceptUntilCancelled,
+        boost::ref(ioManager), conns.listen, boost::ref(served)));
+
+    for (int i = 0; i < 12; ++i) {
+        Socket::ptr sock = conns.address->createSocket(ioManager);
+        sock->connect(conns.address);
+        char c = 'a';
+        sock->send(&c, 1);
+        MORDOR_TEST_ASSERT_EQUAL(sock->receive(&c, 1), 1u);
+    }
+    conns.listen->cancelAccept();
+    ioManager.stop();
+    MORDOR_TEST_ASSERT_EQUAL(served.count, 12u);
+    // Taking turns, so every thread got some
+    MORDOR_TEST_ASSERT_EQUAL(served.threads.size(), 3u);
+}
@@ -1,7 +1,12 @@
 // Copyright (c) 2009 - Decho Corporation
 
+#include <algorithm>
+
 #include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
 
+#include "mordor/config.h"
+#include "mordor/sleep.h"
 #include "mordor/timer.h"
 #include "mordor/test/test.h"
 
@@ -133,3 +138,148 @@ MORDOR_UNITTEST(Timer, later)
     timer->cancel();
     MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
 }
+
+namespace {
+// Make TimerManagers constructed in its scope use a timing wheel
+struct WheelTick
+{
+    WheelTick(unsigned long long us)
+        : m_var(Config::lookup("timer.wheel.tick"))
+    {
+        MORDOR_TEST_ASSERT(m_var);
+        m_previous = m_var->toString();
+        m_var->fromString(boost::lexical_cast<std::string>(us));
+    }
+    ~WheelTick() { m_var->fromString(m_previous); }
+
+    ConfigVarBase::ptr m_var;
+    std::string m_previous;
+};
+}
+
+static void
+firedAt(std::vector<unsigned long long> &fired, int index)
+{
+    fired[index] = TimerManager::now();
+}
+
+static void
+runUntilFired(TimerManager &manager, std::vector<unsigned long long> &fired)
+{
+    while (std::find(fired.begin(), fired.end(), 0ull) != fired.end()) {
+        unsigned long long next = manager.nextTimer();
+        MORDOR_TEST_ASSERT_NOT_EQUAL(next, ~0ull);
+        Mordor::sleep(next);
+        manager.executeTimers();
+    }
+}
+
+MORDOR_UNITTEST(Timer, wheelSingle)
+{
+    WheelTick tick(1000);
+    std::vector<unsigned long long> fired(1);
+    TimerManager manager;
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+    unsigned long long start = TimerManager::now();
+    manager.registerTimer(5000, boost::bind(&firedAt, boost::ref(fired), 0));
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(manager.nextTimer(), 6000u);
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(fired[0], 0u);
+    runUntilFired(manager, fired);
+    // Never early, and no more than a tick late (give or take scheduling)
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(fired[0], start + 5000);
+    MORDOR_TEST_ASSERT_ABOUT_EQUAL(fired[0], start + 5500, 5000u);
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+}
+
+MORDOR_UNITTEST(Timer, wheelCancelRefreshReset)
+{
+    WheelTick tick(1000);
+    std::vector<unsigned long long> fired(3);
+    TimerManager manager;
+    unsigned long long start = TimerManager::now();
+    Timer::ptr cancelled = manager.registerTimer(1000,
+        boost::bind(&firedAt, boost::ref(fired), 0));
+    Timer::ptr refreshed = manager.registerTimer(10000,
+        boost::bind(&firedAt, boost::ref(fired), 1));
+    Timer::ptr reset = manager.registerTimer(1000000,
+        boost::bind(&firedAt, boost::ref(fired), 2));
+    MORDOR_TEST_ASSERT(cancelled->cancel());
+    MORDOR_TEST_ASSERT(!cancelled->cancel());
+    MORDOR_TEST_ASSERT(reset->reset(20000, false));
+    Mordor::sleep(5000);
+    MORDOR_TEST_ASSERT(refreshed->refresh());
+    fired[0] = ~0ull;
+    runUntilFired(manager, fired);
+    MORDOR_TEST_ASSERT_EQUAL(fired[0], ~0ull);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(fired[1], start + 15000);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(fired[2], start + 20000);
+    MORDOR_TEST_ASSERT(!refreshed->refresh());
+    MORDOR_TEST_ASSERT(!reset->reset(1000, true));
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+}
+
+MORDOR_UNITTEST(Timer, wheelCascade)
+{
+    // With 1us ticks, these land in each of the first three levels, and
+    // the last is past the end of the wheel
+    WheelTick tick(1);
+    std::vector<unsigned long long> fired(4);
+    std::vector<unsigned long long> delays;
+    delays.push_back(100);
+    delays.push_back(20000);
+    delays.push_back(150000);
+    TimerManager manager;
+    unsigned long long start = TimerManager::now();
+    // Registered out of order
+    for (int i = 2; i >= 0; --i)
+        manager.registerTimer(delays[i],
+            boost::bind(&firedAt, boost::ref(fired), i));
+    Timer::ptr far = manager.registerTimer(2 * 3600 * 1000000ull,
+        boost::bind(&firedAt, boost::ref(fired), 3));
+    fired[3] = ~0ull;
+    runUntilFired(manager, fired);
+    for (size_t i = 0; i < delays.size(); ++i)
+        MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(fired[i], start + delays[i]);
+    MORDOR_TEST_ASSERT_LESS_THAN(fired[0], fired[1]);
+    MORDOR_TEST_ASSERT_LESS_THAN(fired[1], fired[2]);
+    MORDOR_TEST_ASSERT_ABOUT_EQUAL(fired[2], start + 150000, 50000u);
+    // Still waiting
+    MORDOR_TEST_ASSERT_EQUAL(fired[3], ~0ull);
+    MORDOR_TEST_ASSERT_NOT_EQUAL(manager.nextTimer(), ~0ull);
+    MORDOR_TEST_ASSERT(far->cancel());
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+}
+
+MORDOR_UNITTEST(Timer, deadline)
+{
+    std::vector<unsigned long long> fired(3);
+    TimerManager manager;
+    Deadline expires(manager, boost::bind(&firedAt, boost::ref(fired), 0));
+    Deadline moved(manager, boost::bind(&firedAt, boost::ref(fired), 1));
+    Deadline disarmed(manager, boost::bind(&firedAt, boost::ref(fired), 2));
+    unsigned long long start = TimerManager::now();
+    expires.arm(20000);
+    moved.arm(10000);
+    moved.arm(40000);
+    disarmed.arm(0);
+    MORDOR_TEST_ASSERT(disarmed.disarm());
+    MORDOR_TEST_ASSERT(!disarmed.disarm());
+    fired[2] = ~0ull;
+    runUntilFired(manager, fired);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(fired[0], start + 20000);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(fired[1], start + 40000);
+    MORDOR_TEST_ASSERT_EQUAL(fired[2], ~0ull);
+    MORDOR_TEST_ASSERT(!expires.disarm());
+    // Nothing's armed, so the sweep stopped
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+
+    // The sweeps have let go of all of them by now; arming puts them back
+    fired[0] = fired[1] = ~0ull;
+    fired[2] = 0;
+    start = TimerManager::now();
+    disarmed.arm(10000);
+    runUntilFired(manager, fired);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(fired[2], start + 10000);
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+}
@@ -1,6 +1,14 @@
 // Copyright (c) 2009 - Decho Corporation
 
+#include <boost/bind.hpp>
+
+#include "mordor/iomanager.h"
+#include "mordor/socket.h"
+#include "mordor/streams/buffered.h"
+#include "mordor/streams/file.h"
+#include "mordor/streams/limited.h"
 #include "mordor/streams/memory.h"
+#include "mordor/streams/socket.h"
 #include "mordor/streams/test.h"
 #include "mordor/streams/transfer.h"
 #include "mordor/test/test.h"
@@ -41,3 +49,62 @@ MORDOR_UNITTEST(TransferStream, inferEof)
     MemoryStream outStream;
     MORDOR_TEST_ASSERT_EQUAL(transferStream(inStream, outStream), 5ull);
 }
+
+#ifdef LINUX
+static void receiveAll(Socket::ptr socket, std::string &received)
+{
+    char buffer[4096];
+    size_t result;
+    while ((result = socket->receive(buffer, sizeof(buffer))) > 0)
+        received.append(buffer, result);
+}
+
+MORDOR_UNITTEST(TransferStream, sendFile)
+{
+    IOManager ioManager;
+    std::string path("/tmp/mordorXXXXXX");
+    int fd = mkstemp(&path[0]);
+    if (fd < 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mkstemp");
+    unlink(path.c_str());
+    close(fd);
+    FileStream::ptr file(new FileStream(path, FileStream::READWRITE,
+        (FileStream::CreateFlags)(FileStream::CREATE |
+        FileStream::DELETE_ON_CLOSE), &ioManager));
+    std::string contents;
+    for (int i = 0; i < 100000; ++i)
+        contents.append(1, (char)('a' + i % 26));
+    MemoryStream source((Buffer(contents)));
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(source, file), 100000ull);
+
+    Socket::ptr listen(new Socket(ioManager, AF_INET, SOCK_STREAM));
+    listen->bind(Address::lookup("127.0.0.1:0", AF_INET,
+        SOCK_STREAM).front());
+    listen->listen();
+    Socket::ptr connect(new Socket(ioManager, AF_INET, SOCK_STREAM));
+    connect->connect(listen->localAddress());
+    Socket::ptr accept = listen->accept();
+    std::string received;
+    ioManager.schedule(boost::bind(&receiveAll, accept,
+        boost::ref(received)));
+
+    // Like an HTTP response: headers still buffered, then the body
+    BufferedStream::ptr out(new BufferedStream(
+        Stream::ptr(new SocketStream(connect))));
+    MORDOR_TEST_ASSERT(out->supportsSendFile());
+    out->write("HDR", 3);
+    file->seek(100, Stream::BEGIN);
+    LimitedStream limited(file, 50000, false);
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(limited, out), 50000ull);
+    MORDOR_TEST_ASSERT_EQUAL(limited.remaining(), 0);
+    MORDOR_TEST_ASSERT_EQUAL(file->tell(), 50100);
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(file, out), 49900ull);
+    MORDOR_TEST_ASSERT_EQUAL(file->tell(), 100000);
+    MORDOR_TEST_ASSERT_EXCEPTION(transferStream(file, out, 1),
+        UnexpectedEofException);
+    out->close();
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(received.size(), 3u + 99900u);
+    MORDOR_TEST_ASSERT(received == "HDR" + contents.substr(100));
+}
+#endif
@@ -3,8 +3,10 @@
 #include "thread.h"
 
 #ifdef LINUX
+#include <sched.h>
 #include <sys/prctl.h>
 #include <syscall.h>
+#include <unistd.h>
 #endif
 #ifdef WINDOWS
 #include <process.h>
@@ -27,6 +29,25 @@ tid_t gettid()
 #endif
 }
 
+#ifdef LINUX
+namespace {
+static struct AffinityInitializer {
+    AffinityInitializer()
+    {
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &mask)) {
+            CPU_ZERO(&mask);
+            long cpus = sysconf(_SC_NPROCESSORS_CONF);
+            for (long i = 0; i < cpus && i < CPU_SETSIZE; ++i)
+                CPU_SET(i, &mask);
+        }
+    }
+
+    // What setThreadAffinity(-1) goes back to
+    cpu_set_t mask;
+} g_startupAffinity;
+}
+#endif
+
 #ifdef WINDOWS
 //
 // Usage: SetThreadName (-1, "MainThread");
@@ -61,6 +82,40 @@ static void SetThreadName( DWORD dwThreadID, LPCSTR szThreadName)
 }
 #endif
 
+void
+setThreadAffinity(int cpu)
+{
+#ifdef WINDOWS
+    DWORD_PTR mask = cpu == -1 ? ~(DWORD_PTR)0 : (DWORD_PTR)1 << cpu;
+    DWORD_PTR processMask, systemMask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask,
+        &systemMask))
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("GetProcessAffinityMask");
+    if (!SetThreadAffinityMask(GetCurrentThread(), mask & processMask))
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("SetThreadAffinityMask");
+#elif defined(LINUX)
+    cpu_set_t set = g_startupAffinity.mask;
+    if (cpu != -1) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &set))
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("sched_setaffinity");
+#endif
+}
+
+void
+setThreadName(const char *name)
+{
+#ifdef WINDOWS
+    SetThreadName((DWORD)-1, name);
+#elif defined(LINUX)
+    prctl(PR_SET_NAME, name, 0, 0, 0);
+#elif defined(OSX)
+    pthread_setname_np(name);
+#endif
+}
+
 #ifndef LINUX
 namespace {
 struct Context {
@@ -27,6 +27,15 @@ typedef pthread_t tid_t;
 inline tid_t emptytid() { return (tid_t)-1; }
 tid_t gettid();
 
+/// Restrict the calling thread to running on a single CPU
+/// @param cpu The CPU to run on, or -1 to allow any of the CPUs the process
+/// was allowed when it started (by taskset, a cgroup, etc.)
+/// @note Not supported (silently ignored) on OS X
+void setThreadAffinity(int cpu);
+/// Name the calling thread, as seen by debuggers and tools like top -H
+/// @note Linux truncates the name to 15 characters
+void setThreadName(const char *name);
+
 class Thread : boost::noncopyable
 {
 public:
@@ -5,8 +5,11 @@
 #include <algorithm>
 #include <vector>
 
+#include <boost/bind.hpp>
+
 #include "assert.h"
 #include "atomic.h"
+#include "config.h"
 #include "exception.h"
 #include "log.h"
 #include "version.h"
@@ -25,6 +28,14 @@ namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:timer");
 
+static ConfigVar<unsigned long long>::ptr g_wheelTick = Config::lookup(
+    "timer.wheel.tick", 0ull,
+    "Length (in microseconds) of a tick of TimerManagers' timing wheels; 0 "
+    "keeps Timers in an ordered set instead");
+static ConfigVar<unsigned long long>::ptr g_deadlineInterval = Config::lookup(
+    "timer.deadline.interval", 10000ull,
+    "How often (in microseconds) TimerManagers look for expired Deadlines");
+
 #ifdef WINDOWS
 static unsigned long long queryFrequency()
 {
@@ -75,14 +86,20 @@ Timer::Timer(unsigned long long us, boost::function<void ()> dg, bool recurring,
     : m_recurring(recurring),
       m_us(us),
       m_dg(dg),
-      m_manager(manager)
+      m_manager(manager),
+      m_prev(NULL),
+      m_nextInSlot(NULL),
+      m_level(0),
+      m_slot(0)
 {
     MORDOR_ASSERT(m_dg);
     m_next = TimerManager::now() + m_us;
 }
 
 Timer::Timer(unsigned long long next)
-    : m_next(next)
+    : m_next(next),
+      m_prev(NULL),
+      m_nextInSlot(NULL)
 {}
 
 bool
@@ -92,10 +109,7 @@ Timer::cancel()
     boost::mutex::scoped_lock lock(m_manager->m_mutex);
     if (m_dg) {
         m_dg = NULL;
-        std::set<Timer::ptr, Timer::Comparator>::iterator it =
-            m_manager->m_timers.find(shared_from_this());
-        MORDOR_ASSERT(it != m_manager->m_timers.end());
-        m_manager->m_timers.erase(it);
+        m_manager->eraseNoLock(shared_from_this());
         return true;
     }
     return false;
@@ -107,12 +121,10 @@ Timer::refresh()
     boost::mutex::scoped_lock lock(m_manager->m_mutex);
     if (!m_dg)
         return false;
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_manager->m_timers.find(shared_from_this());
-    MORDOR_ASSERT(it != m_manager->m_timers.end());
-    m_manager->m_timers.erase(it);
+    Timer::ptr self = shared_from_this();
+    m_manager->eraseNoLock(self);
     m_next = TimerManager::now() + m_us;
-    m_manager->m_timers.insert(shared_from_this());
+    m_manager->insertNoLock(self);
     lock.unlock();
     MORDOR_LOG_DEBUG(g_log) << this << " refresh";
     return true;
@@ -127,10 +139,8 @@ Timer::reset(unsigned long long us, bool fromNow)
     // No change
     if (us == m_us && !fromNow)
         return true;
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_manager->m_timers.find(shared_from_this());
-    MORDOR_ASSERT(it != m_manager->m_timers.end());
-    m_manager->m_timers.erase(it);
+    Timer::ptr self = shared_from_this();
+    m_manager->eraseNoLock(self);
     unsigned long long start;
     if (fromNow)
         start = TimerManager::now();
@@ -138,8 +148,7 @@ Timer::reset(unsigned long long us, bool fromNow)
         start = m_next - m_us;
     m_us = us;
     m_next = start + m_us;
-    it = m_manager->m_timers.insert(shared_from_this()).first;
-    bool atFront = (it == m_manager->m_timers.begin()) && !m_manager->m_tickled;
+    bool atFront = m_manager->insertNoLock(self) && !m_manager->m_tickled;
     if (atFront)
         m_manager->m_tickled = true;
     lock.unlock();
@@ -150,15 +159,45 @@ Timer::reset(unsigned long long us, bool fromNow)
 }
 
 TimerManager::TimerManager()
-: m_tickled(false)
-{}
+: m_resolution(g_wheelTick->val()),
+  m_tick(0),
+  m_firstTick(~0ull),
+  m_wheelCount(0),
+  m_tickled(false),
+  m_deadlines(NULL),
+  m_armedDeadlines(NULL),
+  m_sweeping(0)
+{
+    memset(m_wheel, 0, sizeof(m_wheel));
+    memset(m_occupied, 0, sizeof(m_occupied));
+    if (m_resolution != 0)
+        m_tick = now() / m_resolution;
+}
 
 TimerManager::~TimerManager()
 {
-#ifndef NDEBUG
     boost::mutex::scoped_lock lock(m_mutex);
     MORDOR_ASSERT(m_timers.empty());
-#endif
+    MORDOR_ASSERT(m_wheelCount == 0);
+    // Orphan any Deadlines that outlive us (such as a closed Socket's)
+    while (m_deadlines) {
+        Deadline *deadline = m_deadlines;
+        m_deadlines = deadline->m_next;
+        deadline->m_linked = false;
+        deadline->m_prev = deadline->m_next = NULL;
+        deadline->m_queued = false;
+        deadline->m_armedPrev = deadline->m_armedNext = NULL;
+    }
+    m_armedDeadlines = NULL;
+    // Like m_timers, let go of anything left in the wheel
+    for (size_t level = 0; level < WHEEL_LEVELS; ++level) {
+        for (size_t slot = 0; slot < WHEEL_SLOTS; ++slot) {
+            while (m_wheel[level][slot]) {
+                Timer::ptr timer = m_wheel[level][slot]->m_self;
+                eraseNoLock(timer);
+            }
+        }
+    }
 }
 
 Timer::ptr
@@ -168,9 +207,7 @@ TimerManager::registerTimer(unsigned long long us, boost::function<void ()> dg,
     MORDOR_ASSERT(dg);
     Timer::ptr result(new Timer(us, dg, recurring, this));
     boost::mutex::scoped_lock lock(m_mutex);
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_timers.insert(result).first;
-    bool atFront = (it == m_timers.begin()) && !m_tickled;
+    bool atFront = insertNoLock(result) && !m_tickled;
     if (atFront)
         m_tickled = true;
     lock.unlock();
@@ -186,17 +223,27 @@ TimerManager::nextTimer()
 {
     boost::mutex::scoped_lock lock(m_mutex);
     m_tickled = false;
-    if (m_timers.empty()) {
-        MORDOR_LOG_DEBUG(g_log) << this << " nextTimer(): ~0ull";
-        return ~0ull;
+    unsigned long long next;
+    if (m_resolution != 0) {
+        m_firstTick = firstTickNoLock();
+        if (m_firstTick == ~0ull) {
+            MORDOR_LOG_DEBUG(g_log) << this << " nextTimer(): ~0ull";
+            return ~0ull;
+        }
+        next = m_firstTick * m_resolution;
+    } else {
+        if (m_timers.empty()) {
+            MORDOR_LOG_DEBUG(g_log) << this << " nextTimer(): ~0ull";
+            return ~0ull;
+        }
+        next = (*m_timers.begin())->m_next;
     }
-    const Timer::ptr &next = *m_timers.begin();
     unsigned long long nowUs = now();
     unsigned long long result;
-    if (nowUs >= next->m_next)
+    if (nowUs >= next)
         result = 0;
     else
-        result = next->m_next - nowUs;
+        result = next - nowUs;
     MORDOR_LOG_DEBUG(g_log) << this << " nextTimer(): " << result;
     return result;
 }
@@ -209,17 +256,23 @@ TimerManager::processTimers()
     unsigned long long nowUs = now();
     {
         boost::mutex::scoped_lock lock(m_mutex);
-        if (m_timers.empty() || (*m_timers.begin())->m_next > nowUs)
-            return result;
-        Timer nowTimer(nowUs);
-        Timer::ptr nowTimerPtr(&nowTimer, &nop<Timer *>);
-        // Find all timers that are expired
-        std::set<Timer::ptr, Timer::Comparator>::iterator it =
-            m_timers.lower_bound(nowTimerPtr);
-        while (it != m_timers.end() && (*it)->m_next == nowUs ) ++it;
-        // Copy to expired, remove from m_timers;
-        expired.insert(expired.begin(), m_timers.begin(), it);
-        m_timers.erase(m_timers.begin(), it);
+        if (m_resolution != 0) {
+            advanceNoLock(nowUs, expired);
+            if (expired.empty())
+                return result;
+        } else {
+            if (m_timers.empty() || (*m_timers.begin())->m_next > nowUs)
+                return result;
+            Timer nowTimer(nowUs);
+            Timer::ptr nowTimerPtr(&nowTimer, &nop<Timer *>);
+            // Find all timers that are expired
+            std::set<Timer::ptr, Timer::Comparator>::iterator it =
+                m_timers.lower_bound(nowTimerPtr);
+            while (it != m_timers.end() && (*it)->m_next == nowUs ) ++it;
+            // Copy to expired, remove from m_timers;
+            expired.insert(expired.begin(), m_timers.begin(), it);
+            m_timers.erase(m_timers.begin(), it);
+        }
         result.reserve(expired.size());
         // Look at expired timers and re-register recurring timers
         // (while under the same lock)
@@ -232,7 +285,7 @@ TimerManager::processTimers()
             if (timer->m_recurring) {
                 MORDOR_LOG_TRACE(g_log) << timer << " expired and refreshed";
                 timer->m_next = nowUs + timer->m_us;
-                m_timers.insert(timer);
+                insertNoLock(timer);
             } else {
                 MORDOR_LOG_TRACE(g_log) << timer << " expired";
                 timer->m_dg = NULL;
@@ -254,6 +307,323 @@ TimerManager::executeTimers()
     }
 }
 
+bool
+TimerManager::insertNoLock(const Timer::ptr &timer)
+{
+    if (m_resolution == 0) {
+        std::set<Timer::ptr, Timer::Comparator>::iterator it =
+            m_timers.insert(timer).first;
+        return it == m_timers.begin();
+    }
+    timer->m_self = timer;
+    unsigned long long tick = linkNoLock(timer.get());
+    if (tick < m_firstTick) {
+        m_firstTick = tick;
+        return true;
+    }
+    return false;
+}
+
+void
+TimerManager::eraseNoLock(const Timer::ptr &timer)
+{
+    if (m_resolution == 0) {
+        std::set<Timer::ptr, Timer::Comparator>::iterator it =
+            m_timers.find(timer);
+        MORDOR_ASSERT(it != m_timers.end());
+        m_timers.erase(it);
+        return;
+    }
+    MORDOR_ASSERT(timer->m_self);
+    unlinkNoLock(timer.get());
+    timer->m_self.reset();
+}
+
+static bool isOccupied(const unsigned long long *occupied, size_t slot)
+{
+    return (occupied[slot / 64] & (1ull << (slot % 64))) != 0;
+}
+
+unsigned long long
+TimerManager::linkNoLock(Timer *timer)
+{
+    // Round up to the next tick boundary, so it never expires early
+    unsigned long long tick = timer->m_next / m_resolution +
+        (timer->m_next % m_resolution != 0 ? 1 : 0);
+    if (tick < m_tick)
+        tick = m_tick;
+    unsigned long long delta = tick - m_tick;
+    size_t level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+        delta >> (WHEEL_BITS * (level + 1)) != 0)
+        ++level;
+    unsigned long long placed = tick;
+    // Beyond the end of the wheel; park it in the furthest slot, and it
+    // will be placed again when that slot cascades
+    if (delta >> (WHEEL_BITS * WHEEL_LEVELS) != 0)
+        placed = m_tick + (1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    size_t slot = (placed >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    timer->m_level = (unsigned char)level;
+    timer->m_slot = (unsigned char)slot;
+    timer->m_prev = NULL;
+    timer->m_nextInSlot = m_wheel[level][slot];
+    if (timer->m_nextInSlot)
+        timer->m_nextInSlot->m_prev = timer;
+    m_wheel[level][slot] = timer;
+    m_occupied[level][slot / 64] |= 1ull << (slot % 64);
+    ++m_wheelCount;
+    return tick;
+}
+
+void
+TimerManager::unlinkNoLock(Timer *timer)
+{
+    size_t level = timer->m_level, slot = timer->m_slot;
+    if (timer->m_prev) {
+        timer->m_prev->m_nextInSlot = timer->m_nextInSlot;
+    } else {
+        MORDOR_ASSERT(m_wheel[level][slot] == timer);
+        m_wheel[level][slot] = timer->m_nextInSlot;
+        if (!timer->m_nextInSlot)
+            m_occupied[level][slot / 64] &= ~(1ull << (slot % 64));
+    }
+    if (timer->m_nextInSlot)
+        timer->m_nextInSlot->m_prev = timer->m_prev;
+    timer->m_prev = timer->m_nextInSlot = NULL;
+    --m_wheelCount;
+}
+
+unsigned long long
+TimerManager::firstTickNoLock()
+{
+    if (m_wheelCount == 0)
+        return ~0ull;
+    unsigned long long result = ~0ull;
+    // Level 0 holds exactly the next WHEEL_SLOTS ticks
+    for (size_t d = 0; d < WHEEL_SLOTS; ++d) {
+        if (isOccupied(m_occupied[0], (m_tick + d) & (WHEEL_SLOTS - 1))) {
+            result = m_tick + d;
+            break;
+        }
+    }
+    // Nothing in a slot above is due before the slot cascades (and the
+    // current slot of each level has already cascaded)
+    for (size_t level = 1; level < WHEEL_LEVELS; ++level) {
+        size_t shift = WHEEL_BITS * level;
+        unsigned long long current = m_tick >> shift;
+        for (size_t d = 1; d <= WHEEL_SLOTS; ++d) {
+            if (isOccupied(m_occupied[level],
+                (current + d) & (WHEEL_SLOTS - 1))) {
+                result = std::min(result, (current + d) << shift);
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+void
+TimerManager::advanceNoLock(unsigned long long nowUs,
+    std::vector<Timer::ptr> &expired)
+{
+    unsigned long long nowTick = nowUs / m_resolution;
+    while (m_tick <= nowTick) {
+        if (m_wheelCount == 0) {
+            m_tick = nowTick + 1;
+            break;
+        }
+        size_t slot = m_tick & (WHEEL_SLOTS - 1);
+        while (m_wheel[0][slot]) {
+            Timer::ptr timer = m_wheel[0][slot]->m_self;
+            eraseNoLock(timer);
+            expired.push_back(timer);
+        }
+        // Skip straight to the next tick with something to expire, or the
+        // next cascade, whichever comes first
+        unsigned long long next = (m_tick | (WHEEL_SLOTS - 1)) + 1;
+        for (size_t i = slot + 1; i < WHEEL_SLOTS; ++i) {
+            if (isOccupied(m_occupied[0], i)) {
+                next = m_tick - slot + i;
+                break;
+            }
+        }
+        m_tick = std::min(next, nowTick + 1);
+        if ((m_tick & (WHEEL_SLOTS - 1)) != 0)
+            continue;
+        // Entered the next slot of level 1 (and maybe further up); spread
+        // its Timers out over the levels below
+        for (size_t level = 1; level < WHEEL_LEVELS; ++level) {
+            size_t cascade = (m_tick >> (WHEEL_BITS * level)) &
+                (WHEEL_SLOTS - 1);
+            Timer *timer = m_wheel[level][cascade];
+            m_wheel[level][cascade] = NULL;
+            m_occupied[level][cascade / 64] &= ~(1ull << (cascade % 64));
+            while (timer) {
+                Timer *next = timer->m_nextInSlot;
+                --m_wheelCount;
+                linkNoLock(timer);
+                timer = next;
+            }
+            if (cascade != 0)
+                break;
+        }
+    }
+}
+
+void
+TimerManager::startSweep()
+{
+    boost::mutex::scoped_lock lock(m_deadlineMutex);
+    if (m_sweeping)
+        return;
+    m_sweeping = 1;
+    registerTimer(g_deadlineInterval->val(),
+        boost::bind(&TimerManager::sweepDeadlines, this));
+}
+
+void
+TimerManager::sweepDeadlines()
+{
+    unsigned long long nowUs = now();
+    boost::mutex::scoped_lock lock(m_deadlineMutex);
+    bool armed = false;
+    Deadline *deadline = m_armedDeadlines;
+    while (deadline) {
+        Deadline *next = deadline->m_armedNext;
+        int sequence = deadline->m_sequence;
+        if (sequence & 1) {
+            if (deadline->m_deadline > nowUs ||
+                atomicCompareAndSwap(deadline->m_sequence, sequence + 1,
+                sequence) != sequence) {
+                armed = true;
+                deadline = next;
+                continue;
+            }
+            MORDOR_LOG_DEBUG(g_log) << deadline << " expired";
+            deadline->m_dg();
+            ++sequence;
+        }
+        if (!dropDeadlineNoLock(deadline, sequence))
+            armed = true;
+        deadline = next;
+    }
+    if (!armed) {
+        // Stop; but an arm() that saw m_sweeping set before we cleared it
+        // is counting on us
+        atomicCompareAndSwap(m_sweeping, 0, 1);
+        if (!anyArmedNoLock())
+            return;
+        m_sweeping = 1;
+    }
+    registerTimer(g_deadlineInterval->val(),
+        boost::bind(&TimerManager::sweepDeadlines, this));
+}
+
+bool
+TimerManager::anyArmedNoLock()
+{
+    for (Deadline *deadline = m_armedDeadlines; deadline;
+        deadline = deadline->m_armedNext)
+        if (deadline->m_sequence & 1)
+            return true;
+    return false;
+}
+
+bool
+TimerManager::dropDeadlineNoLock(Deadline *deadline, int sequence)
+{
+    // arm() arms first, and checks m_queued after; so (with a barrier on
+    // both sides) either it sees that it's been dropped, and queues it
+    // again, or we see that it's been armed
+    atomicSwap(deadline->m_queued, false);
+    if (deadline->m_sequence != sequence) {
+        deadline->m_queued = true;
+        return false;
+    }
+    if (deadline->m_armedPrev)
+        deadline->m_armedPrev->m_armedNext = deadline->m_armedNext;
+    else
+        m_armedDeadlines = deadline->m_armedNext;
+    if (deadline->m_armedNext)
+        deadline->m_armedNext->m_armedPrev = deadline->m_armedPrev;
+    deadline->m_armedPrev = deadline->m_armedNext = NULL;
+    return true;
+}
+
+Deadline::Deadline(TimerManager &manager, boost::function<void ()> dg)
+    : m_manager(manager),
+      m_dg(dg),
+      m_deadline(~0ull),
+      m_sequence(0),
+      m_linked(false),
+      m_prev(NULL),
+      m_next(NULL),
+      m_queued(false),
+      m_armedPrev(NULL),
+      m_armedNext(NULL)
+{
+    MORDOR_ASSERT(m_dg);
+}
+
+Deadline::~Deadline()
+{
+    if (!m_linked)
+        return;
+    boost::mutex::scoped_lock lock(m_manager.m_deadlineMutex);
+    if (m_prev)
+        m_prev->m_next = m_next;
+    else
+        m_manager.m_deadlines = m_next;
+    if (m_next)
+        m_next->m_prev = m_prev;
+    if (m_queued) {
+        if (m_armedPrev)
+            m_armedPrev->m_armedNext = m_armedNext;
+        else
+            m_manager.m_armedDeadlines = m_armedNext;
+        if (m_armedNext)
+            m_armedNext->m_armedPrev = m_armedPrev;
+    }
+}
+
+void
+Deadline::arm(unsigned long long us)
+{
+    m_deadline = us == ~0ull ? ~0ull : TimerManager::now() + us;
+    // Already armed (a sweep may still expire it by the old deadline)
+    if (m_sequence & 1)
+        return;
+    atomicIncrement(m_sequence);
+    // Only once armed; see TimerManager::dropDeadlineNoLock()
+    if (!m_queued) {
+        boost::mutex::scoped_lock lock(m_manager.m_deadlineMutex);
+        if (!m_linked) {
+            m_next = m_manager.m_deadlines;
+            if (m_next)
+                m_next->m_prev = this;
+            m_manager.m_deadlines = this;
+            m_linked = true;
+        }
+        if (!m_queued) {
+            m_armedNext = m_manager.m_armedDeadlines;
+            if (m_armedNext)
+                m_armedNext->m_armedPrev = this;
+            m_manager.m_armedDeadlines = this;
+            m_queued = true;
+        }
+    }
+    if (!m_manager.m_sweeping)
+        m_manager.startSweep();
+}
+
+bool
+Deadline::disarm()
+{
+    int sequence = m_sequence;
+    return (sequence & 1) &&
+        atomicCompareAndSwap(m_sequence, sequence + 1, sequence) == sequence;
+}
+
 bool
 Timer::Comparator::operator()(const Timer::ptr &lhs,
                               const Timer::ptr &rhs) const
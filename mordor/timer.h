@@ -13,6 +13,7 @@
 
 namespace Mordor {
 
+class Deadline;
 class TimerManager;
 
 class Timer : public boost::noncopyable, public boost::enable_shared_from_this<Timer>
@@ -49,6 +50,12 @@ private:
     boost::function<void ()> m_dg;
     TimerManager *m_manager;
 
+    // Timing wheel bookkeeping; while the Timer is in a slot, the slot's list
+    // holds m_self instead of m_timers holding a reference
+    Timer::ptr m_self;
+    Timer *m_prev, *m_nextInSlot;
+    unsigned char m_level, m_slot;
+
 private:
     struct Comparator
     {
@@ -57,8 +64,19 @@ private:
 
 };
 
+/// Keeps Timers in an ordered set, or (with timer.wheel.tick) in a
+/// hierarchical timing wheel
+
+/// The wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots; a slot in level 0
+/// holds the Timers due in one tick, and a slot in each level above covers
+/// all of the level below it.  Registering, cancelling, refreshing, or
+/// resetting a Timer only moves it between slots, so it takes constant time
+/// however many Timers there are (the set takes logarithmic time).  The
+/// price is resolution: Timers expire at the first tick boundary at or
+/// after when they're due.
 class TimerManager : public boost::noncopyable
 {
+    friend class Deadline;
     friend class Timer;
 public:
     TimerManager();
@@ -67,7 +85,8 @@ public:
     virtual Timer::ptr registerTimer(unsigned long long us,
         boost::function<void ()> dg, bool recurring = false);
 
-    /// @return How long until the next timer expires; ~0ull if no timers
+    /// @return How long until the next timer expires; ~0ull if no timers.
+    /// A timing wheel may answer sooner, with when it next needs to cascade.
     unsigned long long nextTimer();
     void executeTimers();
 
@@ -82,10 +101,99 @@ protected:
     virtual void onTimerInsertedAtFront() {}
     std::vector<boost::function<void ()> > processTimers();
 
+private:
+    enum {
+        WHEEL_LEVELS = 4,
+        WHEEL_BITS = 8,
+        WHEEL_SLOTS = 1 << WHEEL_BITS
+    };
+
+    /// @return If timer is now the first Timer due
+    bool insertNoLock(const Timer::ptr &timer);
+    void eraseNoLock(const Timer::ptr &timer);
+    /// When the first Timer in the wheel is due, give or take a tick
+    unsigned long long firstTickNoLock();
+    /// Move the wheel forward, through every tick that has started by
+    /// nowUs, adding the Timers that expired to expired
+    void advanceNoLock(unsigned long long nowUs,
+        std::vector<Timer::ptr> &expired);
+    /// @return The tick timer is due in
+    unsigned long long linkNoLock(Timer *timer);
+    void unlinkNoLock(Timer *timer);
+
+    /// Make sure sweepDeadlines() will run
+    void startSweep();
+    void sweepDeadlines();
+    /// @return If any Deadline is armed
+    bool anyArmedNoLock();
+    /// Take deadline (disarmed, or just expired, at sequence) off of
+    /// m_armedDeadlines
+    /// @return false if it's been armed again since (and so stays)
+    bool dropDeadlineNoLock(Deadline *deadline, int sequence);
+
 private:
     std::set<Timer::ptr, Timer::Comparator> m_timers;
+    /// Length of a tick, in microseconds; 0 if m_timers is used instead
+    unsigned long long m_resolution;
+    /// The next tick the wheel will expire
+    unsigned long long m_tick;
+    /// No Timer in the wheel is due before this tick (as of the last
+    /// nextTimer())
+    unsigned long long m_firstTick;
+    size_t m_wheelCount;
+    Timer *m_wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+    /// Which slots of m_wheel are non-empty
+    unsigned long long m_occupied[WHEEL_LEVELS][WHEEL_SLOTS / 64];
     boost::mutex m_mutex;
     bool m_tickled;
+
+    /// Every Deadline that's ever been armed (and not destroyed)
+    Deadline *m_deadlines;
+    /// The ones sweepDeadlines() needs to look at: those armed, and those
+    /// disarmed since the last sweep
+    Deadline *m_armedDeadlines;
+    /// A sweepDeadlines() Timer is registered
+    volatile int m_sweeping;
+    boost::mutex m_deadlineMutex;
+};
+
+/// A timeout that's checked lazily, instead of with a Timer of its own
+
+/// arm() and disarm() only record when the timeout is due; the TimerManager
+/// looks for expired Deadlines every timer.deadline.interval microseconds
+/// (only while any are armed), and calls dg for each of them.  So dg may be
+/// called up to an interval late, but an operation that finishes in time
+/// costs a clock read and an atomic operation, not a Timer (the first arm()
+/// after a sweep has seen it disarmed also takes a lock, to put it back in
+/// the sweep's list; the sweep only visits armed Deadlines, and each
+/// disarmed one once).  dg is called
+/// while the TimerManager's Deadlines are locked, and must not arm, disarm,
+/// or destroy any of them.
+class Deadline : public boost::noncopyable
+{
+    friend class TimerManager;
+public:
+    Deadline(TimerManager &manager, boost::function<void ()> dg);
+    ~Deadline();
+
+    /// Call dg us microseconds from now, unless disarm()ed first
+    /// (re-arming an armed Deadline moves it)
+    void arm(unsigned long long us);
+    /// @return If the Deadline was armed, and hadn't expired
+    bool disarm();
+
+private:
+    TimerManager &m_manager;
+    boost::function<void ()> m_dg;
+    volatile unsigned long long m_deadline;
+    /// Odd while armed; every arm() and disarm() (or expiry) increments it,
+    /// so a sweep can tell if it's been re-armed since it checked it
+    volatile int m_sequence;
+    bool m_linked;
+    Deadline *m_prev, *m_next;
+    /// In m_manager.m_armedDeadlines
+    volatile bool m_queued;
+    Deadline *m_armedPrev, *m_armedNext;
 };
 
 }
@@ -4,13 +4,15 @@
 
 #include "fiber.h"
 #include "log.h"
+#include "timer.h"
 
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:workerpool");
 
-WorkerPool::WorkerPool(size_t threads, bool useCaller, size_t batchSize)
-    : Scheduler(threads, useCaller, batchSize)
+WorkerPool::WorkerPool(size_t threads, bool useCaller, size_t batchSize,
+    bool workStealing)
+    : Scheduler(threads, useCaller, batchSize, workStealing)
 {
     start();
 }
@@ -22,7 +24,16 @@ WorkerPool::idle()
         if (stopping()) {
             return;
         }
-        m_semaphore.wait();
+        // Poll for a tickle for a while before blocking
+        unsigned long long spin = spinTime();
+        bool tickled = false;
+        if (spin != 0) {
+            unsigned long long spinUntil = TimerManager::now() + spin;
+            while (!(tickled = m_semaphore.tryWait()) &&
+                TimerManager::now() < spinUntil);
+        }
+        if (!tickled)
+            m_semaphore.wait();
         try {
             Fiber::yield();
         } catch (OperationAbortedException &) {
@@ -14,13 +14,14 @@ namespace Mordor {
 class WorkerPool : public Scheduler
 {
 public:
-    WorkerPool(size_t threads = 1, bool useCaller = true, size_t batchSize = 1);
+    WorkerPool(size_t threads = 1, bool useCaller = true, size_t batchSize = 1,
+        bool workStealing = false);
     ~WorkerPool() { stop(); }
 
 protected:
-    /// The idle Fiber for a WorkerPool simply loops waiting on a Semaphore,
-    /// and yields whenever that Semaphore is signalled, returning if
-    /// stopping() is true.
+    /// The idle Fiber for a WorkerPool simply loops waiting on a Semaphore
+    /// (polling it for spinTime() first), and yields whenever that Semaphore
+    /// is signalled, returning if stopping() is true.
     void idle();
     /// Signals the semaphore so that the idle Fiber will yield.
     void tickle();